@@ -96,6 +96,20 @@ typedef enum {
     BCNN_UNKNOWN_ERROR
 } bcnn_status;
 
+/**
+ * \brief Counter-based random generator (Philox4x32-10).
+ *
+ * A generator is identified by a seed and a stream id: two generators sharing
+ * the same seed but with different streams produce independent sequences.
+ */
+typedef struct bcnn_rng {
+    uint32_t key[2]; /**< Key, derived from the seed */
+    uint32_t ctr[4]; /**< Counter: block index (ctr[0..1]) and stream id
+                        (ctr[2..3]) */
+    uint32_t buf[4]; /**< Last generated block */
+    int idx;         /**< Index of the next unused value in buf */
+} bcnn_rng;
+
 /**
  * \brief Enum of available tasks.
  */
@@ -134,6 +148,32 @@ typedef struct {
     int *label_int;
     float *label_float;
     unsigned char *label_uchar;
+    struct bcnn_data_cache *cache; /**< Decoded samples cache (list only) */
+    int shuffle;         /**< If set, samples are shuffled in train state */
+    bcnn_rng rng;        /**< Generator of the samples order */
+    int cur;             /**< Position in the current epoch */
+    int num_perm;        /**< Number of samples of the shard */
+    int *perm;           /**< Samples order of the current epoch */
+    long *offsets;       /**< Offsets of the lines (indexed list) or of the
+                            records (indexed bin pack) */
+    int *rec_part;       /**< Part file of each record (indexed bin pack) */
+    char **parts;        /**< Part files of a bin pack */
+    int num_parts;
+    int cur_part;        /**< Part file opened in f_input */
+    int buffer_size;     /**< Size of the shuffle buffer, used for datasets
+                            which are not indexed */
+    int buffer_num;      /**< Number of records held by the shuffle buffer */
+    unsigned char **buffer; /**< Shuffle buffer of raw records */
+    int rec_idx;         /**< Index of the next raw record of the current pass
+                            over a dataset which is not indexed */
+    int shard_index;     /**< Index of the data shard read by the iterator */
+    int shard_count;     /**< Number of data shards */
+    unsigned char *data_uchar; /**< Images of in-memory datasets (mnist,
+                                  cifar10), stored interleaved */
+    unsigned char *data_label; /**< Labels of in-memory datasets */
+    int raw_width;       /**< Size of the images of bin packs storing raw
+                            pixels, 0 if images are encoded */
+    int raw_height;
 } bcnn_iterator;
 
 /**
@@ -180,6 +220,7 @@ typedef struct {
     int swap_to_bgr;
     int no_input_norm; /**< If set to 1, Input data range is not normalized
                           between [-1;1] */
+    bcnn_rng rng;      /**< Generator used to draw the random parameters */
 } bcnn_data_augment;
 
 /**
@@ -264,9 +305,13 @@ typedef enum {
 typedef struct {
     bcnn_tensor tensor;
     char *id;
-    int mem_chunk_id;  // reserved for memory manager handle
+    int mem_chunk_id;  // segment + 1 if the memory is shared (checkpointing)
+    int is_view;       // tensor memory is owned by another node
 } bcnn_node;
 
+/* Workers used by the layers themselves when no branches run concurrently */
+typedef struct bcnn_thread_pool bcnn_thread_pool;
+
 /**
  * \brief Structure defining a generic layer.
  */
@@ -277,6 +322,10 @@ typedef struct bcnn_layer {
     int pad;
     int quantize;
     int net_state;
+    int num_threads; /**< Threads the layer may use by itself (set at
+                        compile time, or by the task running it) */
+    bcnn_thread_pool *thread_pool; /**< Workers of these threads, owned by
+                                      the net or its scheduler */
     bcnn_layer_type type;
     bcnn_activation activation;
     bcnn_loss loss;
@@ -286,9 +335,17 @@ typedef struct bcnn_layer {
     int concat_index;
     bcnn_tensor weights;
     bcnn_tensor biases;
+    uint16_t *weights_f16; /**< Half precision weights (predict mode only) */
+    float *weights_packed; /**< Weights laid out as gemm panels (predict mode
+                              only) */
+    float *weights_blocked; /**< Weights reordered for the channel-blocked
+                               kernels (predict mode only) */
     int *indexes;
     float *conv_workspace;
+    int conv_workspace_size; /**< Number of floats of conv_workspace */
     float *rand;
+    uint8_t *mask; /**< Dropout keep mask, 1 bit per element */
+    bcnn_rng rng;  /**< Generator of the dropout mask */
 #ifdef BCNN_USE_CUDA
     int *indexes_gpu;
     float *conv_workspace_gpu;
@@ -340,6 +397,49 @@ typedef struct {
     bcnn_layer *layer;
 } bcnn_connection;
 
+/**
+ * \brief Enum of elementwise operations applied by a fused execution unit.
+ */
+typedef enum { FUSED_AFFINE, FUSED_ACTIVATION } bcnn_fused_op_type;
+
+/**
+ * \brief Elementwise operation of a fused unit epilogue.
+ */
+typedef struct {
+    bcnn_fused_op_type type;
+    bcnn_activation activation; /**< Non-linearity (FUSED_ACTIVATION) */
+    float *scale; /**< Per-channel scale (FUSED_AFFINE), NULL means 1 */
+    float *shift; /**< Per-channel shift (FUSED_AFFINE) */
+    float *slope; /**< PReLU slopes, points to the layer weights */
+} bcnn_fused_op;
+
+/**
+ * \brief Execution unit built by the fusion pass in predict mode.
+ *
+ * A unit covers 'num_conn' consecutive connections starting at 'first'. When
+ * the head connection is a conv / deconv / fullc layer, only its linear part
+ * is computed, the bias and all following elementwise layers (batchnorm,
+ * activations, dropout) being applied in a single epilogue pass.
+ */
+typedef struct {
+    int first;    /**< Index of the first connection covered by the unit */
+    int num_conn; /**< Number of connections covered by the unit */
+    int src;      /**< Input node index */
+    int dst;      /**< Output node index */
+    int num_ops;
+    bcnn_fused_op *ops;
+} bcnn_fused_unit;
+
+/* Worker thread running the parameter updates during backward */
+typedef struct bcnn_updater bcnn_updater;
+
+/* Thread pool running the independent branches of the graph */
+typedef struct bcnn_scheduler bcnn_scheduler;
+
+/* Nodes stored with their channels interleaved by blocks, and the connections
+ * running on them */
+typedef struct bcnn_layout bcnn_layout;
+
 typedef struct {
     int input_width;
     int input_height;
@@ -350,6 +450,14 @@ typedef struct {
     bcnn_loss_metric loss_metric; /**< Loss metric for evaluation */
     bcnn_learner learner;         /**< Learner/optimizer parameters */
     int seen; /**< Number of instances seen by the network */
+    int accumulation_steps; /**< Number of micro-batches of batch_size samples
+                               whose gradients are accumulated before each
+                               update (default 1). Batchnorm statistics are
+                               computed per micro-batch. */
+    unsigned int seed; /**< Seed of all the random generators of the net */
+    unsigned int rng_stream; /**< Offset of the streams drawn by the data
+                                augmentation and dropout generators */
+    bcnn_rng rng;      /**< Generator used for weights initialization */
     int nb_connections;
     bcnn_connection *connections;
     int num_nodes;    /**< Number of nodes hold in the network */
@@ -366,6 +474,66 @@ typedef struct {
 #ifdef BCNN_USE_CUDA
     float *workspace_gpu;
 #endif
+    int fuse_ops;            /**< If set to 1 (default), fusible chains of
+                                connections are merged in predict mode */
+    int half_precision;      /**< If set to 1, conv / deconv / fullc weights
+                                are stored in half precision in predict mode.
+                                Activations stay in fp32 (see the roadmap in
+                                README.md) */
+    int prepack_weights;     /**< If set to 1 (default), conv / deconv / fullc
+                                weights are packed once for the gemm in
+                                predict mode */
+    int num_fused;           /**< Number of fused execution units */
+    bcnn_fused_unit *fused;  /**< Fused execution plan (predict mode only) */
+    int blocked_layout;      /**< If set to 1, conv / depthwise conv /
+                                maxpool / batchnorm / activation layers whose
+                                channels are multiples of 8 keep their
+                                activations as [n][c/8][h][w][8] in predict
+                                mode (CPU only). These layers are then left
+                                out of the fusion */
+    bcnn_layout *layout;
+    char *data_cache_dir;    /**< If set, decoded list samples are cached
+                                and cropped to the input size on each read.
+                                The cache file lives in this directory */
+    int data_cache_mb;       /**< Memory budget of the data cache (MB), the
+                                samples beyond it are read from the file */
+    int shuffle;             /**< If set to 1, training samples are shuffled
+                                at each epoch */
+    int shuffle_buffer;      /**< If > 0, lists are shuffled through a buffer
+                                of this size instead of being indexed. Also
+                                sets the buffer size of bin data (default
+                                1024) */
+    int shard_index;         /**< Data shard read by this process, in
+                                [0; shard_count) */
+    int shard_count;         /**< Number of data shards. Samples are split
+                                between shards by index modulo shard_count */
+    int checkpoint_every;    /**< If > 1, the connections are grouped in
+                                segments of this size during training. Only
+                                the nodes read across segments keep their
+                                activations, the others are recomputed by
+                                bcnn_backward */
+    int recompute;           /**< Set while a segment is replayed */
+    float *checkpoint_data;  /**< Memory shared by the recomputed nodes */
+    float *checkpoint_grad;
+    int overlap_update;      /**< If set to 1, the parameters of a connection
+                                are updated by a worker thread as soon as its
+                                backward is done (CPU only) */
+    bcnn_updater *updater;
+    int num_threads;         /**< If > 1, connections whose inputs are ready
+                                are run concurrently on up to num_threads
+                                threads (CPU only), the threads left over
+                                being split between the layers of the
+                                running connections. A plain chain of layers
+                                lets the small batch fully connected layers
+                                use them all instead */
+    bcnn_scheduler *scheduler;
+    bcnn_thread_pool *thread_pool; /**< Workers of the layers, started when
+                                      there is no scheduler */
+    int numa_node;           /**< If >= 0, the worker threads of the net are
+                                bound to this NUMA node (default -1) */
+    int num_replicas;        /**< Number of data parallel replicas whose
+                                gradients are summed into this net before
+                                each update (see bcnn_replicas) */
 } bcnn_net;
 
 void bcnn_net_set_input_shape(bcnn_net *net, int input_width, int input_height,
@@ -384,17 +552,64 @@ int bcnn_init_net(bcnn_net **net);
 int bcnn_end_net(bcnn_net **net);
 
 int bcnn_set_param(bcnn_net *net, char *name, char *val);
+/* Resets all the random generators of the net. Weights initialization depends
+ * on the seed as well, so it should be set before adding the layers. */
+int bcnn_net_set_seed(bcnn_net *net, unsigned int seed);
+/* Moves the data augmentation and dropout generators of the net to their own
+ * streams, so that nets sharing a seed and trained by different threads (e.g.
+ * replicas) draw independent sequences. Weights initialization is unchanged. */
+int bcnn_net_set_rng_stream(bcnn_net *net, unsigned int stream);
 
 int bcnn_compile_net(bcnn_net *net, char *phase);
 
+/* Operator fusion (predict mode) */
+int bcnn_net_fuse(bcnn_net *net);
+void bcnn_net_free_fused(bcnn_net *net);
+
+/* Channel-blocked activation layout (predict mode) */
+int bcnn_net_plan_layout(bcnn_net *net);
+void bcnn_net_free_layout(bcnn_net *net);
+
+/* Activation checkpointing (train mode) */
+int bcnn_net_plan_checkpoints(bcnn_net *net);
+void bcnn_net_free_checkpoints(bcnn_net *net);
+
+/* Dependency graph of the connections, for concurrent execution */
+int bcnn_net_plan_schedule(bcnn_net *net);
+void bcnn_net_free_schedule(bcnn_net *net);
+
 int bcnn_iterator_initialize(bcnn_net *net, bcnn_iterator *iter,
                              char *path_input, char *path_label, char *type);
 int bcnn_iterator_next(bcnn_net *net, bcnn_iterator *iter);
+/* In-memory datasets (mnist, cifar10): returns the next sample in place in the
+ * dataset, without copying it to input_uchar, and its label. */
+unsigned char *bcnn_iterator_next_sample(bcnn_net *net, bcnn_iterator *iter,
+                                         int *label);
+/* Goes back to the first sample of the data. The order of a shuffled
+ * iterator is drawn again. */
+int bcnn_iterator_rewind(bcnn_iterator *iter);
 int bcnn_iterator_terminate(bcnn_iterator *iter);
 
 /* Load / Write model */
 int bcnn_load_model(bcnn_net *net, char *filename);
 int bcnn_write_model(bcnn_net *net, char *filename);
+/* Same as bcnn_write_model with conv / deconv / fullc weights stored in half
+ * precision. Those files are recognized by bcnn_load_model. */
+int bcnn_write_model_f16(bcnn_net *net, char *filename);
+/* Model serialization in memory, in the format of bcnn_write_model (or
+ * bcnn_write_model_f16 if 'half' is set). 'buf' must hold at least
+ * bcnn_get_model_size bytes. */
+size_t bcnn_get_model_size(bcnn_net *net, int half);
+size_t bcnn_write_model_to_buffer(bcnn_net *net, int half,
+                                  unsigned char *buf);
+int bcnn_load_model_from_buffer(bcnn_net *net, const unsigned char *buf,
+                                size_t size);
+/* Writes a standalone C source computing the inference of the net for its
+ * current input shape and weights, up to the cost layer. The file defines
+ * 'void <name>_forward(const float *input, float *output)' and only calls the
+ * gemm / im2col kernels of the library. Unpadded deconvolutions, computed by
+ * output phases at runtime, only match the runtime up to rounding. */
+int bcnn_write_c_source(bcnn_net *net, char *filename, char *name);
 
 int bcnn_init_workload(bcnn_net *net);
 int bcnn_free_workload(bcnn_net *net);
@@ -436,9 +651,17 @@ int bcnn_add_softmax_layer(bcnn_net *net, char *src_id, char *dst_id);
 int bcnn_add_maxpool_layer(bcnn_net *net, int size, int stride, char *src_id,
                            char *dst_id);
 
-/* Concat layer */
+/* Concat layer. bcnn_add_concat_layer_n concatenates its inputs in the order
+ * they are given. bcnn_add_concat_layer puts the input defined last first, as
+ * it always did, so that existing configs and models are unchanged.
+ * Zero-copy concatenation is a batch size 1 optimization, aimed at
+ * inference: with a single image the inputs are written in place into the
+ * output, while with larger batches the channel blocks of an input are
+ * strided in the output and the concat layer copies them. */
 int bcnn_add_concat_layer(bcnn_net *net, char *src_id1, char *src_id2,
                           char *dst_id);
+int bcnn_add_concat_layer_n(bcnn_net *net, int num_src, char **src_ids,
+                            char *dst_id);
 
 /* Dropout layer */
 int bcnn_add_dropout_layer(bcnn_net *net, float rate, char *id);
@@ -457,12 +680,62 @@ int bcnn_add_cost_layer(bcnn_net *net, bcnn_loss loss,
 
 /* Core network routines */
 int bcnn_update(bcnn_net *net);
+/* Update overlapped with the backward pass: connections pushed between begin
+ * and end are updated in the background, end waits for all of them. begin
+ * fails if the updates can't be run asynchronously. */
+int bcnn_update_async_begin(bcnn_net *net);
+void bcnn_update_async_push(bcnn_net *net, int conn);
+int bcnn_update_async_end(bcnn_net *net);
+void bcnn_free_updater(bcnn_net *net);
 int bcnn_sgd_optimizer(bcnn_connection *conn, int batch_size,
                        float learning_rate, float momentum, float decay);
 int bcnn_visualize_network(bcnn_net *net);
 int bcnn_forward(bcnn_net *net);
+/* Runs the forward pass of the execution units [first, last[: the fused units
+ * if the net has a fused plan, the connections otherwise */
+int bcnn_forward_tasks(bcnn_net *net, int first, int last);
 int bcnn_backward(bcnn_net *net);
 
+/**
+ * Streaming inference (predict mode, CPU).
+ *
+ * The execution units of the net are split into 'num_stages' consecutive
+ * stages of balanced cost, measured by profiling the net at initialization.
+ * Each stage runs on its own thread and hands the activations crossing its
+ * output boundary to the next stage through a queue of 'queue_size' buffers,
+ * so that successive inputs are processed in a pipelined way.
+ * bcnn_stream_push copies an input (the size of the input node) into the
+ * pipeline, bcnn_stream_pop waits for the oldest output not popped yet (the
+ * size of the net output node). Both block while the queues are full / empty.
+ * If 'pin_threads' is set, stage i is bound to the logical core i.
+ * The 'num_threads' of the net are split evenly between the stages, each stage
+ * running its layers on its own workers until bcnn_stream_terminate.
+ */
+typedef struct bcnn_stream bcnn_stream;
+int bcnn_stream_initialize(bcnn_net *net, bcnn_stream **stream, int num_stages,
+                           int queue_size, int pin_threads);
+int bcnn_stream_push(bcnn_stream *stream, const float *input);
+int bcnn_stream_pop(bcnn_stream *stream, float *output);
+int bcnn_stream_terminate(bcnn_stream **stream);
+
+/**
+ * Data parallel training on replicas of a net, one thread per replica bound
+ * to NUMA node (replica index % number of nodes).
+ *
+ * 'nets' must have the same layers, 'iters' are their iterators (each replica
+ * should read its own data shard). The replicas are compiled in train mode
+ * and their parameters copied from nets[0] by their own thread at
+ * initialization, so that their memory is local to their node. Each step
+ * computes the gradients of all the replicas concurrently, sums them into
+ * nets[0] which is updated, and copies the new parameters back into the
+ * other replicas. 'loss' is the mean loss of the replicas.
+ */
+typedef struct bcnn_replicas bcnn_replicas;
+int bcnn_replicas_initialize(bcnn_replicas **replicas, bcnn_net **nets,
+                             bcnn_iterator *iters, int num_replicas);
+int bcnn_replicas_train_on_batch(bcnn_replicas *replicas, float *loss);
+int bcnn_replicas_terminate(bcnn_replicas **replicas);
+
 /* General routines for training / predict */
 int bcnn_train_on_batch(bcnn_net *net, bcnn_iterator *iter, float *loss);
 int bcnn_predict_on_batch(bcnn_net *net, bcnn_iterator *iter, float **pred,
@@ -473,16 +746,24 @@ int bcnn_free_layer(bcnn_layer **layer);
 int bcnn_free_net(bcnn_net *cnn);
 
 /* Helpers */
+/* Packs the images and labels of a list into binary parts. Images are decoded
+ * by num_threads threads (number of cores if <= 0) and written in the list
+ * order. If raw_w and raw_h are > 0, images are stored as raw pixels resized
+ * to raw_w x raw_h, which saves decoding at training time. An index sidecar
+ * <out_pack>.idx is written along the parts: an interrupted packing resumes
+ * from it when called again with the same options. */
 int bcnn_pack_data(char *list, int label_width, bcnn_label_type type,
-                   char *out_pack);
+                   int raw_w, int raw_h, int num_threads, char *out_pack);
 int bcnn_load_image_from_csv(char *str, int w, int h, int c,
                              unsigned char **img);
+/* If 'rng' is NULL, the image is center cropped, otherwise the crop is
+ * randomly placed. */
 int bcnn_load_image_from_path(char *path, int w, int h, int c,
-                              unsigned char *img, int state, int *x_shift,
+                              unsigned char *img, bcnn_rng *rng, int *x_shift,
                               int *y_shift);
 int bcnn_load_image_from_memory(unsigned char *buffer, int buffer_size, int w,
-                                int h, int c, unsigned char **img, int state,
-                                int *x_shift, int *y_shift);
+                                int h, int c, unsigned char **img,
+                                bcnn_rng *rng, int *x_shift, int *y_shift);
 int bcnn_data_augmentation(unsigned char *img, int width, int height, int depth,
                            bcnn_data_augment *param, unsigned char *buffer);
 
@@ -491,6 +772,13 @@ int bcnn_iter_batch(bcnn_net *net, bcnn_iterator *iter);
 int bcnn_convert_img_to_float(unsigned char *src, int w, int h, int c,
                               int no_input_norm, int swap_to_bgr, float mean_r,
                               float mean_g, float mean_b, float *dst);
+/* Same as bcnn_convert_img_to_float on the w x h region of src whose upper
+ * left corner is (x_ul, y_ul) */
+int bcnn_convert_img_crop_to_float(unsigned char *src, int src_w, int src_h,
+                                   int c, int x_ul, int y_ul, int w, int h,
+                                   int no_input_norm, int swap_to_bgr,
+                                   float mean_r, float mean_g, float mean_b,
+                                   float *dst);
 
 /* Cuda kernels routines */
 #ifdef BCNN_USE_CUDA
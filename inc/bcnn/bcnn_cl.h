@@ -21,13 +21,20 @@ typedef struct {
     char                        *input_model;       /**< Path to input model. */
     char                        *output_model;      /**< Path to output model. */
     char                        *pred_out;          /**< Path to output prediction file. */
+    char                        *codegen_output;    /**< If set in predict task, path of the C source generated from the net instead of running the prediction. */
+    char                        *codegen_name;      /**< Prefix of the generated symbols (default "bcnn_model"). */
     bcnn_task                   task;               /**< Task to process. */
     bcnn_target                 prediction_type;    /**< Type of prediction to make. */
     char                        *data_format;       /**< Data format. */
     int                         save_model;         /**< Periodicity of model saving. */
+    int                         model_f16;          /**< Set to 1 to save models with half precision weights. */
+    int                         keep_models;        /**< Number of periodic models kept on disk (all if <= 0). */
     int                         nb_pred;            /**< Number of samples to be predicted in test file. */
     int                         eval_period;        /**< Periodicity of evaluating the train/test error. */
     int                         eval_test;          /**< Set to 1 if evaluation of test database is asked. */
+    int                         eval_async;         /**< Set to 1 (default) to evaluate the test database on a weights snapshot in background. Always set with replicas. */
+    char                        *config_file;       /**< Path to the config file the net has been built from. */
+    int                         replicas;           /**< Number of data parallel replicas used for training, one per NUMA node (default 1). */
 } bcnncl_param;
 
 
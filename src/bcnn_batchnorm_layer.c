@@ -253,6 +253,13 @@ int bcnn_forward_batchnorm_layer(bcnn_net *net, bcnn_connection *conn) {
 #ifdef BCNN_USE_CUDA
     return bcnn_forward_batchnorm_layer_gpu(conn->layer, src, dst);
 #else
+    if (net->recompute) {
+        // The normalized output has been kept by the forward pass, which also
+        // avoids updating the running statistics twice
+        bcnn_copy_f32(bcnn_tensor_get_size(&dst->tensor), conn->layer->x_norm,
+                      dst->tensor.data);
+        return BCNN_SUCCESS;
+    }
     return bcnn_forward_batchnorm_layer_cpu(conn->layer, src, dst);
 #endif
 }
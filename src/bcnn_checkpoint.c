@@ -0,0 +1,185 @@
+/*
+* Copyright (c) 2016 Jean-Noel Braun.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#include <bh/bh.h>
+#include <bh/bh_mem.h>
+
+#include "bcnn/bcnn.h"
+#include "bcnn_tensor.h"
+#include "bh_log.h"
+
+/* Activation checkpointing.
+ *
+ * The connections are split into segments of 'checkpoint_every' consecutive
+ * connections. A node whose producer and consumers all lie in the same
+ * segment only lives while this segment is processed: its data (and gradient)
+ * are carved from a pool shared by all the segments instead of being owned by
+ * the node. The other nodes (network input / output, nodes read by a later
+ * segment, concatenation nodes) keep their own memory and act as checkpoints
+ * from which bcnn_backward replays each segment before back-propagating
+ * through it.
+ *
+ * A pooled node is flagged by its mem_chunk_id, set to its segment index + 1.
+ */
+
+// Offsets in the pool are kept aligned like the tensors allocations.
+static int bcnn_checkpoint_aligned_size(int size) {
+    int a = align_offset_ / sizeof(float);
+    return (size + a - 1) / a * a;
+}
+
+// Returns the segment of the node if its memory can be shared with the other
+// segments, -1 otherwise.
+static int bcnn_checkpoint_node_segment(bcnn_net *net, int node, int k) {
+    int i, j, idx, seg = -1;
+    int n = net->nb_connections;
+    int en = (net->connections[n - 1].layer->type == COST ? (n - 2) : (n - 1));
+
+    // Network input, label and output nodes
+    if (node <= 1 || net->nodes[node].is_view ||
+        node == net->connections[en].dst[0]) {
+        return -1;
+    }
+    for (i = 0; i < n; ++i) {
+        bcnn_connection *conn = &net->connections[i];
+        for (j = 0; j < conn->num_src + conn->num_dst; ++j) {
+            idx = (j < conn->num_src ? conn->src[j]
+                                     : conn->dst[j - conn->num_src]);
+            if (idx != node) {
+                continue;
+            }
+            // Concatenations may alias the memory of their nodes
+            if (conn->layer->type == CONCAT || conn->layer->type == COST) {
+                return -1;
+            }
+            if (seg < 0) {
+                // The node must be produced before being read
+                if (j < conn->num_src) {
+                    return -1;
+                }
+                seg = i / k;
+            } else if (i / k != seg) {
+                return -1;
+            }
+        }
+    }
+    return seg;
+}
+
+void bcnn_net_free_checkpoints(bcnn_net *net) {
+    int i;
+    bcnn_tensor *t = NULL;
+
+    for (i = 0; i < net->num_nodes; ++i) {
+        if (net->nodes[i].mem_chunk_id == 0) {
+            continue;
+        }
+        // Give back its own memory to the node
+        t = &net->nodes[i].tensor;
+        t->data = NULL;
+#ifndef BCNN_DEPLOY_ONLY
+        t->grad_data = NULL;
+#endif
+        bcnn_tensor_allocate(t);
+        net->nodes[i].mem_chunk_id = 0;
+    }
+    bh_align_free(net->checkpoint_data);
+    net->checkpoint_data = NULL;
+    bh_align_free(net->checkpoint_grad);
+    net->checkpoint_grad = NULL;
+}
+
+int bcnn_net_plan_checkpoints(bcnn_net *net) {
+    int i, seg, sz, pool_size = 0, num_pooled = 0, has_grad = 0;
+    int k = net->checkpoint_every;
+    int num_seg = 0;
+    int *seg_size = NULL, *offsets = NULL;
+    float saved_mb = 0.0f;
+    bcnn_tensor *t = NULL;
+
+    bcnn_net_free_checkpoints(net);
+    if (net->state == 0 || k <= 1 || net->nb_connections <= k) {
+        return BCNN_SUCCESS;
+    }
+#ifdef BCNN_USE_CUDA
+    bh_log_warning("Activation checkpointing is not supported on gpu");
+    return BCNN_SUCCESS;
+#endif
+    num_seg = (net->nb_connections + k - 1) / k;
+    seg_size = (int *)calloc(num_seg, sizeof(int));
+    offsets = (int *)calloc(net->num_nodes, sizeof(int));
+    // First pass: offset of each pooled node inside the pool. All the
+    // segments start at offset 0.
+    for (i = 0; i < net->num_nodes; ++i) {
+        seg = bcnn_checkpoint_node_segment(net, i, k);
+        if (seg < 0) {
+            continue;
+        }
+        t = &net->nodes[i].tensor;
+        sz = bcnn_tensor_get_size(t);
+        if (sz <= 0) {
+            continue;
+        }
+        net->nodes[i].mem_chunk_id = seg + 1;
+        bcnn_tensor_free(t);
+        offsets[i] = seg_size[seg];
+        seg_size[seg] += bcnn_checkpoint_aligned_size(sz);
+        pool_size = bh_max(pool_size, seg_size[seg]);
+        has_grad |= t->has_grad;
+        saved_mb += sz * sizeof(float) * (t->has_grad ? 2 : 1);
+        num_pooled++;
+    }
+    if (num_pooled == 0) {
+        bh_free(seg_size);
+        bh_free(offsets);
+        return BCNN_SUCCESS;
+    }
+    net->checkpoint_data =
+        (float *)bh_align_calloc(pool_size * sizeof(float), align_offset_);
+#ifndef BCNN_DEPLOY_ONLY
+    if (has_grad) {
+        net->checkpoint_grad =
+            (float *)bh_align_calloc(pool_size * sizeof(float), align_offset_);
+    }
+#endif
+    // Second pass: point the pooled nodes into the pool
+    for (i = 0; i < net->num_nodes; ++i) {
+        if (net->nodes[i].mem_chunk_id == 0) {
+            continue;
+        }
+        t = &net->nodes[i].tensor;
+        t->data = net->checkpoint_data + offsets[i];
+#ifndef BCNN_DEPLOY_ONLY
+        if (t->has_grad) {
+            t->grad_data = net->checkpoint_grad + offsets[i];
+        }
+#endif
+    }
+    saved_mb -= (float)pool_size * sizeof(float) * (has_grad ? 2 : 1);
+    bh_log_info(
+        "[Checkpointing] %d segments, %d nodes recomputed, %.1f MB saved",
+        num_seg, num_pooled, saved_mb / (1024 * 1024));
+    bh_free(seg_size);
+    bh_free(offsets);
+    return BCNN_SUCCESS;
+}
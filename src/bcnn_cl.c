@@ -30,6 +30,8 @@
 
 #include "bcnn/bcnn.h"
 #include "bcnn/bcnn_cl.h"
+#include "bcnn_model_writer.h"
+#include "bcnn_thread.h"
 #include "bh_log.h"
 
 int bcnncl_init_from_config(bcnn_net *net, char *config_file,
@@ -44,14 +46,18 @@ int bcnncl_init_from_config(bcnn_net *net, char *config_file,
     bcnn_loss_metric cost = COST_SSE;
     bcnn_loss loss = EUCLIDEAN_LOSS;
     float rate = 1.0f;
-    int n_tok;
+    int i, n_tok, n_src;
     char *src_id = NULL, *dst_id = NULL;
+    char **src_ids = NULL;
 
     file = fopen(config_file, "rt");
     if (file == 0) {
         fprintf(stderr, "Couldn't open file: %s\n", config_file);
         exit(-1);
     }
+    bh_fill_option(&param->config_file, config_file);
+    param->eval_async = 1;
+    param->replicas = 1;
 
     bh_info("Network architecture");
     while ((line = bh_fgetline(file)) != 0) {
@@ -136,6 +142,18 @@ int bcnncl_init_from_config(bcnn_net *net, char *config_file,
                                                dst_id);
                     } else if (strcmp(curr_layer, "{dropout}") == 0) {
                         bcnn_add_dropout_layer(net, rate, src_id);
+                    } else if (strcmp(curr_layer, "{concat}") == 0) {
+                        bh_check(dst_id != NULL,
+                                 "Invalid output node name. "
+                                 "Hint: Are you sure that 'dst' field is "
+                                 "correctly setup?");
+                        // Input nodes are given as a comma separated list
+                        n_src = bh_strsplit(src_id, ',', &src_ids);
+                        bcnn_add_concat_layer_n(net, n_src, src_ids, dst_id);
+                        for (i = 0; i < n_src; ++i) {
+                            bh_free(src_ids[i]);
+                        }
+                        bh_free(src_ids);
                     } else {
                         bh_log_error("Unknown Layer %s", curr_layer);
                         return BCNN_INVALID_PARAMETER;
@@ -176,12 +194,24 @@ int bcnncl_init_from_config(bcnn_net *net, char *config_file,
                     bh_fill_option(&param->output_model, tok[1]);
                 else if (strcmp(tok[0], "out_pred") == 0)
                     bh_fill_option(&param->pred_out, tok[1]);
+                else if (strcmp(tok[0], "codegen_output") == 0)
+                    bh_fill_option(&param->codegen_output, tok[1]);
+                else if (strcmp(tok[0], "codegen_name") == 0)
+                    bh_fill_option(&param->codegen_name, tok[1]);
                 else if (strcmp(tok[0], "eval_test") == 0)
                     param->eval_test = atoi(tok[1]);
                 else if (strcmp(tok[0], "eval_period") == 0)
                     param->eval_period = atoi(tok[1]);
+                else if (strcmp(tok[0], "eval_async") == 0)
+                    param->eval_async = atoi(tok[1]);
                 else if (strcmp(tok[0], "save_model") == 0)
                     param->save_model = atoi(tok[1]);
+                else if (strcmp(tok[0], "model_f16") == 0)
+                    param->model_f16 = atoi(tok[1]);
+                else if (strcmp(tok[0], "keep_models") == 0)
+                    param->keep_models = atoi(tok[1]);
+                else if (strcmp(tok[0], "replicas") == 0)
+                    param->replicas = atoi(tok[1]);
                 else if (strcmp(tok[0], "nb_pred") == 0)
                     param->nb_pred = atoi(tok[1]);
                 else if (strcmp(tok[0], "source_train") == 0)
@@ -311,29 +341,258 @@ int bcnncl_init_from_config(bcnn_net *net, char *config_file,
     return 0;
 }
 
+/**
+ * Evaluation of the test database in background.
+ *
+ * The evaluation runs on its own net, built from the same config file and
+ * compiled once in predict mode, with its own iterator and buffers. The
+ * training thread only copies the weights into a snapshot buffer; the snapshot
+ * is loaded and evaluated by a background thread while training goes on, the
+ * result being reported with the iteration the snapshot was taken at.
+ */
+typedef struct {
+    bcnn_net *net;
+    bcnn_iterator iter_data;
+    bcnncl_param *param;
+    bcnn_thread thread;
+    int busy;
+    int iter;  // Training iteration of the snapshot
+    unsigned char *snapshot;
+    size_t size;
+    size_t capacity;
+} bcnncl_eval;
+
+static int bcnncl_eval_init(bcnncl_eval *eval, bcnncl_param *param) {
+    bcnncl_param eval_param = {0};
+
+    memset(eval, 0, sizeof(bcnncl_eval));
+#ifdef BCNN_USE_CUDA
+    // Both nets would share the cublas handle
+    bh_log_warning("Background evaluation is not supported on gpu");
+    return -1;
+#endif
+    if (param->config_file == NULL) {
+        return -1;
+    }
+    eval->param = param;
+    bcnn_init_net(&eval->net);
+    if (bcnncl_init_from_config(eval->net, param->config_file, &eval_param) !=
+        BCNN_SUCCESS) {
+        bcnn_end_net(&eval->net);
+        bcnncl_free_param(&eval_param);
+        return -1;
+    }
+    bcnncl_free_param(&eval_param);
+    bcnn_compile_net(eval->net, "predict");
+    if (bcnn_iterator_initialize(eval->net, &eval->iter_data,
+                                 param->test_input, param->path_test_label,
+                                 param->data_format) != 0) {
+        bcnn_iterator_terminate(&eval->iter_data);
+        bcnn_end_net(&eval->net);
+        return -1;
+    }
+    return 0;
+}
+
+static void *bcnncl_eval_run(void *arg) {
+    bcnncl_eval *eval = (bcnncl_eval *)arg;
+    bcnn_net *net = eval->net;
+    int i, num_batches = (eval->param->nb_pred + net->batch_size - 1) /
+                         net->batch_size;
+    float error = 0.0f, error_batch = 0.0f;
+    float *out = NULL;
+    bh_timer t = {0};
+
+    bh_timer_start(&t);
+    // Loading the weights refreshes the packed, fused and blocked copies, the
+    // net does not need to be compiled again
+    bcnn_load_model_from_buffer(net, eval->snapshot, eval->size);
+    bcnn_iterator_rewind(&eval->iter_data);
+    for (i = 0; i < num_batches; ++i) {
+        bcnn_predict_on_batch(net, &eval->iter_data, &out, &error_batch);
+        error += error_batch;
+    }
+    error /= eval->param->nb_pred;
+    bh_timer_stop(&t);
+    fprintf(stderr, "iter= %d test-error= %f eval-time= %lf sec\n",
+            eval->iter, error, bh_timer_get_msec(&t) / 1000);
+    fflush(stderr);
+    return NULL;
+}
+
+static void bcnncl_eval_wait(bcnncl_eval *eval) {
+    if (eval->busy) {
+        bcnn_thread_join(eval->thread);
+        eval->busy = 0;
+    }
+}
+
+static int bcnncl_eval_start(bcnncl_eval *eval, bcnn_net *net, int iter) {
+    size_t size;
+
+    // A single evaluation runs at a time
+    bcnncl_eval_wait(eval);
+    size = bcnn_get_model_size(net, 0);
+    if (size > eval->capacity) {
+        unsigned char *snapshot =
+            (unsigned char *)realloc(eval->snapshot, size);
+        if (snapshot == NULL) {
+            return BCNN_FAILED_ALLOC;
+        }
+        eval->snapshot = snapshot;
+        eval->capacity = size;
+    }
+    eval->size = bcnn_write_model_to_buffer(net, 0, eval->snapshot);
+    eval->iter = iter;
+    if (bcnn_thread_create(&eval->thread, bcnncl_eval_run, eval) != 0) {
+        bcnncl_eval_run(eval);
+        return BCNN_SUCCESS;
+    }
+    eval->busy = 1;
+    return BCNN_SUCCESS;
+}
+
+static void bcnncl_eval_free(bcnncl_eval *eval) {
+    bcnncl_eval_wait(eval);
+    if (eval->net != NULL) {
+        bcnn_iterator_terminate(&eval->iter_data);
+        bcnn_end_net(&eval->net);
+    }
+    bh_free(eval->snapshot);
+}
+
+/**
+ * Data parallel training (config key 'replicas'). The replicas other than the
+ * trained net are built from the same config file. The training data is split
+ * between them by sharding: replica r reads the shard
+ * shard_index * replicas + r out of shard_count * replicas.
+ */
+typedef struct {
+    int num;
+    bcnn_net **nets;
+    bcnn_iterator *iters;
+    bcnn_replicas *replicas;
+} bcnncl_replicas;
+
+static void bcnncl_replicas_free(bcnncl_replicas *rep) {
+    int i;
+
+    bcnn_replicas_terminate(&rep->replicas);
+    for (i = 0; i < rep->num; ++i) {
+        bcnn_iterator_terminate(&rep->iters[i]);
+        // The first net is owned by the caller
+        if (i > 0) {
+            bcnn_end_net(&rep->nets[i]);
+        }
+    }
+    bh_free(rep->nets);
+    bh_free(rep->iters);
+    memset(rep, 0, sizeof(bcnncl_replicas));
+}
+
+static int bcnncl_replicas_init(bcnncl_replicas *rep, bcnn_net *net,
+                                bcnncl_param *param) {
+    int i, shard_index = net->shard_index;
+    int shard_count = bh_max(net->shard_count, 1);
+    bcnncl_param rep_param = {0};
+
+    memset(rep, 0, sizeof(bcnncl_replicas));
+#ifdef BCNN_USE_CUDA
+    bh_log_warning("Training on replicas is not supported on gpu");
+    return -1;
+#endif
+    if (param->config_file == NULL) {
+        return -1;
+    }
+    rep->nets = (bcnn_net **)calloc(param->replicas, sizeof(bcnn_net *));
+    rep->iters =
+        (bcnn_iterator *)calloc(param->replicas, sizeof(bcnn_iterator));
+    rep->nets[0] = net;
+    for (i = 0; i < param->replicas; ++i) {
+        if (i > 0) {
+            bcnn_init_net(&rep->nets[i]);
+            if (bcnncl_init_from_config(rep->nets[i], param->config_file,
+                                        &rep_param) != BCNN_SUCCESS) {
+                bcnn_end_net(&rep->nets[i]);
+                bcnncl_free_param(&rep_param);
+                bcnncl_replicas_free(rep);
+                return -1;
+            }
+            bcnncl_free_param(&rep_param);
+        }
+        rep->nets[i]->shard_index = shard_index * param->replicas + i;
+        rep->nets[i]->shard_count = shard_count * param->replicas;
+        rep->num = i + 1;
+        if (bcnn_iterator_initialize(rep->nets[i], &rep->iters[i],
+                                     param->train_input,
+                                     param->path_train_label,
+                                     param->data_format) != 0) {
+            bcnncl_replicas_free(rep);
+            return -1;
+        }
+    }
+    if (bcnn_replicas_initialize(&rep->replicas, rep->nets, rep->iters,
+                                 rep->num) != BCNN_SUCCESS) {
+        bcnncl_replicas_free(rep);
+        return -1;
+    }
+    return 0;
+}
+
 int bcnncl_train(bcnn_net *net, bcnncl_param *param, float *error) {
     float error_batch = 0.0f, sum_error = 0.0f, error_valid = 0.0f;
     int i = 0, nb_iter = net->max_batches;
     int batch_size = net->batch_size;
     bh_timer t = {0};
     bcnn_iterator iter_data = {0};
+    bcnn_model_writer writer = {0};
+    bcnncl_eval eval = {0};
+    bcnncl_replicas rep = {0};
+    int eval_async = 0, eval_sync = 0;
     char chk_pt_path[1024];
 
-    if (bcnn_iterator_initialize(net, &iter_data, param->train_input,
+    if (param->replicas > 1) {
+        if (bcnncl_replicas_init(&rep, net, param) != 0) {
+            bh_log_warning("Could not set up %d replicas, training on a "
+                           "single net", param->replicas);
+        }
+    }
+    if (rep.replicas == NULL &&
+        bcnn_iterator_initialize(net, &iter_data, param->train_input,
                                  param->path_train_label,
                                  param->data_format) != 0)
         return -1;
 
-    bcnn_compile_net(net, "train");
+    // Replicas are compiled by their own thread
+    if (rep.replicas == NULL) {
+        bcnn_compile_net(net, "train");
+    }
+    // Periodic models are written in background
+    bcnn_model_writer_init(&writer, param->keep_models);
+    // Replicas are always evaluated in background: the predict and train
+    // compilations of a synchronous evaluation would reallocate the memory of
+    // replica 0 from the main thread, away from its NUMA node
+    if (param->eval_test && (param->eval_async || rep.replicas != NULL)) {
+        eval_async = (bcnncl_eval_init(&eval, param) == 0);
+        if (!eval_async && rep.replicas != NULL) {
+            bh_log_warning("Could not start the background evaluation, the "
+                           "test set is not evaluated during training");
+        }
+    }
+    eval_sync = (param->eval_test && !eval_async && rep.replicas == NULL);
 
     bh_timer_start(&t);
     for (i = 0; i < nb_iter; ++i) {
-        bcnn_train_on_batch(net, &iter_data, &error_batch);
+        if (rep.replicas != NULL) {
+            bcnn_replicas_train_on_batch(rep.replicas, &error_batch);
+        } else {
+            bcnn_train_on_batch(net, &iter_data, &error_batch);
+        }
         sum_error += error_batch;
 
         if (i % param->eval_period == 0 && i > 0) {
             bh_timer_stop(&t);
-            if (param->eval_test) {
+            if (eval_sync) {
                 bcnncl_predict(net, param, &error_valid, 1);
                 fprintf(stderr,
                         "iter= %d train-error= %f test-error= %f "
@@ -349,14 +608,22 @@ int bcnncl_train(bcnn_net *net, bcnncl_param *param, float *error) {
             fflush(stderr);
             bh_timer_start(&t);
             sum_error = 0;
-            if (param->eval_test) bcnn_compile_net(net, "train");
+            if (eval_async) {
+                bcnncl_eval_start(&eval, net, i);
+            } else if (eval_sync) {
+                bcnn_compile_net(net, "train");
+            }
         }
         if (i % param->save_model == 0 && i > 0) {
             sprintf(chk_pt_path, "%s_iter%d.dat", param->output_model, i);
-            bcnn_write_model(net, chk_pt_path);
+            bcnn_model_writer_save(&writer, net, chk_pt_path,
+                                   param->model_f16);
         }
     }
 
+    bcnn_model_writer_free(&writer);
+    bcnncl_eval_free(&eval);
+    bcnncl_replicas_free(&rep);
     bcnn_iterator_terminate(&iter_data);
     *error = (float)sum_error / (param->eval_period * batch_size);
 
@@ -460,11 +727,14 @@ int bcnncl_free_param(bcnncl_param *param) {
     bh_free(param->input_model);
     bh_free(param->output_model);
     bh_free(param->pred_out);
+    bh_free(param->codegen_output);
+    bh_free(param->codegen_name);
     bh_free(param->train_input);
     bh_free(param->test_input);
     bh_free(param->data_format);
     bh_free(param->path_train_label);
     bh_free(param->path_test_label);
+    bh_free(param->config_file);
     return 0;
 }
 
@@ -489,8 +759,13 @@ int run(char *config_file) {
             bh_error("Can not perform training", -1);
         if (param.pred_out != NULL)
             bcnncl_predict(net, &param, &error_valid, 1);
-        if (param.output_model != NULL)
-            bcnn_write_model(net, param.output_model);
+        if (param.output_model != NULL) {
+            if (param.model_f16) {
+                bcnn_write_model_f16(net, param.output_model);
+            } else {
+                bcnn_write_model(net, param.output_model);
+            }
+        }
         bh_info("Training ended successfully");
     } else if (param.task == PREDICT) {
         if (param.input_model != NULL)
@@ -500,10 +775,18 @@ int run(char *config_file) {
                 "No model in input. Inform which model to use in config file "
                 "with field 'input_model'",
                 BCNN_INVALID_PARAMETER);
-        bh_info("Start prediction...");
-        if (bcnncl_predict(net, &param, &error_test, 1) != 0)
-            bh_error("Can not perform prediction", -1);
-        bh_info("Prediction ended successfully");
+        if (param.codegen_output != NULL) {
+            if (bcnn_write_c_source(
+                    net, param.codegen_output,
+                    param.codegen_name ? param.codegen_name : "bcnn_model") !=
+                BCNN_SUCCESS)
+                bh_error("Can not generate the inference code", -1);
+        } else {
+            bh_info("Start prediction...");
+            if (bcnncl_predict(net, &param, &error_test, 1) != 0)
+                bh_error("Can not perform prediction", -1);
+            bh_info("Prediction ended successfully");
+        }
     }
     bcnn_end_net(&net);
     bcnncl_free_param(&param);
@@ -0,0 +1,754 @@
+/*
+* Copyright (c) 2016 Jean-Noel Braun.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <bh/bh.h>
+#include <bh/bh_mem.h>
+
+#include "bcnn/bcnn.h"
+#include "bcnn_mat.h"
+#include "bcnn_tensor.h"
+#include "bh_log.h"
+
+/* Ahead-of-time code generation.
+ *
+ * The generated file computes the inference of the net for its current input
+ * shape. Each connection becomes a function in which every shape is a literal,
+ * the parameters are const arrays (gemm weights being stored already packed
+ * for the micro-kernel) and the nodes live at fixed offsets of one static
+ * arena. Offsets are planned from the lifetime of the nodes: two nodes only
+ * share memory if no connection between the producer and the last reader of
+ * one of them touches the other. Gemm, im2col and col2im are called from the
+ * library, everything else is written inline.
+ *
+ * Deconvolutions are always written as gemm + col2im while the cpu runtime
+ * computes the unpadded ones by output phases (bcnn_deconv_layer_is_phased):
+ * their results only match up to the rounding of the sums. The other layers
+ * match the unfused runtime forward bit for bit. */
+
+typedef struct {
+    int size;
+    int first;   // Producing connection, -1 for the net input
+    int last;    // Last connection reading the node
+    int offset;  // Offset in the arena, -1 if the node is not used
+} bcnn_codegen_buffer;
+
+typedef struct {
+    FILE *f;
+    bcnn_net *net;
+    const char *name;
+    int num_conns;  // Connections generated, the cost layer is left out
+    int output;     // Output node
+    bcnn_codegen_buffer *bufs;
+    int arena_size;
+    int workspace_size;
+} bcnn_codegen;
+
+static int bcnn_codegen_is_supported(bcnn_layer_type type) {
+    switch (type) {
+        case CONVOLUTIONAL:
+        case DECONVOLUTIONAL:
+        case DEPTHWISE_CONV:
+        case ACTIVATION:
+        case FULL_CONNECTED:
+        case MAXPOOL:
+        case SOFTMAX:
+        case DROPOUT:
+        case BATCHNORM:
+        case CONCAT:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static void bcnn_codegen_use_node(bcnn_codegen *cg, int node, int conn) {
+    bcnn_codegen_buffer *b = &cg->bufs[node];
+
+    if (b->offset < 0) {
+        b->offset = 0;
+        b->first = conn;
+        b->last = conn;
+        b->size = bcnn_tensor_get_size(&cg->net->nodes[node].tensor);
+    }
+    b->last = bh_max(b->last, conn);
+}
+
+// First-fit placement of the nodes, by order of production
+static void bcnn_codegen_plan_buffers(bcnn_codegen *cg) {
+    int i, j, k, offset, moved;
+    bcnn_net *net = cg->net;
+
+    for (i = 0; i < net->num_nodes; ++i) {
+        cg->bufs[i].offset = -1;
+    }
+    bcnn_codegen_use_node(cg, 0, -1);
+    for (i = 0; i < cg->num_conns; ++i) {
+        bcnn_connection *conn = &net->connections[i];
+        for (j = 0; j < conn->num_src; ++j) {
+            bcnn_codegen_use_node(cg, conn->src[j], i);
+        }
+        for (j = 0; j < conn->num_dst; ++j) {
+            bcnn_codegen_use_node(cg, conn->dst[j], i);
+        }
+    }
+    // The output is read back after the last connection
+    cg->bufs[cg->output].last = cg->num_conns;
+
+    // Columns of the convolutions and deconvolutions
+    cg->workspace_size = 0;
+    for (i = 0; i < cg->num_conns; ++i) {
+        bcnn_layer *layer = net->connections[i].layer;
+        bcnn_tensor *src = &net->nodes[net->connections[i].src[0]].tensor;
+        bcnn_tensor *dst = &net->nodes[net->connections[i].dst[0]].tensor;
+        if (layer->type == CONVOLUTIONAL && layer->size != 1) {
+            cg->workspace_size =
+                bh_max(cg->workspace_size, layer->size * layer->size *
+                                               src->c * dst->w * dst->h);
+        } else if (layer->type == DECONVOLUTIONAL) {
+            cg->workspace_size =
+                bh_max(cg->workspace_size, layer->num * layer->size *
+                                               layer->size * src->w * src->h);
+        }
+    }
+
+    cg->arena_size = 0;
+    for (i = 0; i < net->num_nodes; ++i) {
+        bcnn_codegen_buffer *b = &cg->bufs[i];
+        if (b->offset < 0) {
+            continue;
+        }
+        offset = 0;
+        do {
+            moved = 0;
+            for (k = 0; k < i; ++k) {
+                bcnn_codegen_buffer *o = &cg->bufs[k];
+                if (o->offset < 0 || o->last < b->first ||
+                    b->last < o->first) {
+                    continue;
+                }
+                if (offset < o->offset + o->size &&
+                    o->offset < offset + b->size) {
+                    // Offsets are kept 32 bytes aligned
+                    offset = (o->offset + o->size + 7) / 8 * 8;
+                    moved = 1;
+                }
+            }
+        } while (moved);
+        b->offset = offset;
+        cg->arena_size = bh_max(cg->arena_size, offset + b->size);
+    }
+}
+
+static void bcnn_codegen_write_array(bcnn_codegen *cg, const char *array,
+                                     int index, const float *data, int n) {
+    int i;
+
+    fprintf(cg->f, "static BCNN_ALIGNED const float %s_%s%d[%d] = {", cg->name,
+            array, index, n);
+    for (i = 0; i < n; ++i) {
+        fprintf(cg->f, "%s", (i % 4 == 0 ? "\n    " : " "));
+        // Hexadecimal notation keeps the exact value of the weights, which
+        // has no literal if not finite
+        if (isnan(data[i])) {
+            fprintf(cg->f, "NAN,");
+        } else if (isinf(data[i])) {
+            fprintf(cg->f, "%sINFINITY,", (data[i] < 0 ? "-" : ""));
+        } else {
+            fprintf(cg->f, "%af,", (double)data[i]);
+        }
+    }
+    fprintf(cg->f, "\n};\n");
+}
+
+// Single precision copy of the weights, which may only be stored in half
+// precision in predict mode
+static float *bcnn_codegen_weights(bcnn_layer *layer) {
+    int sz = bcnn_tensor_get_size(&layer->weights);
+    float *w = (float *)calloc(sz, sizeof(float));
+
+    if (layer->weights.data != NULL) {
+        memcpy(w, layer->weights.data, sz * sizeof(float));
+    } else {
+        bcnn_f16_to_f32(sz, layer->weights_f16, w);
+    }
+    return w;
+}
+
+// Same expressions as bcnn_forward_activation_cpu
+static void bcnn_codegen_write_activation(bcnn_codegen *cg, const char *indent,
+                                          bcnn_activation a) {
+    const char *expr = NULL;
+
+    switch (a) {
+        case TANH:
+            expr = "(float)(exp(2 * v) - 1) / ((float)exp(2 * v) + 1)";
+            break;
+        case RELU:
+            expr = "v * (v > 0)";
+            break;
+        case LRELU:
+            expr = "(v > 0 ? v : 0.01f * v)";
+            break;
+        case RAMP:
+            expr = "v * (v > 0) + 0.1f * v";
+            break;
+        case SOFTPLUS:
+            expr = "(float)log(1.0f + (float)exp(v))";
+            break;
+        case ABS:
+            expr = "(float)fabs(v)";
+            break;
+        case CLAMP:
+            expr = "(v < 0 ? 0 : (v > 1 ? 1 : v))";
+            break;
+        default:
+            return;
+    }
+    fprintf(cg->f, "%sv = %s;\n", indent, expr);
+}
+
+// Adds the biases of 'c' channels of 'spatial' values then applies the
+// activation
+static void bcnn_codegen_write_epilogue(bcnn_codegen *cg, int idx, int batch,
+                                        int c, int spatial, bcnn_activation a) {
+    FILE *f = cg->f;
+
+    fprintf(f, "    for (b = 0; b < %d; ++b) {\n", batch);
+    fprintf(f, "        for (c = 0; c < %d; ++c) {\n", c);
+    fprintf(f, "            float *y = dst + (b * %d + c) * %d;\n", c,
+            spatial);
+    fprintf(f, "            for (i = 0; i < %d; ++i) {\n", spatial);
+    fprintf(f, "                float v = y[i] + %s_b%d[c];\n", cg->name, idx);
+    bcnn_codegen_write_activation(cg, "                ", a);
+    fprintf(f, "                y[i] = v;\n");
+    fprintf(f, "            }\n");
+    fprintf(f, "        }\n");
+    fprintf(f, "    }\n");
+}
+
+static void bcnn_codegen_write_conv(bcnn_codegen *cg, int idx,
+                                    bcnn_layer *layer, bcnn_tensor *src,
+                                    bcnn_tensor *dst) {
+    FILE *f = cg->f;
+    int m = layer->num;
+    int k = layer->size * layer->size * src->c;
+    int n = dst->w * dst->h;
+    float *w = bcnn_codegen_weights(layer);
+    float *p = (float *)bh_align_calloc(
+        bcnn_gemm_pack_a_size(m, k) * sizeof(float), align_offset_);
+
+    bcnn_gemm_pack_a(0, m, k, w, k, p);
+    bcnn_codegen_write_array(cg, "w", idx, p, bcnn_gemm_pack_a_size(m, k));
+    bcnn_codegen_write_array(cg, "b", idx, layer->biases.data, m);
+    bh_align_free(p);
+    bh_free(w);
+
+    fprintf(f, "static void %s_conv%d(const float *src, float *dst) {\n",
+            cg->name, idx);
+    fprintf(f, "    int b, c, i;\n");
+    fprintf(f, "    for (b = 0; b < %d; ++b) {\n", src->n);
+    if (layer->size == 1) {
+        fprintf(f, "        float *col = (float *)src + b * %d;\n",
+                bcnn_tensor_get_size3d(src));
+    } else {
+        fprintf(f, "        float *col = %s_workspace;\n", cg->name);
+        fprintf(f,
+                "        bcnn_im2col(src + b * %d, %d, %d, %d, %d, %d, %d, "
+                "col);\n",
+                bcnn_tensor_get_size3d(src), src->c, src->h, src->w,
+                layer->size, layer->pad, layer->stride);
+    }
+    fprintf(f,
+            "        bcnn_gemm_packed(0, 0, %d, %d, %d, 1.0f, NULL, "
+            "(float *)%s_w%d, %d, col, NULL, %d, 0.0f, dst + b * %d, %d);\n",
+            m, n, k, cg->name, idx, k, n, m * n, n);
+    fprintf(f, "    }\n");
+    bcnn_codegen_write_epilogue(cg, idx, dst->n, m, n, layer->activation);
+    fprintf(f, "}\n\n");
+}
+
+static void bcnn_codegen_write_deconv(bcnn_codegen *cg, int idx,
+                                      bcnn_layer *layer, bcnn_tensor *src,
+                                      bcnn_tensor *dst) {
+    FILE *f = cg->f;
+    int m = layer->num * layer->size * layer->size;
+    int k = src->c;
+    int n = src->w * src->h;
+    float *w = bcnn_codegen_weights(layer);
+    float *p = (float *)bh_align_calloc(
+        bcnn_gemm_pack_a_size(m, k) * sizeof(float), align_offset_);
+
+    bcnn_gemm_pack_a(1, m, k, w, m, p);
+    bcnn_codegen_write_array(cg, "w", idx, p, bcnn_gemm_pack_a_size(m, k));
+    bcnn_codegen_write_array(cg, "b", idx, layer->biases.data, layer->num);
+    bh_align_free(p);
+    bh_free(w);
+
+    fprintf(f, "static void %s_deconv%d(const float *src, float *dst) {\n",
+            cg->name, idx);
+    fprintf(f, "    int b, c, i;\n");
+    fprintf(f, "    memset(dst, 0, %d * sizeof(float));\n",
+            bcnn_tensor_get_size(dst));
+    fprintf(f, "    for (b = 0; b < %d; ++b) {\n", src->n);
+    fprintf(f,
+            "        bcnn_gemm_packed(1, 0, %d, %d, %d, 1.0f, NULL, "
+            "(float *)%s_w%d, %d, (float *)src + b * %d, NULL, %d, 0.0f, "
+            "%s_workspace, %d);\n",
+            m, n, k, cg->name, idx, m, bcnn_tensor_get_size3d(src), n,
+            cg->name, n);
+    fprintf(f,
+            "        bcnn_col2im(%s_workspace, %d, %d, %d, %d, 0, %d, "
+            "dst + b * %d);\n",
+            cg->name, layer->num, dst->h, dst->w, layer->size, layer->stride,
+            bcnn_tensor_get_size3d(dst));
+    fprintf(f, "    }\n");
+    bcnn_codegen_write_epilogue(cg, idx, dst->n, dst->c, dst->w * dst->h,
+                                layer->activation);
+    fprintf(f, "}\n\n");
+}
+
+static void bcnn_codegen_write_depthwise(bcnn_codegen *cg, int idx,
+                                         bcnn_layer *layer, bcnn_tensor *src,
+                                         bcnn_tensor *dst) {
+    FILE *f = cg->f;
+
+    bcnn_codegen_write_array(cg, "w", idx, layer->weights.data,
+                             bcnn_tensor_get_size(&layer->weights));
+    bcnn_codegen_write_array(cg, "b", idx, layer->biases.data, dst->c);
+
+    fprintf(f, "static void %s_dwconv%d(const float *src, float *dst) {\n",
+            cg->name, idx);
+    fprintf(f, "    int b, c, i, y, x, ky, kx;\n");
+    fprintf(f, "    for (b = 0; b < %d; ++b) {\n", dst->n);
+    fprintf(f, "        for (c = 0; c < %d; ++c) {\n", dst->c);
+    fprintf(f, "            const float *s = src + (b * %d + c) * %d;\n",
+            dst->c, src->w * src->h);
+    fprintf(f, "            const float *w = %s_w%d + c * %d;\n", cg->name,
+            idx, layer->size * layer->size);
+    fprintf(f, "            float *d = dst + (b * %d + c) * %d;\n", dst->c,
+            dst->w * dst->h);
+    fprintf(f, "            for (y = 0; y < %d; ++y) {\n", dst->h);
+    fprintf(f, "                for (x = 0; x < %d; ++x) {\n", dst->w);
+    fprintf(f, "                    float v = 0;\n");
+    fprintf(f, "                    for (ky = 0; ky < %d; ++ky) {\n",
+            layer->size);
+    fprintf(f, "                        int sy = y * %d - %d + ky;\n",
+            layer->stride, layer->pad);
+    fprintf(f, "                        for (kx = 0; kx < %d; ++kx) {\n",
+            layer->size);
+    fprintf(f, "                            int sx = x * %d - %d + kx;\n",
+            layer->stride, layer->pad);
+    fprintf(f,
+            "                            if (sy >= 0 && sy < %d && sx >= 0 && "
+            "sx < %d) {\n",
+            src->h, src->w);
+    fprintf(f,
+            "                                v += w[ky * %d + kx] * "
+            "s[sy * %d + sx];\n",
+            layer->size, src->w);
+    fprintf(f, "                            }\n");
+    fprintf(f, "                        }\n");
+    fprintf(f, "                    }\n");
+    fprintf(f, "                    d[y * %d + x] = v;\n", dst->w);
+    fprintf(f, "                }\n");
+    fprintf(f, "            }\n");
+    fprintf(f, "        }\n");
+    fprintf(f, "    }\n");
+    bcnn_codegen_write_epilogue(cg, idx, dst->n, dst->c, dst->w * dst->h,
+                                layer->activation);
+    fprintf(f, "}\n\n");
+}
+
+static void bcnn_codegen_write_fullc(bcnn_codegen *cg, int idx,
+                                     bcnn_layer *layer, bcnn_tensor *src,
+                                     bcnn_tensor *dst) {
+    FILE *f = cg->f;
+    int k = bcnn_tensor_get_size3d(src);
+    int n = bcnn_tensor_get_size3d(dst);
+    float *w = bcnn_codegen_weights(layer);
+    float *p = (float *)bh_align_calloc(
+        bcnn_gemm_pack_b_size(k, n) * sizeof(float), align_offset_);
+
+    bcnn_gemm_pack_b(1, k, n, w, k, p);
+    bcnn_codegen_write_array(cg, "w", idx, p, bcnn_gemm_pack_b_size(k, n));
+    bcnn_codegen_write_array(cg, "b", idx, layer->biases.data, n);
+    bh_align_free(p);
+    bh_free(w);
+
+    fprintf(f, "static void %s_fullc%d(const float *src, float *dst) {\n",
+            cg->name, idx);
+    fprintf(f, "    int b, c, i;\n");
+    fprintf(f,
+            "    bcnn_gemm_packed(0, 1, %d, %d, %d, 1.0f, (float *)src, NULL, "
+            "%d, NULL, (float *)%s_w%d, %d, 0.0f, dst, %d);\n",
+            dst->n, n, k, k, cg->name, idx, k, n);
+    bcnn_codegen_write_epilogue(cg, idx, dst->n, n, 1, layer->activation);
+    fprintf(f, "}\n\n");
+}
+
+static void bcnn_codegen_write_activation_layer(bcnn_codegen *cg, int idx,
+                                                bcnn_layer *layer,
+                                                bcnn_tensor *dst) {
+    FILE *f = cg->f;
+    int spatial = dst->w * dst->h;
+
+    if (layer->activation == PRELU) {
+        bcnn_codegen_write_array(cg, "w", idx, layer->weights.data, dst->c);
+    }
+    fprintf(f, "static void %s_act%d(float *dst) {\n", cg->name, idx);
+    fprintf(f, "    int i;\n");
+    fprintf(f, "    for (i = 0; i < %d; ++i) {\n", bcnn_tensor_get_size(dst));
+    fprintf(f, "        float v = dst[i];\n");
+    if (layer->activation == PRELU) {
+        fprintf(f, "        v = (v > 0 ? v : %s_w%d[(i / %d) %% %d] * v);\n",
+                cg->name, idx, spatial, dst->c);
+    } else {
+        bcnn_codegen_write_activation(cg, "        ", layer->activation);
+    }
+    fprintf(f, "        dst[i] = v;\n");
+    fprintf(f, "    }\n");
+    fprintf(f, "}\n\n");
+}
+
+static void bcnn_codegen_write_batchnorm(bcnn_codegen *cg, int idx,
+                                         bcnn_layer *layer, bcnn_tensor *dst) {
+    FILE *f = cg->f;
+    int i;
+    float *den = (float *)calloc(dst->c, sizeof(float));
+
+    // Same denominator as the batchnorm layer in predict mode
+    for (i = 0; i < dst->c; ++i) {
+        den[i] = sqrtf(layer->running_variance.data[i] + 0.000001f);
+    }
+    bcnn_codegen_write_array(cg, "mean", idx, layer->running_mean.data,
+                             dst->c);
+    bcnn_codegen_write_array(cg, "den", idx, den, dst->c);
+    bh_free(den);
+
+    fprintf(f, "static void %s_bn%d(const float *src, float *dst) {\n",
+            cg->name, idx);
+    fprintf(f, "    int b, c, i;\n");
+    fprintf(f, "    for (b = 0; b < %d; ++b) {\n", dst->n);
+    fprintf(f, "        for (c = 0; c < %d; ++c) {\n", dst->c);
+    fprintf(f, "            int o = (b * %d + c) * %d;\n", dst->c,
+            dst->w * dst->h);
+    fprintf(f, "            for (i = 0; i < %d; ++i) {\n", dst->w * dst->h);
+    fprintf(f,
+            "                dst[o + i] = (src[o + i] - %s_mean%d[c]) / "
+            "%s_den%d[c];\n",
+            cg->name, idx, cg->name, idx);
+    fprintf(f, "            }\n");
+    fprintf(f, "        }\n");
+    fprintf(f, "    }\n");
+    fprintf(f, "}\n\n");
+}
+
+static void bcnn_codegen_write_maxpool(bcnn_codegen *cg, int idx,
+                                       bcnn_layer *layer, bcnn_tensor *src,
+                                       bcnn_tensor *dst) {
+    FILE *f = cg->f;
+
+    fprintf(f, "static void %s_maxpool%d(const float *src, float *dst) {\n",
+            cg->name, idx);
+    fprintf(f, "    int c, y, x, ky, kx;\n");
+    fprintf(f, "    for (c = 0; c < %d; ++c) {\n", dst->n * dst->c);
+    fprintf(f, "        const float *s = src + c * %d;\n", src->w * src->h);
+    fprintf(f, "        float *d = dst + c * %d;\n", dst->w * dst->h);
+    fprintf(f, "        for (y = 0; y < %d; ++y) {\n", dst->h);
+    fprintf(f, "            for (x = 0; x < %d; ++x) {\n", dst->w);
+    fprintf(f, "                float v = -FLT_MAX;\n");
+    fprintf(f, "                for (ky = 0; ky < %d; ++ky) {\n", layer->size);
+    fprintf(f, "                    int sy = y * %d + ky;\n", layer->stride);
+    fprintf(f, "                    for (kx = 0; kx < %d; ++kx) {\n",
+            layer->size);
+    fprintf(f, "                        int sx = x * %d + kx;\n",
+            layer->stride);
+    fprintf(f,
+            "                        if (sy < %d && sx < %d && "
+            "s[sy * %d + sx] > v) {\n",
+            src->h, src->w, src->w);
+    fprintf(f, "                            v = s[sy * %d + sx];\n", src->w);
+    fprintf(f, "                        }\n");
+    fprintf(f, "                    }\n");
+    fprintf(f, "                }\n");
+    fprintf(f, "                d[y * %d + x] = v;\n", dst->w);
+    fprintf(f, "            }\n");
+    fprintf(f, "        }\n");
+    fprintf(f, "    }\n");
+    fprintf(f, "}\n\n");
+}
+
+// Softmax over the channels of each location, as done by the softmax layer
+static void bcnn_codegen_write_softmax(bcnn_codegen *cg, int idx,
+                                       bcnn_tensor *src) {
+    FILE *f = cg->f;
+    int spatial = src->w * src->h;
+    int c = (spatial == 1 ? bcnn_tensor_get_size3d(src) : src->c);
+
+    fprintf(f, "static void %s_softmax%d(const float *src, float *dst) {\n",
+            cg->name, idx);
+    fprintf(f, "    int b, c, i;\n");
+    fprintf(f, "    for (b = 0; b < %d; ++b) {\n", src->n);
+    fprintf(f, "        for (i = 0; i < %d; ++i) {\n", spatial);
+    fprintf(f, "            const float *s = src + b * %d + i;\n",
+            bcnn_tensor_get_size3d(src));
+    fprintf(f, "            float *d = dst + b * %d + i;\n",
+            bcnn_tensor_get_size3d(src));
+    fprintf(f, "            float vmax = -FLT_MAX, sum = 0.0f;\n");
+    fprintf(f, "            for (c = 0; c < %d; ++c) {\n", c);
+    fprintf(f, "                if (s[c * %d] > vmax) {\n", spatial);
+    fprintf(f, "                    vmax = s[c * %d];\n", spatial);
+    fprintf(f, "                }\n");
+    fprintf(f, "            }\n");
+    fprintf(f, "            for (c = 0; c < %d; ++c) {\n", c);
+    fprintf(f, "                sum += (float)exp(s[c * %d] - vmax);\n",
+            spatial);
+    fprintf(f, "            }\n");
+    fprintf(f,
+            "            sum = (sum ? vmax + (float)log(sum) : "
+            "vmax - 100.0f);\n");
+    fprintf(f, "            for (c = 0; c < %d; ++c) {\n", c);
+    fprintf(f, "                d[c * %d] = (float)exp(s[c * %d] - sum);\n",
+            spatial, spatial);
+    fprintf(f, "            }\n");
+    fprintf(f, "        }\n");
+    fprintf(f, "    }\n");
+    fprintf(f, "}\n\n");
+}
+
+static void bcnn_codegen_write_layer(bcnn_codegen *cg, int idx) {
+    bcnn_connection *conn = &cg->net->connections[idx];
+    bcnn_layer *layer = conn->layer;
+    bcnn_tensor *src = &cg->net->nodes[conn->src[0]].tensor;
+    bcnn_tensor *dst = &cg->net->nodes[conn->dst[0]].tensor;
+
+    switch (layer->type) {
+        case CONVOLUTIONAL:
+            bcnn_codegen_write_conv(cg, idx, layer, src, dst);
+            break;
+        case DECONVOLUTIONAL:
+            bcnn_codegen_write_deconv(cg, idx, layer, src, dst);
+            break;
+        case DEPTHWISE_CONV:
+            bcnn_codegen_write_depthwise(cg, idx, layer, src, dst);
+            break;
+        case FULL_CONNECTED:
+            bcnn_codegen_write_fullc(cg, idx, layer, src, dst);
+            break;
+        case ACTIVATION:
+            bcnn_codegen_write_activation_layer(cg, idx, layer, dst);
+            break;
+        case BATCHNORM:
+            bcnn_codegen_write_batchnorm(cg, idx, layer, dst);
+            break;
+        case MAXPOOL:
+            bcnn_codegen_write_maxpool(cg, idx, layer, src, dst);
+            break;
+        case SOFTMAX:
+            bcnn_codegen_write_softmax(cg, idx, src);
+            break;
+        default:
+            // Dropout is the identity at inference, concat is a copy done
+            // in the forward function
+            break;
+    }
+}
+
+// Pointer to a node in the generated code
+static void bcnn_codegen_write_node(bcnn_codegen *cg, int node) {
+    fprintf(cg->f, "%s_arena + %d", cg->name, cg->bufs[node].offset);
+}
+
+static void bcnn_codegen_write_call(bcnn_codegen *cg, int idx) {
+    FILE *f = cg->f;
+    bcnn_connection *conn = &cg->net->connections[idx];
+    const char *fn = NULL;
+    int i, j, offset = 0;
+
+    switch (conn->layer->type) {
+        case CONVOLUTIONAL:
+            fn = "conv";
+            break;
+        case DECONVOLUTIONAL:
+            fn = "deconv";
+            break;
+        case DEPTHWISE_CONV:
+            fn = "dwconv";
+            break;
+        case FULL_CONNECTED:
+            fn = "fullc";
+            break;
+        case BATCHNORM:
+            fn = "bn";
+            break;
+        case MAXPOOL:
+            fn = "maxpool";
+            break;
+        case SOFTMAX:
+            fn = "softmax";
+            break;
+        case ACTIVATION:
+            fprintf(f, "    %s_act%d(", cg->name, idx);
+            bcnn_codegen_write_node(cg, conn->dst[0]);
+            fprintf(f, ");\n");
+            return;
+        case CONCAT: {
+            bcnn_tensor *dst = &cg->net->nodes[conn->dst[0]].tensor;
+            for (i = 0; i < conn->num_src; ++i) {
+                bcnn_tensor *src = &cg->net->nodes[conn->src[i]].tensor;
+                int sz = bcnn_tensor_get_size3d(src);
+                for (j = 0; j < src->n; ++j) {
+                    fprintf(f, "    memcpy(");
+                    bcnn_codegen_write_node(cg, conn->dst[0]);
+                    fprintf(f, " + %d, ",
+                            offset + j * bcnn_tensor_get_size3d(dst));
+                    bcnn_codegen_write_node(cg, conn->src[i]);
+                    fprintf(f, " + %d, %d * sizeof(float));\n", j * sz, sz);
+                }
+                offset += sz;
+            }
+            return;
+        }
+        default:
+            return;
+    }
+    fprintf(f, "    %s_%s%d(", cg->name, fn, idx);
+    bcnn_codegen_write_node(cg, conn->src[0]);
+    fprintf(f, ", ");
+    bcnn_codegen_write_node(cg, conn->dst[0]);
+    fprintf(f, ");\n");
+}
+
+static void bcnn_codegen_write_header(bcnn_codegen *cg) {
+    FILE *f = cg->f;
+    bcnn_tensor *in = &cg->net->nodes[0].tensor;
+    bcnn_tensor *out = &cg->net->nodes[cg->output].tensor;
+
+    fprintf(f,
+            "/* Generated by bcnn. Inference of a net of input shape "
+            "%dx%dx%dx%d (NCHW)\n"
+            " * and output shape %dx%dx%dx%d.\n"
+            " *\n"
+            " * void %s_forward(const float *input, float *output);\n"
+            " *\n"
+            " * Intermediate results live in static buffers: calls must not "
+            "overlap.\n"
+            " * Link against the bcnn library. */\n\n",
+            in->n, in->c, in->h, in->w, out->n, out->c, out->h, out->w,
+            cg->name);
+    fprintf(f, "#include <float.h>\n#include <math.h>\n#include <stddef.h>\n");
+    fprintf(f, "#include <string.h>\n\n");
+    fprintf(f,
+            "#if defined(_MSC_VER)\n"
+            "#define BCNN_ALIGNED __declspec(align(32))\n"
+            "#else\n"
+            "#define BCNN_ALIGNED __attribute__((aligned(32)))\n"
+            "#endif\n\n");
+    // Kernels of the library, declared here so that no header is needed
+    fprintf(f,
+            "int bcnn_gemm_packed(int trans_a, int trans_b, int m, int n, "
+            "int k,\n"
+            "                     float alpha, float *A, float *A_packed, "
+            "int lda,\n"
+            "                     float *B, float *B_packed, int ldb, "
+            "float beta,\n"
+            "                     float *C, int ldc);\n"
+            "void bcnn_im2col(const float *data_im, const int channels,\n"
+            "                 const int height, const int width, "
+            "const int ksize,\n"
+            "                 const int pad, const int stride, "
+            "float *data_col);\n"
+            "void bcnn_col2im(const float *data_col, const int channels,\n"
+            "                 const int height, const int width, "
+            "const int ksize,\n"
+            "                 const int pad, const int stride, "
+            "float *data_im);\n\n");
+    fprintf(f, "const int %s_input_size = %d;\n", cg->name,
+            bcnn_tensor_get_size(in));
+    fprintf(f, "const int %s_output_size = %d;\n\n", cg->name,
+            bcnn_tensor_get_size(out));
+}
+
+int bcnn_write_c_source(bcnn_net *net, char *filename, char *name) {
+    bcnn_codegen cg = {0};
+    int i;
+
+    cg.net = net;
+    cg.name = name;
+    // The cost layer, if any, closes the net
+    cg.num_conns = net->nb_connections;
+    if (cg.num_conns > 0 &&
+        net->connections[cg.num_conns - 1].layer->type == COST) {
+        --cg.num_conns;
+    }
+    if (cg.num_conns == 0) {
+        bh_log_error("bcnn_write_c_source: empty net");
+        return BCNN_INVALID_PARAMETER;
+    }
+    for (i = 0; i < cg.num_conns; ++i) {
+        if (!bcnn_codegen_is_supported(net->connections[i].layer->type)) {
+            bh_log_error("bcnn_write_c_source: unsupported layer type %d",
+                         net->connections[i].layer->type);
+            return BCNN_INVALID_PARAMETER;
+        }
+    }
+    cg.output = net->connections[cg.num_conns - 1].dst[0];
+    cg.bufs = (bcnn_codegen_buffer *)calloc(net->num_nodes,
+                                            sizeof(bcnn_codegen_buffer));
+    bcnn_codegen_plan_buffers(&cg);
+
+    cg.f = fopen(filename, "wt");
+    if (cg.f == NULL) {
+        bh_log_error("bcnn_write_c_source: can not open %s", filename);
+        bh_free(cg.bufs);
+        return BCNN_INVALID_PARAMETER;
+    }
+    bcnn_codegen_write_header(&cg);
+    fprintf(cg.f, "static BCNN_ALIGNED float %s_arena[%d];\n", cg.name,
+            cg.arena_size);
+    if (cg.workspace_size > 0) {
+        fprintf(cg.f, "static BCNN_ALIGNED float %s_workspace[%d];\n",
+                cg.name, cg.workspace_size);
+    }
+    fprintf(cg.f, "\n");
+    for (i = 0; i < cg.num_conns; ++i) {
+        bcnn_codegen_write_layer(&cg, i);
+    }
+    fprintf(cg.f, "void %s_forward(const float *input, float *output) {\n",
+            cg.name);
+    fprintf(cg.f, "    memcpy(");
+    bcnn_codegen_write_node(&cg, 0);
+    fprintf(cg.f, ", input, %d * sizeof(float));\n", cg.bufs[0].size);
+    for (i = 0; i < cg.num_conns; ++i) {
+        bcnn_codegen_write_call(&cg, i);
+    }
+    fprintf(cg.f, "    memcpy(output, ");
+    bcnn_codegen_write_node(&cg, cg.output);
+    fprintf(cg.f, ", %d * sizeof(float));\n}\n", cg.bufs[cg.output].size);
+    fclose(cg.f);
+
+    bh_log_info("Inference code of %d connections written to %s (arena= %d "
+                "workspace= %d floats)",
+                cg.num_conns, filename, cg.arena_size, cg.workspace_size);
+    bh_free(cg.bufs);
+    return BCNN_SUCCESS;
+}
@@ -30,56 +30,51 @@
 #include "bcnn_utils.h"
 #include "bh_log.h"
 
-int bcnn_add_concat_layer(bcnn_net *net, char *src_id1, char *src_id2,
-                          char *dst_id) {
-    int i, sz, ind_concat = -1;
+int bcnn_add_concat_layer_n(bcnn_net *net, int num_src, char **src_ids,
+                            char *dst_id) {
+    int i, j, c = 0;
     bcnn_connection conn = {0};
     bcnn_node dst_node = {0};
-    int is_src_node1_found = 0, is_src_node2_found = 0;
+    bcnn_tensor *t0 = NULL, *t = NULL;
 
     bh_check(net->nb_connections >= 1,
              "Concat layer can't be the first layer of the network");
+    bh_check(num_src >= 2, "Concat layer: at least 2 inputs are expected");
 
     conn.layer = (bcnn_layer *)calloc(1, sizeof(bcnn_layer));
     conn.layer->type = CONCAT;
 
-    for (i = net->num_nodes - 1; i >= 0; --i) {
-        if (strcmp(net->nodes[i].id, src_id1) == 0) {
-            bcnn_connection_add_src_node(&conn, i);
-            is_src_node1_found = 1;
-        }
-        if (strcmp(net->nodes[i].id, src_id2) == 0) {
-            bcnn_connection_add_src_node(&conn, i);
-            is_src_node2_found = 1;
-        }
-        if (is_src_node1_found && is_src_node2_found) {
-            break;
+    // Sources are concatenated in the order they are given
+    for (j = 0; j < num_src; ++j) {
+        int is_src_node_found = 0;
+        for (i = net->num_nodes - 1; i >= 0; --i) {
+            if (strcmp(net->nodes[i].id, src_ids[j]) == 0) {
+                bcnn_connection_add_src_node(&conn, i);
+                is_src_node_found = 1;
+                break;
+            }
         }
+        bh_check(is_src_node_found, "Concat layer: invalid input node name %s",
+                 src_ids[j]);
     }
-    bh_check(is_src_node1_found, "Concat layer: invalid input node name %s",
-             src_id1);
-    bh_check(is_src_node2_found, "Concat layer: invalid input node name %s",
-             src_id2);
     // Check spatial dimensions consistency
-    bh_check(
-        net->nodes[conn.src[0]].tensor.w == net->nodes[conn.src[1]].tensor.w,
-        "Concat layer: inconsistent width size between node %s (w = %d) and "
-        "node %s (w = %d)",
-        src_id1, net->nodes[conn.src[0]].tensor.w, src_id2,
-        net->nodes[conn.src[1]].tensor.w);
-    bh_check(
-        net->nodes[conn.src[0]].tensor.h == net->nodes[conn.src[1]].tensor.h,
-        "Concat layer: inconsistent width size between node %s (w = %d) and "
-        "node %s (w = %d)",
-        src_id1, net->nodes[conn.src[0]].tensor.h, src_id2,
-        net->nodes[conn.src[1]].tensor.h);
+    t0 = &net->nodes[conn.src[0]].tensor;
+    for (j = 0; j < num_src; ++j) {
+        t = &net->nodes[conn.src[j]].tensor;
+        bh_check(t->w == t0->w,
+                 "Concat layer: inconsistent width size between node %s (w = "
+                 "%d) and node %s (w = %d)",
+                 src_ids[0], t0->w, src_ids[j], t->w);
+        bh_check(t->h == t0->h,
+                 "Concat layer: inconsistent height size between node %s (h = "
+                 "%d) and node %s (h = %d)",
+                 src_ids[0], t0->h, src_ids[j], t->h);
+        c += t->c;
+    }
 
     // Setup output node
     bh_strfill(&dst_node.id, dst_id);
-    bcnn_tensor_set_shape(
-        &dst_node.tensor, net->nodes[conn.src[0]].tensor.n,
-        net->nodes[conn.src[0]].tensor.c + net->nodes[conn.src[1]].tensor.c,
-        net->nodes[conn.src[0]].tensor.h, net->nodes[conn.src[0]].tensor.w, 1);
+    bcnn_tensor_set_shape(&dst_node.tensor, t0->n, c, t0->h, t0->w, 1);
     bcnn_tensor_allocate(&dst_node.tensor);
     // Add node to net
     bcnn_net_add_node(net, dst_node);
@@ -88,56 +83,168 @@ int bcnn_add_concat_layer(bcnn_net *net, char *src_id1, char *src_id2,
     // Add connection to net
     bcnn_net_add_connection(net, conn);
 
-    bh_log_info(
-        "[Concat] input1_shape= %dx%dx%d input2_shape= %dx%dx%d output_shape= "
-        "%dx%dx%d",
-        net->nodes[conn.src[0]].tensor.w, net->nodes[conn.src[0]].tensor.h,
-        net->nodes[conn.src[0]].tensor.c, net->nodes[conn.src[1]].tensor.w,
-        net->nodes[conn.src[1]].tensor.h, net->nodes[conn.src[1]].tensor.c,
-        net->nodes[conn.dst[0]].tensor.w, net->nodes[conn.dst[0]].tensor.h,
-        net->nodes[conn.dst[0]].tensor.c);
+    for (j = 0; j < num_src; ++j) {
+        bh_log_info("[Concat] input%d_shape= %dx%dx%d", j + 1,
+                    net->nodes[conn.src[j]].tensor.w,
+                    net->nodes[conn.src[j]].tensor.h,
+                    net->nodes[conn.src[j]].tensor.c);
+    }
+    bh_log_info("[Concat] output_shape= %dx%dx%d",
+                net->nodes[conn.dst[0]].tensor.w,
+                net->nodes[conn.dst[0]].tensor.h,
+                net->nodes[conn.dst[0]].tensor.c);
 
     return BCNN_SUCCESS;
 }
 
-int bcnn_forward_concat_layer_cpu(bcnn_node *src0_node, bcnn_node *src1_node,
-                                  bcnn_node *dst_node) {
-    int j;
-    bcnn_tensor src0 = src0_node->tensor;
-    bcnn_tensor src1 = src1_node->tensor;
-    bcnn_tensor dst = dst_node->tensor;
-    int src0_sz = bcnn_tensor_get_size3d(&src0);
-    int src1_sz = bcnn_tensor_get_size3d(&src1);
-    int dst_sz = bcnn_tensor_get_size3d(&dst);
+static int bcnn_concat_find_node(bcnn_net *net, char *id) {
+    int i;
+    for (i = net->num_nodes - 1; i >= 0; --i) {
+        if (strcmp(net->nodes[i].id, id) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
 
-    for (j = 0; j < src0.n; ++j) {
-        bcnn_copy_f32(src0_sz, src0.data + j * src0_sz, dst.data + j * dst_sz);
+int bcnn_add_concat_layer(bcnn_net *net, char *src_id1, char *src_id2,
+                          char *dst_id) {
+    char *src_ids[2] = {src_id1, src_id2};
+    // The 2 inputs concat has always put the most recent node first, trained
+    // models depend on this channel order
+    if (bcnn_concat_find_node(net, src_id2) >
+        bcnn_concat_find_node(net, src_id1)) {
+        src_ids[0] = src_id2;
+        src_ids[1] = src_id1;
+    }
+    return bcnn_add_concat_layer_n(net, 2, src_ids, dst_id);
+}
+
+/* Returns 1 if connection 'conn' reads (is_src = 1) or writes (is_src = 0)
+ * the node 'node' */
+static int bcnn_concat_conn_uses_node(bcnn_connection *conn, int node,
+                                      int is_src) {
+    int i;
+    int num = (is_src ? conn->num_src : conn->num_dst);
+    int *ids = (is_src ? conn->src : conn->dst);
+    for (i = 0; i < num; ++i) {
+        if (ids[i] == node) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int bcnn_concat_can_alias(bcnn_net *net, int conn_idx, int src_idx) {
+    int i, k;
+    bcnn_connection *conn = &net->connections[conn_idx];
+    int src = conn->src[src_idx];
+    int dst = conn->dst[0];
+    int dst_rewritten = 0, src_read_after = 0;
+
+    // Input and label nodes are reallocated by the workload init
+    if (src <= 1 || net->nodes[src].is_view) {
+        return 0;
+    }
+    // The channel block of an input is contiguous in the output for a single
+    // image only. Views with a per-image stride are not supported since every
+    // layer expects its tensors to be dense: batches keep the copy.
+    if (net->nodes[src].tensor.n != 1) {
+        return 0;
     }
-    for (j = 0; j < src1.n; ++j) {
-        bcnn_copy_f32(src1_sz, src1.data + j * src1_sz,
-                      dst.data + src0_sz + j * dst_sz);
+    for (i = 0; i < conn->num_src; ++i) {
+        if (i != src_idx && conn->src[i] == src) {
+            return 0;
+        }
+    }
+    for (k = conn_idx + 1; k < net->nb_connections; ++k) {
+        // The source must not be modified once concatenated
+        if (bcnn_concat_conn_uses_node(&net->connections[k], src, 0)) {
+            return 0;
+        }
+        if (bcnn_concat_conn_uses_node(&net->connections[k], dst, 0)) {
+            dst_rewritten = 1;
+        }
+        if (bcnn_concat_conn_uses_node(&net->connections[k], src, 1)) {
+            src_read_after = 1;
+        }
     }
+    // An in-place layer on the output would be seen by the other consumers
+    // of the source
+    return !(dst_rewritten && src_read_after);
+}
 
+int bcnn_net_alias_concat_nodes(bcnn_net *net) {
+    int i, j, offset, num_alias = 0, num_concat = 0;
+    bcnn_connection *conn = NULL;
+    bcnn_node *src = NULL, *dst = NULL;
+
+    // Go backward so that nested concatenations end up sharing the memory of
+    // the outermost output
+    for (i = net->nb_connections - 1; i >= 0; --i) {
+        conn = &net->connections[i];
+        if (conn->layer->type != CONCAT) {
+            continue;
+        }
+        dst = &net->nodes[conn->dst[0]];
+        offset = 0;
+        num_concat++;
+        for (j = 0; j < conn->num_src; ++j) {
+            src = &net->nodes[conn->src[j]];
+            if (bcnn_concat_can_alias(net, i, j)) {
+                bcnn_tensor_set_view(&src->tensor, &dst->tensor, offset);
+                src->is_view = 1;
+                num_alias++;
+            }
+            offset += bcnn_tensor_get_size3d(&src->tensor);
+        }
+    }
+    if (num_alias > 0) {
+        bh_log_info("[Concat] %d input nodes share the memory of their output",
+                    num_alias);
+    } else if (num_concat > 0 && net->nodes[0].tensor.n > 1) {
+        bh_log_info("[Concat] Batch size %d: inputs are copied into the output",
+                    net->nodes[0].tensor.n);
+    }
     return BCNN_SUCCESS;
 }
 
-int bcnn_backward_concat_layer_cpu(bcnn_node *src0_node, bcnn_node *src1_node,
-                                   bcnn_node *dst_node) {
-    int j;
-    bcnn_tensor src0 = src0_node->tensor;
-    bcnn_tensor src1 = src1_node->tensor;
-    bcnn_tensor dst = dst_node->tensor;
-    int src0_sz = bcnn_tensor_get_size3d(&src0);
-    int src1_sz = bcnn_tensor_get_size3d(&src1);
+int bcnn_forward_concat_layer_cpu(bcnn_net *net, bcnn_connection *conn) {
+    int i, j, offset = 0;
+    bcnn_tensor dst = net->nodes[conn->dst[0]].tensor;
     int dst_sz = bcnn_tensor_get_size3d(&dst);
 
-    for (j = 0; j < src0.n; ++j) {
-        bcnn_axpy(src0_sz, 1.0f, dst.grad_data + j * dst_sz,
-                  src0.grad_data + j * src0_sz);
+    for (i = 0; i < conn->num_src; ++i) {
+        bcnn_tensor src = net->nodes[conn->src[i]].tensor;
+        int src_sz = bcnn_tensor_get_size3d(&src);
+        // Nothing to do if the source already lives in the output
+        if (src.data != dst.data + offset) {
+            for (j = 0; j < src.n; ++j) {
+                bcnn_copy_f32(src_sz, src.data + j * src_sz,
+                              dst.data + offset + j * dst_sz);
+            }
+        }
+        offset += src_sz;
     }
-    for (j = 0; j < src1.n; ++j) {
-        bcnn_axpy(src1_sz, 1.0f, dst.grad_data + src0_sz + j * dst_sz,
-                  src1.grad_data + j * src1_sz);
+
+    return BCNN_SUCCESS;
+}
+
+int bcnn_backward_concat_layer_cpu(bcnn_net *net, bcnn_connection *conn) {
+    int i, j, offset = 0;
+    bcnn_tensor dst = net->nodes[conn->dst[0]].tensor;
+    int dst_sz = bcnn_tensor_get_size3d(&dst);
+
+    for (i = 0; i < conn->num_src; ++i) {
+        bcnn_tensor src = net->nodes[conn->src[i]].tensor;
+        int src_sz = bcnn_tensor_get_size3d(&src);
+        if (src.grad_data && src.grad_data != dst.grad_data + offset) {
+            for (j = 0; j < src.n; ++j) {
+                bcnn_axpy(src_sz, 1.0f, dst.grad_data + offset + j * dst_sz,
+                          src.grad_data + j * src_sz);
+            }
+        }
+        offset += src_sz;
     }
 
     return BCNN_SUCCESS;
@@ -145,45 +252,43 @@ int bcnn_backward_concat_layer_cpu(bcnn_node *src0_node, bcnn_node *src1_node,
 
 #ifdef BCNN_USE_CUDA
 
-int bcnn_forward_concat_layer_gpu(bcnn_node *src0_node, bcnn_node *src1_node,
-                                  bcnn_node *dst_node) {
-    int j;
-    bcnn_tensor src0 = src0_node->tensor;
-    bcnn_tensor src1 = src1_node->tensor;
-    bcnn_tensor dst = dst_node->tensor;
-    int src0_sz = bcnn_tensor_get_size3d(&src0);
-    int src1_sz = bcnn_tensor_get_size3d(&src1);
+int bcnn_forward_concat_layer_gpu(bcnn_net *net, bcnn_connection *conn) {
+    int i, j, offset = 0;
+    bcnn_tensor dst = net->nodes[conn->dst[0]].tensor;
     int dst_sz = bcnn_tensor_get_size3d(&dst);
 
-    for (j = 0; j < src0.n; ++j) {
-        bcnn_cuda_copy_f32(src0_sz, src0.data_gpu + j * src0_sz, 1,
-                           dst.data_gpu + j * dst_sz, 1);
-    }
-    for (j = 0; j < src0.n; ++j) {
-        bcnn_cuda_copy_f32(src1_sz, src1.data_gpu + j * src1_sz, 1,
-                           dst.data_gpu + src0_sz + j * dst_sz, 1);
+    for (i = 0; i < conn->num_src; ++i) {
+        bcnn_tensor src = net->nodes[conn->src[i]].tensor;
+        int src_sz = bcnn_tensor_get_size3d(&src);
+        if (src.data_gpu != dst.data_gpu + offset) {
+            for (j = 0; j < src.n; ++j) {
+                bcnn_cuda_copy_f32(src_sz, src.data_gpu + j * src_sz, 1,
+                                   dst.data_gpu + offset + j * dst_sz, 1);
+            }
+        }
+        offset += src_sz;
     }
 
     return BCNN_SUCCESS;
 }
 
-int bcnn_backward_concat_layer_gpu(bcnn_node *src0_node, bcnn_node *src1_node,
-                                   bcnn_node *dst_node) {
-    int j;
-    bcnn_tensor src0 = src0_node->tensor;
-    bcnn_tensor src1 = src1_node->tensor;
-    bcnn_tensor dst = dst_node->tensor;
-    int src0_sz = bcnn_tensor_get_size3d(&src0);
-    int src1_sz = bcnn_tensor_get_size3d(&src1);
+int bcnn_backward_concat_layer_gpu(bcnn_net *net, bcnn_connection *conn) {
+    int i, j, offset = 0;
+    bcnn_tensor dst = net->nodes[conn->dst[0]].tensor;
     int dst_sz = bcnn_tensor_get_size3d(&dst);
 
-    for (j = 0; j < src0.n; ++j) {
-        bcnn_cuda_axpy(src0_sz, 1.0f, dst.grad_data_gpu + j * dst_sz, 1,
-                       src0.grad_data_gpu + j * src0_sz, 1);
-    }
-    for (j = 0; j < src0.n; ++j) {
-        bcnn_cuda_axpy(src1_sz, 1.0f, dst.grad_data_gpu + src0_sz + j * dst_sz,
-                       1, src1.grad_data_gpu + j * src1_sz, 1);
+    for (i = 0; i < conn->num_src; ++i) {
+        bcnn_tensor src = net->nodes[conn->src[i]].tensor;
+        int src_sz = bcnn_tensor_get_size3d(&src);
+        if (src.grad_data_gpu &&
+            src.grad_data_gpu != dst.grad_data_gpu + offset) {
+            for (j = 0; j < src.n; ++j) {
+                bcnn_cuda_axpy(src_sz, 1.0f,
+                               dst.grad_data_gpu + offset + j * dst_sz, 1,
+                               src.grad_data_gpu + j * src_sz, 1);
+            }
+        }
+        offset += src_sz;
     }
 
     return BCNN_SUCCESS;
@@ -192,25 +297,19 @@ int bcnn_backward_concat_layer_gpu(bcnn_node *src0_node, bcnn_node *src1_node,
 #endif
 
 int bcnn_forward_concat_layer(bcnn_net *net, bcnn_connection *conn) {
-    bh_check(conn->num_src == 2, "Concat layer: invalid setup");
-    bcnn_node *src0 = &net->nodes[conn->src[0]];
-    bcnn_node *src1 = &net->nodes[conn->src[1]];
-    bcnn_node *dst = &net->nodes[conn->dst[0]];
+    bh_check(conn->num_src >= 2, "Concat layer: invalid setup");
 #ifdef BCNN_USE_CUDA
-    return bcnn_forward_concat_layer_gpu(src0, src1, dst);
+    return bcnn_forward_concat_layer_gpu(net, conn);
 #else
-    return bcnn_forward_concat_layer_cpu(src0, src1, dst);
+    return bcnn_forward_concat_layer_cpu(net, conn);
 #endif
 }
 
 int bcnn_backward_concat_layer(bcnn_net *net, bcnn_connection *conn) {
-    bh_check(conn->num_src == 2, "Concat layer: invalid setup");
-    bcnn_node *src0 = &net->nodes[conn->src[0]];
-    bcnn_node *src1 = &net->nodes[conn->src[1]];
-    bcnn_node *dst = &net->nodes[conn->dst[0]];
+    bh_check(conn->num_src >= 2, "Concat layer: invalid setup");
 #ifdef BCNN_USE_CUDA
-    return bcnn_backward_concat_layer_gpu(src0, src1, dst);
+    return bcnn_backward_concat_layer_gpu(net, conn);
 #else
-    return bcnn_backward_concat_layer_cpu(src0, src1, dst);
+    return bcnn_backward_concat_layer_cpu(net, conn);
 #endif
 }
@@ -32,6 +32,11 @@ extern "C" {
 int bcnn_forward_concat_layer(bcnn_net *net, bcnn_connection *conn);
 int bcnn_backward_concat_layer(bcnn_net *net, bcnn_connection *conn);
 
+/* Makes the inputs of concat layers views on their output when possible, so
+ * that the concatenation does not need any copy. Only done for a batch size
+ * of 1: larger batches would need strided views. */
+int bcnn_net_alias_concat_nodes(bcnn_net *net);
+
 #ifdef __cplusplus
 }
 #endif
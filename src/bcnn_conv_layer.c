@@ -79,7 +79,8 @@ int bcnn_add_convolutional_layer(bcnn_net *net, int n, int size, int stride,
                        net->nodes[conn.src[0]].tensor.c * n * size * size, 1);
     bcnn_tensor_filler w_filler = {
         .range = (size * size * net->nodes[conn.src[0]].tensor.c),
-        .type = init};
+        .type = init,
+        .rng = &net->rng};
     bcnn_tensor_fill(&conn.layer->weights, w_filler);
     // Setup layer biases
     bcnn_tensor_create(&conn.layer->biases, 1, 1, 1, n, 1);
@@ -110,6 +111,7 @@ int bcnn_add_convolutional_layer(bcnn_net *net, int n, int size, int stride,
     sz = net->nodes[conn.dst[0]].tensor.w * net->nodes[conn.dst[0]].tensor.h *
          net->nodes[conn.src[0]].tensor.c * size * size;
     conn.layer->conv_workspace = (float *)calloc(sz, sizeof(float));
+    conn.layer->conv_workspace_size = sz;
 #ifdef BCNN_USE_CUDA
     if (net->learner.optimizer == ADAM) {
         int weights_size = bcnn_tensor_get_size(&conn.layer->weights);
@@ -211,9 +213,9 @@ int bcnn_add_convolutional_layer(bcnn_net *net, int n, int size, int stride,
     return 0;
 }
 
-int bcnn_forward_conv_layer_cpu(bcnn_layer *layer, bcnn_node *src_node,
-                                bcnn_node *dst_node) {
-    int i, j, m, n, k, sz;
+int bcnn_forward_conv_layer_gemm_cpu(bcnn_layer *layer, bcnn_node *src_node,
+                                     bcnn_node *dst_node) {
+    int i, m, n, k, sz;
     float *a = NULL, *b = NULL, *c = NULL;
     bcnn_tensor src = src_node->tensor;
     bcnn_tensor dst = dst_node->tensor;
@@ -240,16 +242,35 @@ int bcnn_forward_conv_layer_cpu(bcnn_layer *layer, bcnn_node *src_node,
             bcnn_im2col(src.data, src.c, src.h, src.w, layer->size, layer->pad,
                         layer->stride, b);
         }
+        if (layer->weights_packed) {
+            bcnn_gemm_packed(0, 0, m, n, k, 1.0f, NULL, layer->weights_packed,
+                             k, b, NULL, n, 1.0f, c, n);
+        } else if (layer->weights_f16) {
+            bcnn_gemm_f16(0, 0, m, n, k, 1.0f, NULL, layer->weights_f16, k, b,
+                          NULL, n, 1.0f, c, n);
+        } else {
 #if BCNN_USE_BLAS
-        cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, m, n, k, 1.0f, a,
-                    k, b, n, 1.0f, c, n);
+            cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, m, n, k,
+                        1.0f, a, k, b, n, 1.0f, c, n);
 #else
-        bcnn_gemm(0, 0, m, n, k, 1.0f, a, k, b, n, 1.0f, c, n);
+            bcnn_gemm(0, 0, m, n, k, 1.0f, a, k, b, n, 1.0f, c, n);
 #endif
+        }
         c += n * m;
         src.data += sz;
     }
 
+    return BCNN_SUCCESS;
+}
+
+int bcnn_forward_conv_layer_cpu(bcnn_layer *layer, bcnn_node *src_node,
+                                bcnn_node *dst_node) {
+    bcnn_tensor dst = dst_node->tensor;
+    int batch_size = src_node->tensor.n;
+    int sz;
+
+    bcnn_forward_conv_layer_gemm_cpu(layer, src_node, dst_node);
+
     bcnn_add_bias(dst.data, layer->biases.data, batch_size, layer->num,
                   dst.w * dst.h);
 
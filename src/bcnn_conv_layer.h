@@ -32,6 +32,10 @@ extern "C" {
 int bcnn_forward_conv_layer(bcnn_net *net, bcnn_connection *conn);
 int bcnn_backward_conv_layer(bcnn_net *net, bcnn_connection *conn);
 
+/* im2col + gemm only: bias and activation are left to the caller */
+int bcnn_forward_conv_layer_gemm_cpu(bcnn_layer *layer, bcnn_node *src_node,
+                                     bcnn_node *dst_node);
+
 #ifdef __cplusplus
 }
 #endif
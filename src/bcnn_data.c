@@ -19,6 +19,12 @@
 * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 * SOFTWARE.
 */
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
 #include <bh/bh.h>
 #include <bh/bh_error.h>
 #include <bh/bh_string.h>
@@ -27,131 +33,604 @@
 #include <bip/bip.h>
 
 #include "bcnn/bcnn.h"
-
-int bcnn_pack_data(char *list, int label_width, bcnn_label_type type,
-                   char *out_pack) {
-    FILE *f_lst = NULL, *f_out = NULL, *f_outlst = NULL;
-    char *line = NULL;
-    int n = 0, n_tok = 0;
+#include "bcnn_data_cache.h"
+#include "bcnn_thread.h"
+#include "bcnn_utils.h"
+#include "bh_log.h"
+
+/* Parts of a pack holding raw pixels have this flag set in the label type
+ * field of their header, followed by the width and height of the images */
+#define BCNN_PACK_RAW 0x100
+#define BCNN_PACK_IDX_MAGIC 0x494b5042 /* "BPKI" */
+#define BCNN_PACK_MAX_PART_SIZE 256000000
+
+typedef struct {
+    int32_t magic;
+    int32_t label_width;
+    int32_t type;
+    int32_t raw_w;
+    int32_t raw_h;
+} bcnn_pack_idx_header;
+
+/* Entry of the index sidecar, one per record written */
+typedef struct {
+    int32_t line;   /* Line of the sample in the list */
+    int32_t part;   /* Part file holding the record */
+    int64_t offset; /* Offset of the record in the part file */
+    int64_t size;   /* Size of the record */
+} bcnn_pack_idx_entry;
+
+/* Batch of list lines decoded by the pool of pack workers. The workers are
+ * started once and wait for the next batch between two batches. */
+typedef struct {
+    char **lines;
+    unsigned char **records;
+    int *records_size;
+    int num_lines;
+    int next;      /* Next line to decode */
+    int num_done;  /* Lines decoded in the current batch */
+    int stop;
+    bcnn_mutex mutex;
+    bcnn_cond cond;
+    int label_width;
+    bcnn_label_type type;
+    int raw_w;
+    int raw_h;
+} bcnn_pack_batch;
+
+/* Builds the record of a list line: image size, image (encoded or raw
+ * pixels) then labels */
+static unsigned char *bcnn_pack_record(bcnn_pack_batch *b, char *line,
+                                       int *rec_sz) {
     char **tok = NULL;
-    int i, w, h, c, buf_sz, part = 0;
+    int i, n_tok, w = 0, h = 0, c = 0, buf_sz = 0;
+    unsigned char *img = NULL, *buf = NULL, *rec = NULL;
     float lf;
-    unsigned char *img = NULL;
-    unsigned char *buf = NULL;
+
+    *rec_sz = 0;
+    n_tok = bh_strsplit(line, ' ', &tok);
+    if (n_tok - 1 != b->label_width) {
+        bh_log_warning("Data and label_width are not consistent: %s", line);
+        goto cleanup;
+    }
+    bip_load_image(tok[0], &img, &w, &h, &c);
+    if (img == NULL || w <= 0 || h <= 0) {
+        bh_log_warning("Can not load image %s", tok[0]);
+        goto cleanup;
+    }
+    if (b->raw_w > 0) {
+        buf_sz = b->raw_w * b->raw_h * c;
+        buf = (unsigned char *)malloc(buf_sz);
+        bip_resize_bilinear(img, w, h, w * c, buf, b->raw_w, b->raw_h,
+                            b->raw_w * c, c);
+    } else {
+        bip_write_image_to_memory(&buf, &buf_sz, img, w, h, c, w * c);
+    }
+    *rec_sz = sizeof(int) + buf_sz;
+    if (b->type == LABEL_INT || b->type == LABEL_FLOAT) {
+        *rec_sz += (n_tok - 1) * sizeof(float);
+    }
+    rec = (unsigned char *)malloc(*rec_sz);
+    memcpy(rec, &buf_sz, sizeof(int));
+    memcpy(rec + sizeof(int), buf, buf_sz);
+    // Label(s)
+    for (i = 1; i < n_tok; ++i) {
+        switch (b->type) {
+            case LABEL_INT:
+                lf = (float)atoi(tok[i]);
+                break;
+            case LABEL_FLOAT:
+                lf = (float)atof(tok[i]);
+                break;
+            default:
+                continue;
+        }
+        memcpy(rec + sizeof(int) + buf_sz + (i - 1) * sizeof(float), &lf,
+               sizeof(float));
+    }
+
+cleanup:
+    bh_free(buf);
+    bh_free(img);
+    for (i = 0; i < n_tok; ++i) {
+        bh_free(tok[i]);
+    }
+    bh_free(tok);
+    return rec;
+}
+
+static void *bcnn_pack_worker(void *arg) {
+    bcnn_pack_batch *b = (bcnn_pack_batch *)arg;
+    int i;
+
+    bcnn_mutex_lock(&b->mutex);
+    for (;;) {
+        while (!b->stop && b->next >= b->num_lines) {
+            bcnn_cond_wait(&b->cond, &b->mutex);
+        }
+        if (b->stop) {
+            break;
+        }
+        i = b->next++;
+        bcnn_mutex_unlock(&b->mutex);
+        b->records[i] = bcnn_pack_record(b, b->lines[i], &b->records_size[i]);
+        bcnn_mutex_lock(&b->mutex);
+        if (++b->num_done == b->num_lines) {
+            bcnn_cond_broadcast(&b->cond);
+        }
+    }
+    bcnn_mutex_unlock(&b->mutex);
+    return NULL;
+}
+
+/* Hands the first 'num_lines' lines of the batch to the workers and waits
+ * until they are all decoded */
+static void bcnn_pack_run_batch(bcnn_pack_batch *b, int num_lines) {
+    bcnn_mutex_lock(&b->mutex);
+    b->num_lines = num_lines;
+    b->next = 0;
+    b->num_done = 0;
+    bcnn_cond_broadcast(&b->cond);
+    while (b->num_done < b->num_lines) {
+        bcnn_cond_wait(&b->cond, &b->mutex);
+    }
+    bcnn_mutex_unlock(&b->mutex);
+}
+
+/* The number of records of a part is only known once it is complete: it is
+ * left to 0 here and written by bcnn_pack_close_part */
+static FILE *bcnn_pack_open_part(char *out_pack, int part, bcnn_pack_batch *b,
+                                 size_t *cnt) {
+    char name[256];
+    int type = (int)b->type | (b->raw_w > 0 ? BCNN_PACK_RAW : 0);
+    int n = 0;
+    FILE *f = NULL;
+
+    sprintf(name, "%s_%d.bin", out_pack, part);
+    f = fopen(name, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "[ERROR] Can not open %s\n", name);
+        return NULL;
+    }
+    *cnt = fwrite(&n, 1, sizeof(int), f);
+    *cnt += fwrite(&b->label_width, 1, sizeof(int), f);
+    *cnt += fwrite(&type, 1, sizeof(int), f);
+    if (b->raw_w > 0) {
+        *cnt += fwrite(&b->raw_w, 1, sizeof(int), f);
+        *cnt += fwrite(&b->raw_h, 1, sizeof(int), f);
+    }
+    return f;
+}
+
+/* Closes a part and writes its number of records in its header */
+static int bcnn_pack_close_part(char *out_pack, int part, FILE *f,
+                                int num_records) {
+    char name[256];
+    int ok;
+
+    fclose(f);
+    sprintf(name, "%s_%d.bin", out_pack, part);
+    f = fopen(name, "r+b");
+    if (f == NULL) {
+        fprintf(stderr, "[ERROR] Can not open %s\n", name);
+        return BCNN_INVALID_PARAMETER;
+    }
+    ok = (fwrite(&num_records, sizeof(int), 1, f) == 1);
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) {
+        fprintf(stderr, "[ERROR] Can not write the header of %s\n", name);
+        return BCNN_INVALID_PARAMETER;
+    }
+    return BCNN_SUCCESS;
+}
+
+static long bcnn_pack_file_size(char *name) {
+    FILE *f = fopen(name, "rb");
+    long size;
+
+    if (f == NULL) {
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fclose(f);
+    return size;
+}
+
+/* Cuts a file after its first 'size' bytes */
+static int bcnn_pack_truncate(char *name, long size) {
+    FILE *f = NULL;
+    int ok;
+
+    if (bcnn_pack_file_size(name) == size) {
+        return BCNN_SUCCESS;
+    }
+    f = fopen(name, "r+b");
+    if (f == NULL) {
+        fprintf(stderr, "[ERROR] Can not truncate %s\n", name);
+        return BCNN_INVALID_PARAMETER;
+    }
+#if defined(_WIN32)
+    ok = (_chsize_s(_fileno(f), size) == 0);
+#else
+    ok = (ftruncate(fileno(f), (off_t)size) == 0);
+#endif
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) {
+        fprintf(stderr, "[ERROR] Can not truncate %s\n", name);
+        return BCNN_INVALID_PARAMETER;
+    }
+    return BCNN_SUCCESS;
+}
+
+/* Finds the last entry of the index whose record is entirely written in its
+ * part file. The index is cut after this entry and the part file after its
+ * record, then both are reopened for appending. Returns the number of
+ * entries kept, 'part_records' being the number of them in the last part. */
+static int bcnn_pack_resume(char *out_pack, char *name_idx, FILE **f_idx,
+                            FILE **f_out, bcnn_pack_idx_entry *e,
+                            int *part_records) {
     char name[256];
-    size_t cnt = 0, max_part_sz = 256000000;
+    int i, k;
+    long size;
+    bcnn_pack_idx_entry prev;
+
+    fseek(*f_idx, 0, SEEK_END);
+    i = (int)((ftell(*f_idx) - (long)sizeof(bcnn_pack_idx_header)) /
+              sizeof(*e));
+    for (; i > 0; --i) {
+        if (fseek(*f_idx,
+                  (long)(sizeof(bcnn_pack_idx_header) + (i - 1) * sizeof(*e)),
+                  SEEK_SET) != 0 ||
+            fread(e, sizeof(*e), 1, *f_idx) != 1) {
+            continue;
+        }
+        sprintf(name, "%s_%d.bin", out_pack, e->part);
+        size = bcnn_pack_file_size(name);
+        if (e->part >= 0 && e->offset >= 0 && e->size > 0 &&
+            size >= (long)(e->offset + e->size)) {
+            break;
+        }
+    }
+    // The entries of a part are contiguous in the index
+    for (k = bh_max(i - 1, 0); k > 0; --k) {
+        if (fseek(*f_idx,
+                  (long)(sizeof(bcnn_pack_idx_header) +
+                         (k - 1) * sizeof(prev)),
+                  SEEK_SET) != 0 ||
+            fread(&prev, sizeof(prev), 1, *f_idx) != 1 ||
+            prev.part != e->part) {
+            break;
+        }
+    }
+    *part_records = i - k;
+    fclose(*f_idx);
+    *f_idx = NULL;
+    if (i == 0) {
+        return 0;
+    }
+    if (bcnn_pack_truncate(name_idx, (long)(sizeof(bcnn_pack_idx_header) +
+                                            i * sizeof(*e))) != BCNN_SUCCESS ||
+        bcnn_pack_truncate(name, (long)(e->offset + e->size)) !=
+            BCNN_SUCCESS) {
+        return -1;
+    }
+    *f_idx = fopen(name_idx, "ab");
+    *f_out = fopen(name, "ab");
+    return i;
+}
 
+int bcnn_pack_data(char *list, int label_width, bcnn_label_type type,
+                   int raw_w, int raw_h, int num_threads, char *out_pack) {
+    FILE *f_lst = NULL, *f_out = NULL, *f_outlst = NULL, *f_idx = NULL;
+    char name[256];
+    int i, part = 0, part_records = 0, line_idx = 0, batch_size, num_lines;
+    int num_started = 0;
+    size_t cnt = 0;
+    bcnn_pack_batch b = {0};
+    bcnn_pack_idx_header hdr = {0}, hdr_file = {0};
+    bcnn_pack_idx_entry e = {0};
+    bcnn_thread *threads = NULL;
+
+    if (num_threads <= 0) {
+        num_threads = bcnn_num_cores();
+    }
+    bh_check(raw_w >= 0 && raw_h >= 0 && (raw_w > 0) == (raw_h > 0),
+             "Invalid raw image size %dx%d", raw_w, raw_h);
     f_lst = fopen(list, "rt");
     if (f_lst == NULL) {
         fprintf(stderr, "[ERROR] Can not open %s\n", list);
         return -1;
     }
+    b.label_width = label_width;
+    b.type = type;
+    b.raw_w = raw_w;
+    b.raw_h = raw_h;
+    hdr.magic = BCNN_PACK_IDX_MAGIC;
+    hdr.label_width = label_width;
+    hdr.type = type;
+    hdr.raw_w = raw_w;
+    hdr.raw_h = raw_h;
+
+    // Resume from the index sidecar if any
+    sprintf(name, "%s.idx", out_pack);
+    f_idx = fopen(name, "r+b");
+    if (f_idx != NULL) {
+        if (fread(&hdr_file, sizeof(hdr_file), 1, f_idx) != 1 ||
+            memcmp(&hdr, &hdr_file, sizeof(hdr)) != 0) {
+            fprintf(stderr,
+                    "[ERROR] Index %s does not match the packing options\n",
+                    name);
+            fclose(f_idx);
+            fclose(f_lst);
+            return BCNN_INVALID_PARAMETER;
+        }
+        i = bcnn_pack_resume(out_pack, name, &f_idx, &f_out, &e,
+                             &part_records);
+        if (i > 0) {
+            part = e.part;
+            line_idx = e.line + 1;
+            cnt = (size_t)(e.offset + e.size);
+        } else if (i == 0) {
+            // No complete record: start over
+            f_idx = fopen(name, "w+b");
+            if (f_idx != NULL) {
+                fwrite(&hdr, sizeof(hdr), 1, f_idx);
+                f_out = bcnn_pack_open_part(out_pack, part, &b, &cnt);
+            }
+        }
+        if (f_idx == NULL) {
+            fprintf(stderr, "[ERROR] Can not resume from %s\n", name);
+            if (f_out != NULL) {
+                fclose(f_out);
+            }
+            fclose(f_lst);
+            return BCNN_INVALID_PARAMETER;
+        }
+        bh_log_info("Resuming packing of %s at line %d", list, line_idx);
+    } else {
+        f_idx = fopen(name, "w+b");
+        if (f_idx == NULL) {
+            fprintf(stderr, "[ERROR] Can not open %s\n", name);
+            fclose(f_lst);
+            return BCNN_INVALID_PARAMETER;
+        }
+        fwrite(&hdr, sizeof(hdr), 1, f_idx);
+        f_out = bcnn_pack_open_part(out_pack, part, &b, &cnt);
+    }
+    if (f_out == NULL) {
+        fclose(f_idx);
+        fclose(f_lst);
+        return BCNN_INVALID_PARAMETER;
+    }
+    bh_fskipline(f_lst, line_idx);
+
+    batch_size = 16 * num_threads;
+    b.lines = (char **)calloc(batch_size, sizeof(char *));
+    b.records = (unsigned char **)calloc(batch_size, sizeof(unsigned char *));
+    b.records_size = (int *)calloc(batch_size, sizeof(int));
+    threads = (bcnn_thread *)calloc(num_threads, sizeof(bcnn_thread));
+    bcnn_mutex_init(&b.mutex);
+    bcnn_cond_init(&b.cond);
+    for (num_started = 0; num_started < num_threads; ++num_started) {
+        if (bcnn_thread_create(&threads[num_started], bcnn_pack_worker, &b) !=
+            0) {
+            break;
+        }
+    }
+    bh_check(num_started > 0, "Could not start the pack workers");
+    for (;;) {
+        for (num_lines = 0; num_lines < batch_size; ++num_lines) {
+            if ((b.lines[num_lines] = bh_fgetline(f_lst)) == NULL) {
+                break;
+            }
+        }
+        if (num_lines == 0) {
+            break;
+        }
+        // Decode in parallel, then write in the list order
+        bcnn_pack_run_batch(&b, num_lines);
+        for (i = 0; i < b.num_lines; ++i, ++line_idx) {
+            if (b.records[i] != NULL) {
+                if (cnt > BCNN_PACK_MAX_PART_SIZE) {
+                    bcnn_pack_close_part(out_pack, part, f_out, part_records);
+                    part++;
+                    part_records = 0;
+                    f_out = bcnn_pack_open_part(out_pack, part, &b, &cnt);
+                    bh_check(f_out != NULL, "Can not open part %d", part);
+                }
+                e.line = line_idx;
+                e.part = part;
+                e.offset = (int64_t)cnt;
+                e.size = b.records_size[i];
+                cnt += fwrite(b.records[i], 1, b.records_size[i], f_out);
+                fwrite(&e, sizeof(e), 1, f_idx);
+                part_records++;
+            }
+            bh_free(b.records[i]);
+            bh_free(b.lines[i]);
+        }
+        // The index is flushed after the records it points to
+        fflush(f_out);
+        fflush(f_idx);
+    }
+    bcnn_mutex_lock(&b.mutex);
+    b.stop = 1;
+    bcnn_cond_broadcast(&b.cond);
+    bcnn_mutex_unlock(&b.mutex);
+    for (i = 0; i < num_started; ++i) {
+        bcnn_thread_join(threads[i]);
+    }
+    bcnn_cond_destroy(&b.cond);
+    bcnn_mutex_destroy(&b.mutex);
+    bh_free(threads);
+    bh_free(b.lines);
+    bh_free(b.records);
+    bh_free(b.records_size);
+    bcnn_pack_close_part(out_pack, part, f_out, part_records);
+    fclose(f_idx);
+    fclose(f_lst);
+
     f_outlst = fopen(out_pack, "wt");
     if (f_outlst == NULL) {
         fprintf(stderr, "[ERROR] Can not open %s\n", out_pack);
         return -1;
     }
-
-    while ((line = bh_fgetline(f_lst)) != NULL) {
-        n++;
-        bh_free(line);
+    for (i = 0; i <= part; ++i) {
+        fprintf(f_outlst, "%s_%d.bin\n", out_pack, i);
     }
-    rewind(f_lst);
+    fclose(f_outlst);
 
-    sprintf(name, "%s_%d.bin", out_pack, part);
-    f_out = fopen(name, "wb");
-    cnt += fwrite(&n, 1, sizeof(int), f_out);
-    cnt += fwrite(&label_width, 1, sizeof(int), f_out);
-    cnt += fwrite(&type, 1, sizeof(int), f_out);
+    return BCNN_SUCCESS;
+}
 
-    while ((line = bh_fgetline(f_lst)) != NULL) {
-        if (cnt > max_part_sz) {
-            if (f_out != NULL) fclose(f_out);
-            cnt = 0;
-            part++;
-            fprintf(f_outlst, "%s\n", name);
-            sprintf(name, "%s_%d.bin", out_pack, part);
-            f_out = fopen(name, "wb");
-            cnt += fwrite(&n, 1, sizeof(int), f_out);
-            cnt += fwrite(&label_width, 1, sizeof(int), f_out);
-            cnt += fwrite(&type, 1, sizeof(int), f_out);
+#ifdef BCNN_USE_AVX
+// pshufb indices gathering channel k of 16 RGB pixels from the 16-byte
+// block i of the 48 input bytes, 0x80 clearing the bytes of other blocks
+static const unsigned char bcnn_rgb_shuffle[3][3][16]
+    __attribute__((aligned(16))) = {
+        {
+            {0x00, 0x03, 0x06, 0x09, 0x0c, 0x0f, 0x80, 0x80,
+             0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80},
+            {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x02, 0x05,
+             0x08, 0x0b, 0x0e, 0x80, 0x80, 0x80, 0x80, 0x80},
+            {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+             0x80, 0x80, 0x80, 0x01, 0x04, 0x07, 0x0a, 0x0d}
+        },
+        {
+            {0x01, 0x04, 0x07, 0x0a, 0x0d, 0x80, 0x80, 0x80,
+             0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80},
+            {0x80, 0x80, 0x80, 0x80, 0x80, 0x00, 0x03, 0x06,
+             0x09, 0x0c, 0x0f, 0x80, 0x80, 0x80, 0x80, 0x80},
+            {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+             0x80, 0x80, 0x80, 0x02, 0x05, 0x08, 0x0b, 0x0e}
+        },
+        {
+            {0x02, 0x05, 0x08, 0x0b, 0x0e, 0x80, 0x80, 0x80,
+             0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80},
+            {0x80, 0x80, 0x80, 0x80, 0x80, 0x01, 0x04, 0x07,
+             0x0a, 0x0d, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80},
+            {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+             0x80, 0x80, 0x00, 0x03, 0x06, 0x09, 0x0c, 0x0f}
+        }};
+
+// Converts 8 values to float and writes (v * sd - m) * sn to dst
+static bh_inline void bcnn_store_norm8(__m256i v, __m256 sd, __m256 m,
+                                       __m256 sn, float *dst) {
+    __m256 f = _mm256_sub_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(v), sd), m);
+    _mm256_storeu_ps(dst, _mm256_mul_ps(f, sn));
+}
+
+// Converts one row of w pixels with 1, 3 or 4 interleaved channels to planar
+// floats. Returns the number of pixels processed.
+static int bcnn_convert_row_avx(unsigned char *src, int w, int c, float sd,
+                                float sn, float *mean, float **dst) {
+    __m256 vsd = _mm256_set1_ps(sd), vsn = _mm256_set1_ps(sn);
+    __m256 m0 = _mm256_set1_ps(mean[0]), m1 = _mm256_set1_ps(mean[1]);
+    __m256 m2 = _mm256_set1_ps(mean[2]), m3 = _mm256_set1_ps(mean[3]);
+    int x = 0, i, k;
+
+    if (c == 1) {
+        for (; x < w - 7; x += 8) {
+            __m256i v = _mm256_cvtepu8_epi32(
+                _mm_loadl_epi64((__m128i const *)(src + x)));
+            bcnn_store_norm8(v, vsd, m0, vsn, dst[0] + x);
         }
-        n_tok = bh_strsplit(line, ' ', &tok);
-        bh_assert((n_tok - 1 == label_width),
-                  "Data and label_width are not consistent", BCNN_INVALID_DATA);
-        bip_load_image(tok[0], &img, &w, &h, &c);
-        bip_write_image_to_memory(&buf, &buf_sz, img, w, h, c, w * c);
-        // Write img
-        cnt += fwrite(&buf_sz, 1, sizeof(int), f_out);
-        cnt += fwrite(buf, 1, buf_sz, f_out);
-        bh_free(buf);
-        bh_free(img);
-        // Write label(s)
-        switch (type) {
-            case LABEL_INT:
-                for (i = 1; i < n_tok; ++i) {
-                    lf = (float)atoi(tok[i]);
-                    cnt += fwrite(&lf, 1, sizeof(float), f_out);
-                }
-                break;
-            case LABEL_FLOAT:
-                for (i = 1; i < n_tok; ++i) {
-                    lf = (float)atof(tok[i]);
-                    cnt += fwrite(&lf, 1, sizeof(float), f_out);
-                }
-                break;
+    } else if (c == 3) {
+        // De-interleave 16 pixels (3 x 16 bytes) with byte shuffles
+        __m128i shuf[3][3];
+        __m256 m[3] = {m0, m1, m2};
+        for (k = 0; k < 3; ++k) {
+            for (i = 0; i < 3; ++i) {
+                shuf[k][i] =
+                    _mm_load_si128((__m128i const *)bcnn_rgb_shuffle[k][i]);
+            }
+        }
+        for (; x < w - 15; x += 16) {
+            __m128i a0 = _mm_loadu_si128((__m128i const *)(src + 3 * x));
+            __m128i a1 = _mm_loadu_si128((__m128i const *)(src + 3 * x + 16));
+            __m128i a2 = _mm_loadu_si128((__m128i const *)(src + 3 * x + 32));
+            for (k = 0; k < 3; ++k) {
+                __m128i p = _mm_or_si128(
+                    _mm_or_si128(_mm_shuffle_epi8(a0, shuf[k][0]),
+                                 _mm_shuffle_epi8(a1, shuf[k][1])),
+                    _mm_shuffle_epi8(a2, shuf[k][2]));
+                bcnn_store_norm8(_mm256_cvtepu8_epi32(p), vsd, m[k], vsn,
+                                 dst[k] + x);
+                bcnn_store_norm8(_mm256_cvtepu8_epi32(_mm_srli_si128(p, 8)),
+                                 vsd, m[k], vsn, dst[k] + x + 8);
+            }
+        }
+    } else if (c == 4) {
+        __m256i mask = _mm256_set1_epi32(0xff);
+        for (; x < w - 7; x += 8) {
+            __m256i v = _mm256_loadu_si256((__m256i const *)(src + 4 * x));
+            bcnn_store_norm8(_mm256_and_si256(v, mask), vsd, m0, vsn,
+                             dst[0] + x);
+            bcnn_store_norm8(_mm256_and_si256(_mm256_srli_epi32(v, 8), mask),
+                             vsd, m1, vsn, dst[1] + x);
+            bcnn_store_norm8(_mm256_and_si256(_mm256_srli_epi32(v, 16), mask),
+                             vsd, m2, vsn, dst[2] + x);
+            bcnn_store_norm8(_mm256_srli_epi32(v, 24), vsd, m3, vsn,
+                             dst[3] + x);
         }
-
-        bh_free(line);
-        for (i = 0; i < n_tok; ++i) bh_free(tok[i]);
-        bh_free(tok);
     }
-    fprintf(f_outlst, "%s\n", name);
-    if (f_out != NULL) fclose(f_out);
-    if (f_lst != NULL) fclose(f_lst);
-    if (f_outlst != NULL) fclose(f_outlst);
+    return x;
+}
+#endif
 
-    return BCNN_SUCCESS;
+// With swap_to_bgr, the first 3 channels are written in reverse order
+static bh_inline int bcnn_bgr_plane(int k, int c, int swap_to_bgr) {
+    return (swap_to_bgr && c >= 3 && k < 3 ? 2 - k : k);
 }
 
 int bcnn_convert_img_to_float(unsigned char *src, int w, int h, int c,
                               int no_input_norm, int swap_to_bgr, float mean_r,
                               float mean_g, float mean_b, float *dst) {
+    return bcnn_convert_img_crop_to_float(src, w, h, c, 0, 0, w, h,
+                                          no_input_norm, swap_to_bgr, mean_r,
+                                          mean_g, mean_b, dst);
+}
+
+int bcnn_convert_img_crop_to_float(unsigned char *src, int src_w, int src_h,
+                                   int c, int x_ul, int y_ul, int w, int h,
+                                   int no_input_norm, int swap_to_bgr,
+                                   float mean_r, float mean_g, float mean_b,
+                                   float *dst) {
     int x, y, k;
-    float m = 0.0f;
     float sn = 1.0f, sd = 1.0f;
+    float mean[4] = {0.5f, 0.5f, 0.5f, 0.5f};
+    float *dst_row[4] = {NULL};
 
+    bh_assert(x_ul >= 0 && y_ul >= 0 && x_ul + w <= src_w &&
+                  y_ul + h <= src_h,
+              "Crop region out of the image", BCNN_INVALID_PARAMETER);
     if (!no_input_norm) {
         sn = 2.0f;
         sd = 1 / 255.0f;
     }
     if (swap_to_bgr) {
-        for (k = 0; k < c; ++k) {
-            switch (k) {
-                case 0:
-                    m = mean_r;
-                    break;
-                case 1:
-                    m = mean_g;
-                    break;
-                case 2:
-                    m = mean_b;
-                    break;
-            }
-            for (y = 0; y < h; ++y) {
-                for (x = 0; x < w; ++x) {
-                    dst[w * (h * (2 - k) + y) + x] =
-                        ((float)src[c * (x + w * y) + k] * sd - m) * sn;
-                }
-            }
+        mean[0] = mean_r;
+        mean[1] = mean_g;
+        mean[2] = mean_b;
+        mean[3] = mean_b;
+    }
+    for (y = 0; y < h; ++y) {
+        unsigned char *row = src + ((y + y_ul) * src_w + x_ul) * c;
+        int x_simd = 0;
+        for (k = 0; k < c && k < 4; ++k) {
+            dst_row[k] = dst + (bcnn_bgr_plane(k, c, swap_to_bgr) * h + y) * w;
         }
-    } else {
+#ifdef BCNN_USE_AVX
+        if (c == 1 || c == 3 || c == 4) {
+            x_simd = bcnn_convert_row_avx(row, w, c, sd, sn, mean, dst_row);
+        }
+#endif
         for (k = 0; k < c; ++k) {
-            for (y = 0; y < h; ++y) {
-                for (x = 0; x < w; ++x) {
-                    dst[w * (h * k + y) + x] =
-                        ((float)src[c * (x + w * y) + k] * sd - 0.5f) * sn;
-                }
+            float m = mean[bh_min(k, 3)];
+            float *d = dst + (bcnn_bgr_plane(k, c, swap_to_bgr) * h + y) * w;
+            for (x = x_simd; x < w; ++x) {
+                d[x] = ((float)row[c * x + k] * sd - m) * sn;
             }
         }
     }
@@ -181,13 +660,37 @@ int bcnn_load_image_from_csv(char *str, int w, int h, int c,
     return BCNN_SUCCESS;
 }
 
+/* Crops a decoded image to fit the required size and copies it in
+ * pre-allocated memory */
+static void bcnn_fit_image(unsigned char *buf, int w_img, int h_img, int w,
+                           int h, int c, unsigned char *img, bcnn_rng *rng,
+                           int *x_shift, int *y_shift) {
+    int x_ul = 0, y_ul = 0;
+
+    if (w_img != w || h_img != h) {
+        if (rng == NULL) {  // state predict, always center crop
+            x_ul = (w_img - w) / 2;
+            y_ul = (h_img - h) / 2;
+        } else {  // state train, random crop
+            x_ul = (int)(bcnn_rng_uniform(rng) * (w_img - w));
+            y_ul = (int)(bcnn_rng_uniform(rng) * (h_img - h));
+        }
+        bip_crop_image(buf, w_img, h_img, w_img * c, x_ul, y_ul, img, w, h,
+                       w * c, c);
+    } else {
+        memcpy(img, buf, w * h * c);
+    }
+    *x_shift = x_ul;
+    *y_shift = y_ul;
+}
+
 /* Load image from disk, performs crop to fit the required size if needed and
  * copy in pre-allocated memory */
 int bcnn_load_image_from_path(char *path, int w, int h, int c,
-                              unsigned char *img, int state, int *x_shift,
+                              unsigned char *img, bcnn_rng *rng, int *x_shift,
                               int *y_shift) {
-    int w_img, h_img, c_img, x_ul = 0, y_ul = 0;
-    unsigned char *buf = NULL, *pimg = NULL;
+    int w_img, h_img, c_img;
+    unsigned char *buf = NULL;
 
     bip_load_image(path, &buf, &w_img, &h_img, &c_img);
     bh_assert(w_img > 0 && h_img > 0 && buf, "Invalid image",
@@ -197,33 +700,15 @@ int bcnn_load_image_from_path(char *path, int w, int h, int c,
         bh_free(buf);
         return BCNN_INVALID_DATA;
     }
-
-    if (w_img != w || h_img != h) {
-        if (state == 0) {  // state predict, always center crop
-            x_ul = (w_img - w) / 2;
-            y_ul = (h_img - h) / 2;
-        } else {  // state train, random crop
-            x_ul = (int)((float)rand() / RAND_MAX * (w_img - w));
-            y_ul = (int)((float)rand() / RAND_MAX * (h_img - h));
-        }
-        pimg = (unsigned char *)calloc(w * h * c, sizeof(unsigned char));
-        bip_crop_image(buf, w_img, h_img, w_img * c_img, x_ul, y_ul, pimg, w, h,
-                       w * c, c);
-        memcpy(img, pimg, w * h * c);
-        bh_free(pimg);
-    } else {
-        memcpy(img, buf, w * h * c);
-    }
+    bcnn_fit_image(buf, w_img, h_img, w, h, c, img, rng, x_shift, y_shift);
     bh_free(buf);
-    *x_shift = x_ul;
-    *y_shift = y_ul;
 
     return BCNN_SUCCESS;
 }
 
 int bcnn_load_image_from_memory(unsigned char *buffer, int buffer_size, int w,
-                                int h, int c, unsigned char **img, int state,
-                                int *x_shift, int *y_shift) {
+                                int h, int c, unsigned char **img,
+                                bcnn_rng *rng, int *x_shift, int *y_shift) {
     int w_img, h_img, c_img, x_ul = 0, y_ul = 0;
     unsigned char *tmp = NULL, *pimg = NULL;
 
@@ -238,12 +723,12 @@ int bcnn_load_image_from_memory(unsigned char *buffer, int buffer_size, int w,
     }
 
     if (w_img != w || h_img != h) {
-        if (state == 0) {  // state predict, always center crop
+        if (rng == NULL) {  // state predict, always center crop
             x_ul = (w_img - w) / 2;
             y_ul = (h_img - h) / 2;
         } else {  // state train, random crop
-            x_ul = (int)((float)rand() / RAND_MAX * (w_img - w));
-            y_ul = (int)((float)rand() / RAND_MAX * (h_img - h));
+            x_ul = (int)(bcnn_rng_uniform(rng) * (w_img - w));
+            y_ul = (int)(bcnn_rng_uniform(rng) * (h_img - h));
         }
         pimg = (unsigned char *)calloc(w * h * c, sizeof(unsigned char));
         bip_crop_image(tmp, w_img, h_img, w_img * c_img, x_ul, y_ul, pimg, w, h,
@@ -260,6 +745,118 @@ int bcnn_load_image_from_memory(unsigned char *buffer, int buffer_size, int w,
     return BCNN_SUCCESS;
 }
 
+/* Sets up the samples order of an iterator holding n_samples indexed
+ * samples. The permutation is drawn at the start of each epoch. */
+static void bcnn_iterator_init_order(bcnn_net *net, bcnn_iterator *iter) {
+    int i;
+
+    iter->shuffle = net->shuffle;
+    // Each shard draws its own permutations
+    bcnn_rng_init(&iter->rng, net->seed,
+                  BCNN_RNG_STREAM_AT(BCNN_RNG_STREAM_SHUFFLE,
+                                     iter->shard_index));
+    if (iter->buffer_size > 0 || iter->n_samples <= 0) {
+        return;
+    }
+    // The shard holds the samples i such that i % shard_count == shard_index
+    iter->num_perm = (iter->n_samples - iter->shard_index +
+                      iter->shard_count - 1) /
+                     iter->shard_count;
+    bh_check(iter->num_perm > 0, "Empty data shard %d", iter->shard_index);
+    iter->perm = (int *)calloc(iter->num_perm, sizeof(int));
+    for (i = 0; i < iter->num_perm; ++i) {
+        iter->perm[i] = iter->shard_index + i * iter->shard_count;
+    }
+    iter->cur = iter->num_perm;
+}
+
+/* Returns the index of the next sample. Samples are shuffled in train state
+ * only so that predictions are always dumped in the data order. */
+static int bcnn_iterator_next_index(bcnn_net *net, bcnn_iterator *iter) {
+    int i, j, tmp;
+
+    if (iter->cur >= iter->num_perm) {
+        iter->cur = 0;
+        if (iter->shuffle && net->state) {
+            for (i = iter->num_perm - 1; i > 0; --i) {
+                j = (int)(((uint64_t)bcnn_rng_u32(&iter->rng) * (i + 1)) >>
+                          32);
+                tmp = iter->perm[i];
+                iter->perm[i] = iter->perm[j];
+                iter->perm[j] = tmp;
+            }
+        }
+    }
+    return iter->perm[iter->cur++];
+}
+
+/* Sequential reader of the raw records of a dataset which is not indexed.
+ * 'next' moves to the start of the next record, wrapping around the dataset
+ * and resetting rec_idx at its end. 'read' then returns the record while
+ * 'skip' moves past it without reading it. */
+typedef struct {
+    int (*next)(bcnn_iterator *iter);
+    unsigned char *(*read)(bcnn_iterator *iter);
+    void (*skip)(bcnn_iterator *iter);
+} bcnn_record_reader;
+
+/* Reads the next raw record belonging to the shard of the iterator. The
+ * records of the other shards are skipped without being read. */
+static unsigned char *bcnn_iterator_read_shard(bcnn_iterator *iter,
+                                               bcnn_record_reader *reader) {
+    int wraps = 0;
+
+    for (;;) {
+        if (reader->next(iter) != BCNN_SUCCESS) {
+            return NULL;
+        }
+        if (iter->shard_count <= 1) {
+            return reader->read(iter);
+        }
+        if (iter->rec_idx == 0 && ++wraps > 2) {
+            bh_error("Empty data shard", BCNN_INVALID_DATA);
+        }
+        if (iter->rec_idx++ % iter->shard_count == iter->shard_index) {
+            return reader->read(iter);
+        }
+        reader->skip(iter);
+    }
+}
+
+/* Returns the next raw record of a sequentially read dataset. When shuffling,
+ * records go through a buffer of buffer_size entries from which they are
+ * picked at random. The returned record is owned by the caller. */
+static unsigned char *bcnn_iterator_next_record(bcnn_net *net,
+                                                bcnn_iterator *iter,
+                                                bcnn_record_reader *reader) {
+    unsigned char *rec = NULL;
+    int j;
+
+    if (!iter->shuffle || !net->state || iter->buffer_size <= 0) {
+        return bcnn_iterator_read_shard(iter, reader);
+    }
+    if (iter->buffer == NULL) {
+        iter->buffer = (unsigned char **)calloc(iter->buffer_size,
+                                                sizeof(unsigned char *));
+    }
+    while (iter->buffer_num < iter->buffer_size) {
+        iter->buffer[iter->buffer_num++] =
+            bcnn_iterator_read_shard(iter, reader);
+    }
+    j = (int)(((uint64_t)bcnn_rng_u32(&iter->rng) * iter->buffer_num) >> 32);
+    rec = iter->buffer[j];
+    iter->buffer[j] = bcnn_iterator_read_shard(iter, reader);
+
+    return rec;
+}
+
+static void bcnn_iterator_seek(FILE *f, long offset) {
+    // Avoid dropping the stream buffer when reading sequentially
+    if (ftell(f) != offset) {
+        fseek(f, offset, SEEK_SET);
+    }
+}
+
 /* Mnist iter */
 static unsigned int _read_int(char *v) {
     int i;
@@ -273,48 +870,89 @@ static unsigned int _read_int(char *v) {
     return ret;
 }
 
+unsigned char *bcnn_iterator_next_sample(bcnn_net *net, bcnn_iterator *iter,
+                                         int *label) {
+    size_t sz = (size_t)iter->input_width * iter->input_height *
+                iter->input_depth;
+    int idx = bcnn_iterator_next_index(net, iter);
+
+    *label = (int)iter->data_label[idx];
+    return iter->data_uchar + idx * sz;
+}
+
 static int bcnn_mnist_next_iter(bcnn_net *net, bcnn_iterator *iter) {
-    char tmp[16];
-    unsigned char l;
-    unsigned int n_img = 0, n_labels = 0;
-    size_t n = 0;
+    int sz = iter->input_width * iter->input_height;
 
-    if (fread((char *)&l, 1, sizeof(char), iter->f_input) == 0) {
-        rewind(iter->f_input);
-    } else {
-        fseek(iter->f_input, -1, SEEK_CUR);
+    bh_assert(net->input_height == iter->input_height &&
+                  net->input_width == iter->input_width,
+              "MNIST data: incoherent image width and height",
+              BCNN_INVALID_DATA);
+    memcpy(iter->input_uchar,
+           bcnn_iterator_next_sample(net, iter, &iter->label_int[0]), sz);
+
+    return BCNN_SUCCESS;
+}
+
+/* Loads the index sidecar written by bcnn_pack_data, which gives the part and
+ * offset of every record so that the pack can be read in any order. Returns
+ * the number of records, 0 if the pack has no usable index. */
+static int bcnn_bin_load_index(bcnn_iterator *iter, char *path_input,
+                               int num_parts) {
+    char name[256];
+    FILE *f_idx = NULL;
+    bcnn_pack_idx_header hdr = {0};
+    bcnn_pack_idx_entry e = {0};
+    int n = 0, cap = 0;
+
+    sprintf(name, "%s.idx", path_input);
+    f_idx = fopen(name, "rb");
+    if (f_idx == NULL) {
+        return 0;
     }
-    if (fread((char *)&l, 1, sizeof(char), iter->f_label) == 0) {
-        rewind(iter->f_label);
-    } else {
-        fseek(iter->f_label, -1, SEEK_CUR);
-    }
-
-    if (ftell(iter->f_input) == 0 && ftell(iter->f_label) == 0) {
-        n = fread(tmp, 1, 16, iter->f_input);
-        n_img = _read_int(tmp + 4);
-        iter->input_height = _read_int(tmp + 8);
-        iter->input_width = _read_int(tmp + 12);
-        n = fread(tmp, 1, 8, iter->f_label);
-        n_labels = _read_int(tmp + 4);
-        bh_assert(n_img == n_labels,
-                  "MNIST data: number of images and labels must be the same",
-                  BCNN_INVALID_DATA);
-        bh_assert(net->input_height == iter->input_height &&
-                      net->input_width == iter->input_width,
-                  "MNIST data: incoherent image width and height",
-                  BCNN_INVALID_DATA);
-        iter->n_samples = n_img;
+    if (fread(&hdr, sizeof(hdr), 1, f_idx) != 1 ||
+        hdr.magic != BCNN_PACK_IDX_MAGIC ||
+        hdr.label_width != iter->label_width ||
+        hdr.raw_w != iter->raw_width || hdr.raw_h != iter->raw_height) {
+        bh_log_warning("Ignoring index %s which does not match the pack",
+                       name);
+        fclose(f_idx);
+        return 0;
     }
+    while (fread(&e, sizeof(e), 1, f_idx) == 1) {
+        if (e.part < 0 || e.part >= num_parts) {
+            bh_log_warning("Ignoring index %s which does not match the pack",
+                           name);
+            n = 0;
+            break;
+        }
+        if (n == cap) {
+            cap = (cap > 0 ? 2 * cap : 1024);
+            iter->offsets = (long *)realloc(iter->offsets, cap * sizeof(long));
+            iter->rec_part = (int *)realloc(iter->rec_part, cap * sizeof(int));
+        }
+        iter->offsets[n] = (long)e.offset;
+        iter->rec_part[n++] = e.part;
+    }
+    fclose(f_idx);
+    if (n == 0) {
+        bh_free(iter->offsets);
+        bh_free(iter->rec_part);
+    }
+    return n;
+}
 
-    // Read label
-    n = fread((char *)&l, 1, sizeof(char), iter->f_label);
-    iter->label_int[0] = (int)l;
-    // Read img
-    n = fread(iter->input_uchar, 1, iter->input_width * iter->input_height,
-              iter->f_input);
+static int bcnn_bin_part_records(char *name) {
+    FILE *f = fopen(name, "rb");
+    int n = 0;
 
-    return BCNN_SUCCESS;
+    if (f == NULL || fread(&n, sizeof(int), 1, f) != 1) {
+        fprintf(stderr, "[ERROR] Can not read the header of %s\n", name);
+        n = 0;
+    }
+    if (f != NULL) {
+        fclose(f);
+    }
+    return n;
 }
 
 static int bcnn_init_bin_iterator(bcnn_net *net, bcnn_iterator *iter,
@@ -322,7 +960,7 @@ static int bcnn_init_bin_iterator(bcnn_net *net, bcnn_iterator *iter,
     FILE *f_bin = NULL, *f_lst = NULL;
     char *line = NULL;
     bcnn_label_type type;
-    int nr = 0;
+    int i, nr = 0, n;
 
     iter->type = ITER_BIN;
 
@@ -331,22 +969,39 @@ static int bcnn_init_bin_iterator(bcnn_net *net, bcnn_iterator *iter,
         fprintf(stderr, "[ERROR] Can not open file %s\n", path_input);
         return BCNN_INVALID_PARAMETER;
     }
-    // Open first binary file
-    line = bh_fgetline(f_lst);
-    if (line == NULL) {
+    // Part files of the pack
+    while ((line = bh_fgetline(f_lst)) != NULL) {
+        if (line[0] == '\0') {
+            bh_free(line);
+            continue;
+        }
+        iter->parts = (char **)realloc(iter->parts,
+                                       (iter->num_parts + 1) * sizeof(char *));
+        iter->parts[iter->num_parts++] = line;
+    }
+    fclose(f_lst);
+    if (iter->num_parts == 0) {
         bh_error("Empty data list", BCNN_INVALID_DATA);
     }
 
-    // bh_strstrip(line);
-    f_bin = fopen(line, "rb");
+    // Open first binary file
+    f_bin = fopen(iter->parts[0], "rb");
     if (f_bin == NULL) {
-        fprintf(stderr, "[ERROR] Can not open file %s\n", line);
+        fprintf(stderr, "[ERROR] Can not open file %s\n", iter->parts[0]);
         return BCNN_INVALID_PARAMETER;
     }
 
     nr = fread(&iter->n_samples, 1, sizeof(int), f_bin);
     nr = fread(&iter->label_width, 1, sizeof(int), f_bin);
     nr = fread(&type, 1, sizeof(int), f_bin);
+    if ((int)type & BCNN_PACK_RAW) {
+        nr = fread(&iter->raw_width, 1, sizeof(int), f_bin);
+        nr = fread(&iter->raw_height, 1, sizeof(int), f_bin);
+        bh_assert(iter->raw_width >= net->input_width &&
+                      iter->raw_height >= net->input_height,
+                  "Raw images of the pack are smaller than the input",
+                  BCNN_INVALID_DATA);
+    }
     iter->input_width = net->input_width;
     iter->input_height = net->input_height;
     iter->input_depth = net->input_channels;
@@ -356,60 +1011,149 @@ static int bcnn_init_bin_iterator(bcnn_net *net, bcnn_iterator *iter,
     iter->label_float = (float *)calloc(iter->label_width, sizeof(float));
 
     iter->f_input = f_bin;
-    iter->f_list = f_lst;
+    iter->cur_part = 0;
+    n = bcnn_bin_load_index(iter, path_input, iter->num_parts);
+    if (n > 0) {
+        // Indexed pack: the records of the shard are read directly
+        iter->n_samples = n;
+        iter->buffer_size = 0;
+    } else {
+        // Parts are read sequentially and shuffling goes through a buffer.
+        // Each part header holds its own number of records.
+        for (i = 1; i < iter->num_parts; ++i) {
+            iter->n_samples += bcnn_bin_part_records(iter->parts[i]);
+        }
+        iter->buffer_size =
+            (net->shuffle_buffer > 0 ? net->shuffle_buffer : 1024);
+    }
+    bcnn_iterator_init_order(net, iter);
 
-    bh_free(line);
+    return BCNN_SUCCESS;
+}
 
+static int bcnn_bin_open_part(bcnn_iterator *iter, int part) {
+    fclose(iter->f_input);
+    iter->f_input = fopen(iter->parts[part], "rb");
+    if (iter->f_input == NULL) {
+        fprintf(stderr, "[ERROR] Can not open file %s\n", iter->parts[part]);
+        return BCNN_INVALID_PARAMETER;
+    }
+    iter->cur_part = part;
     return BCNN_SUCCESS;
 }
 
-static int bcnn_bin_iter(bcnn_net *net, bcnn_iterator *iter) {
-    unsigned char l;
-    size_t n = 0, nr = 0;
-    int i, buf_sz = 0, label_width, type;
-    float lf;
-    unsigned char *buf = NULL;
-    char *line = NULL;
+/* Moves to the next record of the binary parts, going to the next part file
+ * at the end of the current one */
+static int bcnn_bin_next_record(bcnn_iterator *iter) {
+    int n, label_width, type, ch;
+    size_t nr = 0;
 
-    if (fread((char *)&l, 1, sizeof(char), iter->f_input) == 0) {
-        // Jump to next binary part file
-        fclose(iter->f_input);
-        line = bh_fgetline(iter->f_list);
-        if (line == NULL) {
-            rewind(iter->f_list);
-            line = bh_fgetline(iter->f_list);
-        }
-        iter->f_input = fopen(line, "rb");
-        if (iter->f_input == NULL) {
-            fprintf(stderr, "[ERROR] Can not open file %s\n", line);
+    if ((ch = fgetc(iter->f_input)) == EOF) {
+        if (iter->cur_part + 1 == iter->num_parts) {
+            iter->rec_idx = 0;
+        }
+        if (bcnn_bin_open_part(iter, (iter->cur_part + 1) % iter->num_parts) !=
+            BCNN_SUCCESS) {
             return BCNN_INVALID_PARAMETER;
         }
-        bh_free(line);
     } else {
-        fseek(iter->f_input, -1, SEEK_CUR);
+        ungetc(ch, iter->f_input);
     }
 
     if (ftell(iter->f_input) == 0) {
         nr = fread(&n, 1, sizeof(int), iter->f_input);
         nr = fread(&label_width, 1, sizeof(int), iter->f_input);
         nr = fread(&type, 1, sizeof(int), iter->f_input);
+        if (type & BCNN_PACK_RAW) {
+            nr = fread(&iter->raw_width, 1, sizeof(int), iter->f_input);
+            nr = fread(&iter->raw_height, 1, sizeof(int), iter->f_input);
+        }
     }
+    return BCNN_SUCCESS;
+}
 
-    // Read image
-    nr = fread(&buf_sz, 1, sizeof(int), iter->f_input);
-    buf = (unsigned char *)calloc(buf_sz, sizeof(unsigned char));
-    nr = fread(buf, 1, buf_sz, iter->f_input);
-    bcnn_load_image_from_memory(buf, buf_sz, net->input_width,
-                                net->input_height, net->input_channels,
-                                &iter->input_uchar, net->state,
-                                &net->data_aug.shift_x, &net->data_aug.shift_y);
-    bh_free(buf);
+/* Reads a record of the binary parts as a single block: encoded image size,
+ * encoded image then labels */
+static unsigned char *bcnn_bin_read_record(bcnn_iterator *iter) {
+    int buf_sz = 0;
+    size_t sz;
+    unsigned char *rec = NULL;
+
+    if (fread(&buf_sz, 1, sizeof(int), iter->f_input) != sizeof(int) ||
+        buf_sz < 0) {
+        bh_log_warning("Failed to read a record from %s",
+                       iter->parts[iter->cur_part]);
+        return NULL;
+    }
+    sz = buf_sz + iter->label_width * sizeof(float);
+    rec = (unsigned char *)calloc(sizeof(int) + sz, 1);
+    memcpy(rec, &buf_sz, sizeof(int));
+    if (fread(rec + sizeof(int), 1, sz, iter->f_input) != sz) {
+        bh_log_warning("Failed to read a record from %s",
+                       iter->parts[iter->cur_part]);
+    }
+    return rec;
+}
 
-    // Read label
-    for (i = 0; i < iter->label_width; ++i) {
-        nr = fread(&lf, 1, sizeof(float), iter->f_input);
-        iter->label_float[i] = lf;
+/* Moves past a record using the size stored in its header */
+static void bcnn_bin_skip_record(bcnn_iterator *iter) {
+    int buf_sz = 0;
+
+    if (fread(&buf_sz, 1, sizeof(int), iter->f_input) == sizeof(int)) {
+        fseek(iter->f_input,
+              (long)buf_sz + iter->label_width * (long)sizeof(float),
+              SEEK_CUR);
+    }
+}
+
+/* Reads the record 'idx' of an indexed pack */
+static unsigned char *bcnn_bin_read_indexed(bcnn_iterator *iter, int idx) {
+    if (iter->rec_part[idx] != iter->cur_part &&
+        bcnn_bin_open_part(iter, iter->rec_part[idx]) != BCNN_SUCCESS) {
+        return NULL;
     }
+    bcnn_iterator_seek(iter->f_input, iter->offsets[idx]);
+    return bcnn_bin_read_record(iter);
+}
+
+static bcnn_record_reader bcnn_bin_reader = {
+    bcnn_bin_next_record, bcnn_bin_read_record, bcnn_bin_skip_record};
+
+static int bcnn_bin_iter(bcnn_net *net, bcnn_iterator *iter) {
+    int buf_sz = 0;
+    unsigned char *rec = NULL;
+
+    if (iter->perm != NULL) {
+        rec = bcnn_bin_read_indexed(iter, bcnn_iterator_next_index(net, iter));
+    } else {
+        rec = bcnn_iterator_next_record(net, iter, &bcnn_bin_reader);
+    }
+    if (rec == NULL) {
+        return BCNN_INVALID_PARAMETER;
+    }
+    memcpy(&buf_sz, rec, sizeof(int));
+    // Read image
+    if (iter->raw_width > 0) {
+        // Raw pixels, only cropped to the input size
+        bh_assert(buf_sz == iter->raw_width * iter->raw_height *
+                                net->input_channels,
+                  "Unexpected raw image size", BCNN_INVALID_DATA);
+        bcnn_fit_image(rec + sizeof(int), iter->raw_width, iter->raw_height,
+                       net->input_width, net->input_height,
+                       net->input_channels, iter->input_uchar,
+                       (net->state ? &net->data_aug.rng : NULL),
+                       &net->data_aug.shift_x, &net->data_aug.shift_y);
+    } else {
+        bcnn_load_image_from_memory(
+            rec + sizeof(int), buf_sz, net->input_width, net->input_height,
+            net->input_channels, &iter->input_uchar,
+            (net->state ? &net->data_aug.rng : NULL), &net->data_aug.shift_x,
+            &net->data_aug.shift_y);
+    }
+    // Read label
+    memcpy(iter->label_float, rec + sizeof(int) + buf_sz,
+           iter->label_width * sizeof(float));
+    bh_free(rec);
 
     return BCNN_SUCCESS;
 }
@@ -418,6 +1162,8 @@ static int bcnn_bin_iter(bcnn_net *net, bcnn_iterator *iter) {
 static int bcnn_init_cifar10_iterator(bcnn_net *net, bcnn_iterator *iter,
                                       char *path_input) {
     FILE *f_bin = NULL;
+    int i, k, p, sz_plane = 32 * 32, sz = 3 * 32 * 32;
+    unsigned char *rec = NULL, *dst = NULL;
 
     iter->type = ITER_CIFAR10;
 
@@ -427,71 +1173,113 @@ static int bcnn_init_cifar10_iterator(bcnn_net *net, bcnn_iterator *iter,
         return BCNN_INVALID_PARAMETER;
     }
 
-    iter->n_samples = 0;  // not used
+    // Records are made of 1 label byte followed by a 32x32x3 planar image
+    fseek(f_bin, 0, SEEK_END);
+    iter->n_samples = (int)(ftell(f_bin) / (sz + 1));
+    rewind(f_bin);
+    bh_assert(iter->n_samples > 0, "Empty cifar10 data", BCNN_INVALID_DATA);
     iter->label_width = 1;
 
     iter->label_int = (int *)calloc(1, sizeof(int));
     iter->input_width = 32;
     iter->input_height = 32;
     iter->input_depth = 3;
-    iter->input_uchar = (unsigned char *)calloc(
-        iter->input_width * iter->input_height * iter->input_depth,
-        sizeof(unsigned char));
-    iter->f_input = f_bin;
+    iter->input_uchar = (unsigned char *)calloc(sz, sizeof(unsigned char));
+    // The whole dataset is loaded once and stored interleaved
+    iter->data_uchar = (unsigned char *)malloc((size_t)iter->n_samples * sz);
+    iter->data_label = (unsigned char *)malloc(iter->n_samples);
+    rec = (unsigned char *)malloc(sz + 1);
+    for (i = 0; i < iter->n_samples; ++i) {
+        if (fread(rec, 1, sz + 1, f_bin) != (size_t)(sz + 1)) {
+            fclose(f_bin);
+            bh_free(rec);
+            bh_error("Failed to read cifar10 data", BCNN_INVALID_DATA);
+        }
+        iter->data_label[i] = rec[0];
+        dst = iter->data_uchar + (size_t)i * sz;
+        for (k = 0; k < 3; ++k) {
+            for (p = 0; p < sz_plane; ++p) {
+                dst[3 * p + k] = rec[1 + k * sz_plane + p];
+            }
+        }
+    }
+    bh_free(rec);
+    fclose(f_bin);
+    bcnn_iterator_init_order(net, iter);
 
     return BCNN_SUCCESS;
 }
 
 static int bcnn_cifar10_iter(bcnn_net *net, bcnn_iterator *iter) {
-    unsigned char l;
-    unsigned int n_img = 0, n_labels = 0;
-    size_t n = 0;
-    int x, y, k, i,
-        rand_skip = /*(int)(10.0f * (float)rand() / RAND_MAX) + 1*/ 0;
-    char tmp[3072];
-
-    if (net->state == TRAIN) {
-        for (i = 0; i < rand_skip; ++i) {
-            if (fread((char *)&l, 1, sizeof(char), iter->f_input) == 0) {
-                rewind(iter->f_input);
-            } else {
-                fseek(iter->f_input, -1, SEEK_CUR);
+    int sz = iter->input_width * iter->input_height * iter->input_depth;
+
+    memcpy(iter->input_uchar,
+           bcnn_iterator_next_sample(net, iter, &iter->label_int[0]), sz);
+
+    return BCNN_SUCCESS;
+}
+
+static void bcnn_list_build_index(bcnn_iterator *iter) {
+    char *line = NULL;
+    long offset = 0;
+    int n = 0, cap = 0;
+
+    rewind(iter->f_input);
+    for (offset = ftell(iter->f_input);
+         (line = bh_fgetline(iter->f_input)) != NULL;
+         offset = ftell(iter->f_input)) {
+        if (line[0] != '\0') {
+            if (n == cap) {
+                cap = (cap > 0 ? 2 * cap : 1024);
+                iter->offsets =
+                    (long *)realloc(iter->offsets, cap * sizeof(long));
             }
-            fseek(
-                iter->f_input,
-                iter->input_width * iter->input_height * iter->input_depth + 1,
-                SEEK_CUR);
+            iter->offsets[n++] = offset;
         }
+        bh_free(line);
     }
-    if (fread((char *)&l, 1, sizeof(char), iter->f_input) == 0) {
+    iter->n_samples = n;
+    rewind(iter->f_input);
+}
+
+static int bcnn_list_next_record(bcnn_iterator *iter) {
+    int ch = fgetc(iter->f_input);
+
+    if (ch == EOF) {
         rewind(iter->f_input);
+        iter->rec_idx = 0;
     } else {
-        fseek(iter->f_input, -1, SEEK_CUR);
+        ungetc(ch, iter->f_input);
     }
+    return BCNN_SUCCESS;
+}
 
-    // Read label
-    n = fread((char *)&l, 1, sizeof(char), iter->f_input);
-    iter->label_int[0] = (int)l;
-    // Read img
-    n = fread(tmp, 1,
-              iter->input_width * iter->input_height * iter->input_depth,
-              iter->f_input);
-    // Swap depth <-> spatial dim arrangement
-    for (k = 0; k < iter->input_depth; ++k) {
-        for (y = 0; y < iter->input_height; ++y) {
-            for (x = 0; x < iter->input_width; ++x) {
-                iter->input_uchar[(x + iter->input_width * y) *
-                                      iter->input_depth +
-                                  k] =
-                    tmp[iter->input_width * (iter->input_height * k + y) + x];
-            }
-        }
+static unsigned char *bcnn_list_read_line(bcnn_iterator *iter) {
+    return (unsigned char *)bh_fgetline(iter->f_input);
+}
+
+static void bcnn_list_skip_line(bcnn_iterator *iter) {
+    int ch;
+
+    while ((ch = fgetc(iter->f_input)) != EOF && ch != '\n') {
     }
-    /*bip_write_image("test00.png", iter->input_uchar, iter->input_width,
-       iter->input_height, iter->input_depth,
-        iter->input_width * iter->input_depth);*/
+}
 
-    return BCNN_SUCCESS;
+static bcnn_record_reader bcnn_list_reader = {
+    bcnn_list_next_record, bcnn_list_read_line, bcnn_list_skip_line};
+
+/* Returns the line of the next sample of the list and its index if the list
+ * is indexed, -1 otherwise */
+static char *bcnn_list_next_line(bcnn_net *net, bcnn_iterator *iter,
+                                 int *idx) {
+    if (iter->perm == NULL) {
+        *idx = -1;
+        return (char *)bcnn_iterator_next_record(net, iter,
+                                                 &bcnn_list_reader);
+    }
+    *idx = bcnn_iterator_next_index(net, iter);
+    bcnn_iterator_seek(iter->f_input, iter->offsets[*idx]);
+    return bh_fgetline(iter->f_input);
 }
 
 static int bcnn_init_list_iterator(bcnn_net *net, bcnn_iterator *iter,
@@ -518,7 +1306,7 @@ static int bcnn_init_list_iterator(bcnn_net *net, bcnn_iterator *iter,
     }
 
     iter->input_width = net->input_width;
-    iter->input_height = net->input_width;
+    iter->input_height = net->input_height;
     iter->input_depth = net->input_channels;
     iter->input_uchar = (unsigned char *)calloc(
         iter->input_width * iter->input_height * iter->input_depth,
@@ -539,13 +1327,36 @@ static int bcnn_init_list_iterator(bcnn_net *net, bcnn_iterator *iter,
     for (i = 0; i < n_tok; ++i) bh_free(tok[i]);
     bh_free(tok);
 
+    // Index the line offsets unless the list is read through the shuffle
+    // buffer
+    iter->buffer_size = net->shuffle_buffer;
+    if (iter->buffer_size <= 0) {
+        bcnn_list_build_index(iter);
+        bh_assert(iter->n_samples > 0, "Empty data list", BCNN_INVALID_DATA);
+    }
+    bcnn_iterator_init_order(net, iter);
+
+    if (net->data_cache_dir != NULL && iter->buffer_size > 0) {
+        bh_log_warning("Data cache requires an indexed list, disabling it");
+    } else if (net->data_cache_dir != NULL) {
+        if (bcnn_data_cache_open(&iter->cache, net->data_cache_dir, path_input,
+                                 iter->shard_index, iter->shard_count,
+                                 net->input_width, net->input_height,
+                                 net->input_channels, iter->label_width,
+                                 (size_t)net->data_cache_mb << 20) !=
+            BCNN_SUCCESS) {
+            bh_log_warning("Data cache disabled");
+        }
+    }
+
     return BCNN_SUCCESS;
 }
 
-static int bcnn_list_iter(bcnn_net *net, bcnn_iterator *iter) {
-    char *line = NULL;
-    char **tok = NULL;
-    int i, n_tok = 0, tmp_x, tmp_y;
+/* Fills the label of a list entry. For segmentation, the label image is
+ * center cropped to the output size. */
+static int bcnn_list_parse_label(bcnn_net *net, bcnn_iterator *iter,
+                                 char **tok, int n_tok) {
+    int i, tmp_x, tmp_y;
     int out_w =
         net->nodes[net->connections[net->nb_connections - 2].dst[0]].tensor.w;
     int out_h =
@@ -553,13 +1364,101 @@ static int bcnn_list_iter(bcnn_net *net, bcnn_iterator *iter) {
     int out_c =
         net->nodes[net->connections[net->nb_connections - 2].dst[0]].tensor.c;
     unsigned char *img = NULL;
-    // nb_lines_skipped = (int)((float)rand() / RAND_MAX * net->batch_size);
-    // bh_fskipline(f, nb_lines_skipped);
-    line = bh_fgetline(iter->f_input);
-    if (line == NULL) {
-        rewind(iter->f_input);
+
+    if (net->prediction_type != SEGMENTATION) {
+        bh_assert(n_tok == iter->label_width + 1, "Unexpected label format",
+                  BCNN_INVALID_DATA);
+        for (i = 0; i < iter->label_width; ++i) {
+            iter->label_float[i] = (float)atof(tok[i + 1]);
+        }
+    } else {
+        bh_assert(n_tok == 2, "Wrong data format for segmentation",
+                  BCNN_INVALID_DATA);
+        img = (unsigned char *)calloc(out_w * out_h * out_c,
+                                      sizeof(unsigned char));
+        if (iter->type == ITER_LIST) {
+            bcnn_load_image_from_path(tok[1], out_w, out_h, out_c, img, NULL,
+                                      &tmp_x, &tmp_y);
+        } else {
+            bcnn_load_image_from_csv(tok[1], out_w, out_h, out_c, &img);
+        }
+        bcnn_convert_img_to_float(img, out_w, out_h, out_c, 0, 0, 0, 0, 0,
+                                  iter->label_float);
+        bh_free(img);
+    }
+    return BCNN_SUCCESS;
+}
+
+/* List iterator going through the decoded samples cache. Samples are cached
+ * once decoded, so that the epochs after the first one skip decoding while
+ * the crop to the input size is still drawn on each read. The list file is
+ * only read for samples which are not cached yet, and samples which can not
+ * be decoded to the input channels are skipped. */
+static int bcnn_list_iter_cached(bcnn_net *net, bcnn_iterator *iter) {
+    bcnn_data_cache *cache = iter->cache;
+    char *line = NULL;
+    char **tok = NULL;
+    int i, k, n_tok, idx, w_img = 0, h_img = 0, c_img = 0;
+    unsigned char *img = NULL, *buf = NULL;
+    bcnn_rng *rng = (net->state ? &net->data_aug.rng : NULL);
+
+    for (k = 0; k < iter->num_perm; ++k) {
+        idx = bcnn_iterator_next_index(net, iter);
+        if (bcnn_data_cache_get(cache, idx, &img, &w_img, &h_img,
+                                iter->label_float)) {
+            bcnn_fit_image(img, w_img, h_img, net->input_width,
+                           net->input_height, net->input_channels,
+                           iter->input_uchar, rng, &net->data_aug.shift_x,
+                           &net->data_aug.shift_y);
+            break;
+        }
+        bcnn_iterator_seek(iter->f_input, iter->offsets[idx]);
         line = bh_fgetline(iter->f_input);
+        n_tok = bh_strsplit(line, ' ', &tok);
+        if (net->task != PREDICT && net->prediction_type == CLASSIFICATION) {
+            bh_assert(n_tok == 2, "Wrong data format for classification",
+                      BCNN_INVALID_DATA);
+        }
+        bip_load_image(tok[0], &buf, &w_img, &h_img, &c_img);
+        bh_assert(w_img > 0 && h_img > 0 && buf, "Invalid image",
+                  BCNN_INVALID_DATA);
+        if (c_img == net->input_channels) {
+            bcnn_list_parse_label(net, iter, tok, n_tok);
+            bcnn_data_cache_put(cache, idx, buf, w_img, h_img,
+                                iter->label_float);
+            bcnn_fit_image(buf, w_img, h_img, net->input_width,
+                           net->input_height, net->input_channels,
+                           iter->input_uchar, rng, &net->data_aug.shift_x,
+                           &net->data_aug.shift_y);
+        } else {
+            bh_log_warning("Skipping %s: %d channels, expected %d", tok[0],
+                           c_img, net->input_channels);
+        }
+        bh_free(buf);
+        bh_free(line);
+        for (i = 0; i < n_tok; ++i) {
+            bh_free(tok[i]);
+        }
+        bh_free(tok);
+        if (c_img == net->input_channels) {
+            break;
+        }
     }
+    bh_check(k < iter->num_perm, "No valid sample in data shard %d",
+             iter->shard_index);
+
+    return BCNN_SUCCESS;
+}
+
+static int bcnn_list_iter(bcnn_net *net, bcnn_iterator *iter) {
+    char *line = NULL;
+    char **tok = NULL;
+    int i, n_tok = 0, idx;
+
+    if (iter->cache != NULL) {
+        return bcnn_list_iter_cached(net, iter);
+    }
+    line = bcnn_list_next_line(net, iter, &idx);
     n_tok = bh_strsplit(line, ' ', &tok);
     if (net->task != PREDICT && net->prediction_type == CLASSIFICATION) {
         bh_assert(n_tok == 2, "Wrong data format for classification",
@@ -568,33 +1467,15 @@ static int bcnn_list_iter(bcnn_net *net, bcnn_iterator *iter) {
     if (iter->type == ITER_LIST) {
         bcnn_load_image_from_path(tok[0], net->input_width, net->input_height,
                                   net->input_channels, iter->input_uchar,
-                                  net->state, &net->data_aug.shift_x,
+                                  (net->state ? &net->data_aug.rng : NULL),
+                                  &net->data_aug.shift_x,
                                   &net->data_aug.shift_y);
     } else {
         bcnn_load_image_from_csv(tok[0], net->input_width, net->input_height,
                                  net->input_channels, &iter->input_uchar);
     }
-
     // Label
-    if (net->prediction_type != SEGMENTATION) {
-        bh_assert(n_tok == iter->label_width + 1, "Unexpected label format",
-                  BCNN_INVALID_DATA);
-        for (i = 0; i < iter->label_width; ++i) {
-            iter->label_float[i] = (float)atof(tok[i + 1]);
-        }
-    } else {
-        for (i = 0; i < iter->label_width; ++i) {
-            if (iter->type == ITER_LIST) {
-                bcnn_load_image_from_path(tok[i], out_w, out_h, out_c, img,
-                                          net->state, &tmp_x, &tmp_y);
-            } else {
-                bcnn_load_image_from_csv(tok[i], out_w, out_h, out_c, &img);
-            }
-            bcnn_convert_img_to_float(img, out_w, out_h, out_c, 0, 0, 0, 0, 0,
-                                      iter->label_float);
-            bh_free(img);
-        }
-    }
+    bcnn_list_parse_label(net, iter, tok, n_tok);
 
     bh_free(line);
     for (i = 0; i < n_tok; ++i) {
@@ -605,124 +1486,285 @@ static int bcnn_list_iter(bcnn_net *net, bcnn_iterator *iter) {
     return BCNN_SUCCESS;
 }
 
+/* Bilinear interpolation weights are stored on 11 bits */
+#define BCNN_WARP_BITS 11
+#define BCNN_WARP_ONE (1 << BCNN_WARP_BITS)
+#define BCNN_WARP_BORDER 128
+
+static void bcnn_warp_pixel(unsigned char *src, int width, int height,
+                            int depth, float sx, float sy, unsigned char *lut,
+                            unsigned char *dst) {
+    int k, x0 = (int)floorf(sx), y0 = (int)floorf(sy);
+    int fx = (int)((sx - x0) * BCNN_WARP_ONE + 0.5f);
+    int fy = (int)((sy - y0) * BCNN_WARP_ONE + 0.5f);
+    int in00 = (x0 >= 0 && x0 < width && y0 >= 0 && y0 < height);
+    int in01 = (x0 + 1 >= 0 && x0 + 1 < width && y0 >= 0 && y0 < height);
+    int in10 = (x0 >= 0 && x0 < width && y0 + 1 >= 0 && y0 + 1 < height);
+    int in11 =
+        (x0 + 1 >= 0 && x0 + 1 < width && y0 + 1 >= 0 && y0 + 1 < height);
+    unsigned char *p = src + (y0 * width + x0) * depth;
+    int stride = width * depth;
+
+    for (k = 0; k < depth; ++k) {
+        int p00 = (in00 ? p[k] : BCNN_WARP_BORDER);
+        int p01 = (in01 ? p[depth + k] : BCNN_WARP_BORDER);
+        int p10 = (in10 ? p[stride + k] : BCNN_WARP_BORDER);
+        int p11 = (in11 ? p[stride + depth + k] : BCNN_WARP_BORDER);
+        int top = p00 * (BCNN_WARP_ONE - fx) + p01 * fx;
+        int bot = p10 * (BCNN_WARP_ONE - fx) + p11 * fx;
+        dst[k] = lut[(top * (BCNN_WARP_ONE - fy) + bot * fy +
+                      (1 << (2 * BCNN_WARP_BITS - 1))) >>
+                     (2 * BCNN_WARP_BITS)];
+    }
+}
+
+/* Resamples 'src' into 'dst' (same size) with the affine transform 'm' that
+ * maps destination coordinates to source coordinates:
+ * (sx, sy) = (m[0] * x + m[1] * y + m[2], m[3] * x + m[4] * y + m[5]).
+ * The lookup table 'lut' is applied to each output value. */
+static void bcnn_warp_affine(unsigned char *src, int width, int height,
+                             int depth, float *m, unsigned char *lut,
+                             unsigned char *dst) {
+    int x, y, i, k;
+    int stride = width * depth;
+#ifdef BCNN_USE_AVX
+    __m256 m0 = _mm256_set1_ps(m[0]);
+    __m256 m3 = _mm256_set1_ps(m[3]);
+    __m256 one = _mm256_set1_ps((float)BCNN_WARP_ONE);
+    __m256 half = _mm256_set1_ps(0.5f);
+    __m256i wone = _mm256_set1_epi32(BCNN_WARP_ONE);
+    __m256i rnd = _mm256_set1_epi32(1 << (2 * BCNN_WARP_BITS - 1));
+    __m256i mask = _mm256_set1_epi32(0xff);
+    __m256i vdepth = _mm256_set1_epi32(depth);
+    __m256i vstride = _mm256_set1_epi32(stride);
+    // Taps are gathered 4 bytes at a time: keep the last columns for the
+    // scalar path so that no read goes past the end of the image
+    __m256i xmin = _mm256_set1_epi32(-1);
+    __m256i xmax = _mm256_set1_epi32(width - 4);
+    __m256i ymin = _mm256_set1_epi32(-1);
+    __m256i ymax = _mm256_set1_epi32(height - 1);
+    __m256 ramp = _mm256_set_ps(7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f);
+    int val[8];
+#endif
+
+    for (y = 0; y < height; ++y) {
+        float ox = m[1] * y + m[2];
+        float oy = m[4] * y + m[5];
+        unsigned char *d = dst + y * stride;
+        x = 0;
+#ifdef BCNN_USE_AVX
+        for (; x < width - 7; x += 8) {
+            __m256 xs = _mm256_add_ps(_mm256_set1_ps((float)x), ramp);
+            __m256 sx =
+                _mm256_add_ps(_mm256_mul_ps(m0, xs), _mm256_set1_ps(ox));
+            __m256 sy =
+                _mm256_add_ps(_mm256_mul_ps(m3, xs), _mm256_set1_ps(oy));
+            __m256 flx = _mm256_floor_ps(sx);
+            __m256 fly = _mm256_floor_ps(sy);
+            __m256i x0 = _mm256_cvttps_epi32(flx);
+            __m256i y0 = _mm256_cvttps_epi32(fly);
+            __m256i inside = _mm256_and_si256(
+                _mm256_and_si256(_mm256_cmpgt_epi32(x0, xmin),
+                                 _mm256_cmpgt_epi32(xmax, x0)),
+                _mm256_and_si256(_mm256_cmpgt_epi32(y0, ymin),
+                                 _mm256_cmpgt_epi32(ymax, y0)));
+            if (_mm256_movemask_epi8(inside) != -1) {
+                for (i = 0; i < 8; ++i) {
+                    bcnn_warp_pixel(src, width, height, depth,
+                                    m[0] * (x + i) + ox, m[3] * (x + i) + oy,
+                                    lut, d + (x + i) * depth);
+                }
+                continue;
+            }
+            __m256i fx = _mm256_cvttps_epi32(_mm256_add_ps(
+                _mm256_mul_ps(_mm256_sub_ps(sx, flx), one), half));
+            __m256i fy = _mm256_cvttps_epi32(_mm256_add_ps(
+                _mm256_mul_ps(_mm256_sub_ps(sy, fly), one), half));
+            __m256i fx1 = _mm256_sub_epi32(wone, fx);
+            __m256i fy1 = _mm256_sub_epi32(wone, fy);
+            __m256i off = _mm256_add_epi32(_mm256_mullo_epi32(y0, vstride),
+                                           _mm256_mullo_epi32(x0, vdepth));
+            __m256i off_r = _mm256_add_epi32(off, vdepth);
+            __m256i off_b = _mm256_add_epi32(off, vstride);
+            __m256i off_br = _mm256_add_epi32(off_b, vdepth);
+            for (k = 0; k < depth; ++k) {
+                int const *base = (int const *)(src + k);
+                __m256i p00 = _mm256_and_si256(
+                    _mm256_i32gather_epi32(base, off, 1), mask);
+                __m256i p01 = _mm256_and_si256(
+                    _mm256_i32gather_epi32(base, off_r, 1), mask);
+                __m256i p10 = _mm256_and_si256(
+                    _mm256_i32gather_epi32(base, off_b, 1), mask);
+                __m256i p11 = _mm256_and_si256(
+                    _mm256_i32gather_epi32(base, off_br, 1), mask);
+                __m256i top = _mm256_add_epi32(_mm256_mullo_epi32(p00, fx1),
+                                               _mm256_mullo_epi32(p01, fx));
+                __m256i bot = _mm256_add_epi32(_mm256_mullo_epi32(p10, fx1),
+                                               _mm256_mullo_epi32(p11, fx));
+                __m256i v = _mm256_add_epi32(_mm256_mullo_epi32(top, fy1),
+                                             _mm256_mullo_epi32(bot, fy));
+                v = _mm256_srli_epi32(_mm256_add_epi32(v, rnd),
+                                      2 * BCNN_WARP_BITS);
+                _mm256_storeu_si256((__m256i *)val, v);
+                for (i = 0; i < 8; ++i) {
+                    d[(x + i) * depth + k] = lut[val[i]];
+                }
+            }
+        }
+#endif
+        for (; x < width; ++x) {
+            bcnn_warp_pixel(src, width, height, depth, m[0] * x + ox,
+                            m[3] * x + oy, lut, d + x * depth);
+        }
+    }
+}
+
 /* Data augmentation */
 int bcnn_data_augmentation(unsigned char *img, int width, int height, int depth,
                            bcnn_data_augment *param, unsigned char *buffer) {
-    int sz = width * height * depth;
-    unsigned char *img_scale = NULL;
-    int x_ul = 0, y_ul = 0, w_scale, h_scale;
+    int i, sz = width * height * depth;
+    int x_ul = 0, y_ul = 0, flip = 0, use_lut = 0;
     float scale = 1.0f, theta = 0.0f, contrast = 1.0f, kx, ky, distortion;
+    float m[6] = {1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f};
+    float cx = width / 2, cy = height / 2, cs, sn;
     int brightness = 0;
+    unsigned char lut[256];
+    // The resampling steps go back and forth between img and buffer, 'src'
+    // holding the current image
+    unsigned char *src = img, *dst = buffer, *tmp = NULL;
 
+    // Random draws are done in the same order as the transformations are
+    // listed in bcnn_data_augment so that 'use_precomputed' stays consistent.
     if (param->random_fliph) {
-        if ((float)rand() / RAND_MAX > 0.5f) {
-            bip_fliph_image(img, width, height, depth, width * depth, buffer,
-                            width * depth);
-            memcpy(img, buffer, sz * sizeof(unsigned char));
+        if (bcnn_rng_uniform(&param->rng) > 0.5f) {
+            flip = 1;
         }
     }
     if (param->range_shift_x || param->range_shift_y) {
-        memset(buffer, 128, sz);
         if (param->use_precomputed) {
             x_ul = param->shift_x;
             y_ul = param->shift_y;
         } else {
-            x_ul = (int)((float)(rand() - RAND_MAX / 2) / RAND_MAX *
+            x_ul = (int)((bcnn_rng_uniform(&param->rng) - 0.5f) *
                          param->range_shift_x);
-            y_ul = (int)((float)(rand() - RAND_MAX / 2) / RAND_MAX *
+            y_ul = (int)((bcnn_rng_uniform(&param->rng) - 0.5f) *
                          param->range_shift_y);
             param->shift_x = x_ul;
             param->shift_y = y_ul;
         }
-        bip_crop_image(img, width, height, width * depth, x_ul, y_ul, buffer,
-                       width, height, width * depth, depth);
-        memcpy(img, buffer, sz * sizeof(unsigned char));
     }
     if (param->max_scale > 0.0f || param->min_scale > 0.0f) {
         if (param->use_precomputed) {
             scale = param->scale;
         } else {
-            scale = (((float)rand() / RAND_MAX) *
+            scale = (bcnn_rng_uniform(&param->rng) *
                          (param->max_scale - param->min_scale) +
                      param->min_scale);
             param->scale = scale;
         }
-        w_scale = (int)(width * scale);
-        h_scale = (int)(height * scale);
-        img_scale = (unsigned char *)calloc(w_scale * h_scale * depth,
-                                            sizeof(unsigned char));
-        bip_resize_bilinear(img, width, height, width * depth, img_scale,
-                            w_scale, h_scale, w_scale * depth, depth);
-        bip_crop_image(img_scale, w_scale, h_scale, w_scale * depth, x_ul, y_ul,
-                       img, width, height, width * depth, depth);
-        bh_free(img_scale);
     }
     if (param->rotation_range > 0.0f) {
         if (param->use_precomputed) {
             theta = param->rotation;
         } else {
-            theta = bip_deg2rad((float)(rand() - RAND_MAX / 2) / RAND_MAX *
+            theta = bip_deg2rad((bcnn_rng_uniform(&param->rng) - 0.5f) *
                                 param->rotation_range);
             param->rotation = theta;
         }
-        memset(buffer, 128, sz);
-        bip_rotate_image(img, width, height, width * depth, buffer, width,
-                         height, width * depth, depth, theta, width / 2,
-                         height / 2, BILINEAR);
-        memcpy(img, buffer, width * height * depth * sizeof(unsigned char));
     }
     if (param->min_contrast > 0.0f || param->max_contrast > 0.0f) {
         if (param->use_precomputed) {
             contrast = param->contrast;
         } else {
-            contrast = (((float)rand() / RAND_MAX) *
+            contrast = (bcnn_rng_uniform(&param->rng) *
                             (param->max_contrast - param->min_contrast) +
                         param->min_contrast);
             param->contrast = contrast;
         }
-        bip_contrast_stretch(img, width * depth, width, height, depth, img,
-                             width * depth, contrast);
+        use_lut = 1;
     }
     if (param->min_brightness != 0 || param->max_brightness != 0) {
         if (param->use_precomputed) {
             brightness = param->brightness;
         } else {
             brightness =
-                (int)(((float)rand() / RAND_MAX) *
+                (int)(bcnn_rng_uniform(&param->rng) *
                           (param->max_brightness - param->min_brightness) +
                       param->min_brightness);
             param->brightness = brightness;
         }
-        bip_image_brightness(img, width * depth, width, height, depth, img,
-                             width * depth, brightness);
+        use_lut = 1;
     }
+
+    // Contrast and brightness
+    for (i = 0; i < 256; ++i) {
+        int v = (int)(i * contrast + 0.5f) + brightness;
+        lut[i] = (unsigned char)bh_clamp(v, 0, 255);
+    }
+
+    // Composite transform, from destination to source coordinates: rotation
+    // around the image center, then scale, then shift and finally
+    // horizontal flip.
+    if (flip || x_ul != 0 || y_ul != 0 || scale != 1.0f || theta != 0.0f) {
+        bh_assert(scale > 0.0f, "Invalid scale factor",
+                  BCNN_INVALID_PARAMETER);
+        cs = cosf(theta);
+        sn = sinf(theta);
+        m[0] = cs / scale;
+        m[1] = sn / scale;
+        m[2] = (cx - cs * cx - sn * cy) / scale + x_ul;
+        m[3] = -sn / scale;
+        m[4] = cs / scale;
+        m[5] = (cy + sn * cx - cs * cy) / scale + y_ul;
+        if (flip) {
+            m[0] = -m[0];
+            m[1] = -m[1];
+            m[2] = (width - 1) - m[2];
+        }
+        bcnn_warp_affine(src, width, height, depth, m, lut, dst);
+        tmp = src;
+        src = dst;
+        dst = tmp;
+    } else if (use_lut) {
+        for (i = 0; i < sz; ++i) {
+            img[i] = lut[img[i]];
+        }
+    }
+
     if (param->max_distortion > 0.0f) {
         if (param->use_precomputed) {
             kx = param->distortion_kx;
             ky = param->distortion_ky;
             distortion = param->distortion;
         } else {
-            kx = (((float)rand() - RAND_MAX / 2) / RAND_MAX);
-            ky = (((float)rand() - RAND_MAX / 2) / RAND_MAX);
-            distortion = ((float)rand() / RAND_MAX) * (param->max_distortion);
+            kx = (bcnn_rng_uniform(&param->rng) - 0.5f);
+            ky = (bcnn_rng_uniform(&param->rng) - 0.5f);
+            distortion =
+                bcnn_rng_uniform(&param->rng) * (param->max_distortion);
             param->distortion_kx = kx;
             param->distortion_ky = ky;
             param->distortion = distortion;
         }
-        bip_image_perlin_distortion(img, width * depth, width, height, depth,
-                                    buffer, width * depth, param->distortion,
+        bip_image_perlin_distortion(src, width * depth, width, height, depth,
+                                    dst, width * depth, param->distortion,
                                     kx, ky);
-        memcpy(img, buffer, width * height * depth * sizeof(unsigned char));
+        tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+    if (src != img) {
+        memcpy(img, src, sz * sizeof(unsigned char));
     }
 
     return BCNN_SUCCESS;
 }
 
-static int bcnn_init_mnist_iterator(bcnn_iterator *iter, char *path_img,
-                                    char *path_label) {
+static int bcnn_init_mnist_iterator(bcnn_net *net, bcnn_iterator *iter,
+                                    char *path_img, char *path_label) {
     FILE *f_img = NULL, *f_label = NULL;
     char tmp[16] = {0};
     int n_img = 0, n_lab = 0, nr = 0;
+    size_t sz;
 
     iter->type = ITER_MNIST;
     f_img = fopen(path_img, "rb");
@@ -733,38 +1775,53 @@ static int bcnn_init_mnist_iterator(bcnn_iterator *iter, char *path_img,
     f_label = fopen(path_label, "rb");
     if (f_label == NULL) {
         fprintf(stderr, "[ERROR] Cound not open file %s\n", path_label);
+        fclose(f_img);
         return -1;
     }
 
-    iter->f_input = f_img;
-    iter->f_label = f_label;
     iter->n_iter = 0;
     // Read header
-    nr = fread(tmp, 1, 16, iter->f_input);
+    nr = fread(tmp, 1, 16, f_img);
     n_img = _read_int(tmp + 4);
     iter->input_height = _read_int(tmp + 8);
     iter->input_width = _read_int(tmp + 12);
     iter->input_depth = 1;
-    nr = fread(tmp, 1, 8, iter->f_label);
+    nr = fread(tmp, 1, 8, f_label);
     n_lab = _read_int(tmp + 4);
     bh_assert(
         n_img == n_lab,
         "Inconsistent MNIST data: number of images and labels must be the same",
         BCNN_INVALID_DATA);
+    iter->n_samples = n_img;
 
     iter->input_uchar = (unsigned char *)calloc(
         iter->input_width * iter->input_height, sizeof(unsigned char));
     iter->label_int = (int *)calloc(1, sizeof(int));
-    rewind(iter->f_input);
-    rewind(iter->f_label);
+    // The whole dataset is loaded once
+    sz = (size_t)iter->input_width * iter->input_height * n_img;
+    iter->data_uchar = (unsigned char *)malloc(sz);
+    iter->data_label = (unsigned char *)malloc(n_img);
+    if (fread(iter->data_uchar, 1, sz, f_img) != sz ||
+        fread(iter->data_label, 1, n_img, f_label) != (size_t)n_img) {
+        fclose(f_img);
+        fclose(f_label);
+        bh_error("Failed to read MNIST data", BCNN_INVALID_DATA);
+    }
+    fclose(f_img);
+    fclose(f_label);
+    bcnn_iterator_init_order(net, iter);
 
     return 0;
 }
 
 int bcnn_iterator_initialize(bcnn_net *net, bcnn_iterator *iter,
                              char *path_input, char *path_label, char *type) {
+    iter->shard_index = net->shard_index;
+    iter->shard_count = bh_max(net->shard_count, 1);
+    bh_assert(iter->shard_index >= 0 && iter->shard_index < iter->shard_count,
+              "Invalid data shard index", BCNN_INVALID_PARAMETER);
     if (strcmp(type, "mnist") == 0) {
-        return bcnn_init_mnist_iterator(iter, path_input, path_label);
+        return bcnn_init_mnist_iterator(net, iter, path_input, path_label);
     } else if (strcmp(type, "bin") == 0) {
         return bcnn_init_bin_iterator(net, iter, path_input);
     } else if (strcmp(type, "list") == 0) {
@@ -800,6 +1857,28 @@ int bcnn_iterator_next(bcnn_net *net, bcnn_iterator *iter) {
     return 0;
 }
 
+int bcnn_iterator_rewind(bcnn_iterator *iter) {
+    int i;
+
+    // Indexed data: the next sample starts a new pass
+    iter->cur = iter->num_perm;
+    if (iter->perm != NULL) {
+        return BCNN_SUCCESS;
+    }
+    for (i = 0; i < iter->buffer_num; ++i) {
+        bh_free(iter->buffer[i]);
+    }
+    iter->buffer_num = 0;
+    iter->rec_idx = 0;
+    if (iter->type == ITER_BIN) {
+        // The header of the first part is read again with the first record
+        return bcnn_bin_open_part(iter, 0);
+    } else if (iter->f_input != NULL) {
+        rewind(iter->f_input);
+    }
+    return BCNN_SUCCESS;
+}
+
 int bcnn_iterator_terminate(bcnn_iterator *iter) {
     if (iter->f_input != NULL) {
         fclose(iter->f_input);
@@ -814,6 +1893,20 @@ int bcnn_iterator_terminate(bcnn_iterator *iter) {
     bh_free(iter->label_float);
     bh_free(iter->label_uchar);
     bh_free(iter->label_int);
+    bcnn_data_cache_close(&iter->cache);
+    bh_free(iter->data_uchar);
+    bh_free(iter->data_label);
+    bh_free(iter->perm);
+    bh_free(iter->offsets);
+    bh_free(iter->rec_part);
+    for (int i = 0; i < iter->num_parts; ++i) {
+        bh_free(iter->parts[i]);
+    }
+    bh_free(iter->parts);
+    for (int i = 0; i < iter->buffer_num; ++i) {
+        bh_free(iter->buffer[i]);
+    }
+    bh_free(iter->buffer);
 
     return BCNN_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,326 @@
+/*
+* Copyright (c) 2016 Jean-Noel Braun.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "bcnn_data_cache.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <bh/bh_mem.h>
+#include <bh/bh_string.h>
+
+#include "bh_log.h"
+
+#define BCNN_CACHE_MAGIC 0x43444342 /* "BCDC" */
+#define BCNN_CACHE_VERSION 3
+#define BCNN_CACHE_TAG 0x52534342 /* "BCSR" */
+
+/* File layout:
+ * header: magic, version, w, h, c, label_width, list size, list mtime
+ * records: tag, index, w, h, c, pixels (w * h * c bytes), label (floats)
+ * The header holds the input size of the net while each record holds the
+ * size of its decoded image. */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int32_t w;
+    int32_t h;
+    int32_t c;
+    int32_t label_width;
+    int64_t list_size;
+    int64_t list_mtime;
+} bcnn_cache_header;
+
+typedef struct {
+    uint32_t tag;
+    int32_t index;
+    int32_t w;
+    int32_t h;
+    int32_t c;
+} bcnn_cache_record;
+
+static size_t bcnn_cache_image_size(bcnn_data_cache *cache, int w, int h) {
+    return (size_t)w * h * cache->c;
+}
+
+static size_t bcnn_cache_record_size(bcnn_data_cache *cache, int w, int h) {
+    return bcnn_cache_image_size(cache, w, h) +
+           cache->label_width * sizeof(float);
+}
+
+static int bcnn_cache_reserve(bcnn_data_cache *cache, int index) {
+    if (index >= cache->num_entries) {
+        int n = bh_max(index + 1, 2 * cache->num_entries);
+        bcnn_cache_entry *p = (bcnn_cache_entry *)realloc(
+            cache->entries, n * sizeof(bcnn_cache_entry));
+        bh_check(p != NULL, "Failed to allocate data cache index");
+        memset(p + cache->num_entries, 0,
+               (n - cache->num_entries) * sizeof(bcnn_cache_entry));
+        cache->entries = p;
+        cache->num_entries = n;
+    }
+    return BCNN_SUCCESS;
+}
+
+/* Returns 1 if the sample could be kept in memory within the budget */
+static int bcnn_cache_keep_in_memory(bcnn_data_cache *cache,
+                                     bcnn_cache_entry *e, unsigned char *img,
+                                     float *label) {
+    size_t sz = bcnn_cache_record_size(cache, e->w, e->h);
+    size_t sz_img = bcnn_cache_image_size(cache, e->w, e->h);
+    if (e->data != NULL) {
+        return 1;
+    }
+    if (cache->mem_used + sz > cache->budget) {
+        return 0;
+    }
+    e->data = (unsigned char *)malloc(sz);
+    if (e->data == NULL) {
+        return 0;
+    }
+    memcpy(e->data, img, sz_img);
+    memcpy(e->data + sz_img, label, cache->label_width * sizeof(float));
+    cache->mem_used += sz;
+    return 1;
+}
+
+/* Appends the sample to the cache file */
+static int bcnn_cache_write(bcnn_data_cache *cache, int index,
+                            bcnn_cache_entry *e, unsigned char *img,
+                            float *label) {
+    bcnn_cache_record r = {BCNN_CACHE_TAG, index, e->w, e->h, cache->c};
+    size_t sz_img = bcnn_cache_image_size(cache, e->w, e->h);
+
+    if (fseek(cache->f, cache->end, SEEK_SET) != 0 ||
+        fwrite(&r, sizeof(r), 1, cache->f) != 1 ||
+        fwrite(img, 1, sz_img, cache->f) != sz_img ||
+        fwrite(label, sizeof(float), cache->label_width, cache->f) !=
+            (size_t)cache->label_width) {
+        bh_log_warning("Failed to write sample %d to data cache", index);
+        return BCNN_INVALID_DATA;
+    }
+    e->offset = cache->end + (long)sizeof(r);
+    cache->end += (long)(sizeof(r) + bcnn_cache_record_size(cache, e->w, e->h));
+    return BCNN_SUCCESS;
+}
+
+static void bcnn_cache_invalidate(bcnn_data_cache *cache, bcnn_cache_entry *e) {
+    if (e->data != NULL) {
+        bh_free(e->data);
+        cache->mem_used -= bcnn_cache_record_size(cache, e->w, e->h);
+    }
+    e->valid = 0;
+    e->offset = 0;
+}
+
+/* Rebuilds the index from an existing cache file. Reading stops at the first
+ * incomplete or corrupted record, which is then overwritten by the next
+ * insertions. */
+static int bcnn_cache_scan(bcnn_data_cache *cache) {
+    bcnn_cache_record r;
+    long pos = (long)sizeof(bcnn_cache_header);
+    size_t sz;
+    int n = 0;
+
+    fseek(cache->f, pos, SEEK_SET);
+    while (fread(&r, sizeof(r), 1, cache->f) == 1) {
+        if (r.tag != BCNN_CACHE_TAG || r.index < 0 || r.w <= 0 || r.h <= 0 ||
+            r.c != cache->c) {
+            break;
+        }
+        sz = bcnn_cache_record_size(cache, r.w, r.h);
+        if (fseek(cache->f, (long)sz - 1, SEEK_CUR) != 0 ||
+            fgetc(cache->f) == EOF) {
+            break;
+        }
+        bcnn_cache_reserve(cache, r.index);
+        // A sample written again after a failed read supersedes the first one
+        n += !cache->entries[r.index].valid;
+        cache->entries[r.index].valid = 1;
+        cache->entries[r.index].offset = pos + (long)sizeof(r);
+        cache->entries[r.index].w = r.w;
+        cache->entries[r.index].h = r.h;
+        pos += (long)(sizeof(r) + sz);
+    }
+    cache->end = pos;
+    return n;
+}
+
+int bcnn_data_cache_open(bcnn_data_cache **cache, char *dir, char *list_path,
+                         int shard_index, int shard_count, int w, int h, int c,
+                         int label_width, size_t budget) {
+    bcnn_data_cache *p = NULL;
+    bcnn_cache_header hdr = {0}, hdr_file = {0};
+    struct stat st;
+    char *path = NULL;
+    unsigned int hash = 5381;
+    int n;
+
+    bh_check(stat(list_path, &st) == 0, "Can not stat file %s", list_path);
+    bh_check(w > 0 && h > 0 && c > 0, "Invalid data cache sample size");
+    for (char *s = list_path; *s; ++s) {
+        hash = hash * 33 + (unsigned char)*s;
+    }
+    // Nets with different input sizes do not share the cache of a list
+    path = (char *)calloc(strlen(dir) + 96, sizeof(char));
+    if (shard_count > 1) {
+        sprintf(path, "%s/bcnn_%08x_%dx%dx%d_%d_%d.cache", dir, hash, w, h, c,
+                shard_index, shard_count);
+    } else {
+        sprintf(path, "%s/bcnn_%08x_%dx%dx%d.cache", dir, hash, w, h, c);
+    }
+
+    hdr.magic = BCNN_CACHE_MAGIC;
+    hdr.version = BCNN_CACHE_VERSION;
+    hdr.w = w;
+    hdr.h = h;
+    hdr.c = c;
+    hdr.label_width = label_width;
+    hdr.list_size = (int64_t)st.st_size;
+    hdr.list_mtime = (int64_t)st.st_mtime;
+
+    p = (bcnn_data_cache *)calloc(1, sizeof(bcnn_data_cache));
+    p->w = w;
+    p->h = h;
+    p->c = c;
+    p->label_width = label_width;
+    p->budget = budget;
+    p->f = fopen(path, "r+b");
+    if (p->f != NULL && (fread(&hdr_file, sizeof(hdr_file), 1, p->f) != 1 ||
+                         memcmp(&hdr_file, &hdr, sizeof(hdr)) != 0)) {
+        bh_log_info("Data cache %s is outdated, rebuilding it", path);
+        fclose(p->f);
+        p->f = NULL;
+    }
+    if (p->f != NULL) {
+        n = bcnn_cache_scan(p);
+        bh_log_info("Data cache %s: %d samples found", path, n);
+    } else {
+        p->f = fopen(path, "w+b");
+        if (p->f == NULL) {
+            bh_log_warning("Can not create data cache file %s", path);
+            bh_free(path);
+            bh_free(p);
+            return BCNN_INVALID_PARAMETER;
+        }
+        fwrite(&hdr, sizeof(hdr), 1, p->f);
+        p->end = (long)sizeof(hdr);
+    }
+    bh_free(path);
+    *cache = p;
+
+    return BCNN_SUCCESS;
+}
+
+void bcnn_data_cache_close(bcnn_data_cache **cache) {
+    bcnn_data_cache *p = *cache;
+    bcnn_cache_entry *e = NULL;
+    int i;
+
+    if (p == NULL) {
+        return;
+    }
+    for (i = 0; i < p->num_entries; ++i) {
+        e = &p->entries[i];
+        // The samples only held in memory are saved for the next runs
+        if (e->valid && e->offset == 0 && e->data != NULL) {
+            bcnn_cache_write(p, i, e, e->data,
+                             (float *)(e->data +
+                                       bcnn_cache_image_size(p, e->w, e->h)));
+        }
+        bh_free(e->data);
+    }
+    if (p->f != NULL) {
+        fclose(p->f);
+    }
+    bh_free(p->entries);
+    bh_free(p->scratch);
+    bh_free(*cache);
+}
+
+int bcnn_data_cache_get(bcnn_data_cache *cache, int index, unsigned char **img,
+                        int *w, int *h, float *label) {
+    bcnn_cache_entry *e = NULL;
+    bcnn_cache_record r;
+    size_t sz_img;
+    unsigned char *p = NULL;
+
+    if (index >= cache->num_entries || !cache->entries[index].valid) {
+        return 0;
+    }
+    e = &cache->entries[index];
+    sz_img = bcnn_cache_image_size(cache, e->w, e->h);
+    *w = e->w;
+    *h = e->h;
+    if (e->data != NULL) {
+        *img = e->data;
+        memcpy(label, e->data + sz_img, cache->label_width * sizeof(float));
+        return 1;
+    }
+    if (sz_img > cache->scratch_size) {
+        p = (unsigned char *)realloc(cache->scratch, sz_img);
+        if (p == NULL) {
+            return 0;
+        }
+        cache->scratch = p;
+        cache->scratch_size = sz_img;
+    }
+    // The record header is read back as well to catch a file modified since
+    // the scan
+    if (fseek(cache->f, e->offset - (long)sizeof(r), SEEK_SET) != 0 ||
+        fread(&r, sizeof(r), 1, cache->f) != 1 || r.tag != BCNN_CACHE_TAG ||
+        r.index != index || r.w != e->w || r.h != e->h || r.c != cache->c ||
+        fread(cache->scratch, 1, sz_img, cache->f) != sz_img ||
+        fread(label, sizeof(float), cache->label_width, cache->f) !=
+            (size_t)cache->label_width) {
+        bh_log_warning("Failed to read sample %d from data cache", index);
+        bcnn_cache_invalidate(cache, e);
+        return 0;
+    }
+    *img = cache->scratch;
+    // Samples read back from disk are kept in memory if there is room
+    // left, which happens when reusing the cache of a previous run.
+    bcnn_cache_keep_in_memory(cache, e, cache->scratch, label);
+
+    return 1;
+}
+
+int bcnn_data_cache_put(bcnn_data_cache *cache, int index, unsigned char *img,
+                        int w, int h, float *label) {
+    bcnn_cache_entry *e = NULL;
+
+    bcnn_cache_reserve(cache, index);
+    e = &cache->entries[index];
+    if (e->valid) {
+        return BCNN_SUCCESS;
+    }
+    e->w = w;
+    e->h = h;
+    // The file is only written once the memory budget is used up
+    if (!bcnn_cache_keep_in_memory(cache, e, img, label) &&
+        bcnn_cache_write(cache, index, e, img, label) != BCNN_SUCCESS) {
+        return BCNN_INVALID_DATA;
+    }
+    e->valid = 1;
+
+    return BCNN_SUCCESS;
+}
@@ -0,0 +1,87 @@
+/*
+* Copyright (c) 2016 Jean-Noel Braun.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#ifndef BCNN_DATA_CACHE_H
+#define BCNN_DATA_CACHE_H
+
+#include <bcnn/bcnn.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Cache of decoded samples for the list iterator.
+ *
+ * Every sample is kept decoded at its own size, so that it can still be
+ * cropped to the input size on each read. The samples are held in memory as
+ * long as the memory budget allows it and spill to a raw cache file beyond
+ * it; the samples held in memory are written to the file when the cache is
+ * closed. The cache file is tied to the list file (path, size and
+ * modification time) and to the input size of the net (width, height and
+ * channels) and is reused by the following runs.
+ */
+typedef struct {
+    int valid;            /* 1 if the sample is cached */
+    int w;                /* Size of the decoded image */
+    int h;
+    long offset;          /* Offset of the sample in the cache file, 0 if it
+                             is only held in memory */
+    unsigned char *data;  /* In-memory copy (pixels then labels) or NULL */
+} bcnn_cache_entry;
+
+typedef struct bcnn_data_cache {
+    FILE *f;
+    int w;           /* Input size of the net */
+    int h;
+    int c;
+    int label_width;
+    int num_entries;
+    bcnn_cache_entry *entries;
+    long end;        /* End of the cache file */
+    size_t budget;   /* Memory budget in bytes */
+    size_t mem_used;
+    unsigned char *scratch; /* Buffer for samples read back from the file */
+    size_t scratch_size;
+} bcnn_data_cache;
+
+/* Each data shard of a list has its own cache file so that the processes
+ * reading the different shards do not share it */
+int bcnn_data_cache_open(bcnn_data_cache **cache, char *dir, char *list_path,
+                         int shard_index, int shard_count, int w, int h, int c,
+                         int label_width, size_t budget);
+void bcnn_data_cache_close(bcnn_data_cache **cache);
+
+/* Returns 1 if the sample 'index' is in the cache, 0 otherwise. The returned
+ * image holds w * h * c bytes and is valid until the next call. A sample
+ * which can not be read back is dropped from the cache. */
+int bcnn_data_cache_get(bcnn_data_cache *cache, int index, unsigned char **img,
+                        int *w, int *h, float *label);
+/* Adds a decoded image of w * h * c bytes to the cache */
+int bcnn_data_cache_put(bcnn_data_cache *cache, int index, unsigned char *img,
+                        int w, int h, float *label);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // BCNN_DATA_CACHE_H
@@ -26,6 +26,7 @@
 #include "cblas.h"
 #endif
 
+#include <bh/bh.h>
 #include <bh/bh_mem.h>
 #include <bh/bh_string.h>
 #include <bh/bh_timer.h>
@@ -35,6 +36,255 @@
 #include "bcnn_utils.h"
 #include "bh_log.h"
 
+/* Sub-pixel decomposition of the strided deconvolution without padding.
+ * The output pixel (y, x) only gets the kernel taps (y % stride + stride * t,
+ * x % stride + stride * u) applied to the input pixel (y / stride - t,
+ * x / stride - u). Each of the stride^2 output phases is thus a small dense
+ * convolution with at most ceil(size / stride)^2 taps that writes a disjoint
+ * subset of the output, so that neither the col2im scatter-add nor its
+ * num * size^2 * hw columns buffer are needed. */
+int bcnn_deconv_layer_is_phased(bcnn_layer *layer) {
+#ifdef BCNN_USE_CUDA
+    return 0;
+#else
+    return (layer->pad == 0);
+#endif
+}
+
+// Number of kernel taps of the phase r along one dimension
+static int bcnn_deconv_phase_taps(int size, int stride, int r) {
+    return (r < size ? (size - r + stride - 1) / stride : 0);
+}
+
+// The phase (0, 0) has the most taps and the largest output
+static int bcnn_deconv_phase_workspace_size(int c, int h, int w, int num,
+                                            int size, int stride) {
+    int t = bcnn_deconv_phase_taps(size, stride, 0);
+    int q = (h + t - 1) * (w + t - 1);
+    int fwd_sz = num * c * t * t + num * q + (t > 1 ? c * t * t * q : 0);
+    int bwd_sz = 2 * num * c * t * t + num * t * t * h * w;
+    return bh_max(fwd_sz, bwd_sz);
+}
+
+static void bcnn_deconv_gemm(int trans_a, int trans_b, int m, int n, int k,
+                             float alpha, float *A, int lda, float *B, int ldb,
+                             float beta, float *C, int ldc) {
+#ifdef BCNN_USE_BLAS
+    cblas_sgemm(CblasRowMajor, trans_a ? CblasTrans : CblasNoTrans,
+                trans_b ? CblasTrans : CblasNoTrans, m, n, k, alpha, A, lda, B,
+                ldb, beta, C, ldc);
+#else
+    bcnn_gemm(trans_a, trans_b, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc);
+#endif
+}
+
+// Index of the weight of the tap (t, u) of phase (ry, rx) for the channels
+// (c, o)
+static int bcnn_deconv_phase_weight_index(bcnn_layer *layer, int c, int o,
+                                          int ry, int rx, int t, int u) {
+    int k = layer->size;
+    return (c * layer->num + o) * k * k + (ry + layer->stride * t) * k + rx +
+           layer->stride * u;
+}
+
+// Gathers the weights of phase (ry, rx) as w_phase[c][t][u][o]
+static void bcnn_deconv_phase_weights(bcnn_layer *layer, int channels, int ry,
+                                      int rx, int th, int tw, float *w_phase) {
+    int c, t, u, o, idx;
+
+    for (c = 0; c < channels; ++c) {
+        for (t = 0; t < th; ++t) {
+            for (u = 0; u < tw; ++u) {
+                for (o = 0; o < layer->num; ++o) {
+                    idx = bcnn_deconv_phase_weight_index(layer, c, o, ry, rx,
+                                                         t, u);
+                    if (layer->weights_f16 != NULL) {
+                        bcnn_f16_to_f32(1, layer->weights_f16 + idx, w_phase);
+                    } else {
+                        *w_phase = layer->weights.data[idx];
+                    }
+                    w_phase++;
+                }
+            }
+        }
+    }
+}
+
+// Accumulates the gradient dw_phase[c][t][u][o] of phase (ry, rx)
+static void bcnn_deconv_phase_grad_weights(bcnn_layer *layer, int channels,
+                                           int ry, int rx, int th, int tw,
+                                           const float *dw_phase) {
+    int c, t, u, o, idx;
+
+    for (c = 0; c < channels; ++c) {
+        for (t = 0; t < th; ++t) {
+            for (u = 0; u < tw; ++u) {
+                for (o = 0; o < layer->num; ++o) {
+                    idx = bcnn_deconv_phase_weight_index(layer, c, o, ry, rx,
+                                                         t, u);
+                    layer->weights.grad_data[idx] += *dw_phase++;
+                }
+            }
+        }
+    }
+}
+
+// cols[c][t][u][qy][qx] = src[c][qy - t][qx - u], zero outside of the image,
+// with qw = w + tw - 1
+static void bcnn_deconv_phase_im2col(const float *src, int channels, int h,
+                                     int w, int th, int tw, int qh,
+                                     float *cols) {
+    int c, t, u, qy, iy;
+    int qw = w + tw - 1;
+
+    for (c = 0; c < channels; ++c) {
+        for (t = 0; t < th; ++t) {
+            for (u = 0; u < tw; ++u) {
+                for (qy = 0; qy < qh; ++qy) {
+                    iy = qy - t;
+                    memset(cols, 0, qw * sizeof(float));
+                    if (iy >= 0 && iy < h) {
+                        memcpy(cols + u, src + (c * h + iy) * w,
+                               w * sizeof(float));
+                    }
+                    cols += qw;
+                }
+            }
+        }
+    }
+}
+
+// cols[t][u][o][iy][ix] = grad[o][(iy + t) * stride + ry][(ix + u) * stride +
+// rx], which always lies inside of the output since the taps fit the kernel
+static void bcnn_deconv_phase_grad_cols(const float *grad, int num, int dh,
+                                        int dw, int stride, int ry, int rx,
+                                        int th, int tw, int h, int w,
+                                        float *cols) {
+    int t, u, o, iy, ix;
+    const float *row = NULL;
+
+    for (t = 0; t < th; ++t) {
+        for (u = 0; u < tw; ++u) {
+            for (o = 0; o < num; ++o) {
+                for (iy = 0; iy < h; ++iy) {
+                    row = grad + (o * dh + (iy + t) * stride + ry) * dw +
+                          u * stride + rx;
+                    for (ix = 0; ix < w; ++ix) {
+                        *cols++ = row[ix * stride];
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Writes the qh x qw phase (ry, rx) of each output channel, zeros if buf is
+// NULL
+static void bcnn_deconv_phase_scatter(const float *buf, int num, int dh,
+                                      int dw, int stride, int ry, int rx,
+                                      int qh, int qw, float *dst) {
+    int o, qy, qx;
+    float *row = NULL;
+
+    for (o = 0; o < num; ++o) {
+        for (qy = 0; qy < qh; ++qy) {
+            row = dst + (o * dh + qy * stride + ry) * dw + rx;
+            for (qx = 0; qx < qw; ++qx) {
+                row[qx * stride] = (buf != NULL ? *buf++ : 0.0f);
+            }
+        }
+    }
+}
+
+static void bcnn_forward_deconv_phases_cpu(bcnn_layer *layer,
+                                           bcnn_tensor *src,
+                                           bcnn_tensor *dst) {
+    int s = layer->stride, num = layer->num;
+    int t0 = bcnn_deconv_phase_taps(layer->size, s, 0);
+    int ry, rx, i, th, tw, qh, qw, k;
+    float *w_phase = layer->conv_workspace;
+    float *buf = w_phase + num * src->c * t0 * t0;
+    float *cols = buf + num * (src->h + t0 - 1) * (src->w + t0 - 1);
+    float *b = NULL, *pdst = NULL;
+
+    for (ry = 0; ry < s; ++ry) {
+        for (rx = 0; rx < s; ++rx) {
+            th = bcnn_deconv_phase_taps(layer->size, s, ry);
+            tw = bcnn_deconv_phase_taps(layer->size, s, rx);
+            qh = (dst->h - ry + s - 1) / s;
+            qw = (dst->w - rx + s - 1) / s;
+            k = src->c * th * tw;
+            if (k > 0) {
+                bcnn_deconv_phase_weights(layer, src->c, ry, rx, th, tw,
+                                          w_phase);
+            }
+            for (i = 0; i < src->n; ++i) {
+                pdst = dst->data + i * num * dst->h * dst->w;
+                if (k == 0) {
+                    // stride > size: no tap reaches this phase
+                    bcnn_deconv_phase_scatter(NULL, num, dst->h, dst->w, s,
+                                              ry, rx, qh, qw, pdst);
+                    continue;
+                }
+                b = src->data + i * src->c * src->h * src->w;
+                if (th > 1 || tw > 1) {
+                    bcnn_deconv_phase_im2col(b, src->c, src->h, src->w, th, tw,
+                                             qh, cols);
+                    b = cols;
+                }
+                bcnn_deconv_gemm(1, 0, num, qh * qw, k, 1.0f, w_phase, num, b,
+                                 qh * qw, 0.0f, buf, qh * qw);
+                bcnn_deconv_phase_scatter(buf, num, dst->h, dst->w, s, ry, rx,
+                                          qh, qw, pdst);
+            }
+        }
+    }
+}
+
+static void bcnn_backward_deconv_phases_cpu(bcnn_layer *layer,
+                                            bcnn_tensor *src,
+                                            bcnn_tensor *dst) {
+    int s = layer->stride, num = layer->num;
+    int t0 = bcnn_deconv_phase_taps(layer->size, s, 0);
+    int hw = src->h * src->w, sz = src->c * hw;
+    int ry, rx, i, th, tw, k, first = 1;
+    float *w_phase = layer->conv_workspace;
+    float *dw_phase = w_phase + num * src->c * t0 * t0;
+    float *cols = dw_phase + num * src->c * t0 * t0;
+    float alpha = 1.0f / src->n;
+
+    for (ry = 0; ry < s; ++ry) {
+        for (rx = 0; rx < s; ++rx) {
+            th = bcnn_deconv_phase_taps(layer->size, s, ry);
+            tw = bcnn_deconv_phase_taps(layer->size, s, rx);
+            k = num * th * tw;
+            if (k == 0) {
+                continue;
+            }
+            bcnn_deconv_phase_weights(layer, src->c, ry, rx, th, tw, w_phase);
+            memset(dw_phase, 0, src->c * k * sizeof(float));
+            for (i = 0; i < src->n; ++i) {
+                bcnn_deconv_phase_grad_cols(
+                    dst->grad_data + i * num * dst->h * dst->w, num, dst->h,
+                    dst->w, s, ry, rx, th, tw, src->h, src->w, cols);
+                bcnn_deconv_gemm(0, 1, src->c, k, hw, alpha,
+                                 src->data + i * sz, hw, cols, hw, 1.0f,
+                                 dw_phase, k);
+                if (src->grad_data) {
+                    // Phases contribute to every input pixel, the first one
+                    // overwrites the previous gradient
+                    bcnn_deconv_gemm(0, 0, src->c, hw, k, 1.0f, w_phase, k,
+                                     cols, hw, first ? 0.0f : 1.0f,
+                                     src->grad_data + i * sz, hw);
+                }
+            }
+            bcnn_deconv_phase_grad_weights(layer, src->c, ry, rx, th, tw,
+                                           dw_phase);
+            first = 0;
+        }
+    }
+}
+
 /* Deconv layer */
 int bcnn_add_deconvolutional_layer(bcnn_net *net, int n, int size, int stride,
                                    int pad, bcnn_filler_type init,
@@ -74,7 +324,8 @@ int bcnn_add_deconvolutional_layer(bcnn_net *net, int n, int size, int stride,
                        net->nodes[conn.src[0]].tensor.c * n * size * size, 1);
     bcnn_tensor_filler w_filler = {
         .range = (size * size * net->nodes[conn.src[0]].tensor.c),
-        .type = init};
+        .type = init,
+        .rng = &net->rng};
     bcnn_tensor_fill(&conn.layer->weights, w_filler);
     // Setup layer biases
     bcnn_tensor_create(&conn.layer->biases, 1, 1, 1, n, 1);
@@ -100,7 +351,13 @@ int bcnn_add_deconvolutional_layer(bcnn_net *net, int n, int size, int stride,
     bcnn_connection_add_dst_node(&conn, net->num_nodes - 1);
     sz = net->nodes[conn.dst[0]].tensor.w * net->nodes[conn.dst[0]].tensor.h *
          net->nodes[conn.src[0]].tensor.c * size * size;
+    if (bcnn_deconv_layer_is_phased(conn.layer)) {
+        sz = bcnn_deconv_phase_workspace_size(
+            net->nodes[conn.src[0]].tensor.c, net->nodes[conn.src[0]].tensor.h,
+            net->nodes[conn.src[0]].tensor.w, n, size, stride);
+    }
     conn.layer->conv_workspace = (float *)calloc(sz, sizeof(float));
+    conn.layer->conv_workspace_size = sz;
 
 #ifdef BCNN_USE_CUDA
     sz = net->nodes[conn.dst[0]].tensor.w * net->nodes[conn.dst[0]].tensor.h *
@@ -130,13 +387,18 @@ int bcnn_add_deconvolutional_layer(bcnn_net *net, int n, int size, int stride,
     return BCNN_SUCCESS;
 }
 
-int bcnn_forward_deconv_layer_cpu(bcnn_layer *layer, bcnn_node *src_node,
-                                  bcnn_node *dst_node) {
+int bcnn_forward_deconv_layer_gemm_cpu(bcnn_layer *layer, bcnn_node *src_node,
+                                       bcnn_node *dst_node) {
     bcnn_tensor src = src_node->tensor;
     bcnn_tensor dst = dst_node->tensor;
     int batch_size = src.n;
     int i, m, n, k, sz;
 
+    if (bcnn_deconv_layer_is_phased(layer)) {
+        bcnn_forward_deconv_phases_cpu(layer, &src, &dst);
+        return BCNN_SUCCESS;
+    }
+
     sz = batch_size * dst.w * dst.h * dst.c;
 
     bcnn_fill_f32(sz, 0.0f, dst.data);
@@ -146,13 +408,34 @@ int bcnn_forward_deconv_layer_cpu(bcnn_layer *layer, bcnn_node *src_node,
     n = src.w * src.h;
     sz = src.c * src.h * src.w;
     for (i = 0; i < batch_size; ++i) {
-        bcnn_gemm(1, 0, m, n, k, 1.0f, layer->weights.data, m,
-                  src.data + i * sz, n, 0.0f, layer->conv_workspace, n);
+        if (layer->weights_packed) {
+            bcnn_gemm_packed(1, 0, m, n, k, 1.0f, NULL, layer->weights_packed,
+                             m, src.data + i * sz, NULL, n, 0.0f,
+                             layer->conv_workspace, n);
+        } else if (layer->weights_f16) {
+            bcnn_gemm_f16(1, 0, m, n, k, 1.0f, NULL, layer->weights_f16, m,
+                          src.data + i * sz, NULL, n, 0.0f,
+                          layer->conv_workspace, n);
+        } else {
+            bcnn_gemm(1, 0, m, n, k, 1.0f, layer->weights.data, m,
+                      src.data + i * sz, n, 0.0f, layer->conv_workspace, n);
+        }
         bcnn_col2im(layer->conv_workspace, layer->num, dst.h, dst.w,
                     layer->size, 0, layer->stride,
                     dst.data + i * layer->num * dst.w * dst.h);
     }
 
+    return BCNN_SUCCESS;
+}
+
+int bcnn_forward_deconv_layer_cpu(bcnn_layer *layer, bcnn_node *src_node,
+                                  bcnn_node *dst_node) {
+    bcnn_tensor dst = dst_node->tensor;
+    int batch_size = src_node->tensor.n;
+    int sz;
+
+    bcnn_forward_deconv_layer_gemm_cpu(layer, src_node, dst_node);
+
     bcnn_add_bias(dst.data, layer->biases.data, batch_size, layer->num,
                   dst.w * dst.h);
 
@@ -181,6 +464,11 @@ int bcnn_backward_deconv_layer_cpu(bcnn_layer *layer, bcnn_node *src_node,
     bcnn_grad_bias(layer->biases.grad_data, dst.grad_data, batch_size,
                    layer->num, dst.w * dst.h);
 
+    if (bcnn_deconv_layer_is_phased(layer)) {
+        bcnn_backward_deconv_phases_cpu(layer, &src, &dst);
+        return BCNN_SUCCESS;
+    }
+
     for (i = 0; i < batch_size; ++i) {
         pdst = dst.grad_data + i * layer->num * dst.w * dst.h;
         bcnn_im2col(pdst, dst.c, dst.h, dst.w, layer->size, 0, layer->stride,
@@ -32,6 +32,14 @@ extern "C" {
 int bcnn_forward_deconv_layer(bcnn_net *net, bcnn_connection *conn);
 int bcnn_backward_deconv_layer(bcnn_net *net, bcnn_connection *conn);
 
+/* Deconvolutions without padding are computed on cpu as stride^2 smaller
+ * convolutions, one per output phase, instead of gemm + col2im */
+int bcnn_deconv_layer_is_phased(bcnn_layer *layer);
+
+/* gemm + col2im (or output phases) only, without bias and activation */
+int bcnn_forward_deconv_layer_gemm_cpu(bcnn_layer *layer, bcnn_node *src_node,
+                                       bcnn_node *dst_node);
+
 #ifdef __cplusplus
 }
 #endif
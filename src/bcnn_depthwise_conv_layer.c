@@ -80,7 +80,8 @@ int bcnn_add_depthwise_sep_conv_layer(bcnn_net *net, int size, int stride,
                        net->nodes[conn.src[0]].tensor.c * size * size, 1);
     bcnn_tensor_filler w_filler = {
         .range = (size * size * net->nodes[conn.src[0]].tensor.c),
-        .type = init};
+        .type = init,
+        .rng = &net->rng};
     bcnn_tensor_fill(&conn.layer->weights, w_filler);
     // Setup layer biases
     bcnn_tensor_create(&conn.layer->biases, 1, 1, 1,
@@ -113,6 +114,7 @@ int bcnn_add_depthwise_sep_conv_layer(bcnn_net *net, int size, int stride,
     sz = net->nodes[conn.dst[0]].tensor.w * net->nodes[conn.dst[0]].tensor.h *
          net->nodes[conn.src[0]].tensor.c * size * size;
     conn.layer->conv_workspace = (float *)calloc(sz, sizeof(float));
+    conn.layer->conv_workspace_size = sz;
 
 #ifdef BCNN_USE_CUDA
     if (net->learner.optimizer == ADAM) {
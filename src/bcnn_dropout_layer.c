@@ -51,10 +51,15 @@ int bcnn_add_dropout_layer(bcnn_net *net, float rate, char *src_id) {
     conn.layer->type = DROPOUT;
     conn.layer->dropout_rate = rate;
     sz = bcnn_tensor_get_size(&net->nodes[conn.src[0]].tensor);
-    conn.layer->rand = (float *)calloc(sz, sizeof(float));
     conn.layer->scale = 1.0f / (1.0f - rate);
+    bcnn_rng_init(&conn.layer->rng, net->seed,
+                  BCNN_RNG_STREAM_AT(
+                      BCNN_RNG_STREAM_DROPOUT + net->nb_connections,
+                      net->rng_stream));
 #ifdef BCNN_USE_CUDA
-    conn.layer->rand_gpu = bcnn_cuda_memcpy_f32(conn.layer->rand, sz);
+    conn.layer->rand_gpu = bcnn_cuda_malloc_f32(sz);
+#else
+    conn.layer->mask = (uint8_t *)calloc((sz + 7) / 8, sizeof(uint8_t));
 #endif
 
     bcnn_net_add_connection(net, conn);
@@ -68,24 +73,76 @@ int bcnn_add_dropout_layer(bcnn_net *net, float rate, char *src_id) {
     return 0;
 }
 
+// Number of random values drawn at once, multiple of 8
+#define BCNN_DROPOUT_CHUNK 256
+
+/* Draws the keep mask (bit i of mask[i / 8] is set if x[i] is kept) and
+ * applies it to x */
+static void bcnn_dropout_draw_mask(bcnn_rng *rng, int n, float rate,
+                                   float scale, float *x, uint8_t *mask) {
+    float r[BCNN_DROPOUT_CHUNK];
+    int i, j, m;
+#ifdef BCNN_USE_AVX
+    __m256 vrate = _mm256_set1_ps(rate);
+    __m256 vscale = _mm256_set1_ps(scale);
+#endif
+
+    for (i = 0; i < n; i += BCNN_DROPOUT_CHUNK) {
+        m = bh_min(BCNN_DROPOUT_CHUNK, n - i);
+        bcnn_rng_uniform_n(rng, m, r);
+        j = 0;
+#ifdef BCNN_USE_AVX
+        for (; j < m - 7; j += 8) {
+            __m256 keep = _mm256_cmp_ps(_mm256_loadu_ps(r + j), vrate,
+                                        _CMP_GE_OQ);
+            __m256 v = _mm256_mul_ps(_mm256_loadu_ps(x + i + j), vscale);
+            _mm256_storeu_ps(x + i + j, _mm256_and_ps(keep, v));
+            mask[(i + j) / 8] = (uint8_t)_mm256_movemask_ps(keep);
+        }
+#endif
+        for (; j < m; ++j) {
+            int k = i + j;
+            if (k % 8 == 0) {
+                mask[k / 8] = 0;
+            }
+            if (r[j] < rate) {
+                x[k] = 0.0f;
+            } else {
+                x[k] *= scale;
+                mask[k / 8] |= (uint8_t)(1 << (k % 8));
+            }
+        }
+    }
+}
+
+static void bcnn_dropout_apply_mask(int n, uint8_t *mask, float scale,
+                                    float *x) {
+    int i = 0;
+#ifdef BCNN_USE_AVX
+    __m256 vscale = _mm256_set1_ps(scale);
+    __m256i bits = _mm256_set_epi32(128, 64, 32, 16, 8, 4, 2, 1);
+    for (; i < n - 7; i += 8) {
+        __m256i m = _mm256_and_si256(_mm256_set1_epi32(mask[i / 8]), bits);
+        __m256 keep = _mm256_castsi256_ps(_mm256_cmpeq_epi32(m, bits));
+        __m256 v = _mm256_mul_ps(_mm256_loadu_ps(x + i), vscale);
+        _mm256_storeu_ps(x + i, _mm256_and_ps(keep, v));
+    }
+#endif
+    for (; i < n; ++i) {
+        x[i] = ((mask[i / 8] >> (i % 8)) & 1 ? x[i] * scale : 0.0f);
+    }
+}
+
 int bcnn_forward_dropout_layer_cpu(bcnn_layer *layer, bcnn_node *src_node,
                                    bcnn_node *dst_node) {
     bcnn_tensor src = src_node->tensor;
-    int i, sz = bcnn_tensor_get_size(&src);
-    float r;
+    int sz = bcnn_tensor_get_size(&src);
 
     if (!layer->net_state)  // state != train
         return BCNN_SUCCESS;
 
-    for (i = 0; i < sz; ++i) {
-        r = (float)rand() / RAND_MAX;
-        layer->rand[i] = r;
-        if (r < layer->dropout_rate) {
-            src.data[i] = 0;
-        } else {
-            src.data[i] *= layer->scale;
-        }
-    }
+    bcnn_dropout_draw_mask(&layer->rng, sz, layer->dropout_rate, layer->scale,
+                           src.data, layer->mask);
     return BCNN_SUCCESS;
 }
 
@@ -95,6 +152,13 @@ int bcnn_forward_dropout_layer(bcnn_net *net, bcnn_connection *conn) {
 #ifdef BCNN_USE_CUDA
     return bcnn_forward_dropout_layer_gpu(conn->layer, src, dst);
 #else
+    if (net->recompute) {
+        // Replay with the mask drawn by the forward pass
+        bcnn_dropout_apply_mask(bcnn_tensor_get_size(&src->tensor),
+                                conn->layer->mask, conn->layer->scale,
+                                src->tensor.data);
+        return BCNN_SUCCESS;
+    }
     return bcnn_forward_dropout_layer_cpu(conn->layer, src, dst);
 #endif
 }
@@ -102,21 +166,13 @@ int bcnn_forward_dropout_layer(bcnn_net *net, bcnn_connection *conn) {
 int bcnn_backward_dropout_layer_cpu(bcnn_layer *layer, bcnn_node *src_node,
                                     bcnn_node *dst_node) {
     bcnn_tensor src = src_node->tensor;
-    int i, sz = bcnn_tensor_get_size(&src);
-    float r;
+    int sz = bcnn_tensor_get_size(&src);
 
     if (!src.grad_data) {
         return BCNN_SUCCESS;
     }
 
-    for (i = 0; i < sz; ++i) {
-        r = layer->rand[i];
-        if (r < layer->dropout_rate) {
-            src.grad_data[i] = 0;
-        } else {
-            src.grad_data[i] *= layer->scale;
-        }
-    }
+    bcnn_dropout_apply_mask(sz, layer->mask, layer->scale, src.grad_data);
     return BCNN_SUCCESS;
 }
 
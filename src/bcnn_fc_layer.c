@@ -25,14 +25,20 @@
 #include "cblas.h"
 #endif
 
+#include <bh/bh.h>
 #include <bh/bh_mem.h>
 #include <bh/bh_string.h>
 
 #include "bcnn_activation_layer.h"
 #include "bcnn_mat.h"
+#include "bcnn_thread.h"
 #include "bcnn_utils.h"
 #include "bh_log.h"
 
+// Minimum number of weights streamed by each thread of the small batch path,
+// below which waking a worker costs more than it saves
+#define BCNN_FULLC_GEMV_MIN_WORK (1 << 17)
+
 int bcnn_add_fullc_layer(bcnn_net *net, int output_size, bcnn_filler_type init,
                          bcnn_activation activation, int quantize, char *src_id,
                          char *dst_id) {
@@ -77,7 +83,8 @@ int bcnn_add_fullc_layer(bcnn_net *net, int output_size, bcnn_filler_type init,
     // Setup layer weights
     bcnn_tensor_create(&conn.layer->weights, 1, 1, 1, input_size * output_size,
                        1);
-    bcnn_tensor_filler w_filler = {.range = input_size, .type = init};
+    bcnn_tensor_filler w_filler = {
+        .range = input_size, .type = init, .rng = &net->rng};
     bcnn_tensor_fill(&conn.layer->weights, w_filler);
     // Setup layer biases
     bcnn_tensor_create(&conn.layer->biases, 1, 1, 1, output_size, 1);
@@ -110,17 +117,103 @@ int bcnn_add_fullc_layer(bcnn_net *net, int output_size, bcnn_filler_type init,
     return 0;
 }
 
-int bcnn_forward_fullc_layer_cpu(bcnn_layer *layer, bcnn_node *src_node,
-                                 bcnn_node *dst_node) {
+typedef struct {
+    bcnn_layer *layer;
+    int batch_size;
+    int src_size;
+    int dst_size;
+    float *src;
+    float *dst;
+    float *src_grad;
+    float *dst_grad;
+} bcnn_fullc_gemv_job;
+
+static int bcnn_fullc_gemv_threads(bcnn_layer *layer, int src_size,
+                                   int dst_size) {
+    int n = (int)((long long)src_size * dst_size / BCNN_FULLC_GEMV_MIN_WORK);
+    n = bh_min(n, layer->num_threads);
+    return bh_max(n, 1);
+}
+
+// Outputs [begin, end) of every sample
+static void bcnn_fullc_gemv_forward(void *arg, int begin, int end) {
+    bcnn_fullc_gemv_job *job = (bcnn_fullc_gemv_job *)arg;
+    bcnn_layer *layer = job->layer;
+    int k = job->src_size;
+
+    if (layer->weights_f16) {
+        bcnn_gemv_batch(job->batch_size, end - begin, k, 1.0f, job->src, k,
+                        NULL, layer->weights_f16 + begin * k, k, 0.0f,
+                        job->dst + begin, job->dst_size);
+    } else {
+        bcnn_gemv_batch(job->batch_size, end - begin, k, 1.0f, job->src, k,
+                        layer->weights.data + begin * k, NULL, k, 0.0f,
+                        job->dst + begin, job->dst_size);
+    }
+}
+
+// Input columns [8 * begin, 8 * end) of the weights gradient and of the input
+// gradient, both accumulated one row of weights at a time
+static void bcnn_fullc_gemv_backward(void *arg, int begin, int end) {
+    bcnn_fullc_gemv_job *job = (bcnn_fullc_gemv_job *)arg;
+    bcnn_layer *layer = job->layer;
+    int k = job->src_size;
+    int c = 8 * begin, len = bh_min(8 * end, k) - c;
+    int i, j;
+    float g;
+
+    for (j = 0; j < job->dst_size; ++j) {
+        for (i = 0; i < job->batch_size; ++i) {
+            g = job->dst_grad[i * job->dst_size + j];
+            if (g == 0.0f) {
+                continue;
+            }
+            bcnn_axpy(len, g, job->src + i * k + c,
+                      layer->weights.grad_data + j * k + c);
+            if (job->src_grad) {
+                bcnn_axpy(len, g, layer->weights.data + j * k + c,
+                          job->src_grad + i * k + c);
+            }
+        }
+    }
+}
+
+int bcnn_forward_fullc_layer_gemm_cpu(bcnn_layer *layer, bcnn_node *src_node,
+                                      bcnn_node *dst_node) {
     bcnn_tensor src = src_node->tensor;
     bcnn_tensor dst = dst_node->tensor;
-    int i, batch_size = dst.n;
+    int batch_size = dst.n;
     int src_size = bcnn_tensor_get_size3d(&src);
     int dst_size = bcnn_tensor_get_size3d(&dst);
-    int sz = bcnn_tensor_get_size(&dst);
+
+    if (batch_size <= BCNN_FULLC_GEMV_MAX_BATCH) {
+        bcnn_fullc_gemv_job job = {.layer = layer,
+                                   .batch_size = batch_size,
+                                   .src_size = src_size,
+                                   .dst_size = dst_size,
+                                   .src = src.data,
+                                   .dst = dst.data};
+        bcnn_parallel_for(layer->thread_pool, dst_size,
+                          bcnn_fullc_gemv_threads(layer, src_size, dst_size),
+                          bcnn_fullc_gemv_forward, &job);
+        return BCNN_SUCCESS;
+    }
 
     memset(dst.data, 0, dst_size * batch_size * sizeof(float));
 
+    if (layer->weights_packed) {
+        bcnn_gemm_packed(0, 1, batch_size, dst_size, src_size, 1.0f, src.data,
+                         NULL, src_size, NULL, layer->weights_packed, src_size,
+                         1.0f, dst.data, dst_size);
+        return BCNN_SUCCESS;
+    }
+    if (layer->weights_f16) {
+        bcnn_gemm_f16(0, 1, batch_size, dst_size, src_size, 1.0f, src.data,
+                      NULL, src_size, NULL, layer->weights_f16, src_size, 1.0f,
+                      dst.data, dst_size);
+        return BCNN_SUCCESS;
+    }
+
 #ifdef BCNN_USE_BLAS
     cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans, batch_size, dst_size,
                 src_size, 1.0f, src.data, src_size, layer->weights.data,
@@ -131,6 +224,18 @@ int bcnn_forward_fullc_layer_cpu(bcnn_layer *layer, bcnn_node *src_node,
               layer->weights.data, src_size, 1.0f, dst.data, dst_size);
 #endif
 
+    return BCNN_SUCCESS;
+}
+
+int bcnn_forward_fullc_layer_cpu(bcnn_layer *layer, bcnn_node *src_node,
+                                 bcnn_node *dst_node) {
+    bcnn_tensor dst = dst_node->tensor;
+    int i, batch_size = dst.n;
+    int dst_size = bcnn_tensor_get_size3d(&dst);
+    int sz = bcnn_tensor_get_size(&dst);
+
+    bcnn_forward_fullc_layer_gemm_cpu(layer, src_node, dst_node);
+
     for (i = 0; i < batch_size; ++i)
         bcnn_axpy(dst_size, 1, layer->biases.data, dst.data + i * dst_size);
 
@@ -156,6 +261,20 @@ int bcnn_backward_fullc_layer_cpu(bcnn_layer *layer, bcnn_node *src_node,
                   layer->biases.grad_data);
     }
 
+    if (batch_size <= BCNN_FULLC_GEMV_MAX_BATCH) {
+        bcnn_fullc_gemv_job job = {.layer = layer,
+                                   .batch_size = batch_size,
+                                   .src_size = src_size,
+                                   .dst_size = dst_size,
+                                   .src = src.data,
+                                   .src_grad = src.grad_data,
+                                   .dst_grad = dst.grad_data};
+        bcnn_parallel_for(layer->thread_pool, (src_size + 7) / 8,
+                          bcnn_fullc_gemv_threads(layer, src_size, dst_size),
+                          bcnn_fullc_gemv_backward, &job);
+        return BCNN_SUCCESS;
+    }
+
 #ifdef BCNN_USE_BLAS
     cblas_sgemm(CblasRowMajor, CblasTrans, CblasNoTrans, dst_size, src_size,
                 batch_size, 1.0f, dst.grad_data, dst_size, src.data, src_size,
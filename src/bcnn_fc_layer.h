@@ -29,9 +29,17 @@
 extern "C" {
 #endif
 
+/* Batches up to this size are computed on cpu by matrix-vector products over
+ * the rows of the weights rather than by a gemm */
+#define BCNN_FULLC_GEMV_MAX_BATCH 8
+
 int bcnn_forward_fullc_layer(bcnn_net *net, bcnn_connection *conn);
 int bcnn_backward_fullc_layer(bcnn_net *net, bcnn_connection *conn);
 
+/* Matrix product only (bias and activation not applied) */
+int bcnn_forward_fullc_layer_gemm_cpu(bcnn_layer *layer, bcnn_node *src_node,
+                                      bcnn_node *dst_node);
+
 #ifdef __cplusplus
 }
 #endif
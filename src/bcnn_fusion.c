@@ -0,0 +1,381 @@
+/*
+* Copyright (c) 2016 Jean-Noel Braun.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "bcnn_fusion.h"
+
+#include <bh/bh_mem.h>
+#include <bh/bh_string.h>
+
+#include "bcnn_activation_layer.h"
+#include "bcnn_conv_layer.h"
+#include "bcnn_deconv_layer.h"
+#include "bcnn_fc_layer.h"
+#include "bcnn_layout.h"
+#include "bcnn_mat.h"
+#include "bh_log.h"
+
+static int bcnn_fusion_is_head(bcnn_connection *conn) {
+    if (conn->num_src != 1 || conn->num_dst != 1) {
+        return 0;
+    }
+    switch (conn->layer->type) {
+        case CONVOLUTIONAL:
+        case DECONVOLUTIONAL:
+        case FULL_CONNECTED:
+        case BATCHNORM:
+        case ACTIVATION:
+        case DROPOUT:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int bcnn_fusion_is_elementwise(bcnn_connection *conn) {
+    return (conn->num_src == 1 && conn->num_dst == 1 &&
+            (conn->layer->type == BATCHNORM ||
+             conn->layer->type == ACTIVATION ||
+             conn->layer->type == DROPOUT));
+}
+
+// Returns 1 if 'node' is an input of any connection outside [first, last].
+static int bcnn_fusion_is_node_shared(bcnn_net *net, int node, int first,
+                                      int last) {
+    int i, j;
+    for (i = 0; i < net->nb_connections; ++i) {
+        if (i >= first && i <= last) {
+            continue;
+        }
+        for (j = 0; j < net->connections[i].num_src; ++j) {
+            if (net->connections[i].src[j] == node) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static bcnn_fused_op *bcnn_fusion_add_op(bcnn_fused_unit *unit,
+                                         bcnn_fused_op_type type) {
+    bcnn_fused_op *p_ops = NULL;
+    unit->num_ops++;
+    p_ops = (bcnn_fused_op *)realloc(unit->ops,
+                                     unit->num_ops * sizeof(bcnn_fused_op));
+    bh_check((p_ops != NULL), "Internal allocation error");
+    unit->ops = p_ops;
+    memset(&unit->ops[unit->num_ops - 1], 0, sizeof(bcnn_fused_op));
+    unit->ops[unit->num_ops - 1].type = type;
+    return &unit->ops[unit->num_ops - 1];
+}
+
+// Appends y = scale * x + shift. Consecutive affine ops are merged into one.
+static void bcnn_fusion_add_affine(bcnn_fused_unit *unit, int channels,
+                                   float *scale, float *shift) {
+    bcnn_fused_op *op = NULL;
+
+    if (unit->num_ops > 0 &&
+        unit->ops[unit->num_ops - 1].type == FUSED_AFFINE) {
+        op = &unit->ops[unit->num_ops - 1];
+        if (scale != NULL) {
+            if (op->scale == NULL) {
+                op->scale = (float *)calloc(channels, sizeof(float));
+                bcnn_fill_f32(channels, 1.0f, op->scale);
+            }
+            bcnn_vmul(channels, op->scale, scale, op->scale);
+            bcnn_vmul(channels, op->shift, scale, op->shift);
+        }
+        bcnn_vadd(channels, op->shift, shift, op->shift);
+        return;
+    }
+    op = bcnn_fusion_add_op(unit, FUSED_AFFINE);
+    op->shift = (float *)calloc(channels, sizeof(float));
+    bcnn_copy_f32(channels, shift, op->shift);
+    if (scale != NULL) {
+        op->scale = (float *)calloc(channels, sizeof(float));
+        bcnn_copy_f32(channels, scale, op->scale);
+    }
+}
+
+static void bcnn_fusion_add_activation(bcnn_fused_unit *unit,
+                                       bcnn_layer *layer) {
+    bcnn_fused_op *op = NULL;
+    if (layer->activation == NONE) {
+        return;
+    }
+    op = bcnn_fusion_add_op(unit, FUSED_ACTIVATION);
+    op->activation = layer->activation;
+    if (layer->activation == PRELU) {
+        op->slope = layer->weights.data;
+    }
+}
+
+// Batchnorm in predict mode: y = (x - running_mean) / sqrt(running_var + eps)
+static void bcnn_fusion_add_batchnorm(bcnn_fused_unit *unit, bcnn_layer *layer,
+                                      int channels) {
+    int i;
+    float *scale = (float *)calloc(channels, sizeof(float));
+    float *shift = (float *)calloc(channels, sizeof(float));
+
+    for (i = 0; i < channels; ++i) {
+        scale[i] = 1.0f / sqrtf(layer->running_variance.data[i] + 0.000001f);
+        shift[i] = -layer->running_mean.data[i] * scale[i];
+    }
+    bcnn_fusion_add_affine(unit, channels, scale, shift);
+    bh_free(scale);
+    bh_free(shift);
+}
+
+static void bcnn_fusion_build_ops(bcnn_net *net, bcnn_fused_unit *unit) {
+    int i;
+    int channels = net->nodes[unit->dst].tensor.c;
+    bcnn_layer *layer = NULL;
+
+    for (i = unit->first; i < unit->first + unit->num_conn; ++i) {
+        layer = net->connections[i].layer;
+        switch (layer->type) {
+            case CONVOLUTIONAL:
+            case DECONVOLUTIONAL:
+            case FULL_CONNECTED:
+                bcnn_fusion_add_affine(unit, channels, NULL,
+                                       layer->biases.data);
+                bcnn_fusion_add_activation(unit, layer);
+                break;
+            case BATCHNORM:
+                bcnn_fusion_add_batchnorm(unit, layer, channels);
+                break;
+            case ACTIVATION:
+                bcnn_fusion_add_activation(unit, layer);
+                break;
+            default:
+                // Dropout is the identity in predict mode
+                break;
+        }
+    }
+}
+
+static const char *bcnn_fusion_layer_name(bcnn_layer_type type) {
+    switch (type) {
+        case CONVOLUTIONAL:
+            return "Convolutional";
+        case DECONVOLUTIONAL:
+            return "Deconvolutional";
+        case FULL_CONNECTED:
+            return "Connected";
+        case BATCHNORM:
+            return "Batchnorm";
+        case ACTIVATION:
+            return "Activation";
+        case DROPOUT:
+            return "Dropout";
+        default:
+            return "Unknown";
+    }
+}
+
+static void bcnn_fusion_log_unit(bcnn_net *net, bcnn_fused_unit *unit) {
+    int i;
+    char plan[512] = {0};
+    size_t len = 0;
+
+    for (i = unit->first; i < unit->first + unit->num_conn; ++i) {
+        len += snprintf(
+            plan + len, sizeof(plan) - len, "%s%s(%d)",
+            (i == unit->first ? "" : " + "),
+            bcnn_fusion_layer_name(net->connections[i].layer->type), i);
+        if (len >= sizeof(plan)) {
+            break;
+        }
+    }
+    bh_log_info("[Fusion] %s -> output node '%s' epilogue_ops= %d", plan,
+                net->nodes[unit->dst].id, unit->num_ops);
+}
+
+void bcnn_net_free_fused(bcnn_net *net) {
+    int i, j;
+    for (i = 0; i < net->num_fused; ++i) {
+        for (j = 0; j < net->fused[i].num_ops; ++j) {
+            bh_free(net->fused[i].ops[j].scale);
+            bh_free(net->fused[i].ops[j].shift);
+        }
+        bh_free(net->fused[i].ops);
+    }
+    bh_free(net->fused);
+    net->num_fused = 0;
+}
+
+int bcnn_net_fuse(bcnn_net *net) {
+    int i = 0, j, node, num_merged = 0;
+    bcnn_fused_unit *p_units = NULL;
+
+    bcnn_net_free_fused(net);
+#ifdef BCNN_USE_CUDA
+    // Fused units are only implemented on cpu
+    return BCNN_SUCCESS;
+#endif
+    while (i < net->nb_connections) {
+        bcnn_fused_unit unit = {0};
+        unit.first = i;
+        unit.num_conn = 1;
+        unit.src = net->connections[i].src[0];
+        unit.dst = net->connections[i].dst[0];
+        // Connections of the channel-blocked layout run on their own
+        if (bcnn_fusion_is_head(&net->connections[i]) &&
+            !bcnn_layout_is_blocked(net, i)) {
+            // Extend the chain while the next connection is an elementwise
+            // layer reading the current output. An output node can only be
+            // skipped if no other connection reads it.
+            node = unit.dst;
+            for (j = i + 1; j < net->nb_connections; ++j) {
+                if (!bcnn_fusion_is_elementwise(&net->connections[j]) ||
+                    bcnn_layout_is_blocked(net, j) ||
+                    net->connections[j].src[0] != node) {
+                    break;
+                }
+                if (net->connections[j].dst[0] != node &&
+                    bcnn_fusion_is_node_shared(net, node, i, j)) {
+                    break;
+                }
+                node = net->connections[j].dst[0];
+            }
+            unit.num_conn = j - i;
+            unit.dst = node;
+        }
+        if (unit.num_conn > 1) {
+            bcnn_fusion_build_ops(net, &unit);
+            num_merged += unit.num_conn;
+        }
+        net->num_fused++;
+        p_units = (bcnn_fused_unit *)realloc(
+            net->fused, net->num_fused * sizeof(bcnn_fused_unit));
+        bh_check((p_units != NULL), "Internal allocation error");
+        net->fused = p_units;
+        net->fused[net->num_fused - 1] = unit;
+        if (unit.num_conn > 1) {
+            bcnn_fusion_log_unit(net, &net->fused[net->num_fused - 1]);
+        }
+        i += unit.num_conn;
+    }
+    bh_log_info("[Fusion] %d connections executed as %d units (%d merged)",
+                net->nb_connections, net->num_fused, num_merged);
+
+    return BCNN_SUCCESS;
+}
+
+static void bcnn_fusion_apply_op(bcnn_fused_op *op, float *x, int n, int c) {
+    int i;
+    float a, b;
+
+    if (op->type == FUSED_AFFINE) {
+        a = (op->scale != NULL ? op->scale[c] : 1.0f);
+        b = op->shift[c];
+        for (i = 0; i < n; ++i) {
+            x[i] = a * x[i] + b;
+        }
+    } else if (op->activation == PRELU) {
+        a = op->slope[c];
+        for (i = 0; i < n; ++i) {
+            x[i] = (x[i] > 0 ? x[i] : a * x[i]);
+        }
+    } else {
+        bcnn_forward_activation_cpu(x, n, op->activation);
+    }
+}
+
+// Same as above when each element has its own channel (spatial size of 1).
+static void bcnn_fusion_apply_op_channelwise(bcnn_fused_op *op, float *x,
+                                             int n) {
+    int i;
+
+    if (op->type == FUSED_AFFINE) {
+        if (op->scale != NULL) {
+            bcnn_vmul(n, x, op->scale, x);
+        }
+        bcnn_vadd(n, x, op->shift, x);
+    } else if (op->activation == PRELU) {
+        for (i = 0; i < n; ++i) {
+            x[i] = (x[i] > 0 ? x[i] : op->slope[i] * x[i]);
+        }
+    } else {
+        bcnn_forward_activation_cpu(x, n, op->activation);
+    }
+}
+
+/**
+ * Applies all the epilogue operations feature map per feature map, so that
+ * each plane is read from memory once and stays in cache for the whole chain.
+ */
+static void bcnn_fusion_epilogue(bcnn_fused_unit *unit, float *src, float *dst,
+                                 int batch_size, int channels, int spatial) {
+    int b, c, k;
+    float *x = NULL;
+
+    if (spatial == 1) {
+        for (b = 0; b < batch_size; ++b) {
+            x = dst + b * channels;
+            if (src != dst) {
+                memcpy(x, src + b * channels, channels * sizeof(float));
+            }
+            for (k = 0; k < unit->num_ops; ++k) {
+                bcnn_fusion_apply_op_channelwise(&unit->ops[k], x, channels);
+            }
+        }
+        return;
+    }
+    for (b = 0; b < batch_size; ++b) {
+        for (c = 0; c < channels; ++c) {
+            x = dst + (b * channels + c) * spatial;
+            if (src != dst) {
+                memcpy(x, src + (b * channels + c) * spatial,
+                       spatial * sizeof(float));
+            }
+            for (k = 0; k < unit->num_ops; ++k) {
+                bcnn_fusion_apply_op(&unit->ops[k], x, spatial, c);
+            }
+        }
+    }
+}
+
+int bcnn_forward_fused_unit(bcnn_net *net, bcnn_fused_unit *unit) {
+    bcnn_layer *head = net->connections[unit->first].layer;
+    bcnn_node *src = &net->nodes[unit->src];
+    bcnn_node *dst = &net->nodes[unit->dst];
+    float *in = dst->tensor.data;
+
+    switch (head->type) {
+        case CONVOLUTIONAL:
+            bcnn_forward_conv_layer_gemm_cpu(head, src, dst);
+            break;
+        case DECONVOLUTIONAL:
+            bcnn_forward_deconv_layer_gemm_cpu(head, src, dst);
+            break;
+        case FULL_CONNECTED:
+            bcnn_forward_fullc_layer_gemm_cpu(head, src, dst);
+            break;
+        default:
+            in = src->tensor.data;
+            break;
+    }
+    bcnn_fusion_epilogue(unit, in, dst->tensor.data, dst->tensor.n,
+                         dst->tensor.c, dst->tensor.h * dst->tensor.w);
+
+    return BCNN_SUCCESS;
+}
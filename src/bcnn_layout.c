@@ -0,0 +1,773 @@
+/*
+* Copyright (c) 2016 Jean-Noel Braun.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "bcnn_layout.h"
+
+#include <float.h>
+
+#include <bh/bh.h>
+#include <bh/bh_mem.h>
+
+#include "bcnn_activation_layer.h"
+#include "bcnn_mat.h"
+#include "bcnn_tensor.h"
+#include "bh_log.h"
+
+/* Channel-blocked layout of the activations (predict mode, cpu).
+ *
+ * Channels are grouped by blocks of BCNN_BLOCK, the width of an AVX register,
+ * and a blocked tensor is stored as [n][c / BCNN_BLOCK][h][w][BCNN_BLOCK]. The
+ * channels of a pixel being contiguous, the conv, depthwise conv, maxpool,
+ * batchnorm and activation kernels below work on one register per pixel,
+ * without im2col and whatever the spatial size.
+ *
+ * A connection runs its blocked kernel if its type has one and its channels
+ * are multiples of BCNN_BLOCK. A node is stored blocked if every connection
+ * reading or writing it runs blocked and some connection reads it, so that
+ * the outputs of the net stay planar. A blocked connection whose input (resp.
+ * output) node is planar reorders it into (resp. from) a buffer of its own:
+ * reorders only happen at the boundaries of the blocked regions of the graph.
+ */
+
+#define BCNN_BLOCK 8
+
+struct bcnn_layout {
+    int *node_blocked;
+    int *conn_blocked;
+    float **src_buf;  // Blocked copy of a planar input
+    float **dst_buf;  // Blocked output, reordered into a planar node
+    float **bn_den;   // Batchnorm denominators of the global statistics
+};
+
+static int bcnn_layout_has_kernel(bcnn_net *net, bcnn_connection *conn) {
+    bcnn_tensor *src = NULL;
+    bcnn_tensor *dst = NULL;
+
+    if (conn->num_src != 1 || conn->num_dst != 1) {
+        return 0;
+    }
+    src = &net->nodes[conn->src[0]].tensor;
+    dst = &net->nodes[conn->dst[0]].tensor;
+    if (src->c % BCNN_BLOCK != 0 || dst->c % BCNN_BLOCK != 0) {
+        return 0;
+    }
+    switch (conn->layer->type) {
+        case CONVOLUTIONAL:
+        case DEPTHWISE_CONV:
+        case MAXPOOL:
+        case BATCHNORM:
+        case ACTIVATION:
+        case DROPOUT:  // Identity in predict mode
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int bcnn_conn_has_node(bcnn_connection *conn, int node, int dst) {
+    int k;
+    int num = (dst ? conn->num_dst : conn->num_src);
+    int *nodes = (dst ? conn->dst : conn->src);
+
+    for (k = 0; k < num; ++k) {
+        if (nodes[k] == node) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int bcnn_layout_node_is_blocked(bcnn_net *net, bcnn_layout *layout,
+                                       int node) {
+    int i, src, dst, is_read = 0;
+
+    if (node == 0 || net->nodes[node].is_view ||
+        net->nodes[node].tensor.c % BCNN_BLOCK != 0) {
+        return 0;
+    }
+    for (i = 0; i < net->nb_connections; ++i) {
+        src = bcnn_conn_has_node(&net->connections[i], node, 0);
+        dst = bcnn_conn_has_node(&net->connections[i], node, 1);
+        if ((src || dst) && !layout->conn_blocked[i]) {
+            return 0;
+        }
+        // In-place connections do not consume the node
+        is_read |= (src && !dst);
+    }
+    return is_read;
+}
+
+// Single precision copy of the weights, only kept in half precision when the
+// net is compiled with half_precision in predict mode
+static float *bcnn_layout_weights(bcnn_layer *layer) {
+    int sz = bcnn_tensor_get_size(&layer->weights);
+    float *w = (float *)calloc(sz, sizeof(float));
+
+    if (layer->weights.data != NULL) {
+        memcpy(w, layer->weights.data, sz * sizeof(float));
+    } else {
+        bcnn_f16_to_f32(sz, layer->weights_f16, w);
+    }
+    return w;
+}
+
+// Conv weights [o][c][kh][kw] as [o / 8][c / 8][kh][kw][c % 8][o % 8], so
+// that the kernel loads the 8 output channels of an input channel at once
+static void bcnn_layout_block_conv_weights(bcnn_layer *layer, int channels) {
+    int k2 = layer->size * layer->size;
+    int ob, cb, k, ic, oc;
+    int num_cb = channels / BCNN_BLOCK;
+    float *w = bcnn_layout_weights(layer);
+    float *p = NULL;
+
+    bh_align_free(layer->weights_blocked);
+    layer->weights_blocked = (float *)bh_align_calloc(
+        layer->num * channels * k2 * sizeof(float), align_offset_);
+    p = layer->weights_blocked;
+    for (ob = 0; ob < layer->num / BCNN_BLOCK; ++ob) {
+        for (cb = 0; cb < num_cb; ++cb) {
+            for (k = 0; k < k2; ++k) {
+                for (ic = 0; ic < BCNN_BLOCK; ++ic) {
+                    for (oc = 0; oc < BCNN_BLOCK; ++oc) {
+                        *p++ = w[((ob * BCNN_BLOCK + oc) * channels +
+                                  cb * BCNN_BLOCK + ic) *
+                                     k2 +
+                                 k];
+                    }
+                }
+            }
+        }
+    }
+    bh_free(w);
+}
+
+// Depthwise weights [c][kh][kw] as [c / 8][kh][kw][c % 8]
+static void bcnn_layout_block_depthwise_weights(bcnn_layer *layer,
+                                                int channels) {
+    int k2 = layer->size * layer->size;
+    int cb, k, l;
+    float *w = layer->weights.data;
+    float *p = NULL;
+
+    bh_align_free(layer->weights_blocked);
+    layer->weights_blocked = (float *)bh_align_calloc(
+        channels * k2 * sizeof(float), align_offset_);
+    p = layer->weights_blocked;
+    for (cb = 0; cb < channels / BCNN_BLOCK; ++cb) {
+        for (k = 0; k < k2; ++k) {
+            for (l = 0; l < BCNN_BLOCK; ++l) {
+                *p++ = w[(cb * BCNN_BLOCK + l) * k2 + k];
+            }
+        }
+    }
+}
+
+// Same denominator as the planar batchnorm layer in predict mode
+static float *bcnn_layout_batchnorm_den(bcnn_layer *layer, int channels) {
+    int c;
+    float *den = (float *)calloc(channels, sizeof(float));
+
+    for (c = 0; c < channels; ++c) {
+        den[c] = sqrtf(layer->running_variance.data[c] + 0.000001f);
+    }
+    return den;
+}
+
+static float *bcnn_layout_alloc(bcnn_tensor *t) {
+    return (float *)bh_align_calloc(bcnn_tensor_get_size(t) * sizeof(float),
+                                    align_offset_);
+}
+
+void bcnn_net_free_layout(bcnn_net *net) {
+    int i;
+    bcnn_layout *layout = net->layout;
+
+    if (layout == NULL) {
+        return;
+    }
+    for (i = 0; i < net->nb_connections; ++i) {
+        bh_align_free(net->connections[i].layer->weights_blocked);
+        net->connections[i].layer->weights_blocked = NULL;
+        if (layout->dst_buf[i] != layout->src_buf[i]) {
+            bh_align_free(layout->dst_buf[i]);
+        }
+        bh_align_free(layout->src_buf[i]);
+        bh_free(layout->bn_den[i]);
+    }
+    bh_free(layout->node_blocked);
+    bh_free(layout->conn_blocked);
+    bh_free(layout->src_buf);
+    bh_free(layout->dst_buf);
+    bh_free(layout->bn_den);
+    bh_free(layout);
+    net->layout = NULL;
+}
+
+int bcnn_net_plan_layout(bcnn_net *net) {
+    int i, src, dst, num_conn = 0, num_nodes = 0, num_reorders = 0;
+    bcnn_layout *layout = NULL;
+    bcnn_layer *layer = NULL;
+
+    bcnn_net_free_layout(net);
+#ifdef BCNN_USE_CUDA
+    return BCNN_SUCCESS;
+#endif
+    layout = (bcnn_layout *)calloc(1, sizeof(bcnn_layout));
+    layout->node_blocked = (int *)calloc(net->num_nodes, sizeof(int));
+    layout->conn_blocked = (int *)calloc(net->nb_connections, sizeof(int));
+    layout->src_buf = (float **)calloc(net->nb_connections, sizeof(float *));
+    layout->dst_buf = (float **)calloc(net->nb_connections, sizeof(float *));
+    layout->bn_den = (float **)calloc(net->nb_connections, sizeof(float *));
+    net->layout = layout;
+    for (i = 0; i < net->nb_connections; ++i) {
+        layout->conn_blocked[i] =
+            bcnn_layout_has_kernel(net, &net->connections[i]);
+        num_conn += layout->conn_blocked[i];
+    }
+    for (i = 0; i < net->num_nodes; ++i) {
+        layout->node_blocked[i] = bcnn_layout_node_is_blocked(net, layout, i);
+        num_nodes += layout->node_blocked[i];
+    }
+    for (i = 0; i < net->nb_connections; ++i) {
+        if (!layout->conn_blocked[i]) {
+            continue;
+        }
+        layer = net->connections[i].layer;
+        src = net->connections[i].src[0];
+        dst = net->connections[i].dst[0];
+        if (!layout->node_blocked[src]) {
+            layout->src_buf[i] = bcnn_layout_alloc(&net->nodes[src].tensor);
+            num_reorders++;
+        }
+        if (!layout->node_blocked[dst]) {
+            layout->dst_buf[i] =
+                (src == dst ? layout->src_buf[i]
+                            : bcnn_layout_alloc(&net->nodes[dst].tensor));
+            num_reorders++;
+        }
+        if (layer->type == CONVOLUTIONAL) {
+            bcnn_layout_block_conv_weights(layer, net->nodes[src].tensor.c);
+            // The gemm panels are not used anymore
+            bh_align_free(layer->weights_packed);
+            layer->weights_packed = NULL;
+        } else if (layer->type == DEPTHWISE_CONV) {
+            bcnn_layout_block_depthwise_weights(layer,
+                                                net->nodes[src].tensor.c);
+        } else if (layer->type == BATCHNORM) {
+            layout->bn_den[i] = bcnn_layout_batchnorm_den(
+                layer, net->nodes[dst].tensor.c);
+        }
+    }
+    if (num_conn == 0) {
+        bcnn_net_free_layout(net);
+        // Leaves the connections to the fusion
+        return BCNN_SUCCESS;
+    }
+    bh_log_info(
+        "[Layout] %d connections and %d nodes channel-blocked, %d reorders",
+        num_conn, num_nodes, num_reorders);
+
+    return BCNN_SUCCESS;
+}
+
+int bcnn_layout_is_blocked(bcnn_net *net, int conn) {
+    return (net->layout != NULL && net->layout->conn_blocked[conn]);
+}
+
+// [n][c][hw] -> [n][c / 8][hw][8]
+static void bcnn_layout_to_blocked(const float *src, int n, int c, int hw,
+                                   float *dst) {
+    int b, cb, l, i;
+    const float *s = NULL;
+    float *d = NULL;
+
+    for (b = 0; b < n; ++b) {
+        for (cb = 0; cb < c / BCNN_BLOCK; ++cb) {
+            d = dst + (b * c + cb * BCNN_BLOCK) * hw;
+            for (l = 0; l < BCNN_BLOCK; ++l) {
+                s = src + (b * c + cb * BCNN_BLOCK + l) * hw;
+                for (i = 0; i < hw; ++i) {
+                    d[i * BCNN_BLOCK + l] = s[i];
+                }
+            }
+        }
+    }
+}
+
+// [n][c / 8][hw][8] -> [n][c][hw]
+static void bcnn_layout_to_planar(const float *src, int n, int c, int hw,
+                                  float *dst) {
+    int b, cb, l, i;
+    const float *s = NULL;
+    float *d = NULL;
+
+    for (b = 0; b < n; ++b) {
+        for (cb = 0; cb < c / BCNN_BLOCK; ++cb) {
+            s = src + (b * c + cb * BCNN_BLOCK) * hw;
+            for (l = 0; l < BCNN_BLOCK; ++l) {
+                d = dst + (b * c + cb * BCNN_BLOCK + l) * hw;
+                for (i = 0; i < hw; ++i) {
+                    d[i] = s[i * BCNN_BLOCK + l];
+                }
+            }
+        }
+    }
+}
+
+// Adds the contribution of 'num_cb' blocks of input channels to the output
+// pixel (oy, ox) of one block of output channels, any position
+static void bcnn_blocked_conv_pixel(bcnn_layer *layer, const float *in,
+                                    int num_cb, int h, int w, const float *wb,
+                                    int oy, int ox, float *out) {
+    int k = layer->size;
+    int cb, ky, kx, iy, ix, ic;
+    const float *p = NULL, *q = NULL;
+#ifdef BCNN_USE_AVX
+    __m256 acc = _mm256_loadu_ps(out), acc_odd = _mm256_setzero_ps();
+#else
+    int oc;
+#endif
+
+    for (cb = 0; cb < num_cb; ++cb) {
+        for (ky = 0; ky < k; ++ky) {
+            iy = oy * layer->stride - layer->pad + ky;
+            if (iy < 0 || iy >= h) {
+                continue;
+            }
+            for (kx = 0; kx < k; ++kx) {
+                ix = ox * layer->stride - layer->pad + kx;
+                if (ix < 0 || ix >= w) {
+                    continue;
+                }
+                p = in + ((cb * h + iy) * w + ix) * BCNN_BLOCK;
+                q = wb + ((cb * k + ky) * k + kx) * BCNN_BLOCK * BCNN_BLOCK;
+                for (ic = 0; ic < BCNN_BLOCK; ++ic) {
+#ifdef BCNN_USE_AVX
+                    // Two chains of additions, to hide their latency
+                    acc = _mm256_add_ps(
+                        acc,
+                        _mm256_mul_ps(_mm256_broadcast_ss(p + ic),
+                                      _mm256_load_ps(q + ic * BCNN_BLOCK)));
+                    ++ic;
+                    acc_odd = _mm256_add_ps(
+                        acc_odd,
+                        _mm256_mul_ps(_mm256_broadcast_ss(p + ic),
+                                      _mm256_load_ps(q + ic * BCNN_BLOCK)));
+#else
+                    for (oc = 0; oc < BCNN_BLOCK; ++oc) {
+                        out[oc] += p[ic] * q[ic * BCNN_BLOCK + oc];
+                    }
+#endif
+                }
+            }
+        }
+    }
+#ifdef BCNN_USE_AVX
+    _mm256_storeu_ps(out, _mm256_add_ps(acc, acc_odd));
+#endif
+}
+
+#ifdef BCNN_USE_AVX
+#define BCNN_CONV_TILE 8
+// Same for BCNN_CONV_TILE consecutive output pixels whose receptive fields lie
+// inside of the image columns: each weight register serves all of them
+static void bcnn_blocked_conv_tile(bcnn_layer *layer, const float *in,
+                                   int num_cb, int h, int w, const float *wb,
+                                   int oy, int ox, float *out) {
+    int k = layer->size, s = layer->stride * BCNN_BLOCK;
+    int cb, ky, kx, iy, ic;
+    const float *p = NULL, *q = NULL;
+    __m256 acc0 = _mm256_loadu_ps(out);
+    __m256 acc1 = _mm256_loadu_ps(out + BCNN_BLOCK);
+    __m256 acc2 = _mm256_loadu_ps(out + 2 * BCNN_BLOCK);
+    __m256 acc3 = _mm256_loadu_ps(out + 3 * BCNN_BLOCK);
+    __m256 acc4 = _mm256_loadu_ps(out + 4 * BCNN_BLOCK);
+    __m256 acc5 = _mm256_loadu_ps(out + 5 * BCNN_BLOCK);
+    __m256 acc6 = _mm256_loadu_ps(out + 6 * BCNN_BLOCK);
+    __m256 acc7 = _mm256_loadu_ps(out + 7 * BCNN_BLOCK);
+    __m256 wv;
+
+    for (cb = 0; cb < num_cb; ++cb) {
+        for (ky = 0; ky < k; ++ky) {
+            iy = oy * layer->stride - layer->pad + ky;
+            if (iy < 0 || iy >= h) {
+                continue;
+            }
+            for (kx = 0; kx < k; ++kx) {
+                p = in + ((cb * h + iy) * w + ox * layer->stride - layer->pad +
+                          kx) *
+                             BCNN_BLOCK;
+                q = wb + ((cb * k + ky) * k + kx) * BCNN_BLOCK * BCNN_BLOCK;
+                for (ic = 0; ic < BCNN_BLOCK; ++ic) {
+                    wv = _mm256_load_ps(q);
+                    acc0 = _mm256_add_ps(
+                        acc0, _mm256_mul_ps(_mm256_broadcast_ss(p), wv));
+                    acc1 = _mm256_add_ps(
+                        acc1, _mm256_mul_ps(_mm256_broadcast_ss(p + s), wv));
+                    acc2 = _mm256_add_ps(
+                        acc2,
+                        _mm256_mul_ps(_mm256_broadcast_ss(p + 2 * s), wv));
+                    acc3 = _mm256_add_ps(
+                        acc3,
+                        _mm256_mul_ps(_mm256_broadcast_ss(p + 3 * s), wv));
+                    acc4 = _mm256_add_ps(
+                        acc4,
+                        _mm256_mul_ps(_mm256_broadcast_ss(p + 4 * s), wv));
+                    acc5 = _mm256_add_ps(
+                        acc5,
+                        _mm256_mul_ps(_mm256_broadcast_ss(p + 5 * s), wv));
+                    acc6 = _mm256_add_ps(
+                        acc6,
+                        _mm256_mul_ps(_mm256_broadcast_ss(p + 6 * s), wv));
+                    acc7 = _mm256_add_ps(
+                        acc7,
+                        _mm256_mul_ps(_mm256_broadcast_ss(p + 7 * s), wv));
+                    p++;
+                    q += BCNN_BLOCK;
+                }
+            }
+        }
+    }
+    _mm256_storeu_ps(out, acc0);
+    _mm256_storeu_ps(out + BCNN_BLOCK, acc1);
+    _mm256_storeu_ps(out + 2 * BCNN_BLOCK, acc2);
+    _mm256_storeu_ps(out + 3 * BCNN_BLOCK, acc3);
+    _mm256_storeu_ps(out + 4 * BCNN_BLOCK, acc4);
+    _mm256_storeu_ps(out + 5 * BCNN_BLOCK, acc5);
+    _mm256_storeu_ps(out + 6 * BCNN_BLOCK, acc6);
+    _mm256_storeu_ps(out + 7 * BCNN_BLOCK, acc7);
+}
+#endif
+
+/* Direct convolution. An output row of a block of output channels is
+ * accumulated over a few blocks of input channels at a time, so that the
+ * weights and input rows being used stay in cache whatever the number of
+ * channels. */
+static void bcnn_forward_blocked_conv(bcnn_layer *layer, bcnn_tensor *src,
+                                      const float *in, bcnn_tensor *dst,
+                                      float *out) {
+    int num_cb = src->c / BCNN_BLOCK, num_ob = dst->c / BCNN_BLOCK;
+    int k2 = layer->size * layer->size;
+    int in_size = src->h * src->w * BCNN_BLOCK;
+    // About 16KB of weights per pass
+    int cb_step = bh_max(1, 64 / k2);
+    int b, ob, oy, ox, cb, ncb;
+    const float *pin = NULL, *wb = NULL;
+    float *pout = NULL;
+#ifdef BCNN_USE_AVX
+    // Output columns whose receptive field does not cross the image borders
+    int x0 = (layer->pad + layer->stride - 1) / layer->stride;
+    int x1 = (src->w + layer->pad - layer->size) / layer->stride + 1;
+#endif
+
+    for (b = 0; b < src->n; ++b) {
+        for (ob = 0; ob < num_ob; ++ob) {
+            for (oy = 0; oy < dst->h; ++oy) {
+                pout = out + (((b * num_ob + ob) * dst->h + oy) * dst->w) *
+                                 BCNN_BLOCK;
+                for (ox = 0; ox < dst->w; ++ox) {
+                    memcpy(pout + ox * BCNN_BLOCK,
+                           layer->biases.data + ob * BCNN_BLOCK,
+                           BCNN_BLOCK * sizeof(float));
+                }
+                for (cb = 0; cb < num_cb; cb += cb_step) {
+                    ncb = bh_min(cb_step, num_cb - cb);
+                    pin = in + (b * num_cb + cb) * in_size;
+                    wb = layer->weights_blocked +
+                         (ob * num_cb + cb) * k2 * BCNN_BLOCK * BCNN_BLOCK;
+                    for (ox = 0; ox < dst->w; ++ox) {
+#ifdef BCNN_USE_AVX
+                        if (ox >= x0 && ox + BCNN_CONV_TILE <= x1) {
+                            bcnn_blocked_conv_tile(
+                                layer, pin, ncb, src->h, src->w, wb, oy, ox,
+                                pout + ox * BCNN_BLOCK);
+                            ox += BCNN_CONV_TILE - 1;
+                            continue;
+                        }
+#endif
+                        bcnn_blocked_conv_pixel(layer, pin, ncb, src->h,
+                                                src->w, wb, oy, ox,
+                                                pout + ox * BCNN_BLOCK);
+                    }
+                }
+            }
+        }
+    }
+    bcnn_forward_activation_cpu(out, bcnn_tensor_get_size(dst),
+                                layer->activation);
+}
+
+static void bcnn_forward_blocked_depthwise(bcnn_layer *layer,
+                                           bcnn_tensor *src, const float *in,
+                                           bcnn_tensor *dst, float *out) {
+    int k = layer->size;
+    int num_cb = dst->n * dst->c / BCNN_BLOCK;
+    int cb, oy, ox, ky, kx, iy, ix;
+    const float *p = NULL, *q = NULL, *bias = NULL;
+    float *p_out = out;
+#ifdef BCNN_USE_AVX
+    __m256 acc;
+#else
+    int l;
+    float acc[BCNN_BLOCK];
+#endif
+
+    // Batch and channel blocks are walked together, the weights of a block
+    // being those of its channels
+    for (cb = 0; cb < num_cb; ++cb) {
+        q = layer->weights_blocked +
+            (cb % (dst->c / BCNN_BLOCK)) * k * k * BCNN_BLOCK;
+        bias = layer->biases.data + (cb % (dst->c / BCNN_BLOCK)) * BCNN_BLOCK;
+        for (oy = 0; oy < dst->h; ++oy) {
+            for (ox = 0; ox < dst->w; ++ox) {
+#ifdef BCNN_USE_AVX
+                acc = _mm256_setzero_ps();
+#else
+                for (l = 0; l < BCNN_BLOCK; ++l) {
+                    acc[l] = 0.0f;
+                }
+#endif
+                for (ky = 0; ky < k; ++ky) {
+                    iy = oy * layer->stride - layer->pad + ky;
+                    if (iy < 0 || iy >= src->h) {
+                        continue;
+                    }
+                    for (kx = 0; kx < k; ++kx) {
+                        ix = ox * layer->stride - layer->pad + kx;
+                        if (ix < 0 || ix >= src->w) {
+                            continue;
+                        }
+                        p = in + ((cb * src->h + iy) * src->w + ix) *
+                                     BCNN_BLOCK;
+#ifdef BCNN_USE_AVX
+                        acc = _mm256_add_ps(
+                            acc, _mm256_mul_ps(
+                                     _mm256_loadu_ps(p),
+                                     _mm256_load_ps(
+                                         q + (ky * k + kx) * BCNN_BLOCK)));
+#else
+                        for (l = 0; l < BCNN_BLOCK; ++l) {
+                            acc[l] += p[l] * q[(ky * k + kx) * BCNN_BLOCK + l];
+                        }
+#endif
+                    }
+                }
+#ifdef BCNN_USE_AVX
+                _mm256_storeu_ps(p_out,
+                                 _mm256_add_ps(acc, _mm256_loadu_ps(bias)));
+                p_out += BCNN_BLOCK;
+#else
+                for (l = 0; l < BCNN_BLOCK; ++l) {
+                    *p_out++ = acc[l] + bias[l];
+                }
+#endif
+            }
+        }
+    }
+    bcnn_forward_activation_cpu(out, bcnn_tensor_get_size(dst),
+                                layer->activation);
+}
+
+static void bcnn_forward_blocked_maxpool(bcnn_layer *layer, bcnn_tensor *src,
+                                         const float *in, bcnn_tensor *dst,
+                                         float *out) {
+    int num_cb = dst->n * dst->c / BCNN_BLOCK;
+    int cb, oy, ox, ky, kx, iy, ix;
+    const float *p = NULL;
+#ifdef BCNN_USE_AVX
+    __m256 m;
+#else
+    int l;
+    float m[BCNN_BLOCK];
+#endif
+
+    for (cb = 0; cb < num_cb; ++cb) {
+        for (oy = 0; oy < dst->h; ++oy) {
+            for (ox = 0; ox < dst->w; ++ox) {
+#ifdef BCNN_USE_AVX
+                m = _mm256_set1_ps(-FLT_MAX);
+#else
+                for (l = 0; l < BCNN_BLOCK; ++l) {
+                    m[l] = -FLT_MAX;
+                }
+#endif
+                // The last windows may go past the image, without padding
+                for (ky = 0; ky < layer->size; ++ky) {
+                    iy = oy * layer->stride + ky;
+                    for (kx = 0; kx < layer->size && iy < src->h; ++kx) {
+                        ix = ox * layer->stride + kx;
+                        if (ix >= src->w) {
+                            break;
+                        }
+                        p = in + ((cb * src->h + iy) * src->w + ix) *
+                                     BCNN_BLOCK;
+#ifdef BCNN_USE_AVX
+                        m = _mm256_max_ps(m, _mm256_loadu_ps(p));
+#else
+                        for (l = 0; l < BCNN_BLOCK; ++l) {
+                            m[l] = (p[l] > m[l] ? p[l] : m[l]);
+                        }
+#endif
+                    }
+                }
+#ifdef BCNN_USE_AVX
+                _mm256_storeu_ps(out, m);
+                out += BCNN_BLOCK;
+#else
+                for (l = 0; l < BCNN_BLOCK; ++l) {
+                    *out++ = m[l];
+                }
+#endif
+            }
+        }
+    }
+}
+
+// Per-channel 'x = (x - mean[c]) / den[c]', or a PReLU if slope is set, on
+// the 'hw' pixels of one block of channels
+static void bcnn_blocked_channelwise(float *x, int hw, const float *mean,
+                                     const float *den, const float *slope) {
+    int i;
+#ifdef BCNN_USE_AVX
+    __m256 v, a, b, zero = _mm256_setzero_ps();
+
+    if (slope != NULL) {
+        a = _mm256_loadu_ps(slope);
+        for (i = 0; i < hw; ++i) {
+            v = _mm256_loadu_ps(x + i * BCNN_BLOCK);
+            v = _mm256_blendv_ps(_mm256_mul_ps(a, v), v,
+                                 _mm256_cmp_ps(v, zero, _CMP_GT_OQ));
+            _mm256_storeu_ps(x + i * BCNN_BLOCK, v);
+        }
+    } else {
+        a = _mm256_loadu_ps(mean);
+        b = _mm256_loadu_ps(den);
+        for (i = 0; i < hw; ++i) {
+            v = _mm256_loadu_ps(x + i * BCNN_BLOCK);
+            v = _mm256_div_ps(_mm256_sub_ps(v, a), b);
+            _mm256_storeu_ps(x + i * BCNN_BLOCK, v);
+        }
+    }
+#else
+    int l;
+
+    for (i = 0; i < hw; ++i) {
+        for (l = 0; l < BCNN_BLOCK; ++l) {
+            if (slope != NULL) {
+                x[l] = (x[l] > 0 ? x[l] : slope[l] * x[l]);
+            } else {
+                x[l] = (x[l] - mean[l]) / den[l];
+            }
+        }
+        x += BCNN_BLOCK;
+    }
+#endif
+}
+
+// Batchnorm with the global statistics, same expression as the planar layer.
+// 'den' is computed at plan time.
+static void bcnn_forward_blocked_batchnorm(bcnn_layer *layer, const float *den,
+                                           const float *in, bcnn_tensor *dst,
+                                           float *out) {
+    int hw = dst->h * dst->w, num_cb = dst->c / BCNN_BLOCK;
+    int b, cb;
+
+    if (out != in) {
+        memcpy(out, in, bcnn_tensor_get_size(dst) * sizeof(float));
+    }
+    for (b = 0; b < dst->n; ++b) {
+        for (cb = 0; cb < num_cb; ++cb) {
+            bcnn_blocked_channelwise(
+                out + (b * num_cb + cb) * hw * BCNN_BLOCK, hw,
+                layer->running_mean.data + cb * BCNN_BLOCK,
+                den + cb * BCNN_BLOCK, NULL);
+        }
+    }
+}
+
+static void bcnn_forward_blocked_activation(bcnn_layer *layer,
+                                            bcnn_tensor *dst, float *x) {
+    int hw = dst->h * dst->w, num_cb = dst->c / BCNN_BLOCK;
+    int b, cb;
+
+    if (layer->activation != PRELU) {
+        // Elementwise, whatever the layout
+        bcnn_forward_activation_cpu(x, bcnn_tensor_get_size(dst),
+                                    layer->activation);
+        return;
+    }
+    for (b = 0; b < dst->n; ++b) {
+        for (cb = 0; cb < num_cb; ++cb) {
+            bcnn_blocked_channelwise(x + (b * num_cb + cb) * hw * BCNN_BLOCK,
+                                     hw, NULL, NULL,
+                                     layer->weights.data + cb * BCNN_BLOCK);
+        }
+    }
+}
+
+int bcnn_forward_blocked_connection(bcnn_net *net, int i) {
+    bcnn_layout *layout = net->layout;
+    bcnn_connection *conn = &net->connections[i];
+    bcnn_layer *layer = conn->layer;
+    int src = conn->src[0], dst = conn->dst[0];
+    bcnn_tensor *ts = &net->nodes[src].tensor;
+    bcnn_tensor *td = &net->nodes[dst].tensor;
+    float *in = ts->data, *out = td->data;
+
+    if (!layout->node_blocked[src]) {
+        bcnn_layout_to_blocked(ts->data, ts->n, ts->c, ts->h * ts->w,
+                               layout->src_buf[i]);
+        in = layout->src_buf[i];
+    }
+    if (!layout->node_blocked[dst]) {
+        out = layout->dst_buf[i];
+    }
+    switch (layer->type) {
+        case CONVOLUTIONAL:
+            bcnn_forward_blocked_conv(layer, ts, in, td, out);
+            break;
+        case DEPTHWISE_CONV:
+            bcnn_forward_blocked_depthwise(layer, ts, in, td, out);
+            break;
+        case MAXPOOL:
+            bcnn_forward_blocked_maxpool(layer, ts, in, td, out);
+            break;
+        case BATCHNORM:
+            bcnn_forward_blocked_batchnorm(layer, layout->bn_den[i], in, td,
+                                           out);
+            break;
+        default:
+            // Activations work in-place and dropout is the identity in
+            // predict mode
+            if (out != in) {
+                memcpy(out, in, bcnn_tensor_get_size(td) * sizeof(float));
+            }
+            if (layer->type == ACTIVATION) {
+                bcnn_forward_blocked_activation(layer, td, out);
+            }
+            break;
+    }
+    if (!layout->node_blocked[dst]) {
+        bcnn_layout_to_planar(out, td->n, td->c, td->h * td->w, td->data);
+    }
+    return BCNN_SUCCESS;
+}
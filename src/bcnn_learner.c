@@ -32,9 +32,17 @@
 
 #include "bcnn/bcnn.h"
 #include "bcnn_mat.h"
+#include "bcnn_thread.h"
+#include "bh_log.h"
+
+/* Number of samples contributing to the gradients of an update */
+static int bcnn_effective_batch_size(bcnn_net *net) {
+    return net->batch_size * bh_max(net->accumulation_steps, 1) *
+           bh_max(net->num_replicas, 1);
+}
 
 static float bcnn_update_learning_rate(bcnn_net *net) {
-    int iter = net->seen / net->batch_size;
+    int iter = net->seen / bcnn_effective_batch_size(net);
 
     switch (net->learner.policy) {
         case CONSTANT:
@@ -62,6 +70,69 @@ static float bcnn_update_learning_rate(bcnn_net *net) {
     }
 }
 
+/* Single pass sgd step: weight decay, update and momentum scaling of the
+ * gradient, which then holds the contribution of the previous steps for the
+ * next one. */
+static void bcnn_sgd_step(int n, float *w, float *g, float decay, float lr,
+                          float momentum) {
+    int i = 0;
+#ifdef BCNN_USE_AVX
+    __m256 vdecay = _mm256_set1_ps(decay);
+    __m256 vlr = _mm256_set1_ps(lr);
+    __m256 vmomentum = _mm256_set1_ps(momentum);
+    for (; i < n - 7; i += 8) {
+        __m256 vw = _mm256_loadu_ps(w + i);
+        __m256 vg = _mm256_add_ps(_mm256_loadu_ps(g + i),
+                                  _mm256_mul_ps(vdecay, vw));
+        vw = _mm256_add_ps(vw, _mm256_mul_ps(vlr, vg));
+        _mm256_storeu_ps(w + i, vw);
+        _mm256_storeu_ps(g + i, _mm256_mul_ps(vmomentum, vg));
+    }
+#endif
+    for (; i < n; ++i) {
+        float gi = g[i] + decay * w[i];
+        w[i] += lr * gi;
+        g[i] = momentum * gi;
+    }
+}
+
+/* Single pass adam step. The gradient is reset for the next step. */
+static void bcnn_adam_step(int n, float *w, float *g, float *m, float *v,
+                           float decay, float lr, float beta1, float beta2) {
+    int i = 0;
+#ifdef BCNN_USE_AVX
+    __m256 vdecay = _mm256_set1_ps(decay);
+    __m256 vlr = _mm256_set1_ps(lr);
+    __m256 vb1 = _mm256_set1_ps(beta1);
+    __m256 vb1c = _mm256_set1_ps(1.0f - beta1);
+    __m256 vb2 = _mm256_set1_ps(beta2);
+    __m256 vb2c = _mm256_set1_ps(1.0f - beta2);
+    __m256 veps = _mm256_set1_ps(0.0000001f);
+    __m256 vzero = _mm256_setzero_ps();
+    for (; i < n - 7; i += 8) {
+        __m256 vw = _mm256_loadu_ps(w + i);
+        __m256 vg = _mm256_add_ps(_mm256_loadu_ps(g + i),
+                                  _mm256_mul_ps(vdecay, vw));
+        __m256 vm = _mm256_add_ps(_mm256_mul_ps(vb1c, vg),
+                                  _mm256_mul_ps(vb1, _mm256_loadu_ps(m + i)));
+        __m256 vv = _mm256_add_ps(_mm256_mul_ps(vb2c, _mm256_mul_ps(vg, vg)),
+                                  _mm256_mul_ps(vb2, _mm256_loadu_ps(v + i)));
+        __m256 vd = _mm256_div_ps(vm, _mm256_add_ps(_mm256_sqrt_ps(vv), veps));
+        _mm256_storeu_ps(m + i, vm);
+        _mm256_storeu_ps(v + i, vv);
+        _mm256_storeu_ps(w + i, _mm256_add_ps(vw, _mm256_mul_ps(vlr, vd)));
+        _mm256_storeu_ps(g + i, vzero);
+    }
+#endif
+    for (; i < n; ++i) {
+        float gi = g[i] + decay * w[i];
+        m[i] = (1.0f - beta1) * gi + beta1 * m[i];
+        v[i] = (1.0f - beta2) * (gi * gi) + beta2 * v[i];
+        w[i] += lr * (m[i] / (sqrtf(v[i]) + 0.0000001f));
+        g[i] = 0.0f;
+    }
+}
+
 int bcnn_sgd_optimizer(bcnn_connection *conn, int batch_size,
                        float learning_rate, float momentum, float decay) {
     bcnn_layer *layer = conn->layer;
@@ -85,16 +156,13 @@ int bcnn_sgd_optimizer(bcnn_connection *conn, int batch_size,
     }
 #else
     if (layer->biases.data && layer->biases.grad_data) {
-        bcnn_axpy(biases_size, -learning_rate / batch_size,
-                  layer->biases.grad_data, layer->biases.data);
-        bcnn_scal(biases_size, momentum, layer->biases.grad_data);
+        bcnn_sgd_step(biases_size, layer->biases.data, layer->biases.grad_data,
+                      0.0f, -learning_rate / batch_size, momentum);
     }
     if (layer->weights.data && layer->weights.grad_data) {
-        bcnn_axpy(weights_size, decay * batch_size, layer->weights.data,
-                  layer->weights.grad_data);
-        bcnn_axpy(weights_size, -learning_rate / batch_size,
-                  layer->weights.grad_data, layer->weights.data);
-        bcnn_scal(weights_size, momentum, layer->weights.grad_data);
+        bcnn_sgd_step(weights_size, layer->weights.data,
+                      layer->weights.grad_data, decay * batch_size,
+                      -learning_rate / batch_size, momentum);
     }
 #endif
     return 0;
@@ -140,62 +208,196 @@ int bcnn_adam_optimizer(bcnn_connection *conn, int iter, int batch_size,
     }
 #else
     if (layer->biases.data && layer->biases.grad_data) {
-        bcnn_axpy(biases_size, -learning_rate / batch_size,
-                  layer->biases.grad_data, layer->biases.data);
-        bcnn_scal(biases_size, momentum, layer->biases.grad_data);
+        bcnn_sgd_step(biases_size, layer->biases.data, layer->biases.grad_data,
+                      0.0f, -learning_rate / batch_size, momentum);
     }
-
     if (layer->weights.data && layer->weights.grad_data) {
-        bcnn_axpy(weights_size, decay * batch_size, layer->weights.data,
-                  layer->weights.grad_data);
-        bcnn_axpby(weights_size, 1.0f - beta1, layer->weights.grad_data, beta1,
-                   layer->adam_m);
-        bcnn_vmul(weights_size, layer->weights.grad_data,
-                  layer->weights.grad_data, layer->weights.grad_data);
-        bcnn_axpby(weights_size, 1.0f - beta2, layer->weights.grad_data, beta2,
-                   layer->adam_v);
-        bcnn_pow(weights_size, layer->adam_v, 0.5f, layer->weights.grad_data);
-        bcnn_add_scalar(weights_size, 0.0000001f, layer->weights.grad_data);
-        bcnn_vdiv(weights_size, layer->adam_m, layer->weights.grad_data,
-                  layer->weights.grad_data);
-        bcnn_axpy(weights_size, -learning_rate / batch_size * mu_correction,
-                  layer->weights.grad_data, layer->weights.data);
-        memset(layer->weights.grad_data, 0, weights_size * sizeof(float));
+        bcnn_adam_step(weights_size, layer->weights.data,
+                       layer->weights.grad_data, layer->adam_m, layer->adam_v,
+                       decay * batch_size,
+                       -learning_rate / batch_size * mu_correction, beta1,
+                       beta2);
     }
 #endif
     return 0;
 }
 
+static int bcnn_has_params(bcnn_layer *layer) {
+    return (layer->type == CONVOLUTIONAL || layer->type == DECONVOLUTIONAL ||
+            layer->type == DEPTHWISE_CONV || layer->type == FULL_CONNECTED ||
+            (layer->type == ACTIVATION && layer->activation == PRELU));
+}
+
+static void bcnn_update_connection(bcnn_net *net, bcnn_connection *conn,
+                                   float lr, int batch_size, int iter) {
+    if (!bcnn_has_params(conn->layer)) {
+        return;
+    }
+    if (net->learner.optimizer == SGD) {
+        bcnn_sgd_optimizer(conn, batch_size, lr, net->learner.momentum,
+                           net->learner.decay);
+    } else if (net->learner.optimizer == ADAM) {
+        bcnn_adam_optimizer(conn, iter, batch_size, net->learner.beta1,
+                            net->learner.beta2, lr, net->learner.momentum,
+                            net->learner.decay);
+    }
+}
+
 int bcnn_update(bcnn_net *net) {
     int i;
     float lr = bcnn_update_learning_rate(net);
-    bcnn_layer_type type;
+    int batch_size = bcnn_effective_batch_size(net);
 
-    if (net->learner.optimizer == SGD) {
-        for (i = 0; i < net->nb_connections; ++i) {
-            type = net->connections[i].layer->type;
-            if ((type == CONVOLUTIONAL || type == DECONVOLUTIONAL ||
-                 type == DEPTHWISE_CONV || type == FULL_CONNECTED ||
-                 (type == ACTIVATION &&
-                  net->connections[i].layer->activation == PRELU))) {
-                bcnn_sgd_optimizer(&net->connections[i], net->batch_size, lr,
-                                   net->learner.momentum, net->learner.decay);
-            }
+    for (i = 0; i < net->nb_connections; ++i) {
+        bcnn_update_connection(net, &net->connections[i], lr, batch_size,
+                               net->seen);
+    }
+
+    return BCNN_SUCCESS;
+}
+
+/**
+ * Update worker.
+ *
+ * During the backward pass of the last micro-batch, each connection is queued
+ * as soon as its backward is done, its gradients being final, and updated by
+ * the worker thread while the backward pass goes on with the previous
+ * connections. A connection is only read again by the next forward pass, so
+ * that no other synchronization than waiting for the queue to be drained is
+ * needed.
+ */
+struct bcnn_updater {
+    bcnn_net *net;
+    bcnn_thread thread;
+    bcnn_mutex mutex;
+    bcnn_cond cond_work;  // Connections have been queued or stop requested
+    bcnn_cond cond_done;  // All the queued connections have been updated
+    int *queue;
+    int head;
+    int tail;
+    int stop;
+    int active;  // Set between bcnn_update_async_begin / end
+    float lr;
+    int batch_size;
+    int iter;
+};
+
+static void *bcnn_updater_run(void *arg) {
+    bcnn_updater *u = (bcnn_updater *)arg;
+    int i;
+
+    bcnn_mutex_lock(&u->mutex);
+    for (;;) {
+        while (!u->stop && u->head == u->tail) {
+            bcnn_cond_wait(&u->cond_work, &u->mutex);
         }
-    } else if (net->learner.optimizer == ADAM) {
-        for (i = 0; i < net->nb_connections; ++i) {
-            type = net->connections[i].layer->type;
-            if ((type == CONVOLUTIONAL || type == DECONVOLUTIONAL ||
-                 type == DEPTHWISE_CONV || type == FULL_CONNECTED ||
-                 (type == ACTIVATION &&
-                  net->connections[i].layer->activation == PRELU))) {
-                bcnn_adam_optimizer(&net->connections[i], net->seen,
-                                    net->batch_size, net->learner.beta1,
-                                    net->learner.beta2, lr,
-                                    net->learner.momentum, net->learner.decay);
-            }
+        if (u->head == u->tail) {
+            break;
         }
+        i = u->queue[u->head];
+        bcnn_mutex_unlock(&u->mutex);
+        bcnn_update_connection(u->net, &u->net->connections[i], u->lr,
+                               u->batch_size, u->iter);
+        bcnn_mutex_lock(&u->mutex);
+        // The slot is released once the connection is updated
+        u->head++;
+        if (u->head == u->tail) {
+            bcnn_cond_signal(&u->cond_done);
+        }
+    }
+    bcnn_mutex_unlock(&u->mutex);
+    return NULL;
+}
+
+static bcnn_updater *bcnn_updater_create(bcnn_net *net) {
+    bcnn_updater *u = (bcnn_updater *)calloc(1, sizeof(bcnn_updater));
+
+    u->net = net;
+    u->queue = (int *)calloc(net->nb_connections, sizeof(int));
+    bcnn_mutex_init(&u->mutex);
+    bcnn_cond_init(&u->cond_work);
+    bcnn_cond_init(&u->cond_done);
+    if (bcnn_thread_create(&u->thread, bcnn_updater_run, u) != 0) {
+        bh_log_warning("Could not start the update worker");
+        bcnn_cond_destroy(&u->cond_work);
+        bcnn_cond_destroy(&u->cond_done);
+        bcnn_mutex_destroy(&u->mutex);
+        bh_free(u->queue);
+        bh_free(u);
+        return NULL;
     }
+    return u;
+}
+
+void bcnn_free_updater(bcnn_net *net) {
+    bcnn_updater *u = net->updater;
+
+    if (u == NULL) {
+        return;
+    }
+    bcnn_mutex_lock(&u->mutex);
+    u->stop = 1;
+    bcnn_cond_signal(&u->cond_work);
+    bcnn_mutex_unlock(&u->mutex);
+    bcnn_thread_join(u->thread);
+    bcnn_cond_destroy(&u->cond_work);
+    bcnn_cond_destroy(&u->cond_done);
+    bcnn_mutex_destroy(&u->mutex);
+    bh_free(u->queue);
+    bh_free(u);
+    net->updater = NULL;
+}
+
+int bcnn_update_async_begin(bcnn_net *net) {
+#ifdef BCNN_USE_CUDA
+    // Update kernels would be serialized with the backward ones on the stream
+    return BCNN_INVALID_PARAMETER;
+#else
+    bcnn_updater *u = NULL;
 
+    if (net->updater == NULL) {
+        net->updater = bcnn_updater_create(net);
+        if (net->updater == NULL) {
+            return BCNN_INTERNAL_ERROR;
+        }
+    }
+    u = net->updater;
+    bcnn_mutex_lock(&u->mutex);
+    u->lr = bcnn_update_learning_rate(net);
+    u->batch_size = bcnn_effective_batch_size(net);
+    u->iter = net->seen;
+    u->head = 0;
+    u->tail = 0;
+    bcnn_mutex_unlock(&u->mutex);
+    u->active = 1;
+    return BCNN_SUCCESS;
+#endif
+}
+
+void bcnn_update_async_push(bcnn_net *net, int conn) {
+    bcnn_updater *u = net->updater;
+
+    if (u == NULL || !u->active ||
+        !bcnn_has_params(net->connections[conn].layer)) {
+        return;
+    }
+    bcnn_mutex_lock(&u->mutex);
+    u->queue[u->tail++] = conn;
+    bcnn_cond_signal(&u->cond_work);
+    bcnn_mutex_unlock(&u->mutex);
+}
+
+int bcnn_update_async_end(bcnn_net *net) {
+    bcnn_updater *u = net->updater;
+
+    if (u == NULL || !u->active) {
+        return BCNN_SUCCESS;
+    }
+    bcnn_mutex_lock(&u->mutex);
+    while (u->head != u->tail) {
+        bcnn_cond_wait(&u->cond_done, &u->mutex);
+    }
+    u->active = 0;
+    bcnn_mutex_unlock(&u->mutex);
     return BCNN_SUCCESS;
-}
\ No newline at end of file
+}
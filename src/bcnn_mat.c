@@ -27,6 +27,8 @@
 #include <bh/bh_mem.h>
 
 #include "bcnn/bcnn.h"
+#include "bcnn_thread.h"
+#include "bh_log.h"
 
 int bcnn_fill_f32(int n, float a, float *x) {
     int i;
@@ -41,6 +43,109 @@ int bcnn_copy_f32(int n, float *x, float *y) {
     return 0;
 }
 
+#ifndef BCNN_USE_AVX
+static float bcnn_half_to_float(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t bits;
+    float f;
+
+    if (exp == 0x1f) {  // Inf / NaN
+        bits = sign | 0x7f800000 | (mant << 13);
+    } else if (exp != 0) {  // Normalized
+        bits = sign | ((exp + 112) << 23) | (mant << 13);
+    } else if (mant != 0) {  // Subnormal
+        exp = 113;
+        while ((mant & 0x400) == 0) {
+            mant <<= 1;
+            exp--;
+        }
+        bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+    } else {
+        bits = sign;
+    }
+    memcpy(&f, &bits, sizeof(float));
+    return f;
+}
+
+static uint16_t bcnn_float_to_half(float f) {
+    uint32_t bits, sign, mant;
+    int exp;
+
+    memcpy(&bits, &f, sizeof(float));
+    sign = (bits >> 16) & 0x8000;
+    exp = (int)((bits >> 23) & 0xff) - 127 + 15;
+    mant = bits & 0x7fffff;
+
+    if (((bits >> 23) & 0xff) == 0xff) {  // Inf / NaN
+        return (uint16_t)(sign | 0x7c00 | (mant ? 0x200 : 0));
+    }
+    if (exp >= 0x1f) {  // Overflow
+        return (uint16_t)(sign | 0x7c00);
+    }
+    if (exp <= 0) {  // Subnormal or zero
+        if (exp < -10) {
+            return (uint16_t)sign;
+        }
+        mant |= 0x800000;
+        // Round to nearest even
+        uint32_t shift = 14 - exp;
+        uint32_t half_mant = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1);
+        uint32_t mid = 1u << (shift - 1);
+        if (rem > mid || (rem == mid && (half_mant & 1))) {
+            half_mant++;
+        }
+        return (uint16_t)(sign | half_mant);
+    }
+    // Round to nearest even, a carry propagates into the exponent
+    bits = ((uint32_t)exp << 10) | (mant >> 13);
+    if ((mant & 0x1fff) > 0x1000 ||
+        ((mant & 0x1fff) == 0x1000 && (bits & 1))) {
+        bits++;
+    }
+    return (uint16_t)(sign | bits);
+}
+#endif
+
+int bcnn_f32_to_f16(int n, float *x, uint16_t *y) {
+    int i = 0;
+#ifdef BCNN_USE_AVX
+    for (; i < n - 7; i += 8) {
+        _mm_storeu_si128(
+            (__m128i *)(y + i),
+            _mm256_cvtps_ph(_mm256_loadu_ps(x + i), _MM_FROUND_TO_NEAREST_INT));
+    }
+    for (; i < n; ++i) {
+        y[i] = _cvtss_sh(x[i], _MM_FROUND_TO_NEAREST_INT);
+    }
+#else
+    for (; i < n; ++i) {
+        y[i] = bcnn_float_to_half(x[i]);
+    }
+#endif
+    return 0;
+}
+
+int bcnn_f16_to_f32(int n, uint16_t *x, float *y) {
+    int i = 0;
+#ifdef BCNN_USE_AVX
+    for (; i < n - 7; i += 8) {
+        _mm256_storeu_ps(
+            y + i, _mm256_cvtph_ps(_mm_loadu_si128((__m128i *)(x + i))));
+    }
+    for (; i < n; ++i) {
+        y[i] = _cvtsh_ss(x[i]);
+    }
+#else
+    for (; i < n; ++i) {
+        y[i] = bcnn_half_to_float(x[i]);
+    }
+#endif
+    return 0;
+}
+
 int bcnn_axpy(int n, float a, float *x, float *y) {
 #ifndef BCNN_USE_AVX
     int i;
@@ -519,6 +624,106 @@ int bcnn_gemv(int trans_a, int m, int n, float alpha, float *a, float *x,
     return 0;
 }
 
+static inline float bcnn_gemv_weight(const float *w, const uint16_t *w_f16,
+                                     int i) {
+#ifdef BCNN_USE_AVX
+    return (w != NULL ? w[i] : _cvtsh_ss(w_f16[i]));
+#else
+    return (w != NULL ? w[i] : bcnn_half_to_float(w_f16[i]));
+#endif
+}
+
+#ifdef BCNN_USE_AVX
+static inline __m256 bcnn_gemv_load8(const float *w, const uint16_t *w_f16,
+                                     int i) {
+    if (w != NULL) {
+        return _mm256_loadu_ps(w + i);
+    }
+    return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(w_f16 + i)));
+}
+
+static inline float bcnn_hsum8(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v),
+                          _mm256_extractf128_ps(v, 1));
+    s = _mm_hadd_ps(s, s);
+    s = _mm_hadd_ps(s, s);
+    return _mm_cvtss_f32(s);
+}
+#endif
+
+// dot[b] = x[b] . w for nb <= 4 vectors, each row of w being loaded once for
+// all of them
+static inline void bcnn_gemv_dot(const int nb, int k, const float *x, int ldx,
+                                 const float *w, const uint16_t *w_f16,
+                                 float *dot) {
+    int b, i = 0;
+    float wi;
+#ifdef BCNN_USE_AVX
+    __m256 acc0[4], acc1[4], w0, w1;
+
+    for (b = 0; b < nb; ++b) {
+        acc0[b] = _mm256_setzero_ps();
+        acc1[b] = _mm256_setzero_ps();
+    }
+    // Two independent sums per vector to hide the latency of the additions
+    for (; i < k - 15; i += 16) {
+        w0 = bcnn_gemv_load8(w, w_f16, i);
+        w1 = bcnn_gemv_load8(w, w_f16, i + 8);
+        for (b = 0; b < nb; ++b) {
+            acc0[b] = _mm256_add_ps(
+                acc0[b], _mm256_mul_ps(w0, _mm256_loadu_ps(x + b * ldx + i)));
+            acc1[b] = _mm256_add_ps(
+                acc1[b],
+                _mm256_mul_ps(w1, _mm256_loadu_ps(x + b * ldx + i + 8)));
+        }
+    }
+    for (; i < k - 7; i += 8) {
+        w0 = bcnn_gemv_load8(w, w_f16, i);
+        for (b = 0; b < nb; ++b) {
+            acc0[b] = _mm256_add_ps(
+                acc0[b], _mm256_mul_ps(w0, _mm256_loadu_ps(x + b * ldx + i)));
+        }
+    }
+    for (b = 0; b < nb; ++b) {
+        dot[b] = bcnn_hsum8(_mm256_add_ps(acc0[b], acc1[b]));
+    }
+#else
+    for (b = 0; b < nb; ++b) {
+        dot[b] = 0.0f;
+    }
+#endif
+    for (; i < k; ++i) {
+        wi = bcnn_gemv_weight(w, w_f16, i);
+        for (b = 0; b < nb; ++b) {
+            dot[b] += wi * x[b * ldx + i];
+        }
+    }
+}
+
+int bcnn_gemv_batch(int batch, int n, int k, float alpha, float *x, int ldx,
+                    float *w, uint16_t *w_f16, int ldw, float beta, float *y,
+                    int ldy) {
+    int j, b, i, nb;
+    float dot[4];
+    float *wj = NULL, *yb = NULL;
+    uint16_t *wj_f16 = NULL;
+
+    for (j = 0; j < n; ++j) {
+        wj = (w != NULL ? w + j * ldw : NULL);
+        wj_f16 = (w != NULL ? NULL : w_f16 + j * ldw);
+        // The row stays in cache for the following groups of vectors
+        for (b = 0; b < batch; b += 4) {
+            nb = bh_min(batch - b, 4);
+            bcnn_gemv_dot(nb, k, x + b * ldx, ldx, wj, wj_f16, dot);
+            for (i = 0; i < nb; ++i) {
+                yb = y + (b + i) * ldy + j;
+                *yb = alpha * dot[i] + (beta != 0.0f ? beta * *yb : 0.0f);
+            }
+        }
+    }
+    return 0;
+}
+
 float bcnn_l2_distance(float *x, float *y, int n) {
     float dist = 0.0f;
     int i;
@@ -856,10 +1061,44 @@ void bcnn_col2im(const float *data_col, const int channels, const int height,
 #define MR 8
 #define NR 8
 
-float A_[MC * KC] __attribute__((aligned(32)));
-float B_[KC * NC] __attribute__((aligned(32)));
-float C_[MR * NR] __attribute__((aligned(32)));
-float AB_[MR * NR] __attribute__((aligned(32)));
+/* Packing buffers. Each gemm call takes its own pair of buffers from a pool
+ * so that several threads can run gemms concurrently. Buffers are allocated on
+ * first use and kept for the next calls. */
+typedef struct sgemm_buffers {
+    float *A;
+    float *B;
+    struct sgemm_buffers *next;
+} sgemm_buffers;
+
+static bcnn_mutex sgemm_pool_mutex = BCNN_MUTEX_INITIALIZER;
+static sgemm_buffers *sgemm_pool = NULL;
+
+static sgemm_buffers *sgemm_acquire_buffers(void) {
+    sgemm_buffers *buf = NULL;
+
+    bcnn_mutex_lock(&sgemm_pool_mutex);
+    buf = sgemm_pool;
+    if (buf != NULL) {
+        sgemm_pool = buf->next;
+    }
+    bcnn_mutex_unlock(&sgemm_pool_mutex);
+    if (buf == NULL) {
+        buf = (sgemm_buffers *)calloc(1, sizeof(sgemm_buffers));
+        bh_check(buf != NULL, "Internal allocation error");
+        buf->A = (float *)bh_align_calloc(MC * KC * sizeof(float), 32);
+        buf->B = (float *)bh_align_calloc(KC * NC * sizeof(float), 32);
+        bh_check(buf->A != NULL && buf->B != NULL,
+                 "Internal allocation error");
+    }
+    return buf;
+}
+
+static void sgemm_release_buffers(sgemm_buffers *buf) {
+    bcnn_mutex_lock(&sgemm_pool_mutex);
+    buf->next = sgemm_pool;
+    sgemm_pool = buf;
+    bcnn_mutex_unlock(&sgemm_pool_mutex);
+}
 
 static int equal(float a, float b) {
     const float EPSILON = 1e-5;
@@ -989,6 +1228,7 @@ static void sgemm_nn_pack_B(int kc, int nc, const float *B, int inc_row_B,
 
 static void sgemm_ukernel(int kc, float alpha, const float *A, const float *B,
                           float beta, float *C, int inc_row_C, int inc_col_C) {
+    float AB_[MR * NR] __attribute__((aligned(32)));
     int i, j, l;
 #ifdef BCNN_USE_AVX
     __m256 abv0 = _mm256_setzero_ps();
@@ -1114,7 +1354,9 @@ static void sgemm_scal(int m, int n, float alpha, float *X, int incRowX,
 }
 
 static void sgemm_mkernel(int mc, int nc, int kc, float alpha, float beta,
-                          float *C, int inc_row_C, int inc_col_C) {
+                          const float *pack_A, const float *pack_B, float *C,
+                          int inc_row_C, int inc_col_C) {
+    float C_[MR * NR] __attribute__((aligned(32)));
     int mp = (mc + MR - 1) / MR;
     int np = (nc + NR - 1) / NR;
 
@@ -1130,12 +1372,13 @@ static void sgemm_mkernel(int mc, int nc, int kc, float alpha, float beta,
             int mr = (i != mp - 1 || _mr == 0) ? MR : _mr;
 
             if (mr == MR && nr == NR) {
-                sgemm_ukernel(kc, alpha, &A_[i * kc * MR], &B_[j * kc * NR],
-                              beta, &C[i * MR * inc_row_C + j * NR], inc_row_C,
+                sgemm_ukernel(kc, alpha, &pack_A[i * kc * MR],
+                              &pack_B[j * kc * NR], beta,
+                              &C[i * MR * inc_row_C + j * NR], inc_row_C,
                               inc_col_C);
             } else {
-                sgemm_ukernel(kc, alpha, &A_[i * kc * MR], &B_[j * kc * NR],
-                              0.0, C_, 1, MR);
+                sgemm_ukernel(kc, alpha, &pack_A[i * kc * MR],
+                              &pack_B[j * kc * NR], 0.0, C_, 1, MR);
                 sgemm_scal(mr, nr, beta, &C[i * MR * inc_row_C + j * NR],
                            inc_row_C, inc_col_C);
                 sgemm_axpy(mr, nr, 1.0, C_, 1, MR,
@@ -1162,12 +1405,14 @@ static void sgemm_nn(int m, int n, int k, float alpha, const float *A,
     int i, j, l;
 
     float _beta;
+    sgemm_buffers *buf = NULL;
 
     if (equal(alpha, 0.0) || k == 0) {
         sgemm_scal(m, n, beta, C, inc_row_C, inc_col_C);
         return;
     }
 
+    buf = sgemm_acquire_buffers();
     for (j = 0; j < nb; ++j) {
         nc = (j != nb - 1 || _nc == 0) ? NC : _nc;
 
@@ -1176,17 +1421,18 @@ static void sgemm_nn(int m, int n, int k, float alpha, const float *A,
             _beta = (l == 0) ? beta : 1.0f;
 
             sgemm_nn_pack_B(kc, nc, &B[l * KC * inc_row_B + j * NC], inc_row_B,
-                            inc_col_B, B_);
+                            inc_col_B, buf->B);
             for (i = 0; i < mb; ++i) {
                 mc = (i != mb - 1 || _mc == 0) ? MC : _mc;
                 sgemm_nn_pack_A(mc, kc, &A[i * MC * inc_row_A + l * KC],
-                                inc_row_A, inc_col_A, A_);
-                sgemm_mkernel(mc, nc, kc, alpha, _beta,
+                                inc_row_A, inc_col_A, buf->A);
+                sgemm_mkernel(mc, nc, kc, alpha, _beta, buf->A, buf->B,
                               &C[i * MC * inc_row_C + j * NC], inc_row_C,
                               inc_col_C);
             }
         }
     }
+    sgemm_release_buffers(buf);
 }
 
 static void sgemm(int m, int n, int k, float alpha, const float *A,
@@ -1205,30 +1451,254 @@ static void sgemm(int m, int n, int k, float alpha, const float *A,
     int i, j, l;
 
     float _beta;
+    sgemm_buffers *buf = NULL;
+
+    if (equal(alpha, 0.0) || k == 0) {
+        sgemm_scal(m, n, beta, C, inc_row_C, inc_col_C);
+        return;
+    }
+
+    buf = sgemm_acquire_buffers();
+    for (j = 0; j < nb; ++j) {
+        nc = (j != nb - 1 || _nc == 0) ? NC : _nc;
+
+        for (l = 0; l < kb; ++l) {
+            kc = (l != kb - 1 || _kc == 0) ? KC : _kc;
+            _beta = (l == 0) ? beta : 1.0f;
+            sgemm_pack_B(kc, nc, &B[l * KC * inc_row_B + j * NC * inc_col_B],
+                         inc_row_B, inc_col_B, buf->B);
+            for (i = 0; i < mb; ++i) {
+                mc = (i != mb - 1 || _mc == 0) ? MC : _mc;
+                sgemm_pack_A(mc, kc,
+                             &A[i * MC * inc_row_A + l * KC * inc_col_A],
+                             inc_row_A, inc_col_A, buf->A);
+                sgemm_mkernel(mc, nc, kc, alpha, _beta, buf->A, buf->B,
+                              &C[i * MC * inc_row_C + j * NC], inc_row_C,
+                              inc_col_C);
+            }
+        }
+    }
+    sgemm_release_buffers(buf);
+}
+
+/* Pre-packed operands hold the panels of the whole matrix in the order sgemm
+ * consumes them: k-blocks then m-blocks for A, n-blocks then k-blocks for B.
+ * Each block is padded to a multiple of MR (resp. NR) rows (resp. columns). */
+static int sgemm_packed_A_offset(int m, int i, int l, int kc) {
+    return l * KC * ((m + MR - 1) / MR) * MR + i * MC * kc;
+}
+
+static int sgemm_packed_B_offset(int k, int nc, int j, int l) {
+    return j * NC * k + l * KC * ((nc + NR - 1) / NR) * NR;
+}
+
+static void sgemm_prepacked(int m, int n, int k, float alpha, const float *A,
+                            const float *A_packed, int inc_row_A,
+                            int inc_col_A, const float *B,
+                            const float *B_packed, int inc_row_B,
+                            int inc_col_B, float beta, float *C, int inc_row_C,
+                            int inc_col_C) {
+    int mb = (m + MC - 1) / MC;
+    int nb = (n + NC - 1) / NC;
+    int kb = (k + KC - 1) / KC;
+
+    int _mc = m % MC;
+    int _nc = n % NC;
+    int _kc = k % KC;
+
+    int mc, nc, kc;
+    int i, j, l;
+
+    float _beta;
+    const float *pack_A = NULL, *pack_B = NULL;
+    sgemm_buffers *buf = NULL;
 
     if (equal(alpha, 0.0) || k == 0) {
         sgemm_scal(m, n, beta, C, inc_row_C, inc_col_C);
         return;
     }
 
+    buf = sgemm_acquire_buffers();
     for (j = 0; j < nb; ++j) {
         nc = (j != nb - 1 || _nc == 0) ? NC : _nc;
 
         for (l = 0; l < kb; ++l) {
             kc = (l != kb - 1 || _kc == 0) ? KC : _kc;
             _beta = (l == 0) ? beta : 1.0f;
-            sgemm_pack_B(kc, nc, &B[l * KC * inc_row_B + j * NC], inc_row_B,
-                         inc_col_B, B_);
+            if (B_packed != NULL) {
+                pack_B = &B_packed[sgemm_packed_B_offset(k, nc, j, l)];
+            } else {
+                sgemm_pack_B(kc, nc,
+                             &B[l * KC * inc_row_B + j * NC * inc_col_B],
+                             inc_row_B, inc_col_B, buf->B);
+                pack_B = buf->B;
+            }
             for (i = 0; i < mb; ++i) {
                 mc = (i != mb - 1 || _mc == 0) ? MC : _mc;
-                sgemm_pack_A(mc, kc, &A[i * MC * inc_row_A + l * KC], inc_row_A,
-                             inc_col_A, A_);
-                sgemm_mkernel(mc, nc, kc, alpha, _beta,
+                if (A_packed != NULL) {
+                    pack_A = &A_packed[sgemm_packed_A_offset(m, i, l, kc)];
+                } else {
+                    sgemm_pack_A(mc, kc,
+                                 &A[i * MC * inc_row_A + l * KC * inc_col_A],
+                                 inc_row_A, inc_col_A, buf->A);
+                    pack_A = buf->A;
+                }
+                sgemm_mkernel(mc, nc, kc, alpha, _beta, pack_A, pack_B,
                               &C[i * MC * inc_row_C + j * NC], inc_row_C,
                               inc_col_C);
             }
         }
     }
+    sgemm_release_buffers(buf);
+}
+
+// Loads 'n' half precision values read with a stride 'inc' as floats
+static void sgemm_load_f16(int n, const uint16_t *x, int inc, float *y) {
+    int i;
+    if (inc == 1) {
+        bcnn_f16_to_f32(n, (uint16_t *)x, y);
+    } else {
+        for (i = 0; i < n; ++i) {
+            bcnn_f16_to_f32(1, (uint16_t *)&x[i * inc], &y[i]);
+        }
+    }
+}
+
+// Same layout as sgemm_pack_A, values are converted from half precision along
+// the contiguous dimension of A.
+static void sgemm_pack_A_f16(int mc, int kc, const uint16_t *A, int inc_row_A,
+                             int inc_col_A, float *p) {
+    float buf[KC > MC ? KC : MC];
+    int i, j;
+    int mp = (mc + MR - 1) / MR;
+
+    if (inc_col_A == 1) {
+        for (i = 0; i < mp * MR; ++i) {
+            float *pi = p + (i / MR) * MR * kc + (i % MR);
+            if (i < mc) {
+                sgemm_load_f16(kc, A + i * inc_row_A, 1, buf);
+                for (j = 0; j < kc; ++j) {
+                    pi[j * MR] = buf[j];
+                }
+            } else {
+                for (j = 0; j < kc; ++j) {
+                    pi[j * MR] = 0.0f;
+                }
+            }
+        }
+    } else {
+        for (j = 0; j < kc; ++j) {
+            sgemm_load_f16(mc, A + j * inc_col_A, inc_row_A, buf);
+            for (i = 0; i < mp * MR; ++i) {
+                p[(i / MR) * MR * kc + j * MR + (i % MR)] =
+                    (i < mc ? buf[i] : 0.0f);
+            }
+        }
+    }
+}
+
+// Same layout as sgemm_pack_B, from half precision values
+static void sgemm_pack_B_f16(int kc, int nc, const uint16_t *B, int inc_row_B,
+                             int inc_col_B, float *p) {
+    float buf[NC > KC ? NC : KC];
+    int i, j;
+    int np = (nc + NR - 1) / NR;
+
+    if (inc_col_B == 1) {
+        for (i = 0; i < kc; ++i) {
+            sgemm_load_f16(nc, B + i * inc_row_B, 1, buf);
+            for (j = 0; j < np * NR; ++j) {
+                p[(j / NR) * NR * kc + i * NR + (j % NR)] =
+                    (j < nc ? buf[j] : 0.0f);
+            }
+        }
+    } else {
+        for (j = 0; j < np * NR; ++j) {
+            float *pj = p + (j / NR) * NR * kc + (j % NR);
+            if (j < nc) {
+                sgemm_load_f16(kc, B + j * inc_col_B, inc_row_B, buf);
+                for (i = 0; i < kc; ++i) {
+                    pj[i * NR] = buf[i];
+                }
+            } else {
+                for (i = 0; i < kc; ++i) {
+                    pj[i * NR] = 0.0f;
+                }
+            }
+        }
+    }
+}
+
+static void sgemm_f16(int m, int n, int k, float alpha, const float *A,
+                      const uint16_t *A16, int inc_row_A, int inc_col_A,
+                      const float *B, const uint16_t *B16, int inc_row_B,
+                      int inc_col_B, float beta, float *C, int inc_row_C,
+                      int inc_col_C) {
+    int mb = (m + MC - 1) / MC;
+    int nb = (n + NC - 1) / NC;
+    int kb = (k + KC - 1) / KC;
+
+    int _mc = m % MC;
+    int _nc = n % NC;
+    int _kc = k % KC;
+
+    int mc, nc, kc;
+    int i, j, l, offset;
+
+    float _beta;
+    sgemm_buffers *buf = NULL;
+
+    if (equal(alpha, 0.0) || k == 0) {
+        sgemm_scal(m, n, beta, C, inc_row_C, inc_col_C);
+        return;
+    }
+
+    buf = sgemm_acquire_buffers();
+    for (j = 0; j < nb; ++j) {
+        nc = (j != nb - 1 || _nc == 0) ? NC : _nc;
+
+        for (l = 0; l < kb; ++l) {
+            kc = (l != kb - 1 || _kc == 0) ? KC : _kc;
+            _beta = (l == 0) ? beta : 1.0f;
+            offset = l * KC * inc_row_B + j * NC * inc_col_B;
+            if (B16 != NULL) {
+                sgemm_pack_B_f16(kc, nc, &B16[offset], inc_row_B, inc_col_B,
+                                 buf->B);
+            } else {
+                sgemm_pack_B(kc, nc, &B[offset], inc_row_B, inc_col_B, buf->B);
+            }
+            for (i = 0; i < mb; ++i) {
+                mc = (i != mb - 1 || _mc == 0) ? MC : _mc;
+                offset = i * MC * inc_row_A + l * KC * inc_col_A;
+                if (A16 != NULL) {
+                    sgemm_pack_A_f16(mc, kc, &A16[offset], inc_row_A,
+                                     inc_col_A, buf->A);
+                } else {
+                    sgemm_pack_A(mc, kc, &A[offset], inc_row_A, inc_col_A,
+                                 buf->A);
+                }
+                sgemm_mkernel(mc, nc, kc, alpha, _beta, buf->A, buf->B,
+                              &C[i * MC * inc_row_C + j * NC], inc_row_C,
+                              inc_col_C);
+            }
+        }
+    }
+    sgemm_release_buffers(buf);
+}
+
+int bcnn_gemm_f16(int trans_a, int trans_b, int m, int n, int k, float alpha,
+                  float *A, uint16_t *A_f16, int lda, float *B, uint16_t *B_f16,
+                  int ldb, float beta, float *C, int ldc) {
+    int inc_row_A = (!trans_a) ? lda : 1;
+    int inc_col_A = (!trans_a) ? 1 : lda;
+
+    int inc_row_B = (!trans_b) ? ldb : 1;
+    int inc_col_B = (!trans_b) ? 1 : ldb;
+
+    sgemm_f16(m, n, k, alpha, A, A_f16, inc_row_A, inc_col_A, B, B_f16,
+              inc_row_B, inc_col_B, beta, C, ldc, 1);
+
+    return 0;
 }
 
 int bcnn_gemm(int trans_a, int trans_b, int m, int n, int k, float alpha,
@@ -1249,4 +1719,67 @@ int bcnn_gemm(int trans_a, int trans_b, int m, int n, int k, float alpha,
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+int bcnn_gemm_pack_a_size(int m, int k) {
+    return ((m + MR - 1) / MR) * MR * k;
+}
+
+int bcnn_gemm_pack_b_size(int k, int n) {
+    return ((n + NR - 1) / NR) * NR * k;
+}
+
+int bcnn_gemm_pack_a(int trans_a, int m, int k, float *A, int lda,
+                     float *A_packed) {
+    int inc_row_A = (!trans_a) ? lda : 1;
+    int inc_col_A = (!trans_a) ? 1 : lda;
+    int mb = (m + MC - 1) / MC;
+    int kb = (k + KC - 1) / KC;
+    int mc, kc, i, l;
+
+    for (l = 0; l < kb; ++l) {
+        kc = (l != kb - 1 || k % KC == 0) ? KC : k % KC;
+        for (i = 0; i < mb; ++i) {
+            mc = (i != mb - 1 || m % MC == 0) ? MC : m % MC;
+            sgemm_pack_A(mc, kc, &A[i * MC * inc_row_A + l * KC * inc_col_A],
+                         inc_row_A, inc_col_A,
+                         &A_packed[sgemm_packed_A_offset(m, i, l, kc)]);
+        }
+    }
+    return 0;
+}
+
+int bcnn_gemm_pack_b(int trans_b, int k, int n, float *B, int ldb,
+                     float *B_packed) {
+    int inc_row_B = (!trans_b) ? ldb : 1;
+    int inc_col_B = (!trans_b) ? 1 : ldb;
+    int nb = (n + NC - 1) / NC;
+    int kb = (k + KC - 1) / KC;
+    int nc, kc, j, l;
+
+    for (j = 0; j < nb; ++j) {
+        nc = (j != nb - 1 || n % NC == 0) ? NC : n % NC;
+        for (l = 0; l < kb; ++l) {
+            kc = (l != kb - 1 || k % KC == 0) ? KC : k % KC;
+            sgemm_pack_B(kc, nc, &B[l * KC * inc_row_B + j * NC * inc_col_B],
+                         inc_row_B, inc_col_B,
+                         &B_packed[sgemm_packed_B_offset(k, nc, j, l)]);
+        }
+    }
+    return 0;
+}
+
+int bcnn_gemm_packed(int trans_a, int trans_b, int m, int n, int k,
+                     float alpha, float *A, float *A_packed, int lda, float *B,
+                     float *B_packed, int ldb, float beta, float *C, int ldc) {
+    int inc_row_A = (!trans_a) ? lda : 1;
+    int inc_col_A = (!trans_a) ? 1 : lda;
+
+    int inc_row_B = (!trans_b) ? ldb : 1;
+    int inc_col_B = (!trans_b) ? 1 : ldb;
+
+    sgemm_prepacked(m, n, k, alpha, A, A_packed, inc_row_A, inc_col_A, B,
+                    B_packed, inc_row_B, inc_col_B, beta, C, ldc, 1);
+
+    return 0;
+}
@@ -36,6 +36,8 @@
 #endif
 #endif
 
+#include <bcnn/bcnn.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -43,6 +45,8 @@ extern "C" {
 /* Matrix computation routines */
 int bcnn_fill_f32(int n, float a, float *x);
 int bcnn_copy_f32(int n, float *x, float *y);
+int bcnn_f32_to_f16(int n, float *x, uint16_t *y);
+int bcnn_f16_to_f32(int n, uint16_t *x, float *y);
 int bcnn_axpy(int n, float a, float *x, float *y);
 int bcnn_scal(int n, float a, float *x);
 int bcnn_add_scalar(int n, float a, float *x);
@@ -56,11 +60,41 @@ int bcnn_vmul(int n, float *a, float *b, float *y);
 int bcnn_axpby(int n, float a, float *x, float b, float *y);
 int bcnn_gemv(int trans_a, int m, int n, float alpha, float *a, float *x,
     float beta, float *y);
+/* y[b][j] = alpha * dot(x[b], w[j]) + beta * y[b][j] for 'batch' vectors x
+ * of k floats and the n rows of the row-major matrix w, read from w_f16 in
+ * half precision if w is NULL. Each row of w is loaded once for all the
+ * vectors, which suits small batches better than bcnn_gemm. */
+int bcnn_gemv_batch(int batch, int n, int k, float alpha, float *x, int ldx,
+    float *w, uint16_t *w_f16, int ldw, float beta, float *y, int ldy);
 int bcnn_gemm(int trans_a, int trans_b, int M, int N, int K, float ALPHA,
     float *A, int lda,
     float *B, int ldb,
     float BETA,
     float *C, int ldc);
+/* Same as bcnn_gemm, A (resp. B) being read from A_f16 (resp. B_f16) in half
+ * precision when not NULL. Conversion is done while packing the panels. */
+int bcnn_gemm_f16(int trans_a, int trans_b, int m, int n, int k, float alpha,
+    float *A, uint16_t *A_f16, int lda,
+    float *B, uint16_t *B_f16, int ldb,
+    float beta,
+    float *C, int ldc);
+/* Packs the weights operand of bcnn_gemm once into the panel layout of the
+ * micro-kernel. A_packed (resp. B_packed) must be 32 bytes aligned and hold
+ * bcnn_gemm_pack_a_size (resp. bcnn_gemm_pack_b_size) floats. */
+int bcnn_gemm_pack_a_size(int m, int k);
+int bcnn_gemm_pack_b_size(int k, int n);
+int bcnn_gemm_pack_a(int trans_a, int m, int k, float *A, int lda,
+    float *A_packed);
+int bcnn_gemm_pack_b(int trans_b, int k, int n, float *B, int ldb,
+    float *B_packed);
+/* Same as bcnn_gemm, A (resp. B) being read from A_packed (resp. B_packed)
+ * when not NULL */
+int bcnn_gemm_packed(int trans_a, int trans_b, int m, int n, int k,
+    float alpha,
+    float *A, float *A_packed, int lda,
+    float *B, float *B_packed, int ldb,
+    float beta,
+    float *C, int ldc);
 int bcnn_xnor_gemm(int trans_a, int trans_b, int M, int N, int K, float ALPHA,
                         unsigned int *A, int lda,
                         unsigned int *B, int ldb,
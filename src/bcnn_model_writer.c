@@ -0,0 +1,159 @@
+/*
+* Copyright (c) 2016 Jean-Noel Braun.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "bcnn_model_writer.h"
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <bh/bh_mem.h>
+
+#include "bcnn_utils.h"
+
+// Writes 'buf' to 'path' through a temporary file, so that 'path' either
+// holds the previous content or the complete new one.
+static int bcnn_write_file_atomic(const char *path, unsigned char *buf,
+                                  size_t size) {
+    char *tmp = (char *)calloc(strlen(path) + 5, sizeof(char));
+    FILE *fp = NULL;
+    int ok;
+
+    sprintf(tmp, "%s.tmp", path);
+    fp = fopen(tmp, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "[ERROR] Can not open file %s\n", tmp);
+        bh_free(tmp);
+        return BCNN_INVALID_PARAMETER;
+    }
+    ok = (fwrite(buf, 1, size, fp) == size && fflush(fp) == 0);
+    // Data must reach the disk before the rename is
+#if defined(_WIN32)
+    ok = ok && (_commit(_fileno(fp)) == 0);
+#else
+    ok = ok && (fsync(fileno(fp)) == 0);
+#endif
+    ok = (fclose(fp) == 0) && ok;
+#if defined(_WIN32)
+    ok = ok && MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING |
+                                          MOVEFILE_WRITE_THROUGH);
+#else
+    ok = ok && (rename(tmp, path) == 0);
+#endif
+    if (!ok) {
+        fprintf(stderr, "[ERROR] Could not write model %s\n", path);
+        remove(tmp);
+    }
+    bh_free(tmp);
+    return (ok ? BCNN_SUCCESS : BCNN_INTERNAL_ERROR);
+}
+
+static void *bcnn_model_writer_run(void *arg) {
+    bcnn_model_writer *writer = (bcnn_model_writer *)arg;
+    int i;
+
+    writer->status =
+        bcnn_write_file_atomic(writer->path, writer->buf, writer->size);
+    if (writer->status != BCNN_SUCCESS) {
+        bh_free(writer->path);
+        return NULL;
+    }
+    // Retention of the last files. Saving twice to the same path does not
+    // count as a new file.
+    for (i = 0; i < writer->num_files; ++i) {
+        if (strcmp(writer->files[i], writer->path) == 0) {
+            break;
+        }
+    }
+    if (i == writer->num_files) {
+        writer->files = (char **)realloc(
+            writer->files, (writer->num_files + 1) * sizeof(char *));
+        writer->files[writer->num_files++] = writer->path;
+    } else {
+        bh_free(writer->path);
+    }
+    writer->path = NULL;
+    while (writer->keep_last > 0 && writer->num_files > writer->keep_last) {
+        remove(writer->files[0]);
+        bh_free(writer->files[0]);
+        memmove(writer->files, writer->files + 1,
+                (writer->num_files - 1) * sizeof(char *));
+        writer->num_files--;
+    }
+    return NULL;
+}
+
+void bcnn_model_writer_init(bcnn_model_writer *writer, int keep_last) {
+    memset(writer, 0, sizeof(bcnn_model_writer));
+    writer->keep_last = keep_last;
+}
+
+int bcnn_model_writer_wait(bcnn_model_writer *writer) {
+    if (writer->busy) {
+        bcnn_thread_join(writer->thread);
+        writer->busy = 0;
+    }
+    return writer->status;
+}
+
+int bcnn_model_writer_save(bcnn_model_writer *writer, bcnn_net *net,
+                           char *path, int half) {
+    size_t size;
+
+    // The staging buffer is reused: the previous write must be over. It only
+    // blocks if models are saved faster than they can be written.
+    bcnn_model_writer_wait(writer);
+    size = bcnn_get_model_size(net, half);
+    if (size > writer->capacity) {
+        unsigned char *buf = (unsigned char *)realloc(writer->buf, size);
+        if (buf == NULL) {
+            return BCNN_FAILED_ALLOC;
+        }
+        writer->buf = buf;
+        writer->capacity = size;
+    }
+    writer->size = bcnn_write_model_to_buffer(net, half, writer->buf);
+    bh_strfill(&writer->path, path);
+    if (bcnn_thread_create(&writer->thread, bcnn_model_writer_run, writer) !=
+        0) {
+        // Fall back to a synchronous write
+        bcnn_model_writer_run(writer);
+        return writer->status;
+    }
+    writer->busy = 1;
+    return BCNN_SUCCESS;
+}
+
+void bcnn_model_writer_free(bcnn_model_writer *writer) {
+    int i;
+
+    bcnn_model_writer_wait(writer);
+    for (i = 0; i < writer->num_files; ++i) {
+        bh_free(writer->files[i]);
+    }
+    bh_free(writer->files);
+    bh_free(writer->buf);
+    bh_free(writer->path);
+    memset(writer, 0, sizeof(bcnn_model_writer));
+}
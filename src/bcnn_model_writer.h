@@ -0,0 +1,68 @@
+/*
+* Copyright (c) 2016 Jean-Noel Braun.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#ifndef BCNN_MODEL_WRITER_H
+#define BCNN_MODEL_WRITER_H
+
+#include <bcnn/bcnn.h>
+
+#include "bcnn_thread.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Background model writer.
+ *
+ * bcnn_model_writer_save snapshots the model into a staging buffer and
+ * returns; the file is written by a background thread to '<path>.tmp', synced
+ * and then renamed to its final path, so that an interrupted write never
+ * leaves a truncated model behind. Only the last 'keep_last' files saved
+ * through the writer are kept on disk (all of them if keep_last <= 0).
+ */
+typedef struct {
+    bcnn_thread thread;
+    int busy;            // A write has been started and not waited for yet
+    int status;          // Result of the last write
+    unsigned char *buf;  // Staging buffer
+    size_t size;
+    size_t capacity;
+    char *path;          // Destination of the current write
+    int keep_last;
+    int num_files;
+    char **files;        // Files written so far, oldest first
+} bcnn_model_writer;
+
+void bcnn_model_writer_init(bcnn_model_writer *writer, int keep_last);
+/* Waits for the previous write, if any, then starts writing the model. */
+int bcnn_model_writer_save(bcnn_model_writer *writer, bcnn_net *net,
+                           char *path, int half);
+/* Waits for the current write and returns its status. */
+int bcnn_model_writer_wait(bcnn_model_writer *writer);
+void bcnn_model_writer_free(bcnn_model_writer *writer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // BCNN_MODEL_WRITER_H
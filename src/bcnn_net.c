@@ -40,9 +40,13 @@
 #include "bcnn_depthwise_conv_layer.h"
 #include "bcnn_dropout_layer.h"
 #include "bcnn_fc_layer.h"
+#include "bcnn_fusion.h"
+#include "bcnn_layout.h"
 #include "bcnn_mat.h"
 #include "bcnn_pooling_layer.h"
+#include "bcnn_scheduler.h"
 #include "bcnn_softmax_layer.h"
+#include "bcnn_thread.h"
 #include "bcnn_utils.h"
 #include "bh_log.h"
 
@@ -51,6 +55,11 @@ int bcnn_init_net(bcnn_net **net) {
     if (*net == NULL) {
         *net = (bcnn_net *)calloc(1, sizeof(bcnn_net));
     }
+    (*net)->fuse_ops = 1;
+    (*net)->prepack_weights = 1;
+    (*net)->data_cache_mb = 1024;
+    (*net)->numa_node = -1;
+    bcnn_net_set_seed(*net, 0);
     // Create input node
     bcnn_node input = {0};
     bh_strfill(&input.id, "input");
@@ -65,6 +74,28 @@ int bcnn_init_net(bcnn_net **net) {
     return BCNN_SUCCESS;
 }
 
+int bcnn_net_set_seed(bcnn_net *net, unsigned int seed) {
+    net->seed = seed;
+    bcnn_rng_init(&net->rng, seed, BCNN_RNG_STREAM_FILLER);
+    return bcnn_net_set_rng_stream(net, net->rng_stream);
+}
+
+int bcnn_net_set_rng_stream(bcnn_net *net, unsigned int stream) {
+    int i;
+
+    net->rng_stream = stream;
+    bcnn_rng_init(&net->data_aug.rng, net->seed,
+                  BCNN_RNG_STREAM_AT(BCNN_RNG_STREAM_DATA, stream));
+    for (i = 0; i < net->nb_connections; ++i) {
+        if (net->connections[i].layer->type == DROPOUT) {
+            bcnn_rng_init(
+                &net->connections[i].layer->rng, net->seed,
+                BCNN_RNG_STREAM_AT(BCNN_RNG_STREAM_DROPOUT + i, stream));
+        }
+    }
+    return BCNN_SUCCESS;
+}
+
 int bcnn_end_net(bcnn_net **net) {
     bcnn_free_net(*net);
     bh_free(*net);
@@ -84,7 +115,14 @@ int bcnn_free_tensor(bcnn_tensor *tensor) {
 
 int bcnn_free_net(bcnn_net *net) {
     int i;
+    bcnn_free_updater(net);
+    bcnn_net_free_schedule(net);
+    bcnn_thread_pool_destroy(&net->thread_pool);
     bcnn_free_workload(net);
+    bcnn_net_free_fused(net);
+    bcnn_net_free_layout(net);
+    bh_align_free(net->checkpoint_data);
+    bh_align_free(net->checkpoint_grad);
     for (i = 0; i < net->nb_connections; ++i) {
         bcnn_free_connection(&net->connections[i]);
     }
@@ -93,6 +131,7 @@ int bcnn_free_net(bcnn_net *net) {
         bh_free(net->finetune_id[i]);
     }
     bh_free(net->finetune_id);
+    bh_free(net->data_cache_dir);
     bcnn_net_free_nodes(net);
     return BCNN_SUCCESS;
 }
@@ -193,6 +232,39 @@ int bcnn_set_param(bcnn_net *net, char *name, char *val) {
         net->data_aug.swap_to_bgr = atoi(val);
     } else if (strcmp(name, "no_input_norm") == 0) {
         net->data_aug.no_input_norm = atoi(val);
+    } else if (strcmp(name, "fuse_ops") == 0) {
+        net->fuse_ops = atoi(val);
+    } else if (strcmp(name, "half_precision") == 0) {
+        net->half_precision = atoi(val);
+    } else if (strcmp(name, "prepack_weights") == 0) {
+        net->prepack_weights = atoi(val);
+    } else if (strcmp(name, "blocked_layout") == 0) {
+        net->blocked_layout = atoi(val);
+    } else if (strcmp(name, "seed") == 0) {
+        bcnn_net_set_seed(net, (unsigned int)strtoul(val, NULL, 10));
+    } else if (strcmp(name, "data_cache_dir") == 0) {
+        bh_free(net->data_cache_dir);
+        bh_strfill(&net->data_cache_dir, val);
+    } else if (strcmp(name, "data_cache_mb") == 0) {
+        net->data_cache_mb = atoi(val);
+    } else if (strcmp(name, "shuffle") == 0) {
+        net->shuffle = atoi(val);
+    } else if (strcmp(name, "shuffle_buffer") == 0) {
+        net->shuffle_buffer = atoi(val);
+    } else if (strcmp(name, "accumulation_steps") == 0) {
+        net->accumulation_steps = atoi(val);
+    } else if (strcmp(name, "shard_index") == 0) {
+        net->shard_index = atoi(val);
+    } else if (strcmp(name, "shard_count") == 0) {
+        net->shard_count = atoi(val);
+    } else if (strcmp(name, "checkpoint_every") == 0) {
+        net->checkpoint_every = atoi(val);
+    } else if (strcmp(name, "overlap_update") == 0) {
+        net->overlap_update = atoi(val);
+    } else if (strcmp(name, "num_threads") == 0) {
+        net->num_threads = atoi(val);
+    } else if (strcmp(name, "numa_node") == 0) {
+        net->numa_node = atoi(val);
     } else if (strcmp(name, "prediction_type") == 0) {
         if (strcmp(val, "classif") == 0 || strcmp(val, "classification") == 0) {
             net->prediction_type = CLASSIFICATION;
@@ -251,7 +323,9 @@ void bcnn_net_add_node(bcnn_net *net, bcnn_node node) {
 void bcnn_net_free_nodes(bcnn_net *net) {
     int i;
     for (i = 0; i < net->num_nodes; ++i) {
-        bcnn_tensor_free(&net->nodes[i].tensor);
+        if (!net->nodes[i].is_view && net->nodes[i].mem_chunk_id == 0) {
+            bcnn_tensor_free(&net->nodes[i].tensor);
+        }
         bh_free(net->nodes[i].id);
     }
     bh_free(net->nodes);
@@ -320,9 +394,140 @@ int bcnn_free_workload(bcnn_net *net) {
     return 0;
 }
 
-int bcnn_compile_net(bcnn_net *net, char *phase) {
+static int bcnn_has_gemm_weights(bcnn_layer *layer) {
+    return (layer->type == CONVOLUTIONAL || layer->type == DECONVOLUTIONAL ||
+            layer->type == FULL_CONNECTED);
+}
+
+/* Converts the weights of the gemm based layers to half precision. The single
+ * precision weights are released when the net is only used for inference. */
+static void bcnn_net_set_weights_f16(bcnn_net *net) {
+    int i, sz;
+    bcnn_layer *layer = NULL;
+
+    for (i = 0; i < net->nb_connections; ++i) {
+        layer = net->connections[i].layer;
+        if (!bcnn_has_gemm_weights(layer) || layer->weights.data == NULL) {
+            continue;
+        }
+        sz = bcnn_tensor_get_size(&layer->weights);
+        if (layer->weights_f16 == NULL) {
+            layer->weights_f16 = (uint16_t *)bh_align_calloc(
+                sz * sizeof(uint16_t), align_offset_);
+        }
+        bcnn_f32_to_f16(sz, layer->weights.data, layer->weights_f16);
+        if (net->task == PREDICT) {
+            bcnn_tensor_free(&layer->weights);
+        }
+    }
+}
+
+/* Restores the single precision weights, if needed, and drops the half
+ * precision copies */
+static void bcnn_net_unset_weights_f16(bcnn_net *net) {
+    int i;
+    bcnn_layer *layer = NULL;
+
+    for (i = 0; i < net->nb_connections; ++i) {
+        layer = net->connections[i].layer;
+        if (layer->weights_f16 == NULL) {
+            continue;
+        }
+        if (layer->weights.data == NULL) {
+            bcnn_tensor_allocate(&layer->weights);
+            bcnn_f16_to_f32(bcnn_tensor_get_size(&layer->weights),
+                            layer->weights_f16, layer->weights.data);
+        }
+        bh_align_free(layer->weights_f16);
+        layer->weights_f16 = NULL;
+    }
+}
+
+/* Packs the weights of a gemm based layer once into the panel layout of the
+ * gemm micro-kernel so that inference does not repack them for every image */
+static void bcnn_layer_pack_weights(bcnn_net *net, bcnn_connection *conn) {
+    bcnn_layer *layer = conn->layer;
+    bcnn_tensor *src = &net->nodes[conn->src[0]].tensor;
+    bcnn_tensor *dst = &net->nodes[conn->dst[0]].tensor;
+    int m = 0, n = 0, k = 0, sz = 0;
+
+    // Output phases regather their weights and never read the packed ones
+    if (layer->type == DECONVOLUTIONAL && bcnn_deconv_layer_is_phased(layer)) {
+        return;
+    }
+    // Neither do the matrix-vector products of small batches
+    if (layer->type == FULL_CONNECTED && dst->n <= BCNN_FULLC_GEMV_MAX_BATCH) {
+        return;
+    }
+#ifdef BCNN_USE_BLAS
+    // Conv and fullc layers call cblas_sgemm, which packs its own operands
+    if (layer->type != DECONVOLUTIONAL) {
+        return;
+    }
+#endif
+    if (layer->type == CONVOLUTIONAL) {
+        m = layer->num;
+        k = layer->size * layer->size * src->c;
+        sz = bcnn_gemm_pack_a_size(m, k);
+    } else if (layer->type == DECONVOLUTIONAL) {
+        m = layer->num * layer->size * layer->size;
+        k = src->c;
+        sz = bcnn_gemm_pack_a_size(m, k);
+    } else {
+        k = bcnn_tensor_get_size3d(src);
+        n = bcnn_tensor_get_size3d(dst);
+        sz = bcnn_gemm_pack_b_size(k, n);
+    }
+    if (layer->weights_packed == NULL) {
+        layer->weights_packed =
+            (float *)bh_align_calloc(sz * sizeof(float), align_offset_);
+    }
+    if (layer->type == CONVOLUTIONAL) {
+        bcnn_gemm_pack_a(0, m, k, layer->weights.data, k,
+                         layer->weights_packed);
+    } else if (layer->type == DECONVOLUTIONAL) {
+        bcnn_gemm_pack_a(1, m, k, layer->weights.data, m,
+                         layer->weights_packed);
+    } else {
+        bcnn_gemm_pack_b(1, k, n, layer->weights.data, k,
+                         layer->weights_packed);
+    }
+}
+
+// Half precision weights are kept as such to preserve their smaller footprint
+static int bcnn_net_use_packed_weights(bcnn_net *net) {
+#ifdef BCNN_USE_CUDA
+    return 0;
+#else
+    return (net->state == 0 && net->prepack_weights && !net->half_precision);
+#endif
+}
+
+static void bcnn_net_set_weights_packed(bcnn_net *net) {
+    int i;
+    bcnn_layer *layer = NULL;
+
+    for (i = 0; i < net->nb_connections; ++i) {
+        layer = net->connections[i].layer;
+        if (!bcnn_has_gemm_weights(layer) || layer->weights.data == NULL) {
+            continue;
+        }
+        bcnn_layer_pack_weights(net, &net->connections[i]);
+    }
+}
+
+static void bcnn_net_unset_weights_packed(bcnn_net *net) {
     int i;
 
+    for (i = 0; i < net->nb_connections; ++i) {
+        bh_align_free(net->connections[i].layer->weights_packed);
+        net->connections[i].layer->weights_packed = NULL;
+    }
+}
+
+int bcnn_compile_net(bcnn_net *net, char *phase) {
+    int i, ret;
+
     if (strcmp(phase, "train") == 0) {
         net->state = 1;
     } else if (strcmp(phase, "predict") == 0) {
@@ -337,117 +542,274 @@ int bcnn_compile_net(bcnn_net *net, char *phase) {
         net->connections[i].layer->net_state = net->state;
     }
 
+    if (net->state == 0 && net->half_precision) {
+#ifdef BCNN_USE_CUDA
+        bh_log_warning("Half precision weights are not supported on gpu");
+#else
+        bcnn_net_set_weights_f16(net);
+#endif
+    } else {
+        bcnn_net_unset_weights_f16(net);
+    }
+    if (bcnn_net_use_packed_weights(net)) {
+        bcnn_net_set_weights_packed(net);
+    } else {
+        bcnn_net_unset_weights_packed(net);
+    }
+
+    bcnn_net_free_schedule(net);
+    bcnn_net_free_checkpoints(net);
     bcnn_free_workload(net);
     bcnn_init_workload(net);
+    // Zero-copy concatenations
+    bcnn_net_alias_concat_nodes(net);
+    // Nodes recomputed during the backward pass share their memory
+    bcnn_net_plan_checkpoints(net);
+
+    // Channel-blocked nodes, planned before the fusion which only merges the
+    // connections left planar
+    bcnn_net_free_layout(net);
+    if (net->state == 0 && net->blocked_layout) {
+        bcnn_net_plan_layout(net);
+    }
+    // Fused execution plan: the original connections are left untouched so
+    // that switching back to training mode only requires to drop the plan.
+    bcnn_net_free_fused(net);
+    if (net->state == 0 && net->fuse_ops) {
+        bcnn_net_fuse(net);
+    }
+    // Built last, from the final memory layout of the nodes
+    bcnn_net_plan_schedule(net);
+    // The threads are left to the layers when no branches run concurrently,
+    // otherwise the scheduler lends each task the threads of its worker.
+    // Their workers are started once here, on the NUMA node of the net.
+    bcnn_thread_pool_destroy(&net->thread_pool);
+    if (net->scheduler == NULL && net->num_threads > 1) {
+        ret = bcnn_thread_pool_create(&net->thread_pool, net->num_threads - 1,
+                                      net->numa_node);
+        if (ret < 0) {
+            bh_log_warning("Could not start the worker threads of the layers");
+        } else if (ret > 0) {
+            bh_log_warning("Could not bind the worker threads of the layers "
+                           "to NUMA node %d",
+                           net->numa_node);
+        }
+    }
+    for (i = 0; i < net->nb_connections; ++i) {
+        net->connections[i].layer->num_threads =
+            (net->thread_pool != NULL ? net->num_threads : 1);
+        net->connections[i].layer->thread_pool = net->thread_pool;
+    }
 
     return BCNN_SUCCESS;
 }
 
-int bcnn_forward(bcnn_net *net) {
-    int i, j;
+static int bcnn_forward_connection(bcnn_net *net, bcnn_connection conn) {
+    int j;
     int output_size = 0;
-    bcnn_connection conn = {0};
 
-    for (i = 0; i < net->nb_connections; ++i) {
-        conn = net->connections[i];
-        for (j = 0; j < conn.num_dst; ++j) {
-            output_size = bcnn_tensor_get_size(&net->nodes[conn.dst[j]].tensor);
+    for (j = 0; j < conn.num_dst; ++j) {
+        // The gradient of a checkpoint may already hold the contribution of
+        // the following segments when its producer is replayed
+        if (net->recompute && net->nodes[conn.dst[j]].mem_chunk_id == 0) {
+            continue;
+        }
+        output_size = bcnn_tensor_get_size(&net->nodes[conn.dst[j]].tensor);
 #ifdef BCNN_USE_CUDA
-            if (net->nodes[conn.dst[j]].tensor.grad_data_gpu != NULL)
-                bcnn_cuda_fill_f32(output_size, 0.0f,
-                                   net->nodes[conn.dst[j]].tensor.grad_data_gpu,
-                                   1);
+        if (net->nodes[conn.dst[j]].tensor.grad_data_gpu != NULL)
+            bcnn_cuda_fill_f32(output_size, 0.0f,
+                               net->nodes[conn.dst[j]].tensor.grad_data_gpu,
+                               1);
 #else
-            if (net->nodes[conn.dst[j]].tensor.grad_data != NULL)
-                memset(net->nodes[conn.dst[j]].tensor.grad_data, 0,
-                       output_size * sizeof(float));
+        if (net->nodes[conn.dst[j]].tensor.grad_data != NULL)
+            memset(net->nodes[conn.dst[j]].tensor.grad_data, 0,
+                   output_size * sizeof(float));
 #endif
-        }
+    }
+
+    switch (conn.layer->type) {
+        case CONVOLUTIONAL:
+            bcnn_forward_conv_layer(net, &conn);
+            break;
+        case DECONVOLUTIONAL:
+            bcnn_forward_deconv_layer(net, &conn);
+            break;
+        case DEPTHWISE_CONV:
+            bcnn_forward_depthwise_sep_conv_layer(net, &conn);
+            break;
+        case ACTIVATION:
+            bcnn_forward_activation_layer(net, &conn);
+            break;
+        case BATCHNORM:
+            bcnn_forward_batchnorm_layer(net, &conn);
+            break;
+        case FULL_CONNECTED:
+            bcnn_forward_fullc_layer(net, &conn);
+            break;
+        case MAXPOOL:
+            bcnn_forward_maxpool_layer(net, &conn);
+            break;
+        case SOFTMAX:
+            bcnn_forward_softmax_layer(net, &conn);
+            break;
+        case DROPOUT:
+            bcnn_forward_dropout_layer(net, &conn);
+            break;
+        case CONCAT:
+            bcnn_forward_concat_layer(net, &conn);
+            break;
+        case COST:
+            bcnn_forward_cost_layer(net, &conn);
+            break;
+        default:
+            break;
+    }
+
+    return BCNN_SUCCESS;
+}
+
+static void bcnn_forward_task(bcnn_net *net, int task) {
+    int i = task;
 
-        switch (conn.layer->type) {
-            case CONVOLUTIONAL:
-                bcnn_forward_conv_layer(net, &conn);
-                break;
-            case DECONVOLUTIONAL:
-                bcnn_forward_deconv_layer(net, &conn);
-                break;
-            case DEPTHWISE_CONV:
-                bcnn_forward_depthwise_sep_conv_layer(net, &conn);
-                break;
-            case ACTIVATION:
-                bcnn_forward_activation_layer(net, &conn);
-                break;
-            case BATCHNORM:
-                bcnn_forward_batchnorm_layer(net, &conn);
-                break;
-            case FULL_CONNECTED:
-                bcnn_forward_fullc_layer(net, &conn);
-                break;
-            case MAXPOOL:
-                bcnn_forward_maxpool_layer(net, &conn);
-                break;
-            case SOFTMAX:
-                bcnn_forward_softmax_layer(net, &conn);
-                break;
-            case DROPOUT:
-                bcnn_forward_dropout_layer(net, &conn);
-                break;
-            case CONCAT:
-                bcnn_forward_concat_layer(net, &conn);
-                break;
-            case COST:
-                bcnn_forward_cost_layer(net, &conn);
-                break;
-            default:
-                break;
+    if (net->num_fused > 0) {
+        if (net->fused[task].num_conn > 1) {
+            bcnn_forward_fused_unit(net, &net->fused[task]);
+            return;
         }
+        i = net->fused[task].first;
+    }
+    if (bcnn_layout_is_blocked(net, i)) {
+        bcnn_forward_blocked_connection(net, i);
+    } else {
+        bcnn_forward_connection(net, net->connections[i]);
     }
+}
+
+int bcnn_forward_tasks(bcnn_net *net, int first, int last) {
+    int i;
 
+    for (i = first; i < last; ++i) {
+        bcnn_forward_task(net, i);
+    }
     return BCNN_SUCCESS;
 }
 
-int bcnn_backward(bcnn_net *net) {
+int bcnn_forward(bcnn_net *net) {
+    int num_tasks = (net->num_fused > 0 ? net->num_fused : net->nb_connections);
+
+    if (net->scheduler != NULL) {
+        return bcnn_scheduler_run(net, 0, bcnn_forward_task);
+    }
+    return bcnn_forward_tasks(net, 0, num_tasks);
+}
+
+static void bcnn_backward_connection(bcnn_net *net, int i) {
+    bcnn_connection conn = net->connections[i];
+
+    switch (conn.layer->type) {
+        case CONVOLUTIONAL:
+            bcnn_backward_conv_layer(net, &conn);
+            break;
+        case DECONVOLUTIONAL:
+            bcnn_backward_deconv_layer(net, &conn);
+            break;
+        case DEPTHWISE_CONV:
+            bcnn_backward_depthwise_sep_conv_layer(net, &conn);
+            break;
+        case ACTIVATION:
+            bcnn_backward_activation_layer(net, &conn);
+            break;
+        case BATCHNORM:
+            bcnn_backward_batchnorm_layer(net, &conn);
+            break;
+        case FULL_CONNECTED:
+            bcnn_backward_fullc_layer(net, &conn);
+            break;
+        case MAXPOOL:
+            bcnn_backward_maxpool_layer(net, &conn);
+            break;
+        case SOFTMAX:
+            bcnn_backward_softmax_layer(net, &conn);
+            break;
+        case DROPOUT:
+            bcnn_backward_dropout_layer(net, &conn);
+            break;
+        case CONCAT:
+            bcnn_backward_concat_layer(net, &conn);
+            break;
+        case COST:
+            bcnn_backward_cost_layer(net, &conn);
+            break;
+        default:
+            break;
+    }
+    // Gradients of the parameters of connection i are complete
+    bcnn_update_async_push(net, i);
+}
+
+static int bcnn_backward_connections(bcnn_net *net, int first, int last) {
     int i;
-    bcnn_connection conn = {0};
-
-    for (i = net->nb_connections - 1; i >= 0; --i) {
-        conn = net->connections[i];
-        switch (conn.layer->type) {
-            case CONVOLUTIONAL:
-                bcnn_backward_conv_layer(net, &conn);
-                break;
-            case DECONVOLUTIONAL:
-                bcnn_backward_deconv_layer(net, &conn);
-                break;
-            case DEPTHWISE_CONV:
-                bcnn_backward_depthwise_sep_conv_layer(net, &conn);
-                break;
-            case ACTIVATION:
-                bcnn_backward_activation_layer(net, &conn);
-                break;
-            case BATCHNORM:
-                bcnn_backward_batchnorm_layer(net, &conn);
-                break;
-            case FULL_CONNECTED:
-                bcnn_backward_fullc_layer(net, &conn);
-                break;
-            case MAXPOOL:
-                bcnn_backward_maxpool_layer(net, &conn);
-                break;
-            case SOFTMAX:
-                bcnn_backward_softmax_layer(net, &conn);
-                break;
-            case DROPOUT:
-                bcnn_backward_dropout_layer(net, &conn);
-                break;
-            case CONCAT:
-                bcnn_backward_concat_layer(net, &conn);
-                break;
-            case COST:
-                bcnn_backward_cost_layer(net, &conn);
-                break;
-            default:
-                break;
+
+    for (i = last - 1; i >= first; --i) {
+        bcnn_backward_connection(net, i);
+    }
+    return BCNN_SUCCESS;
+}
+
+/* Recomputes the pooled nodes written by connection i. Connections which only
+ * write checkpoints are skipped. */
+static void bcnn_recompute_connection(bcnn_net *net, int i) {
+    int j;
+
+    for (j = 0; j < net->connections[i].num_dst; ++j) {
+        if (net->nodes[net->connections[i].dst[j]].mem_chunk_id > 0) {
+            bcnn_forward_connection(net, net->connections[i]);
+            return;
+        }
+    }
+}
+
+/* Recomputes the pooled nodes of the segment [first, last[ from its
+ * checkpoints. */
+static void bcnn_recompute_segment(bcnn_net *net, int first, int last) {
+    int i;
+
+    net->recompute = 1;
+    if (net->scheduler != NULL) {
+        bcnn_scheduler_run_range(net, 0, bcnn_recompute_connection, first,
+                                 last);
+    } else {
+        for (i = first; i < last; ++i) {
+            bcnn_recompute_connection(net, i);
+        }
+    }
+    net->recompute = 0;
+}
+
+int bcnn_backward(bcnn_net *net) {
+    int first, last;
+    int n = net->nb_connections;
+    int k = net->checkpoint_every;
+
+    if (net->checkpoint_data == NULL) {
+        if (net->scheduler != NULL) {
+            return bcnn_scheduler_run(net, 1, bcnn_backward_connection);
+        }
+        return bcnn_backward_connections(net, 0, n);
+    }
+    // The last segment is still in memory after the forward pass. The
+    // segments go through the scheduler one at a time, so that their
+    // branches and layers keep the threads of the net.
+    for (last = n; last > 0; last = first) {
+        first = (last - 1) / k * k;
+        if (last < n) {
+            bcnn_recompute_segment(net, first, last);
+        }
+        if (net->scheduler != NULL) {
+            bcnn_scheduler_run_range(net, 1, bcnn_backward_connection, first,
+                                     last);
+        } else {
+            bcnn_backward_connections(net, first, last);
         }
     }
     return BCNN_SUCCESS;
@@ -463,7 +825,8 @@ int bcnn_iter_batch(bcnn_net *net, bcnn_iterator *iter) {
     int h_in = net->input_height;
     int c_in = net->input_channels;
     int batch_size = net->batch_size;
-    unsigned char *img_tmp = NULL;
+    unsigned char *img_tmp = NULL, *img = NULL;
+    int label;
     float *x = net->nodes[0].tensor.data;
     float *y = net->nodes[1].tensor.data;
     float x_scale, y_scale;
@@ -472,7 +835,10 @@ int bcnn_iter_batch(bcnn_net *net, bcnn_iterator *iter) {
                           (net->data_aug.range_shift_x != 0 ||
                            net->data_aug.range_shift_y != 0 ||
                            net->data_aug.rotation_range != 0 ||
-                           net->data_aug.random_fliph != 0));
+                           net->data_aug.random_fliph != 0 ||
+                           net->data_aug.min_scale > 0.0f ||
+                           net->data_aug.max_scale > 0.0f ||
+                           net->data_aug.max_distortion > 0.0f));
     bcnn_data_augment *param = &(net->data_aug);
     int input_size = bcnn_tensor_get_size(&net->nodes[0].tensor);
     int en =
@@ -490,40 +856,37 @@ int bcnn_iter_batch(bcnn_net *net, bcnn_iterator *iter) {
     }
 
     if (iter->type == ITER_MNIST || iter->type == ITER_CIFAR10) {
+        bh_assert(iter->type != ITER_MNIST || (h_in == iter->input_height &&
+                                               w_in == iter->input_width),
+                  "MNIST data: incoherent image width and height",
+                  BCNN_INVALID_DATA);
+        // The batch is converted straight from the in-memory dataset, samples
+        // are only copied when they go through data augmentation
         for (i = 0; i < net->batch_size; ++i) {
-            // bcnn_mnist_next_iter(net, iter);
-            bcnn_iterator_next(net, iter);
-            // Data augmentation
+            img = bcnn_iterator_next_sample(net, iter, &label);
             if (net->task == TRAIN && net->state) {
-                bcnn_data_augmentation(iter->input_uchar, iter->input_width,
+                memcpy(iter->input_uchar, img, sz_img);
+                img = iter->input_uchar;
+                bcnn_data_augmentation(img, iter->input_width,
                                        iter->input_height, iter->input_depth,
                                        param, img_tmp);
             }
-            // bip_write_image("test.png", iter->input_uchar, iter->input_width,
-            // iter->input_height, iter->input_depth, iter->input_width *
-            // iter->input_depth);
             if (w_in < iter->input_width || h_in < iter->input_height) {
-                bip_crop_image(
-                    iter->input_uchar, iter->input_width, iter->input_height,
-                    iter->input_width * iter->input_depth,
+                bcnn_convert_img_crop_to_float(
+                    img, iter->input_width, iter->input_height, c_in,
                     (iter->input_width - w_in) / 2,
-                    (iter->input_height - h_in) / 2, net->input_buffer, w_in,
-                    h_in, w_in * c_in, c_in);
-                bcnn_convert_img_to_float(net->input_buffer, w_in, h_in, c_in,
-                                          param->no_input_norm,
-                                          param->swap_to_bgr, param->mean_r,
-                                          param->mean_g, param->mean_b, x);
+                    (iter->input_height - h_in) / 2, w_in, h_in,
+                    param->no_input_norm, param->swap_to_bgr, param->mean_r,
+                    param->mean_g, param->mean_b, x);
             } else
-                bcnn_convert_img_to_float(iter->input_uchar, w_in, h_in, c_in,
+                bcnn_convert_img_to_float(img, w_in, h_in, c_in,
                                           param->no_input_norm,
                                           param->swap_to_bgr, param->mean_r,
                                           param->mean_g, param->mean_b, x);
-            // bip_write_image("test1.png", tmp_buf, w_in, h_in, c_in, w_in *
-            // c_in);
             x += sz;
             if (net->task != PREDICT) {
                 // Load truth
-                y[iter->label_int[0]] = 1;
+                y[label] = 1;
                 y += output_size;
             }
         }
@@ -698,17 +1061,33 @@ int bcnn_iter_batch(bcnn_net *net, bcnn_iterator *iter) {
 }
 
 int bcnn_train_on_batch(bcnn_net *net, bcnn_iterator *iter, float *loss) {
-    bcnn_iter_batch(net, iter);
+    int i, steps = bh_max(net->accumulation_steps, 1);
+    int async = 0;
+    float sum_loss = 0.0f;
 
-    net->seen += net->batch_size;
-    // Forward
-    bcnn_forward(net);
-    // Back prop
-    bcnn_backward(net);
+    // Weights gradients are accumulated over the micro-batches until the
+    // update
+    for (i = 0; i < steps; ++i) {
+        bcnn_iter_batch(net, iter);
+        net->seen += net->batch_size;
+        // Forward
+        bcnn_forward(net);
+        // The last back prop also runs the update when it is overlapped
+        if (i == steps - 1 && net->overlap_update) {
+            async = (bcnn_update_async_begin(net) == BCNN_SUCCESS);
+        }
+        // Back prop
+        bcnn_backward(net);
+        sum_loss += net->nodes[net->connections[net->nb_connections - 1].dst[0]]
+                        .tensor.data[0];
+    }
     // Update network weight
-    bcnn_update(net);
-    *loss = net->nodes[net->connections[net->nb_connections - 1].dst[0]]
-                .tensor.data[0];
+    if (async) {
+        bcnn_update_async_end(net);
+    } else {
+        bcnn_update(net);
+    }
+    *loss = sum_loss / steps;
 
     return BCNN_SUCCESS;
 }
@@ -736,19 +1115,116 @@ int bcnn_predict_on_batch(bcnn_net *net, bcnn_iterator *iter, float **pred,
     return BCNN_SUCCESS;
 }
 
-int bcnn_write_model(bcnn_net *net, char *filename) {
-    bcnn_layer *layer = NULL;
-    int i;
+/* Single precision models start with the learning rate, as they always did.
+ * Other models start with this tag, followed by a version and flags, then by
+ * the same fields. The tag is a signaling NaN, a value that a learning rate
+ * parsed from a config or computed by the learner can not take. */
+static const uint32_t bcnn_model_tag = 0x7F8B434E;
+#define BCNN_MODEL_VERSION 1
+#define BCNN_MODEL_F16 0x1 /* Conv / deconv / fullc weights in half precision */
 
-    FILE *fp = fopen(filename, "wb");
-    if (!fp) {
-        bh_log_error("Can not open file %s\n", filename);
+// Copies 'n' bytes at position 'pos' of 'buf', if not NULL, and returns the
+// next position.
+static size_t bcnn_model_put(unsigned char *buf, size_t pos, const void *src,
+                             size_t n) {
+    if (buf != NULL) {
+        memcpy(buf + pos, src, n);
+    }
+    return pos + n;
+}
+
+static size_t bcnn_write_weights(bcnn_layer *layer, int half,
+                                 unsigned char *buf, size_t pos) {
+    int sz = bcnn_tensor_get_size(&layer->weights);
+    uint16_t *w16 = layer->weights_f16;
+    float *w = layer->weights.data;
+
+    if (buf == NULL) {
+        return pos + sz * (half ? sizeof(uint16_t) : sizeof(float));
     }
+    // Model fields are all 2 or 4 bytes long, conversions can be done in place
+    if (half && w16 == NULL) {
+        bcnn_f32_to_f16(sz, w, (uint16_t *)(buf + pos));
+        return pos + sz * sizeof(uint16_t);
+    } else if (!half && w == NULL) {
+        bcnn_f16_to_f32(sz, w16, (float *)(buf + pos));
+        return pos + sz * sizeof(float);
+    }
+    if (half) {
+        return bcnn_model_put(buf, pos, w16, sz * sizeof(uint16_t));
+    }
+    return bcnn_model_put(buf, pos, w, sz * sizeof(float));
+}
+
+/* Models are read either from a file or from a memory buffer written by
+ * bcnn_write_model_to_buffer */
+typedef struct {
+    FILE *fp;
+    const unsigned char *buf;
+    size_t size;
+    size_t pos;
+} bcnn_model_reader;
+
+// Same as fread
+static size_t bcnn_model_read(void *dst, size_t elem_size, size_t count,
+                              bcnn_model_reader *r) {
+    if (r->fp != NULL) {
+        return fread(dst, elem_size, count, r->fp);
+    }
+    count = bh_min(count, (r->size - r->pos) / elem_size);
+    memcpy(dst, r->buf + r->pos, count * elem_size);
+    r->pos += count * elem_size;
+    return count;
+}
 
-    fwrite(&net->learner.learning_rate, sizeof(float), 1, fp);
-    fwrite(&net->learner.momentum, sizeof(float), 1, fp);
-    fwrite(&net->learner.decay, sizeof(float), 1, fp);
-    fwrite(&net->seen, sizeof(int), 1, fp);
+static size_t bcnn_read_weights(bcnn_layer *layer, int half,
+                                bcnn_model_reader *r) {
+    int sz = bcnn_tensor_get_size(&layer->weights);
+    size_t nb_read = 0;
+
+    if (half) {
+        uint16_t *w16 = layer->weights_f16;
+        if (w16 == NULL) {
+            w16 = (uint16_t *)calloc(sz, sizeof(uint16_t));
+        }
+        nb_read = bcnn_model_read(w16, sizeof(uint16_t), sz, r);
+        if (layer->weights.data != NULL) {
+            bcnn_f16_to_f32(sz, w16, layer->weights.data);
+        }
+        if (w16 != layer->weights_f16) {
+            bh_free(w16);
+        }
+    } else if (layer->weights.data != NULL) {
+        nb_read = bcnn_model_read(layer->weights.data, sizeof(float), sz, r);
+        if (layer->weights_f16 != NULL) {
+            bcnn_f32_to_f16(sz, layer->weights.data, layer->weights_f16);
+        }
+    } else {
+        float *w = (float *)calloc(sz, sizeof(float));
+        nb_read = bcnn_model_read(w, sizeof(float), sz, r);
+        bcnn_f32_to_f16(sz, w, layer->weights_f16);
+        bh_free(w);
+    }
+    return nb_read;
+}
+
+/* Serializes the model into 'buf' and returns its size. Only the size is
+ * computed if 'buf' is NULL. */
+static size_t bcnn_model_serialize(bcnn_net *net, int half,
+                                   unsigned char *buf) {
+    bcnn_layer *layer = NULL;
+    int i, c;
+    size_t pos = 0;
+
+    if (half) {
+        uint32_t header[3] = {bcnn_model_tag, BCNN_MODEL_VERSION,
+                              BCNN_MODEL_F16};
+        pos = bcnn_model_put(buf, pos, header, sizeof(header));
+    }
+    pos = bcnn_model_put(buf, pos, &net->learner.learning_rate, sizeof(float));
+    pos = bcnn_model_put(buf, pos, &net->learner.momentum, sizeof(float));
+    pos = bcnn_model_put(buf, pos, &net->learner.decay, sizeof(float));
+    pos = bcnn_model_put(buf, pos, &net->seen, sizeof(int));
 
     for (i = 0; i < net->nb_connections; ++i) {
         layer = net->connections[i].layer;
@@ -757,56 +1233,111 @@ int bcnn_write_model(bcnn_net *net, char *filename) {
             int weights_size = bcnn_tensor_get_size(&layer->weights);
             int biases_size = bcnn_tensor_get_size(&layer->biases);
 #ifdef BCNN_USE_CUDA
-            bcnn_cuda_memcpy_dev2host(layer->weights.data_gpu,
-                                      layer->weights.data, weights_size);
-            bcnn_cuda_memcpy_dev2host(layer->biases.data_gpu,
-                                      layer->biases.data, biases_size);
+            if (buf != NULL) {
+                bcnn_cuda_memcpy_dev2host(layer->weights.data_gpu,
+                                          layer->weights.data, weights_size);
+                bcnn_cuda_memcpy_dev2host(layer->biases.data_gpu,
+                                          layer->biases.data, biases_size);
+            }
 #endif
-            fwrite(layer->biases.data, sizeof(float), biases_size, fp);
-            fwrite(layer->weights.data, sizeof(float), weights_size, fp);
+            pos = bcnn_model_put(buf, pos, layer->biases.data,
+                                 biases_size * sizeof(float));
+            if (layer->type == DEPTHWISE_CONV) {
+                pos = bcnn_model_put(buf, pos, layer->weights.data,
+                                     weights_size * sizeof(float));
+            } else {
+                pos = bcnn_write_weights(layer, half, buf, pos);
+            }
         }
         if (layer->type == ACTIVATION && layer->activation == PRELU) {
             int weights_size = bcnn_tensor_get_size(&layer->weights);
-            fwrite(layer->weights.data, sizeof(float), weights_size, fp);
+            pos = bcnn_model_put(buf, pos, layer->weights.data,
+                                 weights_size * sizeof(float));
         }
         if (layer->type == BATCHNORM) {
+            c = net->nodes[net->connections[i].dst[0]].tensor.c;
 #ifdef BCNN_USE_CUDA
-            bcnn_cuda_memcpy_dev2host(
-                layer->running_mean.data_gpu, layer->running_mean.data,
-                net->nodes[net->connections[i].dst[0]].tensor.c);
-            bcnn_cuda_memcpy_dev2host(
-                layer->running_variance.data_gpu, layer->running_variance.data,
-                net->nodes[net->connections[i].dst[0]].tensor.c);
+            if (buf != NULL) {
+                bcnn_cuda_memcpy_dev2host(layer->running_mean.data_gpu,
+                                          layer->running_mean.data, c);
+                bcnn_cuda_memcpy_dev2host(layer->running_variance.data_gpu,
+                                          layer->running_variance.data, c);
+            }
 #endif
-            fwrite(layer->running_mean.data, sizeof(float),
-                   net->nodes[net->connections[i].dst[0]].tensor.c, fp);
-            fwrite(layer->running_variance.data, sizeof(float),
-                   net->nodes[net->connections[i].dst[0]].tensor.c, fp);
+            pos = bcnn_model_put(buf, pos, layer->running_mean.data,
+                                 c * sizeof(float));
+            pos = bcnn_model_put(buf, pos, layer->running_variance.data,
+                                 c * sizeof(float));
         }
     }
+    return pos;
+}
+
+size_t bcnn_get_model_size(bcnn_net *net, int half) {
+    return bcnn_model_serialize(net, half, NULL);
+}
+
+size_t bcnn_write_model_to_buffer(bcnn_net *net, int half,
+                                  unsigned char *buf) {
+    return bcnn_model_serialize(net, half, buf);
+}
+
+static int bcnn_write_model_internal(bcnn_net *net, char *filename,
+                                     int half) {
+    size_t sz = bcnn_get_model_size(net, half);
+    unsigned char *buf = NULL;
+
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        bh_log_error("Can not open file %s\n", filename);
+    }
+    buf = (unsigned char *)malloc(sz);
+    if (buf == NULL) {
+        fclose(fp);
+        return BCNN_FAILED_ALLOC;
+    }
+    bcnn_write_model_to_buffer(net, half, buf);
+    fwrite(buf, 1, sz, fp);
     fclose(fp);
+    bh_free(buf);
     return BCNN_SUCCESS;
 }
 
-int bcnn_load_model(bcnn_net *net, char *filename) {
-    FILE *fp = fopen(filename, "rb");
+int bcnn_write_model(bcnn_net *net, char *filename) {
+    return bcnn_write_model_internal(net, filename, 0);
+}
+
+int bcnn_write_model_f16(bcnn_net *net, char *filename) {
+    return bcnn_write_model_internal(net, filename, 1);
+}
+
+static int bcnn_load_model_internal(bcnn_net *net, bcnn_model_reader *r) {
     bcnn_layer *layer = NULL;
-    int i, j, is_ft = 0;
+    int i, j, is_ft = 0, is_f16 = 0;
     size_t nb_read = 0;
     float tmp = 0.0f;
+    uint32_t tag = 0, header[2] = {0};
+    // Sizes are only reported for files, buffers come from this very net
+    int verbose = (r->fp != NULL);
 
-    if (!fp) {
-        bh_log_error("Can not open file %s\n", filename);
+    // The first field is the learning rate for single precision models
+    nb_read = bcnn_model_read(&tag, sizeof(uint32_t), 1, r);
+    if (tag == bcnn_model_tag) {
+        nb_read = bcnn_model_read(header, sizeof(uint32_t), 2, r);
+        bh_check(nb_read == 2 && header[0] <= BCNN_MODEL_VERSION,
+                 "Unsupported model version %u", header[0]);
+        is_f16 = ((header[1] & BCNN_MODEL_F16) != 0);
+        nb_read = bcnn_model_read(&tmp, sizeof(float), 1, r);
+    }
+    nb_read = bcnn_model_read(&tmp, sizeof(float), 1, r);
+    nb_read = bcnn_model_read(&tmp, sizeof(float), 1, r);
+    nb_read = bcnn_model_read(&net->seen, sizeof(int), 1, r);
+    if (verbose) {
+        bh_log_info("lr= %f ", net->learner.learning_rate);
+        bh_log_info("m= %f ", net->learner.momentum);
+        bh_log_info("decay= %f ", net->learner.decay);
+        bh_log_info("seen= %d\n", net->seen);
     }
-
-    nb_read = fread(&tmp, sizeof(float), 1, fp);
-    nb_read = fread(&tmp, sizeof(float), 1, fp);
-    nb_read = fread(&tmp, sizeof(float), 1, fp);
-    nb_read = fread(&net->seen, sizeof(int), 1, fp);
-    bh_log_info("lr= %f ", net->learner.learning_rate);
-    bh_log_info("m= %f ", net->learner.momentum);
-    bh_log_info("decay= %f ", net->learner.decay);
-    bh_log_info("seen= %d\n", net->seen);
 
     for (i = 0; i < net->nb_connections; ++i) {
         layer = net->connections[i].layer;
@@ -822,14 +1353,24 @@ int bcnn_load_model(bcnn_net *net, char *filename) {
             is_ft == 0) {
             int weights_size = bcnn_tensor_get_size(&layer->weights);
             int biases_size = bcnn_tensor_get_size(&layer->biases);
-            nb_read = fread(layer->biases.data, sizeof(float), biases_size, fp);
-            bh_log_info("layer= %d nbread_bias= %lu bias_size_expected= %d\n",
-                        i, (unsigned long)nb_read, biases_size);
-            nb_read =
-                fread(layer->weights.data, sizeof(float), weights_size, fp);
-            bh_log_info(
-                "layer= %d nbread_weight= %lu weight_size_expected= %d\n", i,
-                (unsigned long)nb_read, weights_size);
+            nb_read = bcnn_model_read(layer->biases.data, sizeof(float),
+                                      biases_size, r);
+            if (verbose) {
+                bh_log_info(
+                    "layer= %d nbread_bias= %lu bias_size_expected= %d\n", i,
+                    (unsigned long)nb_read, biases_size);
+            }
+            if (layer->type == DEPTHWISE_CONV) {
+                nb_read = bcnn_model_read(layer->weights.data, sizeof(float),
+                                          weights_size, r);
+            } else {
+                nb_read = bcnn_read_weights(layer, is_f16, r);
+            }
+            if (verbose) {
+                bh_log_info(
+                    "layer= %d nbread_weight= %lu weight_size_expected= %d\n",
+                    i, (unsigned long)nb_read, weights_size);
+            }
 #ifdef BCNN_USE_CUDA
             bcnn_cuda_memcpy_host2dev(layer->weights.data_gpu,
                                       layer->weights.data, weights_size);
@@ -839,23 +1380,31 @@ int bcnn_load_model(bcnn_net *net, char *filename) {
         }
         if (layer->type == ACTIVATION && layer->activation == PRELU) {
             int weights_size = bcnn_tensor_get_size(&layer->weights);
-            nb_read =
-                fread(layer->weights.data, sizeof(float), weights_size, fp);
-            bh_log_info("PReLU layer= %d nbread= %lu expected= %d\n", i,
-                        (unsigned long)nb_read, weights_size);
+            nb_read = bcnn_model_read(layer->weights.data, sizeof(float),
+                                      weights_size, r);
+            if (verbose) {
+                bh_log_info("PReLU layer= %d nbread= %lu expected= %d\n", i,
+                            (unsigned long)nb_read, weights_size);
+            }
         }
         if (layer->type == BATCHNORM) {
             int sz = net->nodes[net->connections[i].dst[0]].tensor.c;
-            nb_read = fread(layer->running_mean.data, sizeof(float), sz, fp);
-            bh_log_info(
-                "batchnorm layer= %d nbread_mean= %lu mean_size_expected= %d\n",
-                i, (unsigned long)nb_read, sz);
-            nb_read =
-                fread(layer->running_variance.data, sizeof(float), sz, fp);
-            bh_log_info(
-                "batchnorm layer= %d nbread_variance= %lu "
-                "variance_size_expected= %d\n",
-                i, (unsigned long)nb_read, sz);
+            nb_read = bcnn_model_read(layer->running_mean.data, sizeof(float),
+                                      sz, r);
+            if (verbose) {
+                bh_log_info(
+                    "batchnorm layer= %d nbread_mean= %lu "
+                    "mean_size_expected= %d\n",
+                    i, (unsigned long)nb_read, sz);
+            }
+            nb_read = bcnn_model_read(layer->running_variance.data,
+                                      sizeof(float), sz, r);
+            if (verbose) {
+                bh_log_info(
+                    "batchnorm layer= %d nbread_variance= %lu "
+                    "variance_size_expected= %d\n",
+                    i, (unsigned long)nb_read, sz);
+            }
 #ifdef BCNN_USE_CUDA
             bcnn_cuda_memcpy_host2dev(layer->running_mean.data_gpu,
                                       layer->running_mean.data, sz);
@@ -864,7 +1413,32 @@ int bcnn_load_model(bcnn_net *net, char *filename) {
 #endif
         }
     }
-    if (fp != NULL) fclose(fp);
+    // Packed panels are rebuilt from the loaded weights
+    if (bcnn_net_use_packed_weights(net)) {
+        bcnn_net_set_weights_packed(net);
+    }
+    // The blocked kernels hold reordered weights and batchnorm denominators
+    if (net->layout != NULL) {
+        bcnn_net_plan_layout(net);
+    }
+    // As well as the epilogues of fused units, which skip the blocked
+    // connections
+    if (net->num_fused > 0) {
+        bcnn_net_fuse(net);
+    }
+
+    return BCNN_SUCCESS;
+}
+
+int bcnn_load_model(bcnn_net *net, char *filename) {
+    bcnn_model_reader r = {0};
+
+    r.fp = fopen(filename, "rb");
+    if (!r.fp) {
+        bh_log_error("Can not open file %s\n", filename);
+    }
+    bcnn_load_model_internal(net, &r);
+    fclose(r.fp);
 
     bh_log_info("Model %s loaded succesfully\n", filename);
     fflush(stdout);
@@ -872,6 +1446,15 @@ int bcnn_load_model(bcnn_net *net, char *filename) {
     return BCNN_SUCCESS;
 }
 
+int bcnn_load_model_from_buffer(bcnn_net *net, const unsigned char *buf,
+                                size_t size) {
+    bcnn_model_reader r = {0};
+
+    r.buf = buf;
+    r.size = size;
+    return bcnn_load_model_internal(net, &r);
+}
+
 int bcnn_visualize_network(bcnn_net *net) {
     int i, j, k, sz, w, h, c;
     bcnn_layer *layer = NULL;
@@ -972,6 +1555,9 @@ int bcnn_free_layer(bcnn_layer **layer) {
     bcnn_layer *p_layer = (*layer);
     bh_free(p_layer->indexes);
     bcnn_tensor_destroy(&p_layer->weights);
+    bh_align_free(p_layer->weights_f16);
+    bh_align_free(p_layer->weights_packed);
+    bh_align_free(p_layer->weights_blocked);
     bcnn_tensor_destroy(&p_layer->biases);
     bcnn_tensor_destroy(&p_layer->scales);
     bcnn_tensor_destroy(&p_layer->saved_mean);
@@ -982,6 +1568,7 @@ int bcnn_free_layer(bcnn_layer **layer) {
     bh_free(p_layer->x_norm);
     bh_free(p_layer->bn_workspace);
     bh_free(p_layer->rand);
+    bh_free(p_layer->mask);
     bh_free(p_layer->adam_m);
     bh_free(p_layer->adam_v);
     bh_free(p_layer->binary_weight);
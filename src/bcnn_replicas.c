@@ -0,0 +1,398 @@
+/*
+* Copyright (c) 2016 Jean-Noel Braun.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <bh/bh.h>
+#include <bh/bh_mem.h>
+
+#include "bcnn/bcnn.h"
+#include "bcnn_concat_layer.h"
+#include "bcnn_tensor.h"
+#include "bcnn_thread.h"
+#include "bh_log.h"
+
+/* Data parallel training on NUMA nodes.
+ *
+ * Every replica is driven by a thread bound to its NUMA node, which runs all
+ * the work touching the replica memory. The layers allocate their nodes,
+ * workspaces and parameters when they are added to the net, i.e. on the
+ * thread building the net: at initialization, the replica thread compiles the
+ * net and copies all these buffers into fresh allocations so that their pages
+ * are first touched on the node. The nodes of the checkpoint pool are
+ * allocated by the compilation itself and the concatenation views are pointed
+ * again into the new memory of their output.
+ *
+ * The gradients are reduced in place into the first replica, each thread
+ * summing a slice of every parameter tensor. The gradients of the other
+ * replicas are reset on the way, the first replica keeping the optimizer
+ * state (sgd momentum lives in its gradients). After the update of the first
+ * replica, each thread copies the new parameters and the batchnorm running
+ * statistics into its own replica.
+ */
+
+typedef enum {
+    BCNN_REPLICA_SETUP,
+    BCNN_REPLICA_GRADIENTS,
+    BCNN_REPLICA_REDUCE,
+    BCNN_REPLICA_UPDATE,
+    BCNN_REPLICA_BROADCAST
+} bcnn_replica_phase;
+
+typedef struct {
+    bcnn_replicas *owner;
+    int id;
+    int numa_node;
+    bcnn_net *net;
+    bcnn_iterator *iter;
+    float loss;
+    bcnn_thread thread;
+} bcnn_replica;
+
+struct bcnn_replicas {
+    int num_replicas;
+    bcnn_replica *replicas;
+    int num_threads;  // Started replica threads
+    bcnn_mutex mutex;
+    bcnn_cond cond;
+    int generation;  // Incremented for each phase
+    bcnn_replica_phase phase;
+    int num_done;  // Threads done with the current phase
+    int stop;
+};
+
+static void *bcnn_replica_migrate(void *buf, size_t size) {
+    void *p = NULL;
+
+    if (buf == NULL || size == 0) {
+        return buf;
+    }
+    p = calloc(1, size);
+    memcpy(p, buf, size);
+    bh_free(buf);
+    return p;
+}
+
+// Moves the nodes owning their memory to the replica NUMA node. The views are
+// detached beforehand and set up again on the migrated outputs.
+static void bcnn_replica_migrate_nodes(bcnn_net *net) {
+    int i;
+    bcnn_node *node = NULL;
+
+    for (i = 0; i < net->num_nodes; ++i) {
+        node = &net->nodes[i];
+        if (node->is_view) {
+            node->tensor.data = NULL;
+#ifndef BCNN_DEPLOY_ONLY
+            node->tensor.grad_data = NULL;
+#endif
+            node->is_view = 0;
+        } else if (node->mem_chunk_id == 0) {
+            bcnn_tensor_migrate(&node->tensor);
+        }
+    }
+    bcnn_net_alias_concat_nodes(net);
+}
+
+static void bcnn_replica_setup(bcnn_replica *r) {
+    int i, sz;
+    bcnn_connection *conn = NULL;
+    bcnn_layer *layer = NULL;
+
+    r->net->numa_node = r->numa_node;
+    // Allocates the input and the checkpoint pool, and starts the scheduler
+    // workers
+    bcnn_compile_net(r->net, "train");
+    bcnn_replica_migrate_nodes(r->net);
+    for (i = 0; i < r->net->nb_connections; ++i) {
+        conn = &r->net->connections[i];
+        layer = conn->layer;
+        sz = bcnn_tensor_get_size(&r->net->nodes[conn->dst[0]].tensor);
+        bcnn_tensor_migrate(&layer->weights);
+        bcnn_tensor_migrate(&layer->biases);
+        bcnn_tensor_migrate(&layer->scales);
+        bcnn_tensor_migrate(&layer->saved_mean);
+        bcnn_tensor_migrate(&layer->saved_variance);
+        bcnn_tensor_migrate(&layer->running_mean);
+        bcnn_tensor_migrate(&layer->running_variance);
+        layer->adam_m = (float *)bcnn_replica_migrate(
+            layer->adam_m,
+            bcnn_tensor_get_size(&layer->weights) * sizeof(float));
+        layer->adam_v = (float *)bcnn_replica_migrate(
+            layer->adam_v,
+            bcnn_tensor_get_size(&layer->weights) * sizeof(float));
+        layer->conv_workspace = (float *)bcnn_replica_migrate(
+            layer->conv_workspace, layer->conv_workspace_size * sizeof(float));
+        // Batchnorm, maxpool and dropout buffers have the size of the output
+        layer->x_norm =
+            (float *)bcnn_replica_migrate(layer->x_norm, sz * sizeof(float));
+        layer->bn_workspace = (float *)bcnn_replica_migrate(
+            layer->bn_workspace, sz * sizeof(float));
+        layer->indexes =
+            (int *)bcnn_replica_migrate(layer->indexes, sz * sizeof(int));
+        layer->mask =
+            (uint8_t *)bcnn_replica_migrate(layer->mask, (sz + 7) / 8);
+    }
+}
+
+static void bcnn_replica_gradients(bcnn_replica *r) {
+    int i, steps = bh_max(r->net->accumulation_steps, 1);
+    bcnn_net *net = r->net;
+
+    r->loss = 0.0f;
+    for (i = 0; i < steps; ++i) {
+        bcnn_iter_batch(net, r->iter);
+        net->seen += net->batch_size;
+        bcnn_forward(net);
+        bcnn_backward(net);
+        r->loss += net->nodes[net->connections[net->nb_connections - 1].dst[0]]
+                       .tensor.data[0];
+    }
+    r->loss /= steps;
+}
+
+// Sums the slice owned by replica 'r' of the weights (or biases) gradient of
+// connection 'conn' into the first replica and clears it in the others.
+static void bcnn_replica_reduce_tensor(bcnn_replica *r, int conn,
+                                       int is_bias) {
+    int i, k, begin, end;
+    int num = r->owner->num_replicas;
+    bcnn_layer *dst_layer = r->owner->replicas[0].net->connections[conn].layer;
+    bcnn_tensor *dst = (is_bias ? &dst_layer->biases : &dst_layer->weights);
+    int size = bcnn_tensor_get_size(dst);
+    bcnn_layer *src_layer = NULL;
+    float *src = NULL;
+
+    if (dst->grad_data == NULL) {
+        return;
+    }
+    begin = (int)((long long)size * r->id / num);
+    end = (int)((long long)size * (r->id + 1) / num);
+    for (k = 1; k < num; ++k) {
+        src_layer = r->owner->replicas[k].net->connections[conn].layer;
+        src = (is_bias ? src_layer->biases.grad_data
+                       : src_layer->weights.grad_data);
+        for (i = begin; i < end; ++i) {
+            dst->grad_data[i] += src[i];
+            src[i] = 0.0f;
+        }
+    }
+}
+
+static void bcnn_replica_broadcast(bcnn_replica *r) {
+    int i;
+    bcnn_net *src = r->owner->replicas[0].net;
+    bcnn_layer *dst_layer = NULL, *src_layer = NULL;
+
+    for (i = 0; i < r->net->nb_connections; ++i) {
+        dst_layer = r->net->connections[i].layer;
+        src_layer = src->connections[i].layer;
+        if (dst_layer->weights.data != NULL) {
+            memcpy(dst_layer->weights.data, src_layer->weights.data,
+                   bcnn_tensor_get_size(&dst_layer->weights) * sizeof(float));
+        }
+        if (dst_layer->biases.data != NULL) {
+            memcpy(dst_layer->biases.data, src_layer->biases.data,
+                   bcnn_tensor_get_size(&dst_layer->biases) * sizeof(float));
+        }
+        // Each replica updates its statistics from its own shard: the ones
+        // of the first replica are kept so that all replicas predict alike
+        if (dst_layer->running_mean.data != NULL) {
+            memcpy(dst_layer->running_mean.data, src_layer->running_mean.data,
+                   bcnn_tensor_get_size(&dst_layer->running_mean) *
+                       sizeof(float));
+        }
+        if (dst_layer->running_variance.data != NULL) {
+            memcpy(dst_layer->running_variance.data,
+                   src_layer->running_variance.data,
+                   bcnn_tensor_get_size(&dst_layer->running_variance) *
+                       sizeof(float));
+        }
+    }
+}
+
+static void bcnn_replica_run_phase(bcnn_replica *r, bcnn_replica_phase phase) {
+    int i;
+
+    switch (phase) {
+        case BCNN_REPLICA_SETUP:
+            bcnn_replica_setup(r);
+            break;
+        case BCNN_REPLICA_GRADIENTS:
+            bcnn_replica_gradients(r);
+            break;
+        case BCNN_REPLICA_REDUCE:
+            for (i = 0; i < r->net->nb_connections; ++i) {
+                bcnn_replica_reduce_tensor(r, i, 0);
+                bcnn_replica_reduce_tensor(r, i, 1);
+            }
+            break;
+        case BCNN_REPLICA_UPDATE:
+            if (r->id == 0) {
+                bcnn_update(r->net);
+            }
+            break;
+        case BCNN_REPLICA_BROADCAST:
+            if (r->id > 0) {
+                bcnn_replica_broadcast(r);
+            }
+            break;
+    }
+}
+
+static void *bcnn_replica_thread(void *arg) {
+    bcnn_replica *r = (bcnn_replica *)arg;
+    bcnn_replicas *s = r->owner;
+    int generation = 0;
+    bcnn_replica_phase phase;
+
+    bcnn_mutex_lock(&s->mutex);
+    for (;;) {
+        while (!s->stop && s->generation == generation) {
+            bcnn_cond_wait(&s->cond, &s->mutex);
+        }
+        if (s->stop) {
+            break;
+        }
+        generation = s->generation;
+        phase = s->phase;
+        bcnn_mutex_unlock(&s->mutex);
+        bcnn_replica_run_phase(r, phase);
+        bcnn_mutex_lock(&s->mutex);
+        if (++s->num_done == s->num_threads) {
+            bcnn_cond_broadcast(&s->cond);
+        }
+    }
+    bcnn_mutex_unlock(&s->mutex);
+    return NULL;
+}
+
+// Runs 'phase' on all the replicas and waits for its completion.
+static void bcnn_replicas_run(bcnn_replicas *s, bcnn_replica_phase phase) {
+    bcnn_mutex_lock(&s->mutex);
+    s->phase = phase;
+    s->num_done = 0;
+    s->generation++;
+    bcnn_cond_broadcast(&s->cond);
+    while (s->num_done < s->num_threads) {
+        bcnn_cond_wait(&s->cond, &s->mutex);
+    }
+    bcnn_mutex_unlock(&s->mutex);
+}
+
+int bcnn_replicas_initialize(bcnn_replicas **replicas, bcnn_net **nets,
+                             bcnn_iterator *iters, int num_replicas) {
+    int i;
+    int num_nodes = bcnn_numa_num_nodes();
+    bcnn_replicas *s = NULL;
+
+    if (num_replicas < 1) {
+        bh_log_error("Invalid number of replicas %d", num_replicas);
+        return BCNN_INVALID_PARAMETER;
+    }
+    for (i = 1; i < num_replicas; ++i) {
+        if (nets[i]->nb_connections != nets[0]->nb_connections) {
+            bh_log_error("Replica %d does not have the layers of the first "
+                         "net", i);
+            return BCNN_INVALID_PARAMETER;
+        }
+    }
+    s = (bcnn_replicas *)calloc(1, sizeof(bcnn_replicas));
+    s->num_replicas = num_replicas;
+    s->replicas = (bcnn_replica *)calloc(num_replicas, sizeof(bcnn_replica));
+    bcnn_mutex_init(&s->mutex);
+    bcnn_cond_init(&s->cond);
+    *replicas = s;
+    for (i = 0; i < num_replicas; ++i) {
+        s->replicas[i].owner = s;
+        s->replicas[i].id = i;
+        s->replicas[i].numa_node = i % num_nodes;
+        s->replicas[i].net = nets[i];
+        s->replicas[i].iter = &iters[i];
+        // Replicas share the seed: each one draws its augmentations and
+        // dropout masks from the streams of its data shard
+        bcnn_net_set_rng_stream(nets[i], (unsigned int)nets[i]->shard_index);
+        if (bcnn_thread_create(&s->replicas[i].thread, bcnn_replica_thread,
+                               &s->replicas[i]) != 0) {
+            bh_log_warning("Could not start the thread of replica %d", i);
+            bcnn_replicas_terminate(replicas);
+            return BCNN_INTERNAL_ERROR;
+        }
+        s->num_threads++;
+        if (num_nodes > 1 &&
+            bcnn_thread_set_numa_node(s->replicas[i].thread,
+                                      s->replicas[i].numa_node) != 0) {
+            bh_log_warning("Could not bind replica %d to NUMA node %d", i,
+                           s->replicas[i].numa_node);
+        }
+    }
+    bcnn_replicas_run(s, BCNN_REPLICA_SETUP);
+    bcnn_replicas_run(s, BCNN_REPLICA_BROADCAST);
+    nets[0]->num_replicas = num_replicas;
+    bh_log_info("[Replicas] %d replicas on %d NUMA nodes", num_replicas,
+                num_nodes);
+    return BCNN_SUCCESS;
+}
+
+int bcnn_replicas_train_on_batch(bcnn_replicas *replicas, float *loss) {
+    int i;
+    bcnn_net *net = replicas->replicas[0].net;
+
+    bcnn_replicas_run(replicas, BCNN_REPLICA_GRADIENTS);
+    bcnn_replicas_run(replicas, BCNN_REPLICA_REDUCE);
+    // The learning rate schedule follows the samples seen by all the replicas
+    for (i = 1; i < replicas->num_replicas; ++i) {
+        net->seen += replicas->replicas[i].net->batch_size *
+                     bh_max(replicas->replicas[i].net->accumulation_steps, 1);
+    }
+    bcnn_replicas_run(replicas, BCNN_REPLICA_UPDATE);
+    bcnn_replicas_run(replicas, BCNN_REPLICA_BROADCAST);
+    *loss = 0.0f;
+    for (i = 0; i < replicas->num_replicas; ++i) {
+        *loss += replicas->replicas[i].loss;
+    }
+    *loss /= replicas->num_replicas;
+    return BCNN_SUCCESS;
+}
+
+int bcnn_replicas_terminate(bcnn_replicas **replicas) {
+    int i;
+    bcnn_replicas *s = *replicas;
+
+    if (s == NULL) {
+        return BCNN_SUCCESS;
+    }
+    bcnn_mutex_lock(&s->mutex);
+    s->stop = 1;
+    bcnn_cond_broadcast(&s->cond);
+    bcnn_mutex_unlock(&s->mutex);
+    for (i = 0; i < s->num_threads; ++i) {
+        bcnn_thread_join(s->replicas[i].thread);
+    }
+    if (s->num_replicas > 0) {
+        s->replicas[0].net->num_replicas = 0;
+    }
+    bcnn_cond_destroy(&s->cond);
+    bcnn_mutex_destroy(&s->mutex);
+    bh_free(s->replicas);
+    bh_free(s);
+    *replicas = NULL;
+    return BCNN_SUCCESS;
+}
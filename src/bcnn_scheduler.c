@@ -0,0 +1,486 @@
+/*
+* Copyright (c) 2016 Jean-Noel Braun.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "bcnn_scheduler.h"
+
+#include <bh/bh.h>
+#include <bh/bh_mem.h>
+
+#include "bcnn/bcnn.h"
+#include "bcnn_thread.h"
+#include "bh_log.h"
+
+/* Dependency-driven execution of the layer graph.
+ *
+ * The tasks (connections, or fused units in predict mode) are the vertices of
+ * a DAG built at compile time: a task depends on every previous task, in
+ * insertion order, whose node accesses conflict with its own. Nodes are
+ * compared by their memory, so that the views of a concatenation output and
+ * the nodes pooled by checkpointing are handled like any other node. Forward
+ * edges only link a writer of a node to its readers and other writers. In the
+ * backward pass, every node of a task is considered written since the
+ * gradients of the sources are accumulated.
+ *
+ * A task made ready is pushed on the deque of the worker which completed its
+ * last dependency and popped from there in LIFO order; idle workers steal the
+ * oldest task of the other deques. The number of workers is capped by the
+ * width of the graph and the threads of the net are split between them: each
+ * worker owns a pool of num_threads / num_workers threads, lent to the layers
+ * of the task it runs. The workers are bound to net->numa_node if it is set,
+ * so that each NUMA node can run the pool of its own net.
+ */
+
+typedef struct {
+    int *offsets;  // Successors of t: succ[offsets[t]] .. succ[offsets[t+1]-1]
+    int *succ;
+} bcnn_task_graph;
+
+typedef struct {
+    bcnn_mutex mutex;
+    int *tasks;
+    int top;     // Oldest task, taken by thieves
+    int bottom;  // Next free slot, the owner takes the task below
+} bcnn_deque;
+
+typedef struct {
+    bcnn_scheduler *sched;
+    int id;
+    struct bcnn_thread_pool *pool;  // Threads of the layers of its tasks
+} bcnn_worker;
+
+struct bcnn_scheduler {
+    int num_tasks;
+    int num_workers;  // Including the thread calling bcnn_scheduler_run
+    bcnn_task_graph fwd;
+    bcnn_task_graph bwd;  // Edges follow the backward execution order
+    bcnn_deque *deques;
+    bcnn_worker *workers;
+    bcnn_thread *threads;
+    int num_threads;  // Started threads (num_workers - 1)
+    int task_threads;  // Threads running the layers of a task
+    bcnn_mutex mutex;
+    bcnn_cond cond;
+    int generation;  // Run counter, workers start when it changes
+    int num_active;  // Workers which have not finished the current run
+    int stop;
+    // Current run
+    bcnn_task_graph *graph;
+    bcnn_task_func func;
+    bcnn_net *net;
+    int first;  // Tasks [first, last[ are run, the others are considered done
+    int last;
+    int *pending;   // Unfinished predecessors of each task
+    int remaining;  // Tasks not done yet
+    int num_ready;  // Tasks sitting in the deques
+};
+
+static void bcnn_task_range(bcnn_net *net, int task, int *first, int *num) {
+    if (net->num_fused > 0) {
+        *first = net->fused[task].first;
+        *num = net->fused[task].num_conn;
+    } else {
+        *first = task;
+        *num = 1;
+    }
+}
+
+static int bcnn_nodes_overlap(bcnn_net *net, int a, int b) {
+    bcnn_tensor *ta = &net->nodes[a].tensor;
+    bcnn_tensor *tb = &net->nodes[b].tensor;
+
+    if (a == b) {
+        return 1;
+    }
+    if (ta->data == NULL || tb->data == NULL) {
+        return 0;
+    }
+    return (ta->data < tb->data + bcnn_tensor_get_size(tb) &&
+            tb->data < ta->data + bcnn_tensor_get_size(ta));
+}
+
+// Returns 1 if an access to node 'node' (a write if 'write' is set) conflicts
+// with the accesses of connection 'conn'.
+static int bcnn_conn_conflicts(bcnn_net *net, bcnn_connection *conn, int node,
+                               int write) {
+    int k;
+
+    for (k = 0; k < conn->num_src; ++k) {
+        if (write && bcnn_nodes_overlap(net, node, conn->src[k])) {
+            return 1;
+        }
+    }
+    for (k = 0; k < conn->num_dst; ++k) {
+        if (bcnn_nodes_overlap(net, node, conn->dst[k])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Task 'j' has to wait for task 'i' < 'j' in the forward pass, or the
+// reverse in the backward pass.
+static int bcnn_tasks_conflict(bcnn_net *net, int i, int j, int backward) {
+    int ci, ni, cj, nj, a, b, k;
+    bcnn_connection *conn = NULL;
+
+    bcnn_task_range(net, i, &ci, &ni);
+    bcnn_task_range(net, j, &cj, &nj);
+    for (a = ci; a < ci + ni; ++a) {
+        conn = &net->connections[a];
+        for (b = cj; b < cj + nj; ++b) {
+            for (k = 0; k < conn->num_src; ++k) {
+                if (bcnn_conn_conflicts(net, &net->connections[b],
+                                        conn->src[k], backward)) {
+                    return 1;
+                }
+            }
+            for (k = 0; k < conn->num_dst; ++k) {
+                if (bcnn_conn_conflicts(net, &net->connections[b],
+                                        conn->dst[k], 1)) {
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static void bcnn_task_graph_free(bcnn_task_graph *g) {
+    bh_free(g->offsets);
+    bh_free(g->succ);
+}
+
+// Builds the graph of one pass and returns its width, i.e. the largest number
+// of tasks at the same depth.
+static int bcnn_task_graph_build(bcnn_net *net, int n, int backward,
+                                 bcnn_task_graph *g) {
+    int i, j, t, u, e, width = 0;
+    int *depth = (int *)calloc(n, sizeof(int));
+    int *count = (int *)calloc(n + 1, sizeof(int));
+
+    g->offsets = (int *)calloc(n + 1, sizeof(int));
+    for (i = 0; i < n; ++i) {
+        for (j = i + 1; j < n; ++j) {
+            if (bcnn_tasks_conflict(net, i, j, backward)) {
+                g->offsets[(backward ? j : i) + 1]++;
+            }
+        }
+    }
+    for (t = 0; t < n; ++t) {
+        g->offsets[t + 1] += g->offsets[t];
+    }
+    g->succ = (int *)calloc(bh_max(g->offsets[n], 1), sizeof(int));
+    // 'count' is used as the fill position of each task here
+    for (i = 0; i < n; ++i) {
+        for (j = i + 1; j < n; ++j) {
+            if (bcnn_tasks_conflict(net, i, j, backward)) {
+                t = (backward ? j : i);
+                g->succ[g->offsets[t] + count[t]++] = (backward ? i : j);
+            }
+        }
+    }
+    // Depth of each task, going through the tasks in execution order
+    memset(count, 0, (n + 1) * sizeof(int));
+    for (i = 0; i < n; ++i) {
+        t = (backward ? n - 1 - i : i);
+        for (e = g->offsets[t]; e < g->offsets[t + 1]; ++e) {
+            u = g->succ[e];
+            depth[u] = bh_max(depth[u], depth[t] + 1);
+        }
+        count[depth[t]]++;
+        width = bh_max(width, count[depth[t]]);
+    }
+    bh_free(depth);
+    bh_free(count);
+    return width;
+}
+
+static void bcnn_deque_push(bcnn_deque *d, int task) {
+    bcnn_mutex_lock(&d->mutex);
+    d->tasks[d->bottom++] = task;
+    bcnn_mutex_unlock(&d->mutex);
+}
+
+static int bcnn_deque_pop(bcnn_deque *d, int steal) {
+    int task = -1;
+
+    bcnn_mutex_lock(&d->mutex);
+    if (d->bottom > d->top) {
+        task = (steal ? d->tasks[d->top++] : d->tasks[--d->bottom]);
+    }
+    bcnn_mutex_unlock(&d->mutex);
+    return task;
+}
+
+static void bcnn_scheduler_push(bcnn_scheduler *s, int id, int task) {
+    bcnn_deque_push(&s->deques[id], task);
+    bcnn_atomic_add(&s->num_ready, 1);
+    bcnn_mutex_lock(&s->mutex);
+    bcnn_cond_broadcast(&s->cond);
+    bcnn_mutex_unlock(&s->mutex);
+}
+
+static int bcnn_scheduler_next(bcnn_scheduler *s, int id) {
+    int k;
+    int task = bcnn_deque_pop(&s->deques[id], 0);
+
+    for (k = 1; task < 0 && k < s->num_workers; ++k) {
+        task = bcnn_deque_pop(&s->deques[(id + k) % s->num_workers], 1);
+    }
+    if (task >= 0) {
+        bcnn_atomic_add(&s->num_ready, -1);
+    }
+    return task;
+}
+
+// Points the layers of 'task' to the threads of the worker running it. A task
+// only runs once per pass so that its layers are never shared.
+static void bcnn_scheduler_lend_threads(bcnn_scheduler *s, int id, int task) {
+    int i, first, num;
+    bcnn_layer *layer = NULL;
+
+    bcnn_task_range(s->net, task, &first, &num);
+    for (i = first; i < first + num; ++i) {
+        layer = s->net->connections[i].layer;
+        layer->thread_pool = s->workers[id].pool;
+        layer->num_threads =
+            (s->workers[id].pool != NULL ? s->task_threads : 1);
+    }
+}
+
+static void bcnn_scheduler_work(bcnn_scheduler *s, int id) {
+    int e, u, task;
+    bcnn_task_graph *g = s->graph;
+
+    while (bcnn_atomic_load(&s->remaining) > 0) {
+        task = bcnn_scheduler_next(s, id);
+        if (task < 0) {
+            bcnn_mutex_lock(&s->mutex);
+            while (bcnn_atomic_load(&s->num_ready) == 0 &&
+                   bcnn_atomic_load(&s->remaining) > 0) {
+                bcnn_cond_wait(&s->cond, &s->mutex);
+            }
+            bcnn_mutex_unlock(&s->mutex);
+            continue;
+        }
+        bcnn_scheduler_lend_threads(s, id, task);
+        s->func(s->net, task);
+        for (e = g->offsets[task]; e < g->offsets[task + 1]; ++e) {
+            u = g->succ[e];
+            if (u >= s->first && u < s->last &&
+                bcnn_atomic_add(&s->pending[u], -1) == 0) {
+                bcnn_scheduler_push(s, id, u);
+            }
+        }
+        if (bcnn_atomic_add(&s->remaining, -1) == 0) {
+            bcnn_mutex_lock(&s->mutex);
+            bcnn_cond_broadcast(&s->cond);
+            bcnn_mutex_unlock(&s->mutex);
+        }
+    }
+}
+
+static void *bcnn_scheduler_thread(void *arg) {
+    bcnn_worker *w = (bcnn_worker *)arg;
+    bcnn_scheduler *s = w->sched;
+    int generation = 0;
+
+    bcnn_mutex_lock(&s->mutex);
+    for (;;) {
+        while (!s->stop && s->generation == generation) {
+            bcnn_cond_wait(&s->cond, &s->mutex);
+        }
+        if (s->stop) {
+            break;
+        }
+        generation = s->generation;
+        bcnn_mutex_unlock(&s->mutex);
+        bcnn_scheduler_work(s, w->id);
+        bcnn_mutex_lock(&s->mutex);
+        if (--s->num_active == 0) {
+            bcnn_cond_broadcast(&s->cond);
+        }
+    }
+    bcnn_mutex_unlock(&s->mutex);
+    return NULL;
+}
+
+int bcnn_scheduler_run_range(bcnn_net *net, int backward, bcnn_task_func func,
+                             int first, int last) {
+    int i, t, e, k = 0;
+    bcnn_scheduler *s = net->scheduler;
+    bcnn_task_graph *g = (backward ? &s->bwd : &s->fwd);
+
+    if (first >= last) {
+        return BCNN_SUCCESS;
+    }
+    bcnn_mutex_lock(&s->mutex);
+    s->graph = g;
+    s->func = func;
+    s->net = net;
+    s->first = first;
+    s->last = last;
+    s->remaining = last - first;
+    s->num_ready = 0;
+    for (i = 0; i < s->num_workers; ++i) {
+        s->deques[i].top = 0;
+        s->deques[i].bottom = 0;
+    }
+    // Only the predecessors inside the range are waited for
+    memset(s->pending, 0, s->num_tasks * sizeof(int));
+    for (t = first; t < last; ++t) {
+        for (e = g->offsets[t]; e < g->offsets[t + 1]; ++e) {
+            s->pending[g->succ[e]]++;
+        }
+    }
+    for (i = first; i < last; ++i) {
+        t = (backward ? first + last - 1 - i : i);
+        if (s->pending[t] == 0) {
+            bcnn_deque_push(&s->deques[k++ % s->num_workers], t);
+            s->num_ready++;
+        }
+    }
+    s->generation++;
+    s->num_active = s->num_threads;
+    bcnn_cond_broadcast(&s->cond);
+    bcnn_mutex_unlock(&s->mutex);
+
+    bcnn_scheduler_work(s, 0);
+
+    bcnn_mutex_lock(&s->mutex);
+    while (s->num_active > 0) {
+        bcnn_cond_wait(&s->cond, &s->mutex);
+    }
+    bcnn_mutex_unlock(&s->mutex);
+    return BCNN_SUCCESS;
+}
+
+int bcnn_scheduler_run(bcnn_net *net, int backward, bcnn_task_func func) {
+    return bcnn_scheduler_run_range(net, backward, func, 0,
+                                    net->scheduler->num_tasks);
+}
+
+void bcnn_net_free_schedule(bcnn_net *net) {
+    int i;
+    bcnn_scheduler *s = net->scheduler;
+
+    if (s == NULL) {
+        return;
+    }
+    bcnn_mutex_lock(&s->mutex);
+    s->stop = 1;
+    bcnn_cond_broadcast(&s->cond);
+    bcnn_mutex_unlock(&s->mutex);
+    for (i = 0; i < s->num_threads; ++i) {
+        bcnn_thread_join(s->threads[i]);
+    }
+    for (i = 0; i < s->num_workers; ++i) {
+        bcnn_thread_pool_destroy(&s->workers[i].pool);
+        bcnn_mutex_destroy(&s->deques[i].mutex);
+        bh_free(s->deques[i].tasks);
+    }
+    bcnn_cond_destroy(&s->cond);
+    bcnn_mutex_destroy(&s->mutex);
+    bcnn_task_graph_free(&s->fwd);
+    bcnn_task_graph_free(&s->bwd);
+    bh_free(s->deques);
+    bh_free(s->workers);
+    bh_free(s->threads);
+    bh_free(s->pending);
+    bh_free(s);
+    net->scheduler = NULL;
+}
+
+int bcnn_net_plan_schedule(bcnn_net *net) {
+    int i, width, bwd_width = 0;
+    int n = (net->num_fused > 0 ? net->num_fused : net->nb_connections);
+    int num_threads = net->num_threads;
+    bcnn_scheduler *s = NULL;
+
+    bcnn_net_free_schedule(net);
+#ifdef BCNN_USE_CUDA
+    // Kernels are serialized on a single stream
+    num_threads = 1;
+#endif
+    if (num_threads <= 1 || n <= 1) {
+        return BCNN_SUCCESS;
+    }
+    s = (bcnn_scheduler *)calloc(1, sizeof(bcnn_scheduler));
+    s->num_tasks = n;
+    width = bcnn_task_graph_build(net, n, 0, &s->fwd);
+    // Backward is only run in training mode
+    if (net->state == 1) {
+        bwd_width = bcnn_task_graph_build(net, n, 1, &s->bwd);
+    }
+    width = bh_max(width, bwd_width);
+    if (width <= 1) {
+        // Plain chain of layers, nothing to run concurrently
+        bcnn_task_graph_free(&s->fwd);
+        bcnn_task_graph_free(&s->bwd);
+        bh_free(s);
+        return BCNN_SUCCESS;
+    }
+    s->num_workers = bh_min(num_threads, width);
+    s->pending = (int *)calloc(n, sizeof(int));
+    s->deques = (bcnn_deque *)calloc(s->num_workers, sizeof(bcnn_deque));
+    s->workers = (bcnn_worker *)calloc(s->num_workers, sizeof(bcnn_worker));
+    s->threads = (bcnn_thread *)calloc(s->num_workers, sizeof(bcnn_thread));
+    bcnn_mutex_init(&s->mutex);
+    bcnn_cond_init(&s->cond);
+    for (i = 0; i < s->num_workers; ++i) {
+        bcnn_mutex_init(&s->deques[i].mutex);
+        s->deques[i].tasks = (int *)calloc(n, sizeof(int));
+        s->workers[i].sched = s;
+        s->workers[i].id = i;
+    }
+    net->scheduler = s;
+    // Worker 0 is the thread running the passes
+    for (i = 1; i < s->num_workers; ++i) {
+        if (bcnn_thread_create(&s->threads[s->num_threads],
+                               bcnn_scheduler_thread, &s->workers[i]) != 0) {
+            // The deques of the missing workers are emptied by stealing
+            bh_log_warning("[Scheduler] Could only start %d worker threads",
+                           s->num_threads);
+            break;
+        }
+        if (net->numa_node >= 0 &&
+            bcnn_thread_set_numa_node(s->threads[s->num_threads],
+                                      net->numa_node) != 0) {
+            bh_log_warning("[Scheduler] Could not bind a worker to NUMA node "
+                           "%d", net->numa_node);
+        }
+        s->num_threads++;
+    }
+    // The remaining threads go to the layers of the tasks
+    s->task_threads = num_threads / s->num_workers;
+    for (i = 0; i < s->num_workers && s->task_threads > 1; ++i) {
+        if (bcnn_thread_pool_create(&s->workers[i].pool, s->task_threads - 1,
+                                    net->numa_node) < 0) {
+            bh_log_warning("[Scheduler] Could not start the layer threads of "
+                           "worker %d", i);
+        }
+    }
+    bh_log_info("[Scheduler] tasks= %d max_concurrent_tasks= %d threads= %d "
+                "threads_per_task= %d",
+                n, width, s->num_threads + 1, bh_max(s->task_threads, 1));
+    return BCNN_SUCCESS;
+}
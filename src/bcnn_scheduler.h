@@ -0,0 +1,50 @@
+/*
+* Copyright (c) 2016 Jean-Noel Braun.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#ifndef BCNN_SCHEDULER_H
+#define BCNN_SCHEDULER_H
+
+#include <bcnn/bcnn.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Runs one task of the schedule: a fused unit (forward in predict mode) or a
+ * connection */
+typedef void (*bcnn_task_func)(bcnn_net *net, int task);
+
+/* Runs all the tasks of net->scheduler in dependency order, on the calling
+ * thread and the workers of the scheduler. The backward pass goes through the
+ * graph in reverse. Returns once all the tasks are done. */
+int bcnn_scheduler_run(bcnn_net *net, int backward, bcnn_task_func func);
+
+/* Same as bcnn_scheduler_run for the tasks [first, last[ only, the tasks out
+ * of the range being considered done. */
+int bcnn_scheduler_run_range(bcnn_net *net, int backward, bcnn_task_func func,
+                             int first, int last);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // BCNN_SCHEDULER_H
@@ -0,0 +1,511 @@
+/*
+* Copyright (c) 2016 Jean-Noel Braun.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <float.h>
+
+#include <bh/bh.h>
+#include <bh/bh_mem.h>
+#include <bh/bh_timer.h>
+
+#include "bcnn/bcnn.h"
+#include "bcnn_tensor.h"
+#include "bcnn_thread.h"
+#include "bh_log.h"
+
+/* Pipelined streaming inference.
+ *
+ * Each stage works on a shallow copy of the net which only owns its array of
+ * nodes. Nodes used by a single stage keep the memory allocated by the net,
+ * while the nodes crossing a boundary between two stages (network input and
+ * output included) are pointed at the buffer of the frame being processed
+ * before each run. Those buffers live in the channel of the boundary: a fixed
+ * set of slots, each holding all the crossing nodes for one frame, that move
+ * between a free list and a queue of filled slots. A node crossing several
+ * boundaries is copied from one slot to the next by the stages it goes
+ * through.
+ *
+ * Concatenation views may end up pointing to another buffer than their output
+ * node, in which case the concat layer copies them instead of sharing memory.
+ *
+ * The layers are shared with the net, but each one belongs to a single stage.
+ * The threads of the net are split between the stages: while the stream runs,
+ * the layers of a stage use the workers of that stage instead of the pool of
+ * the net, which is given back to them at termination.
+ */
+
+typedef struct {
+    int num_nodes;
+    int *nodes;    // Nodes crossing the boundary
+    int *offsets;  // Offset of each node in a slot
+    int slot_size;
+    int num_slots;
+    float *data;
+    int *full;  // Ring of the filled slots, in frame order
+    int full_head;
+    int num_full;
+    int *free_slots;
+    int num_free;
+    int stop;
+    bcnn_mutex mutex;
+    bcnn_cond cond;
+} bcnn_channel;
+
+typedef struct {
+    bcnn_stream *stream;
+    int id;
+    int first;  // Execution units [first, last[
+    int last;
+    int *pass;  // Index in the input channel of each output node, or -1
+    bcnn_net net;
+    struct bcnn_thread_pool *pool;  // Workers of the layers of the stage
+    bcnn_thread thread;
+} bcnn_stage;
+
+struct bcnn_stream {
+    int num_stages;
+    int num_threads;  // Started stage threads
+    bcnn_stage *stages;
+    bcnn_channel *channels;  // Channel i feeds stage i, the last one is the
+                             // output of the net
+};
+
+static void bcnn_stream_unit_range(bcnn_net *net, int unit, int *first,
+                                   int *num) {
+    if (net->num_fused > 0) {
+        *first = net->fused[unit].first;
+        *num = net->fused[unit].num_conn;
+    } else {
+        *first = unit;
+        *num = 1;
+    }
+}
+
+// Points the layers of the units [first, last[ to 'pool'.
+static void bcnn_stage_set_threads(bcnn_stage *st,
+                                   struct bcnn_thread_pool *pool,
+                                   int num_threads) {
+    int u, i, first, num;
+
+    for (u = st->first; u < st->last; ++u) {
+        bcnn_stream_unit_range(&st->net, u, &first, &num);
+        for (i = first; i < first + num; ++i) {
+            st->net.connections[i].layer->thread_pool = pool;
+            st->net.connections[i].layer->num_threads =
+                (pool != NULL ? num_threads : 1);
+        }
+    }
+}
+
+static float *bcnn_channel_node_data(bcnn_channel *ch, int slot, int k) {
+    return ch->data + (size_t)slot * ch->slot_size + ch->offsets[k];
+}
+
+// Takes a filled slot (full = 1) or a free slot (full = 0) from the channel.
+// Returns -1 if the stream is stopped.
+static int bcnn_channel_take(bcnn_channel *ch, int full) {
+    int slot = -1;
+
+    bcnn_mutex_lock(&ch->mutex);
+    while (!ch->stop && (full ? ch->num_full : ch->num_free) == 0) {
+        bcnn_cond_wait(&ch->cond, &ch->mutex);
+    }
+    if (!ch->stop) {
+        if (full) {
+            slot = ch->full[ch->full_head];
+            ch->full_head = (ch->full_head + 1) % ch->num_slots;
+            ch->num_full--;
+        } else {
+            slot = ch->free_slots[--ch->num_free];
+        }
+    }
+    bcnn_mutex_unlock(&ch->mutex);
+    return slot;
+}
+
+static void bcnn_channel_give(bcnn_channel *ch, int slot, int full) {
+    bcnn_mutex_lock(&ch->mutex);
+    if (full) {
+        ch->full[(ch->full_head + ch->num_full) % ch->num_slots] = slot;
+        ch->num_full++;
+    } else {
+        ch->free_slots[ch->num_free++] = slot;
+    }
+    bcnn_cond_broadcast(&ch->cond);
+    bcnn_mutex_unlock(&ch->mutex);
+}
+
+static void bcnn_channel_init(bcnn_channel *ch, bcnn_net *net, int *nodes,
+                              int num_nodes, int num_slots) {
+    int k, a = align_offset_ / sizeof(float);
+
+    ch->num_nodes = num_nodes;
+    ch->nodes = (int *)calloc(bh_max(num_nodes, 1), sizeof(int));
+    ch->offsets = (int *)calloc(bh_max(num_nodes, 1), sizeof(int));
+    for (k = 0; k < num_nodes; ++k) {
+        ch->nodes[k] = nodes[k];
+        ch->offsets[k] = ch->slot_size;
+        ch->slot_size +=
+            (bcnn_tensor_get_size(&net->nodes[nodes[k]].tensor) + a - 1) / a *
+            a;
+    }
+    ch->num_slots = num_slots;
+    ch->data = (float *)bh_align_calloc(
+        (size_t)bh_max(ch->slot_size, 1) * num_slots * sizeof(float),
+        align_offset_);
+    ch->full = (int *)calloc(num_slots, sizeof(int));
+    ch->free_slots = (int *)calloc(num_slots, sizeof(int));
+    for (k = 0; k < num_slots; ++k) {
+        ch->free_slots[ch->num_free++] = num_slots - 1 - k;
+    }
+    bcnn_mutex_init(&ch->mutex);
+    bcnn_cond_init(&ch->cond);
+}
+
+static void bcnn_channel_free(bcnn_channel *ch) {
+    bcnn_mutex_destroy(&ch->mutex);
+    bcnn_cond_destroy(&ch->cond);
+    bh_free(ch->nodes);
+    bh_free(ch->offsets);
+    bh_align_free(ch->data);
+    bh_free(ch->full);
+    bh_free(ch->free_slots);
+}
+
+// Points the boundary nodes of the stage at the slots of the current frame.
+static void bcnn_stage_bind(bcnn_stage *st, bcnn_channel *in, int in_slot,
+                            bcnn_channel *out, int out_slot) {
+    int k;
+    bcnn_tensor *t = NULL;
+
+    for (k = 0; k < in->num_nodes; ++k) {
+        t = &st->net.nodes[in->nodes[k]].tensor;
+        t->data = bcnn_channel_node_data(in, in_slot, k);
+    }
+    for (k = 0; k < out->num_nodes; ++k) {
+        t = &st->net.nodes[out->nodes[k]].tensor;
+        if (st->pass[k] >= 0) {
+            memcpy(bcnn_channel_node_data(out, out_slot, k),
+                   bcnn_channel_node_data(in, in_slot, st->pass[k]),
+                   bcnn_tensor_get_size(t) * sizeof(float));
+        }
+        t->data = bcnn_channel_node_data(out, out_slot, k);
+    }
+}
+
+static void *bcnn_stage_run(void *arg) {
+    bcnn_stage *st = (bcnn_stage *)arg;
+    bcnn_channel *in = &st->stream->channels[st->id];
+    bcnn_channel *out = &st->stream->channels[st->id + 1];
+    int in_slot, out_slot;
+
+    for (;;) {
+        if ((in_slot = bcnn_channel_take(in, 1)) < 0 ||
+            (out_slot = bcnn_channel_take(out, 0)) < 0) {
+            break;
+        }
+        bcnn_stage_bind(st, in, in_slot, out, out_slot);
+        bcnn_forward_tasks(&st->net, st->first, st->last);
+        bcnn_channel_give(out, out_slot, 1);
+        bcnn_channel_give(in, in_slot, 0);
+    }
+    return NULL;
+}
+
+// Splits the units [0, n[ into 'num_stages' consecutive stages minimizing the
+// cost of the slowest one. cuts[s] is the first unit of stage s.
+static void bcnn_stream_partition(double *cost, int n, int num_stages,
+                                  int *cuts) {
+    int k, c, p;
+    double *prefix = (double *)calloc(n + 1, sizeof(double));
+    double *best = (double *)calloc((num_stages + 1) * (n + 1), sizeof(double));
+    int *arg = (int *)calloc((num_stages + 1) * (n + 1), sizeof(int));
+    double v;
+
+    for (c = 0; c < n; ++c) {
+        prefix[c + 1] = prefix[c] + cost[c];
+    }
+    // best[k * (n + 1) + c]: slowest stage when the first c units are split
+    // into k stages
+    for (c = 0; c <= n; ++c) {
+        best[n + 1 + c] = prefix[c];
+    }
+    for (k = 2; k <= num_stages; ++k) {
+        for (c = k; c <= n; ++c) {
+            best[k * (n + 1) + c] = DBL_MAX;
+            for (p = k - 1; p < c; ++p) {
+                v = bh_max(best[(k - 1) * (n + 1) + p], prefix[c] - prefix[p]);
+                if (v < best[k * (n + 1) + c]) {
+                    best[k * (n + 1) + c] = v;
+                    arg[k * (n + 1) + c] = p;
+                }
+            }
+        }
+    }
+    cuts[num_stages] = n;
+    for (k = num_stages, c = n; k > 1; --k) {
+        c = arg[k * (n + 1) + c];
+        cuts[k - 1] = c;
+    }
+    cuts[0] = 0;
+    bh_free(prefix);
+    bh_free(best);
+    bh_free(arg);
+}
+
+// Per unit cost in msec, taken as the fastest of a few runs.
+static void bcnn_stream_profile(bcnn_net *net, int n, double *cost) {
+    int r, u;
+    bh_timer t = {0};
+
+    for (u = 0; u < n; ++u) {
+        cost[u] = DBL_MAX;
+    }
+    for (r = 0; r < 3; ++r) {
+        for (u = 0; u < n; ++u) {
+            bh_timer_start(&t);
+            bcnn_forward_tasks(net, u, u + 1);
+            bh_timer_stop(&t);
+            cost[u] = bh_min(cost[u], bh_timer_get_msec(&t));
+        }
+    }
+}
+
+int bcnn_stream_initialize(bcnn_net *net, bcnn_stream **stream, int num_stages,
+                           int queue_size, int pin_threads) {
+    int i, j, k, u, first, num, n = 0, num_live;
+    int nb = net->nb_connections;
+    int en = (net->connections[nb - 1].layer->type == COST ? (nb - 2)
+                                                           : (nb - 1));
+    int out = net->connections[en].dst[0];
+    int num_units = (net->num_fused > 0 ? net->num_fused : nb);
+    int stage_threads, ret;
+    int *produced = NULL, *last_use = NULL, *live = NULL, *cuts = NULL;
+    double *cost = NULL, stage_cost;
+    bcnn_stream *s = NULL;
+    bcnn_stage *st = NULL;
+    bcnn_connection *conn = NULL;
+
+#ifdef BCNN_USE_CUDA
+    bh_log_error("Streaming inference is not supported on gpu");
+    return BCNN_INVALID_PARAMETER;
+#endif
+    if (net->state != 0) {
+        bh_log_error("Streaming inference requires a net compiled in predict "
+                     "mode");
+        return BCNN_INVALID_PARAMETER;
+    }
+    if (num_stages < 1 || queue_size < 1) {
+        bh_log_error("Invalid number of stages %d or queue size %d",
+                     num_stages, queue_size);
+        return BCNN_INVALID_PARAMETER;
+    }
+    // Execution units up to the output node, the cost layer is left out
+    for (u = 0; u < num_units; ++u) {
+        bcnn_stream_unit_range(net, u, &first, &num);
+        if (first > en) {
+            break;
+        }
+        n = u + 1;
+    }
+    if (num_stages > n) {
+        bh_log_warning("[Stream] Only %d stages for %d execution units", n, n);
+        num_stages = n;
+    }
+    // First unit writing each node and last unit using it
+    produced = (int *)calloc(net->num_nodes, sizeof(int));
+    last_use = (int *)calloc(net->num_nodes, sizeof(int));
+    live = (int *)calloc(net->num_nodes, sizeof(int));
+    for (i = 0; i < net->num_nodes; ++i) {
+        produced[i] = (i == 0 ? -1 : n);
+        last_use[i] = -1;
+    }
+    for (u = n - 1; u >= 0; --u) {
+        bcnn_stream_unit_range(net, u, &first, &num);
+        for (i = first; i < first + num; ++i) {
+            conn = &net->connections[i];
+            for (j = 0; j < conn->num_src; ++j) {
+                last_use[conn->src[j]] = bh_max(last_use[conn->src[j]], u);
+            }
+            for (j = 0; j < conn->num_dst; ++j) {
+                produced[conn->dst[j]] = bh_min(produced[conn->dst[j]], u);
+                last_use[conn->dst[j]] = bh_max(last_use[conn->dst[j]], u);
+            }
+        }
+    }
+    cost = (double *)calloc(n, sizeof(double));
+    cuts = (int *)calloc(num_stages + 1, sizeof(int));
+    bcnn_stream_profile(net, n, cost);
+    bcnn_stream_partition(cost, n, num_stages, cuts);
+
+    s = (bcnn_stream *)calloc(1, sizeof(bcnn_stream));
+    s->num_stages = num_stages;
+    s->stages = (bcnn_stage *)calloc(num_stages, sizeof(bcnn_stage));
+    s->channels = (bcnn_channel *)calloc(num_stages + 1, sizeof(bcnn_channel));
+    // Nodes crossing each boundary: written before it and used after it (or
+    // being the output)
+    for (k = 0; k <= num_stages; ++k) {
+        num_live = 0;
+        for (i = 0; i < net->num_nodes; ++i) {
+            if (produced[i] < cuts[k] &&
+                (last_use[i] >= cuts[k] || (i == out && k == num_stages))) {
+                live[num_live++] = i;
+            }
+        }
+        bcnn_channel_init(&s->channels[k], net, live, num_live, queue_size);
+    }
+    for (k = 0; k < num_stages; ++k) {
+        st = &s->stages[k];
+        st->stream = s;
+        st->id = k;
+        st->first = cuts[k];
+        st->last = cuts[k + 1];
+        st->net = *net;
+        st->net.scheduler = NULL;
+        st->net.updater = NULL;
+        st->net.nodes = (bcnn_node *)calloc(net->num_nodes, sizeof(bcnn_node));
+        memcpy(st->net.nodes, net->nodes, net->num_nodes * sizeof(bcnn_node));
+        // No gradients in inference, the stages would all clear them
+        for (i = 0; i < net->num_nodes; ++i) {
+            st->net.nodes[i].tensor.grad_data = NULL;
+        }
+        st->pass = (int *)calloc(bh_max(s->channels[k + 1].num_nodes, 1),
+                                 sizeof(int));
+        for (i = 0; i < s->channels[k + 1].num_nodes; ++i) {
+            st->pass[i] = -1;
+            for (j = 0; j < s->channels[k].num_nodes; ++j) {
+                if (s->channels[k].nodes[j] == s->channels[k + 1].nodes[i]) {
+                    st->pass[i] = j;
+                }
+            }
+        }
+        // The stages would otherwise run their layers on the same workers
+        stage_threads = bh_max(net->num_threads / num_stages, 1);
+        if (stage_threads > 1) {
+            ret = bcnn_thread_pool_create(&st->pool, stage_threads - 1,
+                                          net->numa_node);
+            if (ret < 0) {
+                bh_log_warning("[Stream] Could not start the worker threads "
+                               "of stage %d", k);
+            }
+        }
+        bcnn_stage_set_threads(st, st->pool, stage_threads);
+        stage_cost = 0;
+        for (u = st->first; u < st->last; ++u) {
+            stage_cost += cost[u];
+        }
+        bh_log_info("[Stream] stage %d: units [%d, %d[ time= %.3f ms "
+                    "output_nodes= %d", k, st->first, st->last, stage_cost,
+                    s->channels[k + 1].num_nodes);
+    }
+    for (k = 0; k < num_stages; ++k) {
+        st = &s->stages[k];
+        if (bcnn_thread_create(&st->thread, bcnn_stage_run, st) != 0) {
+            bh_log_warning("[Stream] Could not start the thread of stage %d",
+                           k);
+            *stream = s;
+            bcnn_stream_terminate(stream);
+            bh_free(produced);
+            bh_free(last_use);
+            bh_free(live);
+            bh_free(cost);
+            bh_free(cuts);
+            return BCNN_INTERNAL_ERROR;
+        }
+        s->num_threads++;
+        if (pin_threads &&
+            bcnn_thread_set_affinity(st->thread, k % bcnn_num_cores()) != 0) {
+            bh_log_warning("[Stream] Could not pin stage %d to core %d", k,
+                           k % bcnn_num_cores());
+        }
+    }
+    *stream = s;
+    bh_free(produced);
+    bh_free(last_use);
+    bh_free(live);
+    bh_free(cost);
+    bh_free(cuts);
+    return BCNN_SUCCESS;
+}
+
+int bcnn_stream_push(bcnn_stream *stream, const float *input) {
+    bcnn_channel *ch = &stream->channels[0];
+    int slot = bcnn_channel_take(ch, 0);
+
+    if (slot < 0) {
+        return BCNN_INTERNAL_ERROR;
+    }
+    memcpy(bcnn_channel_node_data(ch, slot, 0), input,
+           bcnn_tensor_get_size(&stream->stages[0].net.nodes[0].tensor) *
+               sizeof(float));
+    bcnn_channel_give(ch, slot, 1);
+    return BCNN_SUCCESS;
+}
+
+int bcnn_stream_pop(bcnn_stream *stream, float *output) {
+    bcnn_channel *ch = &stream->channels[stream->num_stages];
+    bcnn_net *net = &stream->stages[0].net;
+    int slot = bcnn_channel_take(ch, 1);
+
+    if (slot < 0) {
+        return BCNN_INTERNAL_ERROR;
+    }
+    memcpy(output, bcnn_channel_node_data(ch, slot, 0),
+           bcnn_tensor_get_size(&net->nodes[ch->nodes[0]].tensor) *
+               sizeof(float));
+    bcnn_channel_give(ch, slot, 0);
+    return BCNN_SUCCESS;
+}
+
+int bcnn_stream_terminate(bcnn_stream **stream) {
+    int k;
+    bcnn_stream *s = *stream;
+    bcnn_stage *st = NULL;
+
+    if (s == NULL) {
+        return BCNN_SUCCESS;
+    }
+    // Frames still in the pipeline are dropped
+    for (k = 0; k <= s->num_stages; ++k) {
+        bcnn_mutex_lock(&s->channels[k].mutex);
+        s->channels[k].stop = 1;
+        bcnn_cond_broadcast(&s->channels[k].cond);
+        bcnn_mutex_unlock(&s->channels[k].mutex);
+    }
+    for (k = 0; k < s->num_threads; ++k) {
+        bcnn_thread_join(s->stages[k].thread);
+    }
+    for (k = 0; k < s->num_stages; ++k) {
+        st = &s->stages[k];
+        bcnn_stage_set_threads(st, st->net.thread_pool, st->net.num_threads);
+        bcnn_thread_pool_destroy(&st->pool);
+        bh_free(s->stages[k].net.nodes);
+        bh_free(s->stages[k].pass);
+    }
+    for (k = 0; k <= s->num_stages; ++k) {
+        bcnn_channel_free(&s->channels[k]);
+    }
+    bh_free(s->stages);
+    bh_free(s->channels);
+    bh_free(s);
+    *stream = NULL;
+    return BCNN_SUCCESS;
+}
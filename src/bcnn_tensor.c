@@ -37,17 +37,20 @@ void bcnn_tensor_create(bcnn_tensor *t, int n, int c, int h, int w,
 
 void bcnn_tensor_fill(bcnn_tensor *t, bcnn_tensor_filler filler) {
     bh_check(t->data != NULL, "Invalid tensor data");
+    bh_check(filler.type == FIXED || filler.rng != NULL,
+             "Random tensor filler requires a generator");
     switch (filler.type) {
         float std_init;
         case XAVIER:
             std_init = sqrtf(3.0f / filler.range);
             for (int i = 0; i < bcnn_tensor_get_size(t); ++i) {
-                t->data[i] = std_init * (2 * ((float)rand() / RAND_MAX) - 1);
+                t->data[i] =
+                    std_init * (2 * bcnn_rng_uniform(filler.rng) - 1);
             }
             break;
         case MSRA:
             std_init = sqrtf(2.0f / filler.range);
-            bcnn_gauss_gen g = {0};
+            bcnn_gauss_gen g = {.rng = filler.rng};
             for (int i = 0; i < bcnn_tensor_get_size(t); ++i) {
                 t->data[i] = std_init * bcnn_rng_gaussian(&g);
             }
@@ -161,3 +164,43 @@ void bcnn_tensor_assign(bcnn_tensor *dst, bcnn_tensor *src) {
 #endif
 #endif
 }
+
+void bcnn_tensor_set_view(bcnn_tensor *t, bcnn_tensor *src, int offset) {
+    bcnn_tensor_free(t);
+    t->data = src->data + offset;
+#ifndef BCNN_DEPLOY_ONLY
+    if (t->has_grad) {
+        t->grad_data = (src->grad_data ? src->grad_data + offset : NULL);
+    }
+#endif
+#ifdef BCNN_USE_CUDA
+    t->data_gpu = src->data_gpu + offset;
+#ifndef BCNN_DEPLOY_ONLY
+    if (t->has_grad) {
+        t->grad_data_gpu =
+            (src->grad_data_gpu ? src->grad_data_gpu + offset : NULL);
+    }
+#endif
+#endif
+}
+
+static float *bcnn_tensor_migrate_buffer(float *src, int size) {
+    float *dst = (float *)bh_align_calloc(size * sizeof(float), align_offset_);
+    memcpy(dst, src, size * sizeof(float));
+    bh_align_free(src);
+    return dst;
+}
+
+void bcnn_tensor_migrate(bcnn_tensor *t) {
+    int size = bcnn_tensor_get_size(t);
+
+    if (size <= 0) return;
+    if (t->data != NULL) {
+        t->data = bcnn_tensor_migrate_buffer(t->data, size);
+    }
+#ifndef BCNN_DEPLOY_ONLY
+    if (t->has_grad && t->grad_data != NULL) {
+        t->grad_data = bcnn_tensor_migrate_buffer(t->grad_data, size);
+    }
+#endif
+}
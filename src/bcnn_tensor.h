@@ -55,10 +55,13 @@ typedef enum bcnn_filler_type {
     MSRA     // MSRA init
 } bcnn_filler_type;
 
+struct bcnn_rng;
+
 typedef struct tensor_filler {
     int range;
     float value;
     bcnn_filler_type type;
+    struct bcnn_rng *rng;  // Random generator, required by XAVIER and MSRA
 } bcnn_tensor_filler;
 
 void bcnn_tensor_create(bcnn_tensor *t, int n, int c, int h, int w,
@@ -104,6 +107,14 @@ int bcnn_tensor_get_size2d(bcnn_tensor *t);
 
 void bcnn_tensor_assign(bcnn_tensor *dst, bcnn_tensor *src);
 
+// Releases the memory of 't' and makes it point to the memory of 'src',
+// starting at element 'offset'. 't' must not be freed afterwards.
+void bcnn_tensor_set_view(bcnn_tensor *t, bcnn_tensor *src, int offset);
+
+// Moves the host memory of 't' to new buffers allocated and written by the
+// calling thread, so that their pages are placed on its NUMA node.
+void bcnn_tensor_migrate(bcnn_tensor *t);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,430 @@
+/*
+* Copyright (c) 2016 Jean-Noel Braun.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE  // pthread_setaffinity_np
+#endif
+
+#include "bcnn_thread.h"
+
+#include <stdio.h>
+
+#if defined(_WIN32)
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <bh/bh_mem.h>
+
+#if defined(_WIN32)
+typedef struct {
+    bcnn_thread_func func;
+    void *arg;
+} bcnn_thread_start;
+
+static unsigned __stdcall bcnn_thread_entry(void *p) {
+    bcnn_thread_start start = *(bcnn_thread_start *)p;
+    bh_free(p);
+    start.func(start.arg);
+    return 0;
+}
+
+int bcnn_thread_create(bcnn_thread *thread, bcnn_thread_func func, void *arg) {
+    bcnn_thread_start *start =
+        (bcnn_thread_start *)malloc(sizeof(bcnn_thread_start));
+    start->func = func;
+    start->arg = arg;
+    *thread = (HANDLE)_beginthreadex(NULL, 0, bcnn_thread_entry, start, 0,
+                                     NULL);
+    if (*thread == 0) {
+        bh_free(start);
+        return -1;
+    }
+    return 0;
+}
+
+int bcnn_thread_join(bcnn_thread thread) {
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    return 0;
+}
+
+// Slim reader / writer locks can be statically initialized
+void bcnn_mutex_init(bcnn_mutex *mutex) { InitializeSRWLock(mutex); }
+
+void bcnn_mutex_lock(bcnn_mutex *mutex) { AcquireSRWLockExclusive(mutex); }
+
+void bcnn_mutex_unlock(bcnn_mutex *mutex) { ReleaseSRWLockExclusive(mutex); }
+
+void bcnn_mutex_destroy(bcnn_mutex *mutex) { (void)mutex; }
+
+void bcnn_cond_init(bcnn_cond *cond) { InitializeConditionVariable(cond); }
+
+void bcnn_cond_wait(bcnn_cond *cond, bcnn_mutex *mutex) {
+    SleepConditionVariableSRW(cond, mutex, INFINITE, 0);
+}
+
+void bcnn_cond_signal(bcnn_cond *cond) { WakeConditionVariable(cond); }
+
+void bcnn_cond_broadcast(bcnn_cond *cond) { WakeAllConditionVariable(cond); }
+
+void bcnn_cond_destroy(bcnn_cond *cond) { (void)cond; }
+
+int bcnn_atomic_add(volatile int *val, int inc) {
+    return (int)InterlockedExchangeAdd((volatile LONG *)val, inc) + inc;
+}
+
+int bcnn_atomic_load(volatile int *val) {
+    return (int)InterlockedCompareExchange((volatile LONG *)val, 0, 0);
+}
+
+int bcnn_thread_set_affinity(bcnn_thread thread, int core) {
+    if (core < 0 || core >= (int)(sizeof(DWORD_PTR) * 8)) {
+        return -1;
+    }
+    return (SetThreadAffinityMask(thread, (DWORD_PTR)1 << core) != 0 ? 0
+                                                                       : -1);
+}
+
+int bcnn_num_cores(void) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+}
+
+int bcnn_numa_num_nodes(void) {
+    ULONG highest = 0;
+    if (!GetNumaHighestNodeNumber(&highest)) {
+        return 1;
+    }
+    return (int)highest + 1;
+}
+
+int bcnn_numa_node_cores(int node, int *cores, int max_cores) {
+    ULONGLONG mask = 0;
+    int i, n = 0;
+
+    if (!GetNumaNodeProcessorMask((UCHAR)node, &mask)) {
+        return 0;
+    }
+    for (i = 0; i < (int)(sizeof(mask) * 8) && n < max_cores; ++i) {
+        if (mask & ((ULONGLONG)1 << i)) {
+            cores[n++] = i;
+        }
+    }
+    return n;
+}
+
+int bcnn_thread_set_numa_node(bcnn_thread thread, int node) {
+    ULONGLONG mask = 0;
+
+    if (!GetNumaNodeProcessorMask((UCHAR)node, &mask) || mask == 0) {
+        return -1;
+    }
+    return (SetThreadAffinityMask(thread, (DWORD_PTR)mask) != 0 ? 0 : -1);
+}
+#else
+int bcnn_thread_create(bcnn_thread *thread, bcnn_thread_func func, void *arg) {
+    return pthread_create(thread, NULL, func, arg);
+}
+
+int bcnn_thread_join(bcnn_thread thread) { return pthread_join(thread, NULL); }
+
+void bcnn_mutex_init(bcnn_mutex *mutex) { pthread_mutex_init(mutex, NULL); }
+
+void bcnn_mutex_lock(bcnn_mutex *mutex) { pthread_mutex_lock(mutex); }
+
+void bcnn_mutex_unlock(bcnn_mutex *mutex) { pthread_mutex_unlock(mutex); }
+
+void bcnn_mutex_destroy(bcnn_mutex *mutex) { pthread_mutex_destroy(mutex); }
+
+void bcnn_cond_init(bcnn_cond *cond) { pthread_cond_init(cond, NULL); }
+
+void bcnn_cond_wait(bcnn_cond *cond, bcnn_mutex *mutex) {
+    pthread_cond_wait(cond, mutex);
+}
+
+void bcnn_cond_signal(bcnn_cond *cond) { pthread_cond_signal(cond); }
+
+void bcnn_cond_broadcast(bcnn_cond *cond) { pthread_cond_broadcast(cond); }
+
+void bcnn_cond_destroy(bcnn_cond *cond) { pthread_cond_destroy(cond); }
+
+int bcnn_atomic_add(volatile int *val, int inc) {
+    return __atomic_add_fetch(val, inc, __ATOMIC_ACQ_REL);
+}
+
+int bcnn_atomic_load(volatile int *val) {
+    return __atomic_load_n(val, __ATOMIC_ACQUIRE);
+}
+
+int bcnn_thread_set_affinity(bcnn_thread thread, int core) {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set);
+#else
+    (void)thread;
+    (void)core;
+    return -1;
+#endif
+}
+
+int bcnn_num_cores(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0 ? (int)n : 1);
+}
+
+int bcnn_numa_num_nodes(void) {
+    int n = 0;
+#if defined(__linux__)
+    char path[64];
+    for (;; ++n) {
+        sprintf(path, "/sys/devices/system/node/node%d", n);
+        if (access(path, F_OK) != 0) {
+            break;
+        }
+    }
+#endif
+    return (n > 0 ? n : 1);
+}
+
+int bcnn_numa_node_cores(int node, int *cores, int max_cores) {
+    int a, b, n = 0;
+#if defined(__linux__)
+    char path[64], sep;
+    FILE *f = NULL;
+
+    // List of ranges, e.g. "0-3,8-11"
+    sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+    f = fopen(path, "r");
+    if (f != NULL) {
+        while (fscanf(f, "%d", &a) == 1) {
+            b = a;
+            sep = (char)fgetc(f);
+            if (sep == '-') {
+                if (fscanf(f, "%d", &b) != 1) {
+                    break;
+                }
+                sep = (char)fgetc(f);
+            }
+            for (; a <= b && n < max_cores; ++a) {
+                cores[n++] = a;
+            }
+            if (sep != ',') {
+                break;
+            }
+        }
+        fclose(f);
+        return n;
+    }
+#endif
+    // No topology information: a single node holding all the cores
+    if (node == 0) {
+        for (a = 0; a < bcnn_num_cores() && n < max_cores; ++a) {
+            cores[n++] = a;
+        }
+    }
+    return n;
+}
+
+int bcnn_thread_set_numa_node(bcnn_thread thread, int node) {
+#if defined(__linux__)
+    int i, n, cores[CPU_SETSIZE];
+    cpu_set_t set;
+
+    n = bcnn_numa_node_cores(node, cores, CPU_SETSIZE);
+    if (n <= 0) {
+        return -1;
+    }
+    CPU_ZERO(&set);
+    for (i = 0; i < n; ++i) {
+        CPU_SET(cores[i], &set);
+    }
+    return pthread_setaffinity_np(thread, sizeof(set), &set);
+#else
+    (void)thread;
+    (void)node;
+    return -1;
+#endif
+}
+#endif
+
+typedef struct {
+    struct bcnn_thread_pool *pool;
+    int id;  // Range run by the worker, 0 being the calling thread
+} bcnn_pool_worker;
+
+struct bcnn_thread_pool {
+    int num_threads;  // Started workers
+    bcnn_thread *threads;
+    bcnn_pool_worker *workers;
+    bcnn_mutex run_mutex;  // Held by the caller of the current loop
+    bcnn_mutex mutex;
+    bcnn_cond cond;       // New loop or stop
+    bcnn_cond done_cond;  // Workers done with the loop
+    int generation;       // Loop counter, workers start when it changes
+    int num_done;
+    int stop;
+    // Current loop
+    bcnn_range_func func;
+    void *arg;
+    int n;
+    int num_ranges;
+};
+
+static void bcnn_pool_run_range(struct bcnn_thread_pool *pool, int i) {
+    int begin = (int)((long long)pool->n * i / pool->num_ranges);
+    int end = (int)((long long)pool->n * (i + 1) / pool->num_ranges);
+    pool->func(pool->arg, begin, end);
+}
+
+static void *bcnn_pool_worker_run(void *arg) {
+    bcnn_pool_worker *w = (bcnn_pool_worker *)arg;
+    struct bcnn_thread_pool *pool = w->pool;
+    int generation = 0;
+
+    bcnn_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (!pool->stop && pool->generation == generation) {
+            bcnn_cond_wait(&pool->cond, &pool->mutex);
+        }
+        if (pool->stop) {
+            break;
+        }
+        generation = pool->generation;
+        if (w->id < pool->num_ranges) {
+            bcnn_mutex_unlock(&pool->mutex);
+            bcnn_pool_run_range(pool, w->id);
+            bcnn_mutex_lock(&pool->mutex);
+        }
+        if (++pool->num_done == pool->num_threads) {
+            bcnn_cond_signal(&pool->done_cond);
+        }
+    }
+    bcnn_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+int bcnn_thread_pool_create(struct bcnn_thread_pool **pool, int num_threads,
+                            int numa_node) {
+    int i, ret = 0;
+    struct bcnn_thread_pool *p = NULL;
+
+    *pool = NULL;
+    if (num_threads <= 0) {
+        return -1;
+    }
+    p = (struct bcnn_thread_pool *)calloc(1, sizeof(struct bcnn_thread_pool));
+    p->threads = (bcnn_thread *)calloc(num_threads, sizeof(bcnn_thread));
+    p->workers =
+        (bcnn_pool_worker *)calloc(num_threads, sizeof(bcnn_pool_worker));
+    bcnn_mutex_init(&p->run_mutex);
+    bcnn_mutex_init(&p->mutex);
+    bcnn_cond_init(&p->cond);
+    bcnn_cond_init(&p->done_cond);
+    for (i = 0; i < num_threads; ++i) {
+        p->workers[i].pool = p;
+        p->workers[i].id = i + 1;
+        if (bcnn_thread_create(&p->threads[i], bcnn_pool_worker_run,
+                               &p->workers[i]) != 0) {
+            break;
+        }
+        if (numa_node >= 0 &&
+            bcnn_thread_set_numa_node(p->threads[i], numa_node) != 0) {
+            ret = 1;
+        }
+        p->num_threads++;
+    }
+    if (p->num_threads == 0) {
+        bcnn_thread_pool_destroy(&p);
+        return -1;
+    }
+    *pool = p;
+    return ret;
+}
+
+void bcnn_thread_pool_destroy(struct bcnn_thread_pool **pool) {
+    int i;
+    struct bcnn_thread_pool *p = *pool;
+
+    if (p == NULL) {
+        return;
+    }
+    bcnn_mutex_lock(&p->mutex);
+    p->stop = 1;
+    bcnn_cond_broadcast(&p->cond);
+    bcnn_mutex_unlock(&p->mutex);
+    for (i = 0; i < p->num_threads; ++i) {
+        bcnn_thread_join(p->threads[i]);
+    }
+    bcnn_cond_destroy(&p->done_cond);
+    bcnn_cond_destroy(&p->cond);
+    bcnn_mutex_destroy(&p->mutex);
+    bcnn_mutex_destroy(&p->run_mutex);
+    bh_free(p->workers);
+    bh_free(p->threads);
+    bh_free(p);
+    *pool = NULL;
+}
+
+int bcnn_parallel_for(struct bcnn_thread_pool *pool, int n, int num_threads,
+                      bcnn_range_func func, void *arg) {
+    if (pool == NULL) {
+        num_threads = 1;
+    } else if (num_threads > pool->num_threads + 1) {
+        num_threads = pool->num_threads + 1;
+    }
+    if (num_threads > n) {
+        num_threads = n;
+    }
+    if (num_threads <= 1) {
+        if (n > 0) {
+            func(arg, 0, n);
+        }
+        return 0;
+    }
+    // The pool holds a single loop: concurrent callers wait for their turn
+    bcnn_mutex_lock(&pool->run_mutex);
+    bcnn_mutex_lock(&pool->mutex);
+    pool->func = func;
+    pool->arg = arg;
+    pool->n = n;
+    pool->num_ranges = num_threads;
+    pool->num_done = 0;
+    pool->generation++;
+    bcnn_cond_broadcast(&pool->cond);
+    bcnn_mutex_unlock(&pool->mutex);
+
+    bcnn_pool_run_range(pool, 0);
+
+    // Every worker reports, with or without a range to run
+    bcnn_mutex_lock(&pool->mutex);
+    while (pool->num_done < pool->num_threads) {
+        bcnn_cond_wait(&pool->done_cond, &pool->mutex);
+    }
+    bcnn_mutex_unlock(&pool->mutex);
+    bcnn_mutex_unlock(&pool->run_mutex);
+    return 0;
+}
@@ -0,0 +1,106 @@
+/*
+* Copyright (c) 2016 Jean-Noel Braun.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#ifndef BCNN_THREAD_H
+#define BCNN_THREAD_H
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Minimal portable threading primitives (pthread or win32) */
+#if defined(_WIN32)
+typedef HANDLE bcnn_thread;
+typedef SRWLOCK bcnn_mutex;
+typedef CONDITION_VARIABLE bcnn_cond;
+#define BCNN_MUTEX_INITIALIZER SRWLOCK_INIT
+#else
+typedef pthread_t bcnn_thread;
+typedef pthread_mutex_t bcnn_mutex;
+typedef pthread_cond_t bcnn_cond;
+#define BCNN_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#endif
+
+typedef void *(*bcnn_thread_func)(void *arg);
+
+int bcnn_thread_create(bcnn_thread *thread, bcnn_thread_func func, void *arg);
+int bcnn_thread_join(bcnn_thread thread);
+/* Restricts 'thread' to the logical core 'core'. Returns 0 on success, non
+ * zero if it failed or is not supported by the platform. */
+int bcnn_thread_set_affinity(bcnn_thread thread, int core);
+
+void bcnn_mutex_init(bcnn_mutex *mutex);
+void bcnn_mutex_lock(bcnn_mutex *mutex);
+void bcnn_mutex_unlock(bcnn_mutex *mutex);
+void bcnn_mutex_destroy(bcnn_mutex *mutex);
+
+void bcnn_cond_init(bcnn_cond *cond);
+/* Releases 'mutex' while waiting, it is locked again on return */
+void bcnn_cond_wait(bcnn_cond *cond, bcnn_mutex *mutex);
+void bcnn_cond_signal(bcnn_cond *cond);
+void bcnn_cond_broadcast(bcnn_cond *cond);
+void bcnn_cond_destroy(bcnn_cond *cond);
+
+/* Atomically adds 'inc' to '*val' and returns the new value */
+int bcnn_atomic_add(volatile int *val, int inc);
+int bcnn_atomic_load(volatile int *val);
+
+/* Persistent workers running the ranges of bcnn_parallel_for. They are bound
+ * to the cores of NUMA node 'numa_node' if it is >= 0. Returns 0 on success,
+ * 1 if some workers could not be bound and -1 if no worker could be started,
+ * '*pool' being left NULL in that case. */
+struct bcnn_thread_pool;
+int bcnn_thread_pool_create(struct bcnn_thread_pool **pool, int num_threads,
+                            int numa_node);
+void bcnn_thread_pool_destroy(struct bcnn_thread_pool **pool);
+
+/* Splits [0, n) into up to 'num_threads' contiguous ranges and calls
+ * func(arg, begin, end) on each of them, the first range being run by the
+ * calling thread and the others by the workers of 'pool' (everything runs on
+ * the calling thread if 'pool' is NULL). Returns once all the ranges are
+ * done. A pool runs one loop at a time: concurrent callers are serialized. */
+typedef void (*bcnn_range_func)(void *arg, int begin, int end);
+int bcnn_parallel_for(struct bcnn_thread_pool *pool, int n, int num_threads,
+                      bcnn_range_func func, void *arg);
+
+/* Number of logical cores available */
+int bcnn_num_cores(void);
+
+/* NUMA topology. Without topology information, the system is seen as a
+ * single node holding all the cores. bcnn_numa_node_cores fills 'cores' with
+ * the logical cores of 'node' and returns their number. */
+int bcnn_numa_num_nodes(void);
+int bcnn_numa_node_cores(int node, int *cores, int max_cores);
+/* Restricts 'thread' to the cores of NUMA node 'node' */
+int bcnn_thread_set_numa_node(bcnn_thread thread, int node);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // BCNN_THREAD_H
@@ -28,6 +28,144 @@
 #include <bh/bh_error.h>
 #include <bh/bh_string.h>
 
+/* Philox4x32-10 constants (Salmon et al., "Parallel random numbers: as easy
+ * as 1, 2, 3") */
+#define PHILOX_M0 0xD2511F53
+#define PHILOX_M1 0xCD9E8D57
+#define PHILOX_W0 0x9E3779B9
+#define PHILOX_W1 0xBB67AE85
+
+static void bcnn_philox4x32(const uint32_t *ctr, const uint32_t *key,
+                            uint32_t *out) {
+    uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+    uint32_t k0 = key[0], k1 = key[1];
+    int r;
+
+    for (r = 0; r < 10; ++r) {
+        uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+        uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+        c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c1 = (uint32_t)p1;
+        c3 = (uint32_t)p0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+static void bcnn_rng_incr(bcnn_rng *rng, uint32_t n) {
+    uint32_t lo = rng->ctr[0] + n;
+    if (lo < rng->ctr[0]) {
+        rng->ctr[1]++;
+    }
+    rng->ctr[0] = lo;
+}
+
+void bcnn_rng_init(bcnn_rng *rng, uint64_t seed, uint64_t stream) {
+    rng->key[0] = (uint32_t)seed;
+    rng->key[1] = (uint32_t)(seed >> 32);
+    rng->ctr[0] = 0;
+    rng->ctr[1] = 0;
+    rng->ctr[2] = (uint32_t)stream;
+    rng->ctr[3] = (uint32_t)(stream >> 32);
+    rng->idx = 4;
+}
+
+uint32_t bcnn_rng_u32(bcnn_rng *rng) {
+    if (rng->idx == 4) {
+        bcnn_philox4x32(rng->ctr, rng->key, rng->buf);
+        bcnn_rng_incr(rng, 1);
+        rng->idx = 0;
+    }
+    return rng->buf[rng->idx++];
+}
+
+float bcnn_rng_uniform(bcnn_rng *rng) {
+    return (bcnn_rng_u32(rng) >> 8) * (1.0f / 16777216.0f);
+}
+
+#ifdef BCNN_USE_AVX
+// Unsigned 32 x 32 -> 64 bits products of the 8 lanes of a by m
+static bh_inline void bcnn_mulhilo_avx(__m256i a, __m256i m, __m256i *hi,
+                                       __m256i *lo) {
+    __m256i even = _mm256_mul_epu32(a, m);
+    __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), m);
+    *lo = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+    *hi = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+}
+
+// Generates 8 consecutive blocks, i.e. 32 floats, starting at the current
+// counter
+static void bcnn_philox4x32_avx(bcnn_rng *rng, float *x) {
+    __m256i c0, c1, c2, c3, hi0, lo0, hi1, lo1, out[4];
+    __m256i m0 = _mm256_set1_epi32((int)PHILOX_M0);
+    __m256i m1 = _mm256_set1_epi32((int)PHILOX_M1);
+    __m256 norm = _mm256_set1_ps(1.0f / 16777216.0f);
+    uint32_t k0 = rng->key[0], k1 = rng->key[1];
+    float v[4][8];
+    int i, r;
+
+    if (rng->ctr[0] > 0xFFFFFFF7) {  // Carry in the middle of the batch
+        for (i = 0; i < 32; ++i) {
+            x[i] = bcnn_rng_uniform(rng);
+        }
+        return;
+    }
+    c0 = _mm256_add_epi32(_mm256_set1_epi32((int)rng->ctr[0]),
+                          _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+    c1 = _mm256_set1_epi32((int)rng->ctr[1]);
+    c2 = _mm256_set1_epi32((int)rng->ctr[2]);
+    c3 = _mm256_set1_epi32((int)rng->ctr[3]);
+    for (r = 0; r < 10; ++r) {
+        bcnn_mulhilo_avx(c0, m0, &hi0, &lo0);
+        bcnn_mulhilo_avx(c2, m1, &hi1, &lo1);
+        c0 = _mm256_xor_si256(_mm256_xor_si256(hi1, c1),
+                              _mm256_set1_epi32((int)k0));
+        c2 = _mm256_xor_si256(_mm256_xor_si256(hi0, c3),
+                              _mm256_set1_epi32((int)k1));
+        c1 = lo1;
+        c3 = lo0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+    for (r = 0; r < 4; ++r) {
+        __m256 f = _mm256_cvtepi32_ps(_mm256_srli_epi32(out[r], 8));
+        _mm256_storeu_ps(v[r], _mm256_mul_ps(f, norm));
+    }
+    for (i = 0; i < 8; ++i) {
+        x[4 * i] = v[0][i];
+        x[4 * i + 1] = v[1][i];
+        x[4 * i + 2] = v[2][i];
+        x[4 * i + 3] = v[3][i];
+    }
+    bcnn_rng_incr(rng, 8);
+}
+#endif
+
+void bcnn_rng_uniform_n(bcnn_rng *rng, int n, float *x) {
+    int i = 0;
+    // Flush the values left in the current block first
+    for (; i < n && rng->idx < 4; ++i) {
+        x[i] = bcnn_rng_uniform(rng);
+    }
+#ifdef BCNN_USE_AVX
+    for (; i < n - 31; i += 32) {
+        bcnn_philox4x32_avx(rng, x + i);
+    }
+#endif
+    for (; i < n; ++i) {
+        x[i] = bcnn_rng_uniform(rng);
+    }
+}
+
 float bcnn_rng_gaussian(bcnn_gauss_gen *g) {
     float v1, v2, s, m;
 
@@ -36,8 +174,8 @@ float bcnn_rng_gaussian(bcnn_gauss_gen *g) {
         return g->r;
     } else {
         do {
-            v1 = 2 * (float)rand() / RAND_MAX - 1;
-            v2 = 2 * (float)rand() / RAND_MAX - 1;
+            v1 = 2 * bcnn_rng_uniform(g->rng) - 1;
+            v2 = 2 * bcnn_rng_uniform(g->rng) - 1;
             s = v1 * v1 + v2 * v2;
         } while (s >= 1.0f || s == 0.0f);
         g->state = 1;
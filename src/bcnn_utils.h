@@ -39,9 +39,29 @@
 extern "C" {
 #endif
 
+/* Stream ids of the generators owned by a net. Dropout layers use
+ * BCNN_RNG_STREAM_DROPOUT + index of their connection. The high 32 bits of a
+ * stream hold the offset of the thread, replica or shard drawing from it, see
+ * BCNN_RNG_STREAM_AT. */
+#define BCNN_RNG_STREAM_FILLER 0
+#define BCNN_RNG_STREAM_DATA 1
+#define BCNN_RNG_STREAM_SHUFFLE 2
+#define BCNN_RNG_STREAM_DROPOUT 3
+#define BCNN_RNG_STREAM_AT(id, offset) \
+    (((uint64_t)(offset) << 32) | (uint64_t)(uint32_t)(id))
+
+void bcnn_rng_init(bcnn_rng *rng, uint64_t seed, uint64_t stream);
+uint32_t bcnn_rng_u32(bcnn_rng *rng);
+/* Uniform float in [0; 1) */
+float bcnn_rng_uniform(bcnn_rng *rng);
+/* Fills x with n uniform floats in [0; 1). Gives the same sequence as n calls
+ * to bcnn_rng_uniform. */
+void bcnn_rng_uniform_n(bcnn_rng *rng, int n, float *x);
+
 typedef struct {
     int state;
     float r;
+    bcnn_rng *rng;
 } bcnn_gauss_gen;
 
 float bcnn_rng_gaussian(bcnn_gauss_gen *g);
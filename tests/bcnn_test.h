@@ -0,0 +1,115 @@
+/*
+* Copyright (c) 2016 Jean-Noel Braun.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/* Helpers shared by the tests */
+
+#ifndef BCNN_TEST_H
+#define BCNN_TEST_H
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <bcnn/bcnn.h>
+
+#include "bcnn_tensor.h"
+
+/* Fails the test (returns 1 from the calling function) if 'cond' is false */
+#define BCNN_TEST_CHECK(cond, ...)                                        \
+    do {                                                                  \
+        if (!(cond)) {                                                    \
+            fprintf(stderr, "%s:%d: check failed: ", __FILE__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__);                                 \
+            fprintf(stderr, "\n");                                        \
+            return 1;                                                     \
+        }                                                                 \
+    } while (0)
+
+/* Deterministic values in [-1; 1] */
+static inline void bcnn_test_fill(float *x, int n, int seed) {
+    int i;
+    for (i = 0; i < n; ++i) {
+        x[i] = (float)(((i + seed) * 7919 + seed * 104729) % 255) / 127.0f -
+               1.0f;
+    }
+}
+
+static inline float bcnn_test_max_diff(const float *a, const float *b, int n) {
+    int i;
+    float d, m = 0.0f;
+    for (i = 0; i < n; ++i) {
+        d = fabsf(a[i] - b[i]);
+        m = (d > m ? d : m);
+    }
+    return m;
+}
+
+/* Output node of the net: destination of the last connection before the
+ * cost layer, if any */
+static inline int bcnn_test_output_node(bcnn_net *net) {
+    int last = net->nb_connections - 1;
+    if (net->connections[last].layer->type == COST) {
+        last--;
+    }
+    return net->connections[last].dst[0];
+}
+
+/* Runs a forward pass on 'in' (the size of the input node) and copies the
+ * node 'out' to 'res'. Returns the size of the output */
+static inline int bcnn_test_run(bcnn_net *net, const float *in, int out,
+                                float *res) {
+    int out_sz = bcnn_tensor_get_size(&net->nodes[out].tensor);
+    memcpy(net->nodes[0].tensor.data, in,
+           bcnn_tensor_get_size(&net->nodes[0].tensor) * sizeof(float));
+    bcnn_forward(net);
+    memcpy(res, net->nodes[out].tensor.data, out_sz * sizeof(float));
+    return out_sz;
+}
+
+/* Sets deterministic biases, batchnorm statistics and PReLU slopes, so that
+ * these parameters are not trivially 0 or 1 */
+static inline void bcnn_test_fill_params(bcnn_net *net) {
+    int i, k;
+    bcnn_layer *l = NULL;
+    for (i = 0; i < net->nb_connections; ++i) {
+        l = net->connections[i].layer;
+        if (l->type == BATCHNORM) {
+            for (k = 0; k < bcnn_tensor_get_size(&l->running_mean); ++k) {
+                l->running_mean.data[k] = 0.1f * k - 0.2f;
+                l->running_variance.data[k] = 0.5f + 0.05f * k;
+            }
+        }
+        if (l->biases.data != NULL) {
+            for (k = 0; k < bcnn_tensor_get_size(&l->biases); ++k) {
+                l->biases.data[k] = 0.01f * k - 0.05f;
+            }
+        }
+        if (l->type == ACTIVATION && l->activation == PRELU) {
+            for (k = 0; k < bcnn_tensor_get_size(&l->weights); ++k) {
+                l->weights.data[k] = 0.1f * k;
+            }
+        }
+    }
+}
+
+#endif  // BCNN_TEST_H
@@ -0,0 +1,138 @@
+/*
+* Copyright (c) 2016 Jean-Noel Braun.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/* Code generation, first step: writes the inference source of a net together
+ * with the runtime forward of a test input, which test_codegen compares once
+ * the generated file is compiled. Also checks the literals of non-finite
+ * weights.
+ *
+ * Usage: codegen_write <output directory> */
+
+#include "../bcnn_test.h"
+
+static bcnn_net *build_net(void) {
+    bcnn_net *net = NULL;
+
+    bcnn_init_net(&net);
+    bcnn_net_set_seed(net, 5);
+    bcnn_net_set_input_shape(net, 13, 11, 3, 2);
+    bcnn_add_convolutional_layer(net, 16, 3, 1, 1, 0, XAVIER, RELU, 0, "input",
+                                 "c1");
+    bcnn_add_batchnorm_layer(net, "c1", "b1");
+    bcnn_add_activation_layer(net, PRELU, "b1");
+    bcnn_add_maxpool_layer(net, 2, 2, "b1", "p1");
+    bcnn_add_depthwise_sep_conv_layer(net, 3, 1, 1, 0, XAVIER, TANH, "p1",
+                                      "dw1");
+    bcnn_add_convolutional_layer(net, 8, 1, 1, 0, 0, XAVIER, LRELU, 0, "p1",
+                                 "c2");
+    bcnn_add_concat_layer(net, "dw1", "c2", "cat");
+    bcnn_add_deconvolutional_layer(net, 5, 3, 2, 0, XAVIER, RAMP, "cat", "d1");
+    bcnn_add_dropout_layer(net, 0.3f, "d1");
+    bcnn_add_convolutional_layer(net, 4, 3, 2, 0, 0, XAVIER, NONE, 0, "d1",
+                                 "c3");
+    bcnn_add_fullc_layer(net, 10, XAVIER, NONE, 0, "c3", "f1");
+    bcnn_add_softmax_layer(net, "f1", "out");
+    bcnn_add_cost_layer(net, EUCLIDEAN_LOSS, COST_SSE, 1.0f, "out", "label",
+                        "cost");
+    bcnn_test_fill_params(net);
+    return net;
+}
+
+static int write_reference(const char *dir) {
+    bcnn_net *net = build_net();
+    int out = net->connections[net->nb_connections - 2].dst[0];
+    int in_sz = bcnn_tensor_get_size(&net->nodes[0].tensor);
+    int out_sz = bcnn_tensor_get_size(&net->nodes[out].tensor);
+    char path[1024];
+    FILE *f = NULL;
+
+    bcnn_set_param(net, "fuse_ops", "0");
+    bcnn_compile_net(net, "predict");
+    bcnn_test_fill(net->nodes[0].tensor.data, in_sz, 3);
+    bcnn_forward(net);
+    snprintf(path, sizeof(path), "%s/codegen_ref.bin", dir);
+    f = fopen(path, "wb");
+    BCNN_TEST_CHECK(f != NULL, "can not open %s", path);
+    fwrite(&in_sz, sizeof(int), 1, f);
+    fwrite(&out_sz, sizeof(int), 1, f);
+    fwrite(net->nodes[0].tensor.data, sizeof(float), in_sz, f);
+    fwrite(net->nodes[out].tensor.data, sizeof(float), out_sz, f);
+    fclose(f);
+    snprintf(path, sizeof(path), "%s/codegen_net.c", dir);
+    BCNN_TEST_CHECK(bcnn_write_c_source(net, path, "cg") == BCNN_SUCCESS,
+                    "can not write %s", path);
+    bcnn_end_net(&net);
+    return 0;
+}
+
+static int check_nonfinite(const char *dir) {
+    bcnn_net *net = NULL;
+    char path[1024], *src = NULL, *p = NULL;
+    FILE *f = NULL;
+    long size;
+    int num_inf = 0;
+
+    bcnn_init_net(&net);
+    bcnn_net_set_input_shape(net, 4, 4, 1, 1);
+    bcnn_add_fullc_layer(net, 3, XAVIER, NONE, 0, "input", "f1");
+    net->connections[0].layer->weights.data[0] = -INFINITY;
+    net->connections[0].layer->weights.data[1] = INFINITY;
+    net->connections[0].layer->biases.data[0] = NAN;
+    bcnn_compile_net(net, "predict");
+    snprintf(path, sizeof(path), "%s/codegen_nonfinite.c", dir);
+    BCNN_TEST_CHECK(bcnn_write_c_source(net, path, "nf") == BCNN_SUCCESS,
+                    "can not write %s", path);
+    bcnn_end_net(&net);
+
+    f = fopen(path, "rb");
+    BCNN_TEST_CHECK(f != NULL, "can not open %s", path);
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    src = (char *)calloc(size + 1, 1);
+    fread(src, 1, size, f);
+    fclose(f);
+    for (p = strstr(src, "INFINITY,"); p != NULL;
+         p = strstr(p + 1, "INFINITY,")) {
+        num_inf++;
+    }
+    BCNN_TEST_CHECK(strstr(src, "NAN,") != NULL, "no NAN literal");
+    BCNN_TEST_CHECK(strstr(src, "-INFINITY,") != NULL && num_inf == 2,
+                    "missing INFINITY literals (%d)", num_inf);
+    BCNN_TEST_CHECK(strstr(src, "nanf") == NULL && strstr(src, "inff") == NULL,
+                    "non-finite value printed as a number");
+    BCNN_TEST_CHECK(strstr(src, "static BCNN_ALIGNED float nf_arena[") != NULL,
+                    "unaligned arena");
+    free(src);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <output directory>\n", argv[0]);
+        return 1;
+    }
+    if (write_reference(argv[1]) != 0) {
+        return 1;
+    }
+    return check_nonfinite(argv[1]);
+}
@@ -0,0 +1,71 @@
+/*
+* Copyright (c) 2016 Jean-Noel Braun.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/* Code generation, second step: the source written by codegen_write is built
+ * into this test, whose forward must match the runtime one. The deconvolution
+ * of the net has no padding, so that the runtime computes it by output phases
+ * and the generated gemm + col2im only matches up to rounding. */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+extern const int cg_input_size;
+extern const int cg_output_size;
+void cg_forward(const float *input, float *output);
+
+int main(void) {
+    FILE *f = fopen("codegen_ref.bin", "rb");
+    int i, in_sz = 0, out_sz = 0;
+    float *in = NULL, *ref = NULL, *res = NULL, diff = 0.0f;
+
+    if (f == NULL) {
+        fprintf(stderr, "can not open codegen_ref.bin\n");
+        return 1;
+    }
+    if (fread(&in_sz, sizeof(int), 1, f) != 1 ||
+        fread(&out_sz, sizeof(int), 1, f) != 1 || in_sz != cg_input_size ||
+        out_sz != cg_output_size) {
+        fprintf(stderr, "reference does not match the generated shapes\n");
+        fclose(f);
+        return 1;
+    }
+    in = (float *)calloc(in_sz, sizeof(float));
+    ref = (float *)calloc(out_sz, sizeof(float));
+    res = (float *)calloc(out_sz, sizeof(float));
+    fread(in, sizeof(float), in_sz, f);
+    fread(ref, sizeof(float), out_sz, f);
+    fclose(f);
+
+    cg_forward(in, res);
+    for (i = 0; i < out_sz; ++i) {
+        diff = fmaxf(diff, fabsf(ref[i] - res[i]));
+    }
+    free(in);
+    free(ref);
+    free(res);
+    if (!(diff < 1e-5f)) {
+        fprintf(stderr, "generated outputs differ by %g\n", diff);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,138 @@
+/*
+* Copyright (c) 2016 Jean-Noel Braun.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/* Concat layer: input order of the 2 inputs and n-ary versions, and zero-copy
+ * concatenation against the copy path used for batches */
+
+#include "bcnn_test.h"
+
+static bcnn_net *build_net(int batch) {
+    bcnn_net *net = NULL;
+    char *ids[3] = {"a", "bn", "c"};
+
+    bcnn_init_net(&net);
+    bcnn_net_set_seed(net, 1);
+    bcnn_net_set_input_shape(net, 8, 8, 2, batch);
+    bcnn_add_convolutional_layer(net, 3, 3, 1, 1, 0, XAVIER, RELU, 0, "input",
+                                 "a");
+    bcnn_add_convolutional_layer(net, 2, 3, 1, 1, 0, XAVIER, NONE, 0, "a",
+                                 "b");
+    bcnn_add_batchnorm_layer(net, "b", "bn");
+    bcnn_add_activation_layer(net, RELU, "bn");
+    bcnn_add_convolutional_layer(net, 4, 1, 1, 0, 0, XAVIER, TANH, 0, "bn",
+                                 "c");
+    bcnn_add_concat_layer_n(net, 3, ids, "cat");
+    bcnn_add_concat_layer(net, "a", "cat", "cat2");
+    bcnn_add_convolutional_layer(net, 2, 3, 1, 1, 0, XAVIER, NONE, 0, "cat2",
+                                 "o");
+    bcnn_add_fullc_layer(net, 3, XAVIER, NONE, 0, "o", "f");
+    bcnn_add_cost_layer(net, EUCLIDEAN_LOSS, COST_SSE, 1.0f, "f", "label",
+                        "cost");
+    bcnn_test_fill_params(net);
+    return net;
+}
+
+static int find_concat(bcnn_net *net, int nth) {
+    int i;
+    for (i = 0; i < net->nb_connections; ++i) {
+        if (net->connections[i].layer->type == CONCAT && nth-- == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int num_views(bcnn_net *net) {
+    int i, n = 0;
+    for (i = 0; i < net->num_nodes; ++i) {
+        n += net->nodes[i].is_view;
+    }
+    return n;
+}
+
+int main(void) {
+    bcnn_net *n1 = build_net(1), *n2 = build_net(2);
+    bcnn_connection *cat = &n1->connections[find_concat(n1, 0)];
+    bcnn_connection *cat2 = &n1->connections[find_concat(n1, 1)];
+    int in_sz = bcnn_tensor_get_size3d(&n1->nodes[0].tensor);
+    int out = bcnn_test_output_node(n1);
+    int i, k, state, sz;
+    float in[2 * 8 * 8 * 2], res1[3], res2[2 * 3], diff;
+    bcnn_layer *l1 = NULL, *l2 = NULL;
+
+    // n-ary: order of the arguments
+    BCNN_TEST_CHECK(strcmp(n1->nodes[cat->src[0]].id, "a") == 0 &&
+                        strcmp(n1->nodes[cat->src[1]].id, "bn") == 0 &&
+                        strcmp(n1->nodes[cat->src[2]].id, "c") == 0,
+                    "n-ary concat inputs are not in argument order");
+    // 2 inputs: the node defined last comes first
+    BCNN_TEST_CHECK(strcmp(n1->nodes[cat2->src[0]].id, "cat") == 0 &&
+                        strcmp(n1->nodes[cat2->src[1]].id, "a") == 0,
+                    "2 inputs concat order changed");
+
+    // n2 holds twice the image of n1: batchnorm statistics are the same and
+    // the gradients of the weights are summed over the 2 images
+    for (state = 0; state < 2; ++state) {
+        bcnn_compile_net(n1, state ? "train" : "predict");
+        bcnn_compile_net(n2, state ? "train" : "predict");
+        BCNN_TEST_CHECK(num_views(n1) > 0, "no concat input was aliased");
+        BCNN_TEST_CHECK(num_views(n2) == 0, "batch inputs were aliased");
+        bcnn_test_fill(in, in_sz, 3);
+        memcpy(in + in_sz, in, in_sz * sizeof(float));
+        for (i = 0; i < 3; ++i) {
+            n1->nodes[1].tensor.data[i] = (float)i;
+            n2->nodes[1].tensor.data[i] = (float)i;
+            n2->nodes[1].tensor.data[i + 3] = (float)i;
+        }
+        bcnn_test_run(n1, in, out, res1);
+        bcnn_test_run(n2, in, out, res2);
+        for (i = 0; i < 2; ++i) {
+            diff = bcnn_test_max_diff(res1, res2 + i * 3, 3);
+            BCNN_TEST_CHECK(diff < 1e-5f, "state %d: outputs differ by %g",
+                            state, diff);
+        }
+        if (state == 0) {
+            continue;
+        }
+        bcnn_backward(n1);
+        bcnn_backward(n2);
+        for (k = 0; k < n1->nb_connections; ++k) {
+            l1 = n1->connections[k].layer;
+            l2 = n2->connections[k].layer;
+            if (l1->type != CONVOLUTIONAL && l1->type != FULL_CONNECTED) {
+                continue;
+            }
+            sz = bcnn_tensor_get_size(&l1->weights);
+            for (i = 0; i < sz; ++i) {
+                diff = fabsf(2.0f * l1->weights.grad_data[i] -
+                             l2->weights.grad_data[i]);
+                BCNN_TEST_CHECK(diff < 1e-4f,
+                                "connection %d: weight gradients differ by %g",
+                                k, diff);
+            }
+        }
+    }
+
+    bcnn_end_net(&n1);
+    bcnn_end_net(&n2);
+    return 0;
+}
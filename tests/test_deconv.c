@@ -0,0 +1,144 @@
+/*
+* Copyright (c) 2016 Jean-Noel Braun.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/* Deconvolution by output phases: the outputs, weights gradients and inputs
+ * gradients of unpadded deconvolutions must match the gemm + col2im
+ * formulation */
+
+#include "bcnn_test.h"
+
+#include "bcnn_deconv_layer.h"
+#include "bcnn_mat.h"
+
+typedef struct {
+    int c, h, w, num, size, stride, batch;
+} deconv_case;
+
+// Same computations as the unphased cpu path of the deconvolution layer
+static void reference(bcnn_layer *layer, bcnn_tensor *src, bcnn_tensor *dst,
+                      float *out, float *grad_w, float *grad_src) {
+    int i, num = layer->num, ks = layer->size * layer->size;
+    int src_sz = bcnn_tensor_get_size3d(src);
+    int dst_sz = bcnn_tensor_get_size3d(dst);
+    int hw = src->w * src->h;
+    float *col = (float *)calloc(num * ks * hw, sizeof(float));
+
+    memset(out, 0, bcnn_tensor_get_size(dst) * sizeof(float));
+    for (i = 0; i < src->n; ++i) {
+        bcnn_gemm(1, 0, num * ks, hw, src->c, 1.0f, layer->weights.data,
+                  num * ks, src->data + i * src_sz, hw, 0.0f, col, hw);
+        bcnn_col2im(col, num, dst->h, dst->w, layer->size, 0, layer->stride,
+                    out + i * dst_sz);
+    }
+    memset(grad_w, 0, bcnn_tensor_get_size(&layer->weights) * sizeof(float));
+    for (i = 0; i < src->n; ++i) {
+        bcnn_im2col(dst->grad_data + i * dst_sz, num, dst->h, dst->w,
+                    layer->size, 0, layer->stride, col);
+        bcnn_gemm(0, 1, src->c, num * ks, hw, 1.0f / src->n,
+                  src->data + i * src_sz, hw, col, hw, 1.0f, grad_w, num * ks);
+        bcnn_gemm(0, 0, src->c, hw, num * ks, 1.0f, layer->weights.data,
+                  num * ks, col, hw, 0.0f, grad_src + i * src_sz, hw);
+    }
+    free(col);
+}
+
+static int run_case(const deconv_case *t) {
+    bcnn_net *net = NULL;
+    bcnn_connection *conn = NULL;
+    bcnn_tensor *src = NULL, *dst = NULL;
+    int out_sz, w_sz, src_sz;
+    float *out = NULL, *grad_w = NULL, *grad_src = NULL;
+    float d_out, d_w, d_src;
+
+    bcnn_init_net(&net);
+    bcnn_net_set_seed(net, 2);
+    bcnn_net_set_input_shape(net, t->w, t->h, t->c, t->batch);
+    bcnn_add_deconvolutional_layer(net, t->num, t->size, t->stride, 0, XAVIER,
+                                   NONE, "input", "d1");
+    bcnn_compile_net(net, "train");
+    conn = &net->connections[0];
+    src = &net->nodes[conn->src[0]].tensor;
+    dst = &net->nodes[conn->dst[0]].tensor;
+    BCNN_TEST_CHECK(bcnn_deconv_layer_is_phased(conn->layer),
+                    "unpadded deconvolution not computed by phases");
+    out_sz = bcnn_tensor_get_size(dst);
+    w_sz = bcnn_tensor_get_size(&conn->layer->weights);
+    src_sz = bcnn_tensor_get_size(src);
+    // The net input has no gradient: one is lent for the test
+    BCNN_TEST_CHECK(src->grad_data == NULL, "unexpected input gradient");
+    src->grad_data = (float *)calloc(src_sz, sizeof(float));
+    bcnn_test_fill(src->data, src_sz, 1);
+    bcnn_test_fill(dst->grad_data, out_sz, 2);
+    bcnn_test_fill(src->grad_data, src_sz, 3);
+
+    out = (float *)calloc(out_sz, sizeof(float));
+    grad_w = (float *)calloc(w_sz, sizeof(float));
+    grad_src = (float *)calloc(src_sz, sizeof(float));
+    reference(conn->layer, src, dst, out, grad_w, grad_src);
+
+    // Stale values must be overwritten
+    bcnn_test_fill(dst->data, out_sz, 4);
+    bcnn_forward_deconv_layer_gemm_cpu(conn->layer, &net->nodes[conn->src[0]],
+                                       &net->nodes[conn->dst[0]]);
+    memset(conn->layer->weights.grad_data, 0, w_sz * sizeof(float));
+    bcnn_backward_deconv_layer(net, conn);
+    d_out = bcnn_test_max_diff(out, dst->data, out_sz);
+    d_w = bcnn_test_max_diff(grad_w, conn->layer->weights.grad_data, w_sz);
+    d_src = bcnn_test_max_diff(grad_src, src->grad_data, src_sz);
+    free(out);
+    free(grad_w);
+    free(grad_src);
+    free(src->grad_data);
+    src->grad_data = NULL;
+    BCNN_TEST_CHECK(d_out < 1e-4f && d_w < 1e-4f && d_src < 1e-4f,
+                    "c=%d %dx%d num=%d size=%d stride=%d batch=%d: outputs "
+                    "differ by %g, weights gradients by %g, inputs gradients "
+                    "by %g",
+                    t->c, t->h, t->w, t->num, t->size, t->stride, t->batch,
+                    d_out, d_w, d_src);
+    bcnn_end_net(&net);
+    return 0;
+}
+
+int main(void) {
+    int i;
+    const deconv_case cases[] = {
+        {3, 5, 4, 4, 2, 2, 1},  // size multiple of the stride
+        {2, 4, 6, 3, 4, 2, 2},
+        {3, 5, 5, 2, 3, 2, 3},  // size not divisible by the stride
+        {4, 3, 4, 5, 5, 3, 2},
+        {2, 4, 3, 3, 2, 3, 2},  // stride larger than the kernel
+        {3, 3, 3, 2, 1, 2, 1},
+        {5, 4, 4, 3, 3, 1, 2},  // single phase
+    };
+
+#ifdef BCNN_USE_CUDA
+    // Deconvolutions are never phased on gpu
+    return 0;
+#endif
+    for (i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); ++i) {
+        if (run_case(&cases[i]) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
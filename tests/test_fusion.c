@@ -0,0 +1,85 @@
+/*
+* Copyright (c) 2016 Jean-Noel Braun.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/* Operator fusion: a predict pass through the fused units must give the same
+ * outputs as the connections run one by one */
+
+#include "bcnn_test.h"
+
+static bcnn_net *build_net(void) {
+    bcnn_net *net = NULL;
+
+    bcnn_init_net(&net);
+    bcnn_net_set_seed(net, 1);
+    bcnn_net_set_input_shape(net, 12, 12, 3, 4);
+    bcnn_add_convolutional_layer(net, 8, 3, 1, 1, 0, XAVIER, NONE, 0, "input",
+                                 "c1");
+    bcnn_add_batchnorm_layer(net, "c1", "b1");
+    bcnn_add_activation_layer(net, PRELU, "b1");
+    bcnn_add_dropout_layer(net, 0.3f, "b1");
+    bcnn_add_deconvolutional_layer(net, 4, 2, 2, 0, XAVIER, RELU, "b1", "d1");
+    bcnn_add_batchnorm_layer(net, "d1", "b2");
+    bcnn_add_convolutional_layer(net, 4, 3, 2, 1, 0, XAVIER, TANH, 0, "b2",
+                                 "c2");
+    bcnn_add_fullc_layer(net, 10, XAVIER, RELU, 0, "c2", "f1");
+    bcnn_add_batchnorm_layer(net, "f1", "b3");
+    bcnn_add_activation_layer(net, LRELU, "b3");
+    bcnn_add_cost_layer(net, EUCLIDEAN_LOSS, COST_SSE, 1.0f, "b3", "label",
+                        "cost");
+    bcnn_test_fill_params(net);
+    return net;
+}
+
+int main(void) {
+    bcnn_net *net = build_net();
+    int out = bcnn_test_output_node(net);
+    int in_sz = bcnn_tensor_get_size(&net->nodes[0].tensor);
+    int out_sz = bcnn_tensor_get_size(&net->nodes[out].tensor);
+    float *in = (float *)calloc(in_sz, sizeof(float));
+    float *ref = (float *)calloc(out_sz, sizeof(float));
+    float *res = (float *)calloc(out_sz, sizeof(float));
+    float diff;
+
+    bcnn_test_fill(in, in_sz, 1);
+    bcnn_set_param(net, "fuse_ops", "0");
+    bcnn_compile_net(net, "predict");
+    BCNN_TEST_CHECK(net->num_fused == 0, "fusion should be disabled");
+    bcnn_test_run(net, in, out, ref);
+
+    bcnn_set_param(net, "fuse_ops", "1");
+    bcnn_compile_net(net, "predict");
+    BCNN_TEST_CHECK(net->num_fused > 0 && net->num_fused < net->nb_connections,
+                    "no connection was fused (%d units)", net->num_fused);
+    bcnn_test_run(net, in, out, res);
+    diff = bcnn_test_max_diff(ref, res, out_sz);
+    BCNN_TEST_CHECK(diff < 1e-5f, "fused outputs differ by %g", diff);
+
+    // Training never runs the fused plan
+    bcnn_compile_net(net, "train");
+    BCNN_TEST_CHECK(net->num_fused == 0, "fused plan kept in train mode");
+
+    bcnn_end_net(&net);
+    free(in);
+    free(ref);
+    free(res);
+    return 0;
+}
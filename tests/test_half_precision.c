@@ -0,0 +1,87 @@
+/*
+* Copyright (c) 2016 Jean-Noel Braun.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/* Half precision weights and model files */
+
+#include "bcnn_test.h"
+
+static bcnn_net *build_net(void) {
+    bcnn_net *net = NULL;
+
+    bcnn_init_net(&net);
+    bcnn_net_set_seed(net, 1);
+    bcnn_net_set_input_shape(net, 24, 24, 3, 3);
+    bcnn_add_convolutional_layer(net, 20, 3, 1, 1, 0, XAVIER, RELU, 0, "input",
+                                 "c1");
+    bcnn_add_deconvolutional_layer(net, 6, 2, 2, 0, XAVIER, RELU, "c1", "d1");
+    bcnn_add_convolutional_layer(net, 9, 3, 2, 1, 0, XAVIER, TANH, 0, "d1",
+                                 "c2");
+    bcnn_add_fullc_layer(net, 37, XAVIER, NONE, 0, "c2", "f1");
+    bcnn_add_cost_layer(net, EUCLIDEAN_LOSS, COST_SSE, 1.0f, "f1", "label",
+                        "cost");
+    return net;
+}
+
+int main(void) {
+    bcnn_net *net = build_net(), *net2 = build_net();
+    int in_sz = bcnn_tensor_get_size(&net->nodes[0].tensor);
+    int out = bcnn_test_output_node(net);
+    float *in = (float *)calloc(in_sz, sizeof(float));
+    float ref[37 * 3], res[37 * 3], res2[37 * 3], diff;
+    int n;
+    uint32_t old_magic = 0x36314642;
+
+    bcnn_test_fill(in, in_sz, 1);
+    bcnn_compile_net(net, "predict");
+    n = bcnn_test_run(net, in, out, ref);
+    bcnn_set_param(net, "half_precision", "1");
+    bcnn_compile_net(net, "predict");
+    bcnn_test_run(net, in, out, res);
+    diff = bcnn_test_max_diff(ref, res, n);
+    BCNN_TEST_CHECK(diff < 1e-2f, "half precision outputs differ by %g", diff);
+
+    // Half precision file, loaded into a single precision net
+    bcnn_write_model_f16(net, "test_f16.bcnnmodel");
+    bcnn_load_model(net2, "test_f16.bcnnmodel");
+    bcnn_compile_net(net2, "predict");
+    bcnn_test_run(net2, in, out, res2);
+    diff = bcnn_test_max_diff(res, res2, n);
+    BCNN_TEST_CHECK(diff < 1e-5f, "f16 model reload differs by %g", diff);
+
+    // A single precision model whose learning rate has the bit pattern of
+    // the former half precision tag is still read as single precision
+    bcnn_compile_net(net, "train");
+    memcpy(&net->learner.learning_rate, &old_magic, sizeof(float));
+    bcnn_write_model(net, "test_f32.bcnnmodel");
+    bcnn_load_model(net2, "test_f32.bcnnmodel");
+    bcnn_compile_net(net2, "predict");
+    bcnn_test_run(net2, in, out, res2);
+    diff = bcnn_test_max_diff(ref, res2, n);
+    BCNN_TEST_CHECK(diff < 1e-6f, "f32 model reload differs by %g", diff);
+
+    remove("test_f16.bcnnmodel");
+    remove("test_f32.bcnnmodel");
+    bcnn_end_net(&net);
+    bcnn_end_net(&net2);
+    free(in);
+    return 0;
+}
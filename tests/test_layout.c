@@ -0,0 +1,149 @@
+/*
+* Copyright (c) 2016 Jean-Noel Braun.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/* Channel-blocked layout: a predict pass with the blocked kernels must give
+ * the same outputs as the planar connections, the fusion still merging the
+ * connections that the layout leaves planar */
+
+#include "bcnn_test.h"
+
+#include "bcnn_layout.h"
+#include "bcnn_mat.h"
+
+static bcnn_net *build_net(void) {
+    bcnn_net *net = NULL;
+
+    bcnn_init_net(&net);
+    bcnn_net_set_seed(net, 3);
+    bcnn_net_set_input_shape(net, 21, 21, 3, 2);
+    bcnn_add_convolutional_layer(net, 16, 3, 1, 1, 0, XAVIER, RELU, 0, "input",
+                                 "c0");
+    bcnn_add_convolutional_layer(net, 16, 3, 1, 1, 0, XAVIER, NONE, 0, "c0",
+                                 "c1");
+    bcnn_add_batchnorm_layer(net, "c1", "b1");
+    bcnn_add_activation_layer(net, PRELU, "b1");
+    bcnn_add_dropout_layer(net, 0.3f, "b1");
+    bcnn_add_maxpool_layer(net, 2, 2, "b1", "p1");
+    bcnn_add_depthwise_sep_conv_layer(net, 3, 1, 1, 0, XAVIER, RELU, "p1",
+                                      "dw");
+    bcnn_add_convolutional_layer(net, 8, 1, 1, 0, 0, XAVIER, LRELU, 0, "dw",
+                                 "c2");
+    bcnn_add_convolutional_layer(net, 16, 3, 2, 1, 0, XAVIER, TANH, 0, "c2",
+                                 "c3");
+    bcnn_add_maxpool_layer(net, 3, 2, "c3", "p2");
+    // Planar tail, left to the fusion
+    bcnn_add_fullc_layer(net, 10, XAVIER, NONE, 0, "p2", "f1");
+    bcnn_add_batchnorm_layer(net, "f1", "b2");
+    bcnn_add_activation_layer(net, RELU, "b2");
+    bcnn_add_cost_layer(net, EUCLIDEAN_LOSS, COST_SSE, 1.0f, "b2", "label",
+                        "cost");
+    bcnn_test_fill_params(net);
+    return net;
+}
+
+// Fused units must leave the blocked connections on their own
+static int check_plan(bcnn_net *net) {
+    int i, j, num_merged = 0;
+    bcnn_fused_unit *unit = NULL;
+
+    BCNN_TEST_CHECK(net->layout != NULL, "no connection is blocked");
+    for (i = 0; i < net->num_fused; ++i) {
+        unit = &net->fused[i];
+        if (unit->num_conn == 1) {
+            continue;
+        }
+        num_merged += unit->num_conn;
+        for (j = unit->first; j < unit->first + unit->num_conn; ++j) {
+            BCNN_TEST_CHECK(!bcnn_layout_is_blocked(net, j),
+                            "blocked connection %d fused", j);
+        }
+    }
+    BCNN_TEST_CHECK(num_merged > 0, "the planar connections were not fused");
+    return 0;
+}
+
+int main(void) {
+    bcnn_net *net = build_net();
+    int i, out = bcnn_test_output_node(net);
+    int in_sz = bcnn_tensor_get_size(&net->nodes[0].tensor);
+    int out_sz = bcnn_tensor_get_size(&net->nodes[out].tensor);
+    float *in = (float *)calloc(in_sz, sizeof(float));
+    float *ref = (float *)calloc(out_sz, sizeof(float));
+    float *res = (float *)calloc(out_sz, sizeof(float));
+    float diff;
+    bcnn_layer *layer = NULL;
+
+    bcnn_test_fill(in, in_sz, 1);
+    bcnn_set_param(net, "fuse_ops", "0");
+    bcnn_compile_net(net, "predict");
+    BCNN_TEST_CHECK(net->layout == NULL, "blocked layout should be disabled");
+    bcnn_test_run(net, in, out, ref);
+
+    net->blocked_layout = 1;
+    bcnn_set_param(net, "fuse_ops", "1");
+    bcnn_compile_net(net, "predict");
+    if (check_plan(net) != 0) {
+        return 1;
+    }
+    bcnn_test_run(net, in, out, res);
+    diff = bcnn_test_max_diff(ref, res, out_sz);
+    BCNN_TEST_CHECK(diff < 1e-4f, "blocked outputs differ by %g", diff);
+
+    // The reordered weights and the batchnorm denominators follow the loaded
+    // model
+    BCNN_TEST_CHECK(bcnn_write_model(net, "test_layout.bcnnmodel") ==
+                        BCNN_SUCCESS,
+                    "can not write the model");
+    for (i = 0; i < net->nb_connections; ++i) {
+        layer = net->connections[i].layer;
+        if (layer->weights.data != NULL) {
+            memset(layer->weights.data, 0,
+                   bcnn_tensor_get_size(&layer->weights) * sizeof(float));
+        }
+        if (layer->type == BATCHNORM) {
+            bcnn_fill_f32(bcnn_tensor_get_size(&layer->running_variance), 4.0f,
+                          layer->running_variance.data);
+        }
+    }
+    bcnn_compile_net(net, "predict");
+    BCNN_TEST_CHECK(bcnn_load_model(net, "test_layout.bcnnmodel") ==
+                        BCNN_SUCCESS,
+                    "can not load the model");
+    remove("test_layout.bcnnmodel");
+    if (check_plan(net) != 0) {
+        return 1;
+    }
+    bcnn_test_run(net, in, out, res);
+    diff = bcnn_test_max_diff(ref, res, out_sz);
+    BCNN_TEST_CHECK(diff < 1e-4f, "reloaded outputs differ by %g", diff);
+
+    // Training never runs the blocked kernels
+    bcnn_compile_net(net, "train");
+    BCNN_TEST_CHECK(net->layout == NULL && net->num_fused == 0,
+                    "predict plan kept in train mode");
+
+    bcnn_end_net(&net);
+    free(in);
+    free(ref);
+    free(res);
+    return 0;
+}
@@ -0,0 +1,179 @@
+/*
+* Copyright (c) 2016 Jean-Noel Braun.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/* Resuming an interrupted bcnn_pack_data */
+
+#include <bip/bip.h>
+
+#include "bcnn_test.h"
+
+#define NUM_IMAGES 10
+
+typedef struct {
+    int32_t line;
+    int32_t part;
+    int64_t offset;
+    int64_t size;
+} idx_entry;
+
+static long read_file(const char *name, unsigned char **buf) {
+    FILE *f = fopen(name, "rb");
+    long size;
+
+    *buf = NULL;
+    if (f == NULL) {
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    rewind(f);
+    *buf = (unsigned char *)malloc(size + 1);
+    if (fread(*buf, 1, size, f) != (size_t)size) {
+        size = -1;
+    }
+    fclose(f);
+    return size;
+}
+
+static void write_file(const char *name, unsigned char *buf, long size) {
+    FILE *f = fopen(name, "wb");
+    fwrite(buf, 1, size, f);
+    fclose(f);
+}
+
+static int same_file(const char *a, const char *b) {
+    unsigned char *da = NULL, *db = NULL;
+    long na = read_file(a, &da), nb = read_file(b, &db);
+    int same = (na >= 0 && na == nb && memcmp(da, db, na) == 0);
+
+    free(da);
+    free(db);
+    return same;
+}
+
+/* Copies the complete pack 'full' to 'out' as left by an interruption: the
+ * index keeps 'num_entries' entries plus half of the next one and the part
+ * file is cut 'part_cut' bytes after the end of the record of the last
+ * kept entry (negative values cut into this record). */
+static void make_interrupted(int num_entries, long part_cut) {
+    unsigned char *idx = NULL, *part = NULL;
+    long idx_size = read_file("full.idx", &idx);
+    long part_size = read_file("full_0.bin", &part);
+    long hdr_size = idx_size - NUM_IMAGES * (long)sizeof(idx_entry);
+    idx_entry e;
+
+    memcpy(&e, idx + hdr_size + (num_entries - 1) * sizeof(idx_entry),
+           sizeof(e));
+    write_file("resumed.idx", idx,
+               hdr_size + num_entries * sizeof(idx_entry) +
+                   sizeof(idx_entry) / 2);
+    write_file("resumed_0.bin", part,
+               bh_min(part_size, (long)(e.offset + e.size) + part_cut));
+    free(idx);
+    free(part);
+}
+
+static int check_resume(int num_entries, long part_cut) {
+    make_interrupted(num_entries, part_cut);
+    BCNN_TEST_CHECK(bcnn_pack_data("list.txt", 1, LABEL_FLOAT, 0, 0, 2,
+                                   "resumed") == BCNN_SUCCESS,
+                    "resume after %d entries failed", num_entries);
+    BCNN_TEST_CHECK(same_file("full_0.bin", "resumed_0.bin"),
+                    "resumed part differs (%d entries, cut %ld)", num_entries,
+                    part_cut);
+    BCNN_TEST_CHECK(same_file("full.idx", "resumed.idx"),
+                    "resumed index differs (%d entries, cut %ld)",
+                    num_entries, part_cut);
+    return 0;
+}
+
+int main(void) {
+    unsigned char img[8 * 8 * 3];
+    char name[64];
+    FILE *f = fopen("list.txt", "wt");
+    bcnn_net *net = NULL;
+    bcnn_iterator iter = {0};
+    int i, k, seen[NUM_IMAGES] = {0};
+
+    for (i = 0; i < NUM_IMAGES; ++i) {
+        for (k = 0; k < (int)sizeof(img); ++k) {
+            img[k] = (unsigned char)(i * 17 + k);
+        }
+        sprintf(name, "pack_img%d.png", i);
+        bip_write_image(name, img, 8, 8, 3, 8 * 3);
+        fprintf(f, "%s %d\n", name, i);
+        // A line which can not be packed
+        if (i == NUM_IMAGES / 2) {
+            fprintf(f, "pack_missing.png %d\n", i);
+        }
+    }
+    fclose(f);
+    remove("full.idx");
+    BCNN_TEST_CHECK(bcnn_pack_data("list.txt", 1, LABEL_FLOAT, 0, 0, 2,
+                                   "full") == BCNN_SUCCESS,
+                    "packing failed");
+    // The part header holds the number of records packed, not of lines
+    f = fopen("full_0.bin", "rb");
+    BCNN_TEST_CHECK(f != NULL && fread(&k, sizeof(int), 1, f) == 1,
+                    "can not read the part header");
+    fclose(f);
+    BCNN_TEST_CHECK(k == NUM_IMAGES, "part header counts %d records", k);
+
+    // Garbage after the last indexed record
+    if (check_resume(4, 100) != 0) {
+        return 1;
+    }
+    // Record of the last entry only partly written: resumes one line before
+    if (check_resume(6, -10) != 0) {
+        return 1;
+    }
+    // No complete entry
+    if (check_resume(1, -10) != 0) {
+        return 1;
+    }
+
+    // The resumed pack reads back entirely
+    bcnn_init_net(&net);
+    bcnn_net_set_input_shape(net, 8, 8, 3, 1);
+    bcnn_add_fullc_layer(net, 1, XAVIER, NONE, 0, "input", "f1");
+    bcnn_add_cost_layer(net, EUCLIDEAN_LOSS, COST_SSE, 1.0f, "f1", "label",
+                        "cost");
+    net->prediction_type = REGRESSION;
+    bcnn_compile_net(net, "predict");
+    BCNN_TEST_CHECK(bcnn_iterator_initialize(net, &iter, "resumed", NULL,
+                                             "bin") == BCNN_SUCCESS,
+                    "can not read the resumed pack");
+    BCNN_TEST_CHECK(iter.n_samples == NUM_IMAGES, "%d samples read back",
+                    iter.n_samples);
+    for (i = 0; i < NUM_IMAGES; ++i) {
+        bcnn_iterator_next(net, &iter);
+        k = (int)iter.label_float[0];
+        BCNN_TEST_CHECK(k >= 0 && k < NUM_IMAGES && !seen[k] &&
+                            iter.input_uchar[0] == (unsigned char)(k * 17),
+                        "unexpected sample %d", k);
+        seen[k] = 1;
+    }
+    bcnn_iterator_terminate(&iter);
+    bcnn_end_net(&net);
+
+    return 0;
+}
@@ -0,0 +1,101 @@
+/*
+* Copyright (c) 2016 Jean-Noel Braun.
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+/* Streaming inference: the frames popped from a pipeline of stages running
+ * multithreaded layers must match a serial predict pass */
+
+#include "bcnn_test.h"
+
+#define NUM_FRAMES 6
+
+static bcnn_net *build_net(void) {
+    bcnn_net *net = NULL;
+    int i;
+    char src[8], dst[8];
+
+    bcnn_init_net(&net);
+    bcnn_net_set_seed(net, 1);
+    bcnn_net_set_input_shape(net, 1, 1, 2048, 1);
+    for (i = 0; i < 4; ++i) {
+        snprintf(src, sizeof(src), (i == 0 ? "input" : "f%d"), i - 1);
+        snprintf(dst, sizeof(dst), "f%d", i);
+        bcnn_add_fullc_layer(net, 1024, XAVIER, RELU, 0, src, dst);
+    }
+    bcnn_test_fill_params(net);
+    return net;
+}
+
+int main(void) {
+    bcnn_net *net = build_net();
+    bcnn_stream *stream = NULL;
+    int out = bcnn_test_output_node(net);
+    int in_sz = bcnn_tensor_get_size(&net->nodes[0].tensor);
+    int out_sz = bcnn_tensor_get_size(&net->nodes[out].tensor);
+    float *in = (float *)calloc(NUM_FRAMES * in_sz, sizeof(float));
+    float *ref = (float *)calloc(NUM_FRAMES * out_sz, sizeof(float));
+    float *res = (float *)calloc(out_sz, sizeof(float));
+    float diff;
+    int i;
+
+    bcnn_set_param(net, "num_threads", "1");
+    bcnn_compile_net(net, "predict");
+    for (i = 0; i < NUM_FRAMES; ++i) {
+        bcnn_test_fill(in + i * in_sz, in_sz, i + 1);
+        bcnn_test_run(net, in + i * in_sz, out, ref + i * out_sz);
+    }
+
+    // Each stage gets a single fully connected layer and its own workers
+    bcnn_set_param(net, "num_threads", "4");
+    bcnn_compile_net(net, "predict");
+    BCNN_TEST_CHECK(bcnn_stream_initialize(net, &stream, 4, 2, 0) ==
+                        BCNN_SUCCESS,
+                    "could not start the stream");
+    for (i = 0; i < NUM_FRAMES; ++i) {
+        BCNN_TEST_CHECK(bcnn_stream_push(stream, in + i * in_sz) ==
+                            BCNN_SUCCESS,
+                        "could not push frame %d", i);
+        if (i >= 1) {
+            bcnn_stream_pop(stream, res);
+            diff = bcnn_test_max_diff(ref + (i - 1) * out_sz, res, out_sz);
+            BCNN_TEST_CHECK(diff < 1e-4f, "frame %d differs by %g", i - 1,
+                            diff);
+        }
+    }
+    bcnn_stream_pop(stream, res);
+    diff = bcnn_test_max_diff(ref + (NUM_FRAMES - 1) * out_sz, res, out_sz);
+    BCNN_TEST_CHECK(diff < 1e-4f, "frame %d differs by %g", NUM_FRAMES - 1,
+                    diff);
+    bcnn_stream_terminate(&stream);
+
+    // The layers run on the workers of the net again
+    bcnn_test_run(net, in, out, res);
+    diff = bcnn_test_max_diff(ref, res, out_sz);
+    BCNN_TEST_CHECK(diff < 1e-4f, "outputs after the stream differ by %g",
+                    diff);
+
+    bcnn_end_net(&net);
+    free(in);
+    free(ref);
+    free(res);
+    return 0;
+}
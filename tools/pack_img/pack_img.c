@@ -30,8 +30,11 @@
 
 int show_usage()
 {
-    fprintf(stderr, "Usage: pack-img <list_img_labels> <output_path> [-l label_width] [-t label_type]\n");
+    fprintf(stderr, "Usage: pack-img <list_img_labels> <output_path> [-l label_width] [-t label_type] [-r width height] [-j num_threads]\n");
     fprintf(stderr, "\t Values for 'label_type': 'int' or 'float' or 'img' \n");
+    fprintf(stderr, "\t -r: store raw pixels resized to width x height instead of encoded images\n");
+    fprintf(stderr, "\t -j: number of threads. Default: number of cores\n");
+    fprintf(stderr, "\t An interrupted packing is resumed when run again with the same options\n");
     return 0;
 }
 
@@ -60,6 +63,7 @@ int main(int argc, char **argv)
 {
     int label_width = 1;
     bcnn_label_type type = LABEL_INT;
+    int raw_w = 0, raw_h = 0, num_threads = 0;
     int i = 3;
 
     if (argc < 2) {
@@ -101,6 +105,27 @@ int main(int argc, char **argv)
             }
             i++;
         }
+        else if (strcmp(argv[i], "-r") == 0) {
+            if (i + 2 < argc && !is_option(argv[i + 1]) && !is_option(argv[i + 2])) {
+                raw_w = atoi(argv[i + 1]);
+                raw_h = atoi(argv[i + 2]);
+            }
+            else {
+                bad_parameter(argv[i]);
+                return -1;
+            }
+            i += 2;
+        }
+        else if (strcmp(argv[i], "-j") == 0) {
+            if (i + 1 < argc && !is_option(argv[i + 1])) {
+                num_threads = atoi(argv[i + 1]);
+            }
+            else {
+                bad_parameter(argv[i]);
+                return -1;
+            }
+            i++;
+        }
         else {
             bad_option(argv[i]);
             return -1;
@@ -108,7 +133,13 @@ int main(int argc, char **argv)
         i++;
     }
 
-    bcnn_pack_data(argv[1], label_width, type, argv[2]);
+    if (argc < 3) {
+        show_usage();
+        return -1;
+    }
+    if (bcnn_pack_data(argv[1], label_width, type, raw_w, raw_h, num_threads, argv[2]) != BCNN_SUCCESS) {
+        return -1;
+    }
 
     return 0;
 }